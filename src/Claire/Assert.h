@@ -2,6 +2,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
 
 #define ASSERT(condition, format, ...) \
     _ASSERT(condition, __FILE__, __func__, __LINE__, format, ##__VA_ARGS__)
@@ -28,7 +30,7 @@ void _ASSERT(
     vsnprintf(message, sizeof(message), format, args);
     va_end(args);
 
-    printf("[%s -> %s:%d] Assertion failed! :: %s\n", file, func, line, message);
+    fprintf(stderr, "[%s -> %s:%d] Assertion failed! :: %s\n", file, func, line, message);
     exit(1);
 }
 
@@ -45,6 +47,6 @@ void _ASSERT(
     vsnprintf(message, sizeof(message), format, args);
     va_end(args);
 
-    printf("[%s -> %s:%d] ASSERT_NOT_REACHED reached! :: %s\n", file, func, line, message);
+    fprintf(stderr, "[%s -> %s:%d] ASSERT_NOT_REACHED reached! :: %s\n", file, func, line, message);
     exit(1);
 }
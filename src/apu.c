@@ -0,0 +1,661 @@
+#include <string.h>
+#include "apu.h"
+
+#define FLAG_C 0x01
+#define FLAG_Z 0x02
+#define FLAG_I 0x04
+#define FLAG_H 0x08
+#define FLAG_B 0x10
+#define FLAG_P 0x20 // Direct page is $01xx instead of $00xx
+#define FLAG_V 0x40
+#define FLAG_N 0x80
+
+// Mapped over $FFC0-$FFFF while CONTROL bit 7 is set. Clears the zero page,
+// says $AA/$BB on ports 0/1, then takes whatever the S-CPU sends it
+static const uint8_t ipl_rom[64] = {
+    0xCD, 0xEF, 0xBD, 0xE8, 0x00, 0xC6, 0x1D, 0xD0, 0xFC, 0x8F, 0xAA, 0xF4, 0x8F, 0xBB, 0xF5, 0x78,
+    0xCC, 0xF4, 0xD0, 0xFB, 0x2F, 0x19, 0xEB, 0xF4, 0xD0, 0xFC, 0x7E, 0xF4, 0xD0, 0x0B, 0xE4, 0xF5,
+    0xCB, 0xF4, 0xD7, 0x00, 0xFC, 0xD0, 0xF3, 0xAB, 0x01, 0x10, 0xEF, 0x7E, 0xF4, 0x10, 0xEB, 0xBA,
+    0xF6, 0xDA, 0x00, 0xBA, 0xF4, 0xC4, 0xF4, 0xDD, 0x5D, 0xD0, 0xDB, 0x1F, 0x00, 0x00, 0xC0, 0xFF,
+};
+
+// Base cycles per opcode. Branches add 2 when they're taken
+static const uint8_t opcode_cycles[256] = {
+    2, 8, 4, 5, 3, 4, 3, 6, 2, 6, 5, 4, 5, 4, 6, 8,
+    2, 8, 4, 5, 4, 5, 5, 6, 5, 5, 6, 5, 2, 2, 4, 6,
+    2, 8, 4, 5, 3, 4, 3, 6, 2, 6, 5, 4, 5, 4, 5, 4,
+    2, 8, 4, 5, 4, 5, 5, 6, 5, 5, 6, 5, 2, 2, 3, 8,
+    2, 8, 4, 5, 3, 4, 3, 6, 2, 6, 4, 4, 5, 4, 6, 6,
+    2, 8, 4, 5, 4, 5, 5, 6, 5, 5, 4, 5, 2, 2, 4, 3,
+    2, 8, 4, 5, 3, 4, 3, 6, 2, 6, 4, 4, 5, 4, 5, 5,
+    2, 8, 4, 5, 4, 5, 5, 6, 5, 5, 5, 5, 2, 2, 3, 6,
+    2, 8, 4, 5, 3, 4, 3, 6, 2, 6, 5, 4, 5, 2, 4, 5,
+    2, 8, 4, 5, 4, 5, 5, 6, 5, 5, 5, 5, 2, 2, 12, 5,
+    3, 8, 4, 5, 3, 4, 3, 6, 2, 6, 4, 4, 5, 2, 4, 4,
+    2, 8, 4, 5, 4, 5, 5, 6, 5, 5, 5, 5, 2, 2, 3, 4,
+    3, 8, 4, 5, 4, 5, 4, 7, 2, 5, 6, 4, 5, 2, 4, 9,
+    2, 8, 4, 5, 5, 6, 6, 7, 4, 5, 5, 5, 2, 2, 6, 3,
+    2, 8, 4, 5, 3, 4, 3, 6, 2, 4, 5, 3, 4, 3, 4, 3,
+    2, 8, 4, 5, 4, 5, 5, 6, 3, 4, 5, 4, 2, 2, 4, 3,
+};
+
+// Timers 0 and 1 count at 8 kHz, timer 2 at 64 kHz
+static const uint8_t timer_shift[3] = { 7, 7, 4 };
+
+static void sync_timer(struct Apu* apu, int index) {
+    struct ApuTimer* timer = &apu->timers[index];
+    uint64_t ticks = apu->cycles >> timer_shift[index];
+
+    if (apu->control & (1 << index)) {
+        uint32_t target = timer->target ? timer->target : 256;
+        uint64_t stage = timer->stage + (ticks - timer->ticks);
+        timer->counter = (timer->counter + stage / target) & 0xF;
+        timer->stage = stage % target;
+    }
+    timer->ticks = ticks;
+}
+
+static uint8_t read_io(struct Apu* apu, uint16_t addr) {
+    switch (addr) {
+        case 0xF2: return apu->dsp_addr;
+        case 0xF3:
+            apu_sync_dsp(apu);
+            return apu->dsp.regs[apu->dsp_addr & 0x7F];
+        case 0xF4: case 0xF5: case 0xF6: case 0xF7:
+            return apu->cpu_in[addr - 0xF4];
+        case 0xF8: case 0xF9:
+            return apu_read_aram(apu, addr);
+        case 0xFD: case 0xFE: case 0xFF: {
+            struct ApuTimer* timer = &apu->timers[addr - 0xFD];
+            sync_timer(apu, addr - 0xFD);
+            uint8_t out = timer->counter;
+            timer->counter = 0;
+            return out;
+        }
+    }
+    // Write only
+    return 0;
+}
+
+static void write_io(struct Apu* apu, uint16_t addr, uint8_t value) {
+    switch (addr) {
+        case 0xF1:
+            for (int i = 0; i < 3; i++) {
+                sync_timer(apu, i);
+                // Starting a timer starts it from scratch
+                if ((value & (1 << i)) && !(apu->control & (1 << i))) {
+                    apu->timers[i].stage = 0;
+                    apu->timers[i].counter = 0;
+                }
+            }
+            if (value & 0x10) apu->cpu_in[0] = apu->cpu_in[1] = 0;
+            if (value & 0x20) apu->cpu_in[2] = apu->cpu_in[3] = 0;
+            apu->control = value;
+            break;
+        case 0xF2: apu->dsp_addr = value; break;
+        case 0xF3:
+            // $80-$FF are read only mirrors
+            if (apu->dsp_addr < 0x80) {
+                apu_sync_dsp(apu);
+                dsp_write(&apu->dsp, apu->dsp_addr, value);
+            }
+            break;
+        case 0xF4: case 0xF5: case 0xF6: case 0xF7:
+            apu->cpu_out[addr - 0xF4] = value;
+            break;
+        case 0xFA: case 0xFB: case 0xFC:
+            sync_timer(apu, addr - 0xFA);
+            apu->timers[addr - 0xFA].target = value;
+            break;
+    }
+}
+
+static inline uint8_t read(struct Apu* apu, uint16_t addr) {
+    if ((addr & 0xFFF0) == 0x00F0) return read_io(apu, addr);
+    if (addr >= 0xFFC0 && (apu->control & 0x80)) return ipl_rom[addr - 0xFFC0];
+    return apu_read_aram(apu, addr);
+}
+
+// The RAM under the registers and the IPL ROM gets written either way
+static inline void write(struct Apu* apu, uint16_t addr, uint8_t value) {
+    if ((addr & 0xFFF0) == 0x00F0) write_io(apu, addr, value);
+    apu_write_aram(apu, addr, value);
+}
+
+static inline uint8_t fetch(struct Apu* apu) {
+    return read(apu, apu->PC++);
+}
+
+static inline uint16_t fetch_u16(struct Apu* apu) {
+    uint8_t low = fetch(apu);
+    return (fetch(apu) << 8) | low;
+}
+
+static inline uint16_t read_u16(struct Apu* apu, uint16_t addr) {
+    return read(apu, addr) | (read(apu, addr + 1) << 8);
+}
+
+// Direct page address. Words in the direct page wrap around inside it
+static inline uint16_t dp(struct Apu* apu, uint8_t offset) {
+    return ((apu->PSW & FLAG_P) << 3) | offset;
+}
+
+static inline uint16_t read_dp_u16(struct Apu* apu, uint8_t offset) {
+    return read(apu, dp(apu, offset)) | (read(apu, dp(apu, offset + 1)) << 8);
+}
+
+static inline void write_dp_u16(struct Apu* apu, uint8_t offset, uint16_t value) {
+    write(apu, dp(apu, offset), value & 0xFF);
+    write(apu, dp(apu, offset + 1), value >> 8);
+}
+
+static inline void push(struct Apu* apu, uint8_t value) {
+    write(apu, 0x100 | apu->SP--, value);
+}
+
+static inline uint8_t pop(struct Apu* apu) {
+    return read(apu, 0x100 | ++apu->SP);
+}
+
+static inline void push_u16(struct Apu* apu, uint16_t value) {
+    push(apu, value >> 8);
+    push(apu, value & 0xFF);
+}
+
+static inline uint16_t pop_u16(struct Apu* apu) {
+    uint8_t low = pop(apu);
+    return (pop(apu) << 8) | low;
+}
+
+static inline void set_flag(struct Apu* apu, uint8_t flag, bool set) {
+    apu->PSW = set ? apu->PSW | flag : apu->PSW & ~flag;
+}
+
+static inline uint8_t set_nz(struct Apu* apu, uint8_t value) {
+    set_flag(apu, FLAG_N, value & 0x80);
+    set_flag(apu, FLAG_Z, !value);
+    return value;
+}
+
+static inline void set_nz_u16(struct Apu* apu, uint16_t value) {
+    set_flag(apu, FLAG_N, value & 0x8000);
+    set_flag(apu, FLAG_Z, !value);
+}
+
+static inline void set_ya(struct Apu* apu, uint16_t value) {
+    apu->A = value & 0xFF;
+    apu->Y = value >> 8;
+}
+
+static uint8_t adc(struct Apu* apu, uint8_t a, uint8_t b) {
+    uint16_t result = a + b + (apu->PSW & FLAG_C);
+    set_flag(apu, FLAG_C, result > 0xFF);
+    set_flag(apu, FLAG_H, (a ^ b ^ result) & 0x10);
+    set_flag(apu, FLAG_V, ~(a ^ b) & (a ^ result) & 0x80);
+    return set_nz(apu, result);
+}
+
+static void compare(struct Apu* apu, uint8_t a, uint8_t b) {
+    set_flag(apu, FLAG_C, a >= b);
+    set_nz(apu, a - b);
+}
+
+// The six ALU rows of the opcode map, in order
+enum { ALU_OR, ALU_AND, ALU_EOR, ALU_CMP, ALU_ADC, ALU_SBC };
+
+static uint8_t alu(struct Apu* apu, int op, uint8_t a, uint8_t b) {
+    switch (op) {
+        case ALU_OR: return set_nz(apu, a | b);
+        case ALU_AND: return set_nz(apu, a & b);
+        case ALU_EOR: return set_nz(apu, a ^ b);
+        case ALU_CMP: compare(apu, a, b); return a;
+        case ALU_ADC: return adc(apu, a, b);
+        default: return adc(apu, a, ~b);
+    }
+}
+
+// ...and the read-modify-write ones
+enum { RMW_ASL, RMW_ROL, RMW_LSR, RMW_ROR, RMW_DEC, RMW_INC };
+
+static uint8_t rmw(struct Apu* apu, int op, uint8_t value) {
+    bool carry = apu->PSW & FLAG_C;
+    switch (op) {
+        case RMW_ASL: set_flag(apu, FLAG_C, value & 0x80); value <<= 1; break;
+        case RMW_ROL: set_flag(apu, FLAG_C, value & 0x80); value = (value << 1) | carry; break;
+        case RMW_LSR: set_flag(apu, FLAG_C, value & 1); value >>= 1; break;
+        case RMW_ROR: set_flag(apu, FLAG_C, value & 1); value = (value >> 1) | (carry << 7); break;
+        case RMW_DEC: value--; break;
+        default: value++; break;
+    }
+    return set_nz(apu, value);
+}
+
+// Extra cycles
+static inline int branch(struct Apu* apu, bool take) {
+    int8_t offset = fetch(apu);
+    if (!take) return 0;
+    apu->PC += offset;
+    return 2;
+}
+
+// mem.bit operands: 13 bit address, 3 bit bit number
+static inline bool read_mem_bit(struct Apu* apu) {
+    uint16_t operand = fetch_u16(apu);
+    return (read(apu, operand & 0x1FFF) >> (operand >> 13)) & 1;
+}
+
+static int step(struct Apu* apu) {
+    uint8_t opcode = fetch(apu);
+    uint8_t column = opcode & 0x0F;
+    int op = opcode >> 5;
+
+    // OR/AND/EOR/CMP/ADC/SBC, every addressing mode
+    if (column >= 0x4 && column <= 0x9 && opcode < 0xC0) {
+        uint8_t a = apu->A;
+        uint8_t b;
+        uint16_t addr = 0;
+        bool to_memory = false;
+
+        switch (opcode & 0x1F) {
+            case 0x04: b = read(apu, dp(apu, fetch(apu))); break;
+            case 0x05: b = read(apu, fetch_u16(apu)); break;
+            case 0x06: b = read(apu, dp(apu, apu->X)); break;
+            case 0x07: b = read(apu, read_dp_u16(apu, fetch(apu) + apu->X)); break;
+            case 0x08: b = fetch(apu); break;
+            case 0x09:
+                b = read(apu, dp(apu, fetch(apu)));
+                addr = dp(apu, fetch(apu));
+                to_memory = true;
+                break;
+            case 0x14: b = read(apu, dp(apu, fetch(apu) + apu->X)); break;
+            case 0x15: b = read(apu, fetch_u16(apu) + apu->X); break;
+            case 0x16: b = read(apu, fetch_u16(apu) + apu->Y); break;
+            case 0x17: b = read(apu, read_dp_u16(apu, fetch(apu)) + apu->Y); break;
+            case 0x18:
+                b = fetch(apu);
+                addr = dp(apu, fetch(apu));
+                to_memory = true;
+                break;
+            default:
+                b = read(apu, dp(apu, apu->Y));
+                addr = dp(apu, apu->X);
+                to_memory = true;
+                break;
+        }
+
+        if (to_memory) a = read(apu, addr);
+        uint8_t result = alu(apu, op, a, b);
+        if (op != ALU_CMP) {
+            if (to_memory) {
+                write(apu, addr, result);
+            } else {
+                apu->A = result;
+            }
+        }
+        return opcode_cycles[opcode];
+    }
+
+    // ASL/ROL/LSR/ROR/DEC/INC on dp, abs, dp+X and A
+    if ((column == 0xB || column == 0xC) && opcode < 0xC0) {
+        if ((opcode & 0x1F) == 0x1C) {
+            apu->A = rmw(apu, op, apu->A);
+        } else {
+            uint16_t addr;
+            switch (opcode & 0x1F) {
+                case 0x0B: addr = dp(apu, fetch(apu)); break;
+                case 0x0C: addr = fetch_u16(apu); break;
+                default: addr = dp(apu, fetch(apu) + apu->X); break;
+            }
+            write(apu, addr, rmw(apu, op, read(apu, addr)));
+        }
+        return opcode_cycles[opcode];
+    }
+
+    switch (column) {
+        case 0x0:
+            // Branches on N, V, C and Z, each way
+            if (opcode & 0x10) {
+                static const uint8_t branch_flags[4] = { FLAG_N, FLAG_V, FLAG_C, FLAG_Z };
+                bool set = apu->PSW & branch_flags[opcode >> 6];
+                return opcode_cycles[opcode] + branch(apu, set == ((opcode & 0x20) != 0));
+            }
+            break;
+        case 0x1:
+            // TCALL
+            push_u16(apu, apu->PC);
+            apu->PC = read_u16(apu, 0xFFDE - (opcode >> 4) * 2);
+            return opcode_cycles[opcode];
+        case 0x2: {
+            // SET1/CLR1 dp.bit
+            uint16_t addr = dp(apu, fetch(apu));
+            uint8_t value = read(apu, addr);
+            value = (opcode & 0x10) ? value & ~(1 << op) : value | (1 << op);
+            write(apu, addr, value);
+            return opcode_cycles[opcode];
+        }
+        case 0x3: {
+            // BBS/BBC dp.bit, rel
+            bool set = (read(apu, dp(apu, fetch(apu))) >> op) & 1;
+            return opcode_cycles[opcode] + branch(apu, set != ((opcode & 0x10) != 0));
+        }
+    }
+
+    int extra = 0;
+    switch (opcode) {
+        case 0x00: break; // NOP
+        case 0x0A: set_flag(apu, FLAG_C, (apu->PSW & FLAG_C) | read_mem_bit(apu)); break;
+        case 0x0D: push(apu, apu->PSW); break;
+        case 0x0E: case 0x4E: {
+            // TSET1/TCLR1
+            uint16_t addr = fetch_u16(apu);
+            uint8_t value = read(apu, addr);
+            set_nz(apu, apu->A - value);
+            write(apu, addr, opcode == 0x0E ? value | apu->A : value & ~apu->A);
+            break;
+        }
+        case 0x0F:
+            // BRK
+            push_u16(apu, apu->PC);
+            push(apu, apu->PSW);
+            apu->PSW = (apu->PSW | FLAG_B) & ~FLAG_I;
+            apu->PC = read_u16(apu, 0xFFDE);
+            break;
+        case 0x1A: case 0x3A: {
+            // DECW/INCW
+            uint8_t offset = fetch(apu);
+            uint16_t value = read_dp_u16(apu, offset) + (opcode == 0x3A ? 1 : -1);
+            write_dp_u16(apu, offset, value);
+            set_nz_u16(apu, value);
+            break;
+        }
+        case 0x1D: apu->X = set_nz(apu, apu->X - 1); break;
+        case 0x1E: compare(apu, apu->X, read(apu, fetch_u16(apu))); break;
+        case 0x1F: apu->PC = read_u16(apu, fetch_u16(apu) + apu->X); break;
+        case 0x20: apu->PSW &= ~FLAG_P; break;
+        case 0x2A: set_flag(apu, FLAG_C, (apu->PSW & FLAG_C) | !read_mem_bit(apu)); break;
+        case 0x2D: push(apu, apu->A); break;
+        case 0x2E: {
+            // CBNE dp, rel
+            uint8_t value = read(apu, dp(apu, fetch(apu)));
+            extra = branch(apu, apu->A != value);
+            break;
+        }
+        case 0x2F: branch(apu, true); break;
+        case 0x3D: apu->X = set_nz(apu, apu->X + 1); break;
+        case 0x3E: compare(apu, apu->X, read(apu, dp(apu, fetch(apu)))); break;
+        case 0x3F: {
+            uint16_t addr = fetch_u16(apu);
+            push_u16(apu, apu->PC);
+            apu->PC = addr;
+            break;
+        }
+        case 0x40: apu->PSW |= FLAG_P; break;
+        case 0x4A: set_flag(apu, FLAG_C, (apu->PSW & FLAG_C) & read_mem_bit(apu)); break;
+        case 0x4D: push(apu, apu->X); break;
+        case 0x4F: {
+            // PCALL
+            uint8_t offset = fetch(apu);
+            push_u16(apu, apu->PC);
+            apu->PC = 0xFF00 | offset;
+            break;
+        }
+        case 0x5A: {
+            // CMPW
+            uint16_t ya = (apu->Y << 8) | apu->A;
+            uint16_t value = read_dp_u16(apu, fetch(apu));
+            set_flag(apu, FLAG_C, ya >= value);
+            set_nz_u16(apu, ya - value);
+            break;
+        }
+        case 0x5D: apu->X = set_nz(apu, apu->A); break;
+        case 0x5E: compare(apu, apu->Y, read(apu, fetch_u16(apu))); break;
+        case 0x5F: apu->PC = fetch_u16(apu); break;
+        case 0x60: apu->PSW &= ~FLAG_C; break;
+        case 0x6A: set_flag(apu, FLAG_C, (apu->PSW & FLAG_C) & !read_mem_bit(apu)); break;
+        case 0x6D: push(apu, apu->Y); break;
+        case 0x6E: {
+            // DBNZ dp, rel
+            uint16_t addr = dp(apu, fetch(apu));
+            uint8_t value = read(apu, addr) - 1;
+            write(apu, addr, value);
+            extra = branch(apu, value);
+            break;
+        }
+        case 0x6F: apu->PC = pop_u16(apu); break;
+        case 0x7A: case 0x9A: {
+            // ADDW/SUBW
+            uint16_t ya = (apu->Y << 8) | apu->A;
+            uint16_t value = read_dp_u16(apu, fetch(apu));
+            uint32_t result;
+            if (opcode == 0x7A) {
+                result = ya + value;
+                set_flag(apu, FLAG_C, result > 0xFFFF);
+                set_flag(apu, FLAG_H, (ya & 0xFFF) + (value & 0xFFF) > 0xFFF);
+                set_flag(apu, FLAG_V, ~(ya ^ value) & (ya ^ result) & 0x8000);
+            } else {
+                result = ya - value;
+                set_flag(apu, FLAG_C, ya >= value);
+                set_flag(apu, FLAG_H, (ya & 0xFFF) >= (value & 0xFFF));
+                set_flag(apu, FLAG_V, (ya ^ value) & (ya ^ result) & 0x8000);
+            }
+            set_ya(apu, result);
+            set_nz_u16(apu, result);
+            break;
+        }
+        case 0x7D: apu->A = set_nz(apu, apu->X); break;
+        case 0x7E: compare(apu, apu->Y, read(apu, dp(apu, fetch(apu)))); break;
+        case 0x7F:
+            // RETI
+            apu->PSW = pop(apu);
+            apu->PC = pop_u16(apu);
+            break;
+        case 0x80: apu->PSW |= FLAG_C; break;
+        case 0x8A: set_flag(apu, FLAG_C, (apu->PSW & FLAG_C) ^ read_mem_bit(apu)); break;
+        case 0x8D: apu->Y = set_nz(apu, fetch(apu)); break;
+        case 0x8E: apu->PSW = pop(apu); break;
+        case 0x8F: {
+            uint8_t value = fetch(apu);
+            write(apu, dp(apu, fetch(apu)), value);
+            break;
+        }
+        case 0x9D: apu->X = set_nz(apu, apu->SP); break;
+        case 0x9E: {
+            // DIV YA, X. Quotients that don't fit come out the way the hardware gets them
+            uint16_t ya = (apu->Y << 8) | apu->A;
+            uint16_t x = apu->X;
+            set_flag(apu, FLAG_V, apu->Y >= x);
+            set_flag(apu, FLAG_H, (apu->Y & 0xF) >= (x & 0xF));
+            if (apu->Y < (x << 1)) {
+                apu->A = ya / x;
+                apu->Y = ya % x;
+            } else {
+                apu->A = 255 - (ya - (x << 9)) / (256 - x);
+                apu->Y = x + (ya - (x << 9)) % (256 - x);
+            }
+            set_nz(apu, apu->A);
+            break;
+        }
+        case 0x9F: apu->A = set_nz(apu, (apu->A >> 4) | (apu->A << 4)); break;
+        case 0xA0: apu->PSW |= FLAG_I; break;
+        case 0xAA: set_flag(apu, FLAG_C, read_mem_bit(apu)); break;
+        case 0xAD: compare(apu, apu->Y, fetch(apu)); break;
+        case 0xAE: apu->A = pop(apu); break;
+        case 0xAF: write(apu, dp(apu, apu->X++), apu->A); break;
+        case 0xBA: {
+            // MOVW YA, dp
+            uint16_t value = read_dp_u16(apu, fetch(apu));
+            set_ya(apu, value);
+            set_nz_u16(apu, value);
+            break;
+        }
+        case 0xBD: apu->SP = apu->X; break;
+        case 0xBE:
+            // DAS
+            if (!(apu->PSW & FLAG_C) || apu->A > 0x99) {
+                apu->A -= 0x60;
+                apu->PSW &= ~FLAG_C;
+            }
+            if (!(apu->PSW & FLAG_H) || (apu->A & 0xF) > 9) apu->A -= 6;
+            set_nz(apu, apu->A);
+            break;
+        case 0xBF: apu->A = set_nz(apu, read(apu, dp(apu, apu->X++))); break;
+        case 0xC0: apu->PSW &= ~FLAG_I; break;
+        case 0xC4: write(apu, dp(apu, fetch(apu)), apu->A); break;
+        case 0xC5: write(apu, fetch_u16(apu), apu->A); break;
+        case 0xC6: write(apu, dp(apu, apu->X), apu->A); break;
+        case 0xC7: write(apu, read_dp_u16(apu, fetch(apu) + apu->X), apu->A); break;
+        case 0xC8: compare(apu, apu->X, fetch(apu)); break;
+        case 0xC9: write(apu, fetch_u16(apu), apu->X); break;
+        case 0xCA: {
+            // MOV1 mem.bit, C
+            uint16_t operand = fetch_u16(apu);
+            uint16_t addr = operand & 0x1FFF;
+            uint8_t bit = 1 << (operand >> 13);
+            uint8_t value = read(apu, addr);
+            write(apu, addr, (apu->PSW & FLAG_C) ? value | bit : value & ~bit);
+            break;
+        }
+        case 0xCB: write(apu, dp(apu, fetch(apu)), apu->Y); break;
+        case 0xCC: write(apu, fetch_u16(apu), apu->Y); break;
+        case 0xCD: apu->X = set_nz(apu, fetch(apu)); break;
+        case 0xCE: apu->X = pop(apu); break;
+        case 0xCF: {
+            // MUL YA, flags from Y alone
+            uint16_t result = apu->Y * apu->A;
+            set_ya(apu, result);
+            set_nz(apu, apu->Y);
+            break;
+        }
+        case 0xD4: write(apu, dp(apu, fetch(apu) + apu->X), apu->A); break;
+        case 0xD5: write(apu, fetch_u16(apu) + apu->X, apu->A); break;
+        case 0xD6: write(apu, fetch_u16(apu) + apu->Y, apu->A); break;
+        case 0xD7: write(apu, read_dp_u16(apu, fetch(apu)) + apu->Y, apu->A); break;
+        case 0xD8: write(apu, dp(apu, fetch(apu)), apu->X); break;
+        case 0xD9: write(apu, dp(apu, fetch(apu) + apu->Y), apu->X); break;
+        case 0xDA: write_dp_u16(apu, fetch(apu), (apu->Y << 8) | apu->A); break;
+        case 0xDB: write(apu, dp(apu, fetch(apu) + apu->X), apu->Y); break;
+        case 0xDC: apu->Y = set_nz(apu, apu->Y - 1); break;
+        case 0xDD: apu->A = set_nz(apu, apu->Y); break;
+        case 0xDE: {
+            // CBNE dp+X, rel
+            uint8_t value = read(apu, dp(apu, fetch(apu) + apu->X));
+            extra = branch(apu, apu->A != value);
+            break;
+        }
+        case 0xDF:
+            // DAA
+            if ((apu->PSW & FLAG_C) || apu->A > 0x99) {
+                apu->A += 0x60;
+                apu->PSW |= FLAG_C;
+            }
+            if ((apu->PSW & FLAG_H) || (apu->A & 0xF) > 9) apu->A += 6;
+            set_nz(apu, apu->A);
+            break;
+        case 0xE0: apu->PSW &= ~(FLAG_V | FLAG_H); break;
+        case 0xE4: apu->A = set_nz(apu, read(apu, dp(apu, fetch(apu)))); break;
+        case 0xE5: apu->A = set_nz(apu, read(apu, fetch_u16(apu))); break;
+        case 0xE6: apu->A = set_nz(apu, read(apu, dp(apu, apu->X))); break;
+        case 0xE7: apu->A = set_nz(apu, read(apu, read_dp_u16(apu, fetch(apu) + apu->X))); break;
+        case 0xE8: apu->A = set_nz(apu, fetch(apu)); break;
+        case 0xE9: apu->X = set_nz(apu, read(apu, fetch_u16(apu))); break;
+        case 0xEA: {
+            // NOT1 mem.bit
+            uint16_t operand = fetch_u16(apu);
+            uint16_t addr = operand & 0x1FFF;
+            write(apu, addr, read(apu, addr) ^ (1 << (operand >> 13)));
+            break;
+        }
+        case 0xEB: apu->Y = set_nz(apu, read(apu, dp(apu, fetch(apu)))); break;
+        case 0xEC: apu->Y = set_nz(apu, read(apu, fetch_u16(apu))); break;
+        case 0xED: apu->PSW ^= FLAG_C; break;
+        case 0xEE: apu->Y = pop(apu); break;
+        case 0xEF: case 0xFF: apu->stopped = true; break; // SLEEP/STOP
+        case 0xF4: apu->A = set_nz(apu, read(apu, dp(apu, fetch(apu) + apu->X))); break;
+        case 0xF5: apu->A = set_nz(apu, read(apu, fetch_u16(apu) + apu->X)); break;
+        case 0xF6: apu->A = set_nz(apu, read(apu, fetch_u16(apu) + apu->Y)); break;
+        case 0xF7: apu->A = set_nz(apu, read(apu, read_dp_u16(apu, fetch(apu)) + apu->Y)); break;
+        case 0xF8: apu->X = set_nz(apu, read(apu, dp(apu, fetch(apu)))); break;
+        case 0xF9: apu->X = set_nz(apu, read(apu, dp(apu, fetch(apu) + apu->Y))); break;
+        case 0xFA: {
+            uint8_t value = read(apu, dp(apu, fetch(apu)));
+            write(apu, dp(apu, fetch(apu)), value);
+            break;
+        }
+        case 0xFB: apu->Y = set_nz(apu, read(apu, dp(apu, fetch(apu) + apu->X))); break;
+        case 0xFC: apu->Y = set_nz(apu, apu->Y + 1); break;
+        case 0xFD: apu->Y = set_nz(apu, apu->A); break;
+        case 0xFE: apu->Y--; extra = branch(apu, apu->Y); break; // DBNZ Y, rel
+    }
+
+    return opcode_cycles[opcode] + extra;
+}
+
+void apu_reset(struct Apu* apu) {
+    struct AudioRing* audio = apu->audio;
+    bool fast = apu->fast;
+    memset(apu, 0, sizeof(*apu));
+    apu->audio = audio;
+    apu->fast = fast;
+    for (int i = 0; i < ARAM_PAGES; i++) {
+        apu->aram[i] = new_shared_page();
+        memset(apu->aram[i]->data, 0, ARAM_PAGE_SIZE);
+    }
+    dsp_reset(&apu->dsp);
+    // IPL ROM on, both pairs of input ports cleared
+    apu->control = 0xB0;
+    apu->PC = read_u16(apu, 0xFFFE);
+    memset(apu->aram_dirty, true, sizeof(apu->aram_dirty));
+}
+
+void apu_copy(struct Apu* apu, const struct Apu* from) {
+    for (int i = 0; i < ARAM_PAGES; i++) {
+        retain_shared_page(from->aram[i]);
+        if (apu->aram[i]) release_shared_page(apu->aram[i]);
+    }
+    *apu = *from;
+}
+
+void apu_free(struct Apu* apu) {
+    for (int i = 0; i < ARAM_PAGES; i++) {
+        release_shared_page(apu->aram[i]);
+        apu->aram[i] = NULL;
+    }
+}
+
+void apu_run(struct Apu* apu, uint64_t cycles) {
+    if (apu->stopped) {
+        if (apu->cycles < cycles) apu->cycles = cycles;
+        return;
+    }
+
+    while (apu->cycles < cycles && !apu->stopped) {
+        apu->cycles += step(apu);
+    }
+}
+
+void apu_sync_dsp(struct Apu* apu) {
+    dsp_run(apu, apu->cycles / DSP_CYCLES_PER_SAMPLE);
+}
+
+uint8_t apu_read_port(struct Apu* apu, int port) {
+    return apu->cpu_out[port];
+}
+
+void apu_write_port(struct Apu* apu, int port, uint8_t value) {
+    apu->cpu_in[port] = value;
+}
+
+void apu_clear_aram_dirty(struct Apu* apu) {
+    memset(apu->aram_dirty, 0, sizeof(apu->aram_dirty));
+}
+
+void apu_replace_aram(struct Apu* apu, const uint8_t* aram) {
+    for (int i = 0; i < ARAM_PAGES; i++) {
+        const uint8_t* data = aram + i * ARAM_PAGE_SIZE;
+        if (!memcmp(apu->aram[i]->data, data, ARAM_PAGE_SIZE)) continue;
+
+        if (unshare_page(&apu->aram[i], false)) apu->aram_copies++;
+        memcpy(apu->aram[i]->data, data, ARAM_PAGE_SIZE);
+        apu->aram_dirty[i] = true;
+    }
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "shared_page.h"
+#include "dsp.h"
+#include "audio.h"
+
+// Audio processing unit: the SPC700 and its 64 KiB of ARAM. It keeps its own
+// clock, in SPC700 cycles, and only runs when someone needs to know where it's
+// got to. main.c brings it up to the present whenever the S-CPU touches the
+// ports at $2140-$2143, and again at the end of every frame. Nothing it does in
+// between can be seen from the S-CPU side, so running it in one go then is as
+// good as running it alongside.
+//
+// Timers work the same way, they're only brought up to date from the clock
+// when the SPC700 looks at them or changes their setup. The DSP too (see dsp.h),
+// which is run up to the SPC700's clock when it's about to touch $F3, and from
+// main.c at the end of every frame.
+//
+// ARAM's in shared pages like VRAM (see ppu.h), and everything that writes it
+// goes through apu_write_aram().
+
+#define ARAM_SIZE 0x10000
+#define ARAM_PAGE_SIZE 0x1000
+#define ARAM_PAGES (ARAM_SIZE / ARAM_PAGE_SIZE)
+
+// SPC700 cycles (1.024 MHz) per master cycle (~21.477 MHz), as a fraction
+#define APU_CYCLES_NUMERATOR 11264
+#define APU_CYCLES_DENOMINATOR 236250
+
+struct ApuTimer {
+    uint8_t target; // $FA-$FC, 0 is 256
+    uint16_t stage; // Ticks towards the target
+    uint8_t counter; // $FD-$FF, 4 bits, cleared by reading
+    uint64_t ticks; // Ticks of its clock as of the last time it was brought up to date
+};
+
+struct Apu {
+    uint16_t PC;
+    uint8_t A;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t SP;
+    uint8_t PSW;
+    // SLEEP or STOP, nothing wakes it back up
+    bool stopped;
+
+    uint8_t control; // $F1
+    uint8_t dsp_addr;
+    struct Dsp dsp;
+    uint8_t cpu_in[4]; // Written by the S-CPU, read at $F4-$F7
+    uint8_t cpu_out[4]; // Written at $F4-$F7, read by the S-CPU
+    struct ApuTimer timers[3];
+
+    uint64_t cycles;
+
+    // Everything above is small enough to copy around whole, ARAM goes by page
+    struct SharedPage* aram[ARAM_PAGES];
+    // Pages written since apu_clear_aram_dirty()
+    bool aram_dirty[ARAM_PAGES];
+    // Pages it had to copy because they were shared
+    uint64_t aram_copies;
+
+    // Not part of the machine. Where the DSP's samples go, NULL to throw them away
+    struct AudioRing* audio;
+    // Nor's this. Keeps the DSP's registers going without making any sound, for
+    // runs nobody's listening to. Can be flipped at any time, see dsp.h
+    bool fast;
+};
+
+#define APU_REGISTERS_SIZE offsetof(struct Apu, aram)
+
+// Power on, with zeroed ARAM pages of its own. For an Apu that hasn't got any
+// yet, though `audio` and `fast` are kept
+void apu_reset(struct Apu* apu);
+// Makes `apu` a copy of `from`, sharing its ARAM, and lets go of whatever pages
+// `apu` had before (NULL ones are fine)
+void apu_copy(struct Apu* apu, const struct Apu* from);
+void apu_free(struct Apu* apu);
+// Runs until its clock gets to `cycles`, finishing off whatever instruction takes it there
+void apu_run(struct Apu* apu, uint64_t cycles);
+// Generates samples up to where the SPC700's got to
+void apu_sync_dsp(struct Apu* apu);
+
+// The S-CPU's side of $2140-$2143
+uint8_t apu_read_port(struct Apu* apu, int port);
+void apu_write_port(struct Apu* apu, int port, uint8_t value);
+
+void apu_clear_aram_dirty(struct Apu* apu);
+// Puts all of ARAM back to `aram`. Pages that already match stay shared
+void apu_replace_aram(struct Apu* apu, const uint8_t* aram);
+
+static inline uint8_t apu_read_aram(const struct Apu* apu, uint16_t addr) {
+    return apu->aram[addr / ARAM_PAGE_SIZE]->data[addr % ARAM_PAGE_SIZE];
+}
+
+// Copies the page first if it's shared, and marks it dirty
+static inline void apu_write_aram(struct Apu* apu, uint16_t addr, uint8_t value) {
+    struct SharedPage** page = &apu->aram[addr / ARAM_PAGE_SIZE];
+    if (!shared_page_private(*page) && unshare_page(page, true)) apu->aram_copies++;
+    (*page)->data[addr % ARAM_PAGE_SIZE] = value;
+    apu->aram_dirty[addr / ARAM_PAGE_SIZE] = true;
+}
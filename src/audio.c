@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <string.h>
+#include "audio.h"
+
+struct AudioRing* audio_ring_create() {
+    struct AudioRing* ring = aligned_alloc(64, sizeof(struct AudioRing));
+    if (!ring) return NULL;
+    ring->head = 0;
+    ring->dropped = 0;
+    ring->tail = 0;
+    return ring;
+}
+
+void audio_ring_free(struct AudioRing* ring) {
+    free(ring);
+}
+
+int audio_ring_push(struct AudioRing* ring, const int16_t (*frames)[2], int count) {
+    uint64_t head = ring->head;
+    uint64_t room = AUDIO_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+    if ((uint64_t)count > room) {
+        ring->dropped += count - room;
+        count = room;
+    }
+
+    // At most two pieces, either side of the end of the buffer
+    uint32_t start = head % AUDIO_RING_SIZE;
+    int first = count < AUDIO_RING_SIZE - (int)start ? count : AUDIO_RING_SIZE - (int)start;
+    memcpy(ring->frames[start], frames, first * sizeof(ring->frames[0]));
+    memcpy(ring->frames[0], frames + first, (count - first) * sizeof(ring->frames[0]));
+
+    __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+int audio_ring_pop(struct AudioRing* ring, int16_t (*frames)[2], int count) {
+    uint64_t tail = ring->tail;
+    uint64_t available = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+    if ((uint64_t)count > available) count = available;
+
+    uint32_t start = tail % AUDIO_RING_SIZE;
+    int first = count < AUDIO_RING_SIZE - (int)start ? count : AUDIO_RING_SIZE - (int)start;
+    memcpy(frames, ring->frames[start], first * sizeof(ring->frames[0]));
+    memcpy(frames + first, ring->frames[0], (count - first) * sizeof(ring->frames[0]));
+
+    __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+static void put_u16(uint8_t* out, uint16_t value) {
+    out[0] = value & 0xFF;
+    out[1] = value >> 8;
+}
+
+static void put_u32(uint8_t* out, uint32_t value) {
+    put_u16(out, value & 0xFFFF);
+    put_u16(out + 2, value >> 16);
+}
+
+#define WAV_HEADER_SIZE 44
+
+static void wav_header(uint8_t* header, int rate, uint32_t frames) {
+    uint32_t data_size = frames * 4;
+    memcpy(header, "RIFF", 4);
+    put_u32(header + 4, 36 + data_size);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_u32(header + 16, 16);
+    put_u16(header + 20, 1); // PCM
+    put_u16(header + 22, 2); // Channels
+    put_u32(header + 24, rate);
+    put_u32(header + 28, rate * 4);
+    put_u16(header + 32, 4); // Bytes per frame
+    put_u16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    put_u32(header + 40, data_size);
+}
+
+bool wav_open(struct WavWriter* wav, const char* path, int rate) {
+    wav->file = fopen(path, "wb");
+    wav->rate = rate;
+    wav->frames = 0;
+    if (!wav->file) return false;
+
+    // Sizes are left at 0 until wav_close() knows them
+    uint8_t header[WAV_HEADER_SIZE];
+    wav_header(header, rate, 0);
+    return fwrite(header, sizeof(header), 1, wav->file) == 1;
+}
+
+void wav_write(struct WavWriter* wav, const int16_t (*frames)[2], int count) {
+    // Little endian on disk, same as every host this builds for
+    fwrite(frames, sizeof(frames[0]), count, wav->file);
+    wav->frames += count;
+}
+
+void wav_close(struct WavWriter* wav) {
+    if (!wav->file) return;
+
+    uint8_t header[WAV_HEADER_SIZE];
+    wav_header(header, wav->rate, wav->frames);
+    fseek(wav->file, 0, SEEK_SET);
+    fwrite(header, sizeof(header), 1, wav->file);
+    fclose(wav->file);
+    wav->file = NULL;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Where the DSP's samples go. The emulator pushes stereo frames into a
+// lock-free single producer/single consumer ring as it makes them, and
+// whoever's playing them (raylib's audio thread, or a WAV file in headless
+// runs) pops them off at its own pace.
+//
+// Neither side ever waits for the other. If the ring fills up, the newest
+// frames are dropped. If it runs dry, the reader gets short and makes do.
+
+// Stereo frames, a power of two. A frame's worth is ~534
+#define AUDIO_RING_SIZE 8192
+
+struct AudioRing {
+    // Producer side
+    _Alignas(64) uint64_t head;
+    uint64_t dropped;
+
+    // Consumer side
+    _Alignas(64) uint64_t tail;
+
+    _Alignas(64) int16_t frames[AUDIO_RING_SIZE][2];
+};
+
+struct AudioRing* audio_ring_create();
+void audio_ring_free(struct AudioRing* ring);
+
+// Returns how many went in, the rest are dropped
+int audio_ring_push(struct AudioRing* ring, const int16_t (*frames)[2], int count);
+// Returns how many came out, up to `count`
+int audio_ring_pop(struct AudioRing* ring, int16_t (*frames)[2], int count);
+
+// 16-bit stereo PCM. The header's sizes are filled in on close
+struct WavWriter {
+    FILE* file;
+    int rate;
+    uint32_t frames;
+};
+
+bool wav_open(struct WavWriter* wav, const char* path, int rate);
+void wav_write(struct WavWriter* wav, const int16_t (*frames)[2], int count);
+void wav_close(struct WavWriter* wav);
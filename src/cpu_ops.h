@@ -0,0 +1,922 @@
+// Opcode handlers, instantiated once per CPU mode by main.c. The includer
+// defines CPU_MODE_SUFFIX along with M16, X16 and EMU as 0/1 constants, so
+// every width check in here folds away and each handler has a single path.
+//
+// Most opcodes are an addressing mode generator (ea_*) glued to an operation
+// kernel (k_*) by the DEFINE_* macros below, going off the OPCODES list at the
+// bottom. Anything that doesn't fit that shape is written out as a CUSTOM
+// handler.
+//
+// Handlers get the operand bytes already fetched (little endian, length from
+// the dispatch table) and PC already past the instruction. The cycle counts in
+// OPCODES are charged before the handler runs, handlers only add the parts that
+// depend on runtime state (DL != 0, index page crossings, taken branches).
+
+#define CPU_PASTE2(a, b) a##_##b
+#define CPU_PASTE(a, b) CPU_PASTE2(a, b)
+#define OP(name) CPU_PASTE(name, CPU_MODE_SUFFIX)
+
+#define M_MASK (M16 ? 0xFFFF : 0xFF)
+#define M_SIGN (M16 ? 0x8000 : 0x80)
+
+// Which register width each kernel works at
+#define WIDTH_ora M16
+#define WIDTH_and M16
+#define WIDTH_eor M16
+#define WIDTH_adc M16
+#define WIDTH_sbc M16
+#define WIDTH_cmp M16
+#define WIDTH_bit M16
+#define WIDTH_lda M16
+#define WIDTH_sta M16
+#define WIDTH_stz M16
+#define WIDTH_ldx X16
+#define WIDTH_ldy X16
+#define WIDTH_cpx X16
+#define WIDTH_cpy X16
+#define WIDTH_stx X16
+#define WIDTH_sty X16
+
+// --- Addressing modes ---
+// `read` is false for stores and read-modify-writes, which always pay for the
+// index carry and so have it in their base cycle count already
+
+static inline uint32_t OP(ea_dp)(struct Emulator* emu, uint32_t operand, bool read) {
+    if (emu->registers.D & 0xFF) eat_cycles(emu, 1);
+    return (emu->registers.D + operand) & 0xFFFF;
+}
+
+static inline uint32_t OP(ea_dp_indexed)(struct Emulator* emu, uint32_t operand, uint16_t index) {
+    if (emu->registers.D & 0xFF) eat_cycles(emu, 1);
+
+    // The 6502 wrapped within the page, emulation mode keeps that when it can
+    if (EMU && !(emu->registers.D & 0xFF)) return emu->registers.D | ((operand + index) & 0xFF);
+    return (emu->registers.D + operand + index) & 0xFFFF;
+}
+
+static inline uint32_t OP(ea_dp_x)(struct Emulator* emu, uint32_t operand, bool read) {
+    return OP(ea_dp_indexed)(emu, operand, emu->registers.X);
+}
+
+static inline uint32_t OP(ea_dp_y)(struct Emulator* emu, uint32_t operand, bool read) {
+    return OP(ea_dp_indexed)(emu, operand, emu->registers.Y);
+}
+
+static inline uint32_t OP(ea_dp_indirect)(struct Emulator* emu, uint32_t operand, bool read) {
+    return (emu->registers.DBR << 16) | read_pointer_u16(emu, OP(ea_dp)(emu, operand, read));
+}
+
+static inline uint32_t OP(ea_dp_x_indirect)(struct Emulator* emu, uint32_t operand, bool read) {
+    return (emu->registers.DBR << 16) | read_pointer_u16(emu, OP(ea_dp_x)(emu, operand, read));
+}
+
+// Narrow index reads pay a cycle for carrying into the next page
+static inline uint32_t OP(index_page_penalty)(struct Emulator* emu, uint32_t base, uint32_t ea, bool read) {
+    if (!X16 && read && ((base ^ ea) & 0xFF00)) eat_cycles(emu, 1);
+    return ea & 0xFFFFFF;
+}
+
+static inline uint32_t OP(ea_dp_indirect_y)(struct Emulator* emu, uint32_t operand, bool read) {
+    uint32_t base = OP(ea_dp_indirect)(emu, operand, read);
+    return OP(index_page_penalty)(emu, base, base + emu->registers.Y, read);
+}
+
+static inline uint32_t OP(ea_dp_indirect_long)(struct Emulator* emu, uint32_t operand, bool read) {
+    return read_pointer_u24(emu, OP(ea_dp)(emu, operand, read));
+}
+
+static inline uint32_t OP(ea_dp_indirect_long_y)(struct Emulator* emu, uint32_t operand, bool read) {
+    return (OP(ea_dp_indirect_long)(emu, operand, read) + emu->registers.Y) & 0xFFFFFF;
+}
+
+static inline uint32_t OP(ea_abs)(struct Emulator* emu, uint32_t operand, bool read) {
+    return (emu->registers.DBR << 16) | operand;
+}
+
+static inline uint32_t OP(ea_abs_x)(struct Emulator* emu, uint32_t operand, bool read) {
+    uint32_t base = OP(ea_abs)(emu, operand, read);
+    return OP(index_page_penalty)(emu, base, base + emu->registers.X, read);
+}
+
+static inline uint32_t OP(ea_abs_y)(struct Emulator* emu, uint32_t operand, bool read) {
+    uint32_t base = OP(ea_abs)(emu, operand, read);
+    return OP(index_page_penalty)(emu, base, base + emu->registers.Y, read);
+}
+
+static inline uint32_t OP(ea_long)(struct Emulator* emu, uint32_t operand, bool read) {
+    return operand;
+}
+
+static inline uint32_t OP(ea_long_x)(struct Emulator* emu, uint32_t operand, bool read) {
+    return (operand + emu->registers.X) & 0xFFFFFF;
+}
+
+static inline uint32_t OP(ea_sr)(struct Emulator* emu, uint32_t operand, bool read) {
+    return (emu->registers.S + operand) & 0xFFFF;
+}
+
+static inline uint32_t OP(ea_sr_indirect_y)(struct Emulator* emu, uint32_t operand, bool read) {
+    uint32_t base = (emu->registers.DBR << 16) | read_pointer_u16(emu, OP(ea_sr)(emu, operand, read));
+    return (base + emu->registers.Y) & 0xFFFFFF;
+}
+
+// --- Stack ---
+
+static inline void OP(push_u8)(struct Emulator* emu, uint8_t value) {
+    write_u8(emu, emu->registers.S, value);
+    emu->registers.S = EMU ? (0x0100 | ((emu->registers.S - 1) & 0xFF)) : (emu->registers.S - 1);
+}
+
+static inline void OP(push_u16)(struct Emulator* emu, uint16_t value) {
+    OP(push_u8)(emu, value >> 8);
+    OP(push_u8)(emu, value & 0xFF);
+}
+
+static inline uint8_t OP(pull_u8)(struct Emulator* emu) {
+    emu->registers.S = EMU ? (0x0100 | ((emu->registers.S + 1) & 0xFF)) : (emu->registers.S + 1);
+    return read_mem(emu, emu->registers.S);
+}
+
+static inline uint16_t OP(pull_u16)(struct Emulator* emu) {
+    uint8_t low = OP(pull_u8)(emu);
+    return (OP(pull_u8)(emu) << 8) | low;
+}
+
+// The 65816's own stack instructions (PEA, PEI, PER, PHD, PLD, PLB, JSL, RTL
+// and JSR (abs,X)) don't wrap inside page 1 in emulation mode. S runs on
+// past it for the rest of the instruction, and only gets put back in page 1
+// by stack_done() once it's finished
+static inline void OP(push_u8_nowrap)(struct Emulator* emu, uint8_t value) {
+    write_u8(emu, emu->registers.S, value);
+    emu->registers.S--;
+}
+
+static inline void OP(push_u16_nowrap)(struct Emulator* emu, uint16_t value) {
+    OP(push_u8_nowrap)(emu, value >> 8);
+    OP(push_u8_nowrap)(emu, value & 0xFF);
+}
+
+static inline uint8_t OP(pull_u8_nowrap)(struct Emulator* emu) {
+    emu->registers.S++;
+    return read_mem(emu, emu->registers.S);
+}
+
+static inline uint16_t OP(pull_u16_nowrap)(struct Emulator* emu) {
+    uint8_t low = OP(pull_u8_nowrap)(emu);
+    return (OP(pull_u8_nowrap)(emu) << 8) | low;
+}
+
+static inline void OP(stack_done)(struct Emulator* emu) {
+    if (EMU) emu->registers.S = 0x0100 | (emu->registers.S & 0xFF);
+}
+
+static inline void OP(push_data)(struct Emulator* emu, uint16_t value, bool wide) {
+    if (wide) {
+        OP(push_u16)(emu, value);
+    } else {
+        OP(push_u8)(emu, value & 0xFF);
+    }
+}
+
+static inline uint16_t OP(pull_data)(struct Emulator* emu, bool wide) {
+    return wide ? OP(pull_u16)(emu) : OP(pull_u8)(emu);
+}
+
+// --- Kernels ---
+
+static inline void OP(k_lda)(struct Emulator* emu, uint16_t value) { load_register(emu, &emu->registers.A, value, M16); }
+static inline void OP(k_ldx)(struct Emulator* emu, uint16_t value) { load_register(emu, &emu->registers.X, value, X16); }
+static inline void OP(k_ldy)(struct Emulator* emu, uint16_t value) { load_register(emu, &emu->registers.Y, value, X16); }
+static inline void OP(k_ora)(struct Emulator* emu, uint16_t value) { load_register(emu, &emu->registers.A, emu->registers.A | value, M16); }
+static inline void OP(k_and)(struct Emulator* emu, uint16_t value) { load_register(emu, &emu->registers.A, emu->registers.A & value, M16); }
+static inline void OP(k_eor)(struct Emulator* emu, uint16_t value) { load_register(emu, &emu->registers.A, emu->registers.A ^ value, M16); }
+
+static inline void OP(k_cmp)(struct Emulator* emu, uint16_t value) { compare(emu, emu->registers.A, value, M16); }
+static inline void OP(k_cpx)(struct Emulator* emu, uint16_t value) { compare(emu, emu->registers.X, value, X16); }
+static inline void OP(k_cpy)(struct Emulator* emu, uint16_t value) { compare(emu, emu->registers.Y, value, X16); }
+
+static inline void OP(k_bit)(struct Emulator* emu, uint16_t value) {
+    emu->registers.status.flags.N = !!(value & M_SIGN);
+    emu->registers.status.flags.V = !!(value & (M_SIGN >> 1));
+    emu->registers.status.flags.Z = !(emu->registers.A & value & M_MASK);
+}
+
+// ADC and SBC share this, SBC being an add of the complement. Decimal mode
+// works a nibble at a time, the same way the chip does it
+static inline void OP(add_with_carry)(struct Emulator* emu, uint16_t value, bool subtract) {
+    int32_t a = emu->registers.A & M_MASK;
+    int32_t v = subtract ? (~value & M_MASK) : (value & M_MASK);
+    int32_t result;
+
+    if (!emu->registers.status.flags.D) {
+        result = a + v + emu->registers.status.flags.C;
+        emu->registers.status.flags.V = !!(~(a ^ v) & (a ^ result) & M_SIGN);
+    } else {
+        int bits = M16 ? 16 : 8;
+        int32_t carry = emu->registers.status.flags.C;
+        result = 0;
+
+        for (int shift = 0; shift < bits; shift += 4) {
+            int32_t digit = 0xF << shift;
+            int32_t below = (1 << shift) - 1;
+            result = (a & digit) + (v & digit) + (carry << shift) + (result & below);
+
+            if (shift == bits - 4) emu->registers.status.flags.V = !!(~(a ^ v) & (a ^ result) & M_SIGN);
+
+            if (!subtract && result > ((0xA << shift) - 1)) result += 0x6 << shift;
+            if (subtract && result <= ((0x10 << shift) - 1)) result -= 0x6 << shift;
+            carry = result > ((0x10 << shift) - 1);
+        }
+    }
+
+    emu->registers.status.flags.C = result > M_MASK;
+    load_register(emu, &emu->registers.A, result & M_MASK, M16);
+}
+
+static inline void OP(k_adc)(struct Emulator* emu, uint16_t value) { OP(add_with_carry)(emu, value, false); }
+static inline void OP(k_sbc)(struct Emulator* emu, uint16_t value) { OP(add_with_carry)(emu, value, true); }
+
+// Store kernels just say what gets written
+static inline uint16_t OP(k_sta)(struct Emulator* emu) { return emu->registers.A; }
+static inline uint16_t OP(k_stx)(struct Emulator* emu) { return emu->registers.X; }
+static inline uint16_t OP(k_sty)(struct Emulator* emu) { return emu->registers.Y; }
+static inline uint16_t OP(k_stz)(struct Emulator* emu) { return 0; }
+
+// Read-modify-write kernels, on memory or the accumulator
+static inline uint16_t OP(k_asl)(struct Emulator* emu, uint16_t value) {
+    emu->registers.status.flags.C = !!(value & M_SIGN);
+    value = (value << 1) & M_MASK;
+    set_nz(emu, value, M16);
+    return value;
+}
+
+static inline uint16_t OP(k_lsr)(struct Emulator* emu, uint16_t value) {
+    emu->registers.status.flags.C = value & 1;
+    value = (value & M_MASK) >> 1;
+    set_nz(emu, value, M16);
+    return value;
+}
+
+static inline uint16_t OP(k_rol)(struct Emulator* emu, uint16_t value) {
+    bool carry = !!(value & M_SIGN);
+    value = ((value << 1) | emu->registers.status.flags.C) & M_MASK;
+    emu->registers.status.flags.C = carry;
+    set_nz(emu, value, M16);
+    return value;
+}
+
+static inline uint16_t OP(k_ror)(struct Emulator* emu, uint16_t value) {
+    bool carry = value & 1;
+    value = ((value & M_MASK) >> 1) | (emu->registers.status.flags.C ? M_SIGN : 0);
+    emu->registers.status.flags.C = carry;
+    set_nz(emu, value, M16);
+    return value;
+}
+
+static inline uint16_t OP(k_inc)(struct Emulator* emu, uint16_t value) {
+    value = (value + 1) & M_MASK;
+    set_nz(emu, value, M16);
+    return value;
+}
+
+static inline uint16_t OP(k_dec)(struct Emulator* emu, uint16_t value) {
+    value = (value - 1) & M_MASK;
+    set_nz(emu, value, M16);
+    return value;
+}
+
+static inline uint16_t OP(k_tsb)(struct Emulator* emu, uint16_t value) {
+    emu->registers.status.flags.Z = !(emu->registers.A & value & M_MASK);
+    return (value | emu->registers.A) & M_MASK;
+}
+
+static inline uint16_t OP(k_trb)(struct Emulator* emu, uint16_t value) {
+    emu->registers.status.flags.Z = !(emu->registers.A & value & M_MASK);
+    return value & ~emu->registers.A & M_MASK;
+}
+
+// --- Generators ---
+
+#define DEFINE_READ(opcode, kernel, mode) \
+    static void OP(op_##opcode)(struct Emulator* emu, uint32_t operand) { \
+        OP(k_##kernel)(emu, read_data(emu, OP(ea_##mode)(emu, operand, true), WIDTH_##kernel)); \
+    }
+
+#define DEFINE_IMMEDIATE(opcode, kernel, mode) \
+    static void OP(op_##opcode)(struct Emulator* emu, uint32_t operand) { \
+        OP(k_##kernel)(emu, operand); \
+    }
+
+#define DEFINE_WRITE(opcode, kernel, mode) \
+    static void OP(op_##opcode)(struct Emulator* emu, uint32_t operand) { \
+        write_data(emu, OP(ea_##mode)(emu, operand, false), OP(k_##kernel)(emu), WIDTH_##kernel); \
+    }
+
+#define DEFINE_RMW(opcode, kernel, mode) \
+    static void OP(op_##opcode)(struct Emulator* emu, uint32_t operand) { \
+        uint32_t ea = OP(ea_##mode)(emu, operand, false); \
+        write_data(emu, ea, OP(k_##kernel)(emu, read_data(emu, ea, M16)), M16); \
+    }
+
+#define DEFINE_ACCUMULATOR(opcode, kernel, mode) \
+    static void OP(op_##opcode)(struct Emulator* emu, uint32_t operand) { \
+        uint16_t value = OP(k_##kernel)(emu, emu->registers.A & M_MASK); \
+        emu->registers.A = M16 ? value : ((emu->registers.A & 0xFF00) | value); \
+    }
+
+#define DEFINE_CUSTOM(opcode, kernel, mode)
+
+// --- Everything else ---
+
+// BRK
+static void OP(op_0x00)(struct Emulator* emu, uint32_t operand) {
+    enter_interrupt(emu, 0xFFE6, 0xFFFE, true);
+}
+
+// COP
+static void OP(op_0x02)(struct Emulator* emu, uint32_t operand) {
+    enter_interrupt(emu, 0xFFE4, 0xFFF4, true);
+}
+
+// PHP
+static void OP(op_0x08)(struct Emulator* emu, uint32_t operand) {
+    OP(push_u8)(emu, emu->registers.status.byte);
+}
+
+// PHD
+static void OP(op_0x0B)(struct Emulator* emu, uint32_t operand) {
+    OP(push_u16_nowrap)(emu, emu->registers.D);
+    OP(stack_done)(emu);
+}
+
+// Conditional branches
+static void OP(op_0x10)(struct Emulator* emu, uint32_t operand) { branch(emu, !emu->registers.status.flags.N, operand, EMU); }
+static void OP(op_0x30)(struct Emulator* emu, uint32_t operand) { branch(emu, emu->registers.status.flags.N, operand, EMU); }
+static void OP(op_0x50)(struct Emulator* emu, uint32_t operand) { branch(emu, !emu->registers.status.flags.V, operand, EMU); }
+static void OP(op_0x70)(struct Emulator* emu, uint32_t operand) { branch(emu, emu->registers.status.flags.V, operand, EMU); }
+static void OP(op_0x80)(struct Emulator* emu, uint32_t operand) { branch(emu, true, operand, EMU); }
+static void OP(op_0x90)(struct Emulator* emu, uint32_t operand) { branch(emu, !emu->registers.status.flags.C, operand, EMU); }
+static void OP(op_0xB0)(struct Emulator* emu, uint32_t operand) { branch(emu, emu->registers.status.flags.C, operand, EMU); }
+static void OP(op_0xD0)(struct Emulator* emu, uint32_t operand) { branch(emu, !emu->registers.status.flags.Z, operand, EMU); }
+static void OP(op_0xF0)(struct Emulator* emu, uint32_t operand) { branch(emu, emu->registers.status.flags.Z, operand, EMU); }
+
+// BRL
+static void OP(op_0x82)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.PC = (emu->registers.PC & 0xFF0000) | ((emu->registers.PC + (int16_t)operand) & 0xFFFF);
+}
+
+// Flags
+static void OP(op_0x18)(struct Emulator* emu, uint32_t operand) { emu->registers.status.flags.C = 0; }
+static void OP(op_0x38)(struct Emulator* emu, uint32_t operand) { emu->registers.status.flags.C = 1; }
+static void OP(op_0x78)(struct Emulator* emu, uint32_t operand) { emu->registers.status.flags.I = 1; }
+static void OP(op_0xB8)(struct Emulator* emu, uint32_t operand) { emu->registers.status.flags.V = 0; }
+static void OP(op_0xD8)(struct Emulator* emu, uint32_t operand) { emu->registers.status.flags.D = 0; }
+static void OP(op_0xF8)(struct Emulator* emu, uint32_t operand) { emu->registers.status.flags.D = 1; }
+
+// CLI
+static void OP(op_0x58)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.status.flags.I = 0;
+    if (emu->memory.irq_flag) request_interrupt_check(emu);
+}
+
+// Pulling or clearing bits of P can change widths and unmask IRQs
+static inline void OP(status_changed)(struct Emulator* emu) {
+    if (EMU) {
+        emu->registers.status.flags.M = 1;
+        emu->registers.status.flags.X = 1;
+    }
+
+    if (emu->registers.status.flags.X) {
+        emu->registers.X &= 0xFF;
+        emu->registers.Y &= 0xFF;
+    }
+
+    if (!emu->registers.status.flags.I && emu->memory.irq_flag) request_interrupt_check(emu);
+    update_cpu_mode(emu);
+}
+
+// REP
+static void OP(op_0xC2)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.status.byte &= ~operand;
+    OP(status_changed)(emu);
+}
+
+// SEP
+static void OP(op_0xE2)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.status.byte |= operand;
+    OP(status_changed)(emu);
+}
+
+// PLP
+static void OP(op_0x28)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.status.byte = OP(pull_u8)(emu);
+    OP(status_changed)(emu);
+}
+
+// RTI
+static void OP(op_0x40)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.status.byte = OP(pull_u8)(emu);
+    uint16_t pc = OP(pull_u16)(emu);
+    uint8_t bank = EMU ? (emu->registers.PC >> 16) : OP(pull_u8)(emu);
+
+    emu->registers.PC = (bank << 16) | pc;
+    OP(status_changed)(emu);
+}
+
+// XCE
+static void OP(op_0xFB)(struct Emulator* emu, uint32_t operand) {
+    uint8_t old_e = emu->registers.E_flag;
+    emu->registers.E_flag = emu->registers.status.flags.C;
+    emu->registers.status.flags.C = old_e;
+
+    if (emu->registers.E_flag) {
+        emu->registers.status.flags.M = 1;
+        emu->registers.status.flags.X = 1;
+        emu->registers.S = 0x0100 | (emu->registers.S & 0xFF);
+        emu->registers.X &= 0xFF;
+        emu->registers.Y &= 0xFF;
+    }
+    update_cpu_mode(emu);
+}
+
+// JSR abs
+static void OP(op_0x20)(struct Emulator* emu, uint32_t operand) {
+    OP(push_u16)(emu, (emu->registers.PC - 1) & 0xFFFF);
+    emu->registers.PC = (emu->registers.PC & 0xFF0000) | operand;
+}
+
+// JSL long
+static void OP(op_0x22)(struct Emulator* emu, uint32_t operand) {
+    OP(push_u8_nowrap)(emu, emu->registers.PC >> 16);
+    OP(push_u16_nowrap)(emu, (emu->registers.PC - 1) & 0xFFFF);
+    OP(stack_done)(emu);
+    emu->registers.PC = operand;
+}
+
+// JSR (abs,X)
+static void OP(op_0xFC)(struct Emulator* emu, uint32_t operand) {
+    uint32_t bank = emu->registers.PC & 0xFF0000;
+    uint16_t target = read_pointer_u16(emu, bank | ((operand + emu->registers.X) & 0xFFFF));
+
+    OP(push_u16_nowrap)(emu, (emu->registers.PC - 1) & 0xFFFF);
+    OP(stack_done)(emu);
+    emu->registers.PC = bank | target;
+}
+
+// RTS
+static void OP(op_0x60)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.PC = (emu->registers.PC & 0xFF0000) | ((OP(pull_u16)(emu) + 1) & 0xFFFF);
+}
+
+// RTL
+static void OP(op_0x6B)(struct Emulator* emu, uint32_t operand) {
+    uint16_t pc = OP(pull_u16_nowrap)(emu) + 1;
+    emu->registers.PC = (OP(pull_u8_nowrap)(emu) << 16) | pc;
+    OP(stack_done)(emu);
+}
+
+// JMP abs
+static void OP(op_0x4C)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.PC = (emu->registers.PC & 0xFF0000) | operand;
+}
+
+// JML long
+static void OP(op_0x5C)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.PC = operand;
+}
+
+// JMP (abs)
+static void OP(op_0x6C)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.PC = (emu->registers.PC & 0xFF0000) | read_pointer_u16(emu, operand);
+}
+
+// JMP (abs,X)
+static void OP(op_0x7C)(struct Emulator* emu, uint32_t operand) {
+    uint32_t bank = emu->registers.PC & 0xFF0000;
+    emu->registers.PC = bank | read_pointer_u16(emu, bank | ((operand + emu->registers.X) & 0xFFFF));
+}
+
+// JML [abs]
+static void OP(op_0xDC)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.PC = read_pointer_u24(emu, operand);
+}
+
+// Pushes
+static void OP(op_0x48)(struct Emulator* emu, uint32_t operand) { OP(push_data)(emu, emu->registers.A, M16); }
+static void OP(op_0x4B)(struct Emulator* emu, uint32_t operand) { OP(push_u8)(emu, emu->registers.PC >> 16); }
+static void OP(op_0x5A)(struct Emulator* emu, uint32_t operand) { OP(push_data)(emu, emu->registers.Y, X16); }
+static void OP(op_0x8B)(struct Emulator* emu, uint32_t operand) { OP(push_u8)(emu, emu->registers.DBR); }
+static void OP(op_0xDA)(struct Emulator* emu, uint32_t operand) { OP(push_data)(emu, emu->registers.X, X16); }
+
+// PER
+static void OP(op_0x62)(struct Emulator* emu, uint32_t operand) {
+    OP(push_u16_nowrap)(emu, emu->registers.PC + (int16_t)operand);
+    OP(stack_done)(emu);
+}
+
+// PEI
+static void OP(op_0xD4)(struct Emulator* emu, uint32_t operand) {
+    OP(push_u16_nowrap)(emu, read_pointer_u16(emu, OP(ea_dp)(emu, operand, true)));
+    OP(stack_done)(emu);
+}
+
+// PEA
+static void OP(op_0xF4)(struct Emulator* emu, uint32_t operand) {
+    OP(push_u16_nowrap)(emu, operand);
+    OP(stack_done)(emu);
+}
+
+// Pulls
+static void OP(op_0x68)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.A, OP(pull_data)(emu, M16), M16); }
+static void OP(op_0x7A)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.Y, OP(pull_data)(emu, X16), X16); }
+static void OP(op_0xFA)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.X, OP(pull_data)(emu, X16), X16); }
+
+// PLB
+static void OP(op_0xAB)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.DBR = OP(pull_u8_nowrap)(emu);
+    OP(stack_done)(emu);
+    set_nz(emu, emu->registers.DBR, false);
+}
+
+// PLD
+static void OP(op_0x2B)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.D = OP(pull_u16_nowrap)(emu);
+    OP(stack_done)(emu);
+    set_nz(emu, emu->registers.D, true);
+}
+
+// Transfers. Whatever's being written to decides the width
+static void OP(op_0x8A)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.A, emu->registers.X, M16); } // TXA
+static void OP(op_0x98)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.A, emu->registers.Y, M16); } // TYA
+static void OP(op_0xA8)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.Y, emu->registers.A, X16); } // TAY
+static void OP(op_0xAA)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.X, emu->registers.A, X16); } // TAX
+static void OP(op_0xBA)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.X, emu->registers.S, X16); } // TSX
+static void OP(op_0x9B)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.Y, emu->registers.X, X16); } // TXY
+static void OP(op_0xBB)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.X, emu->registers.Y, X16); } // TYX
+static void OP(op_0x5B)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.D, emu->registers.A, true); } // TCD
+static void OP(op_0x7B)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.A, emu->registers.D, true); } // TDC
+static void OP(op_0x3B)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.A, emu->registers.S, true); } // TSC
+
+// TCS
+static void OP(op_0x1B)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.S = EMU ? (0x0100 | (emu->registers.A & 0xFF)) : emu->registers.A;
+}
+
+// TXS
+static void OP(op_0x9A)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.S = EMU ? (0x0100 | (emu->registers.X & 0xFF)) : emu->registers.X;
+}
+
+// Index increments
+static void OP(op_0x88)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.Y, emu->registers.Y - 1, X16); } // DEY
+static void OP(op_0xC8)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.Y, emu->registers.Y + 1, X16); } // INY
+static void OP(op_0xCA)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.X, emu->registers.X - 1, X16); } // DEX
+static void OP(op_0xE8)(struct Emulator* emu, uint32_t operand) { load_register(emu, &emu->registers.X, emu->registers.X + 1, X16); } // INX
+
+// BIT #const only touches Z
+static void OP(op_0x89)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.status.flags.Z = !(emu->registers.A & operand & M_MASK);
+}
+
+// XBA
+static void OP(op_0xEB)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.A = (emu->registers.A << 8) | (emu->registers.A >> 8);
+    set_nz(emu, emu->registers.A, false);
+}
+
+// Block moves move one byte per run, rewinding PC until A underflows
+static inline void OP(block_move)(struct Emulator* emu, uint32_t operand, int step) {
+    uint8_t dest_bank = operand & 0xFF;
+    uint8_t source_bank = operand >> 8;
+
+    emu->registers.DBR = dest_bank;
+    write_u8(emu, (dest_bank << 16) | emu->registers.Y, read_mem(emu, (source_bank << 16) | emu->registers.X));
+
+    emu->registers.X = (emu->registers.X + step) & (X16 ? 0xFFFF : 0xFF);
+    emu->registers.Y = (emu->registers.Y + step) & (X16 ? 0xFFFF : 0xFF);
+
+    if (emu->registers.A--) {
+        emu->registers.PC = (emu->registers.PC & 0xFF0000) | ((emu->registers.PC - 3) & 0xFFFF);
+    }
+}
+
+// MVP
+static void OP(op_0x44)(struct Emulator* emu, uint32_t operand) { OP(block_move)(emu, operand, -1); }
+
+// MVN
+static void OP(op_0x54)(struct Emulator* emu, uint32_t operand) { OP(block_move)(emu, operand, 1); }
+
+// WAI
+static void OP(op_0xCB)(struct Emulator* emu, uint32_t operand) {
+    wait_for_interrupt(emu);
+}
+
+// STP. Only a reset gets out of this, so just sit here
+static void OP(op_0xDB)(struct Emulator* emu, uint32_t operand) {
+    emu->registers.PC = (emu->registers.PC & 0xFF0000) | ((emu->registers.PC - 1) & 0xFFFF);
+    if (emu->scheduler.now < emu->scheduler.deadline) emu->scheduler.now = emu->scheduler.deadline;
+}
+
+// NOP, WDM
+static void OP(op_0xEA)(struct Emulator* emu, uint32_t operand) {}
+static void OP(op_0x42)(struct Emulator* emu, uint32_t operand) {}
+
+// opcode, kind, kernel, addressing mode, cycles
+#define OPCODES(X) \
+    X(0x00, CUSTOM, brk, -, EMU ? 7 : 8) \
+    X(0x01, READ, ora, dp_x_indirect, 6 + M16) \
+    X(0x02, CUSTOM, cop, -, EMU ? 7 : 8) \
+    X(0x03, READ, ora, sr, 4 + M16) \
+    X(0x04, RMW, tsb, dp, 5 + 2 * M16) \
+    X(0x05, READ, ora, dp, 3 + M16) \
+    X(0x06, RMW, asl, dp, 5 + 2 * M16) \
+    X(0x07, READ, ora, dp_indirect_long, 6 + M16) \
+    X(0x08, CUSTOM, php, -, 3) \
+    X(0x09, IMMEDIATE, ora, -, 2 + M16) \
+    X(0x0A, ACCUMULATOR, asl, -, 2) \
+    X(0x0B, CUSTOM, phd, -, 4) \
+    X(0x0C, RMW, tsb, abs, 6 + 2 * M16) \
+    X(0x0D, READ, ora, abs, 4 + M16) \
+    X(0x0E, RMW, asl, abs, 6 + 2 * M16) \
+    X(0x0F, READ, ora, long, 5 + M16) \
+    X(0x10, CUSTOM, bpl, -, 2) \
+    X(0x11, READ, ora, dp_indirect_y, 5 + M16 + X16) \
+    X(0x12, READ, ora, dp_indirect, 5 + M16) \
+    X(0x13, READ, ora, sr_indirect_y, 7 + M16) \
+    X(0x14, RMW, trb, dp, 5 + 2 * M16) \
+    X(0x15, READ, ora, dp_x, 4 + M16) \
+    X(0x16, RMW, asl, dp_x, 6 + 2 * M16) \
+    X(0x17, READ, ora, dp_indirect_long_y, 6 + M16) \
+    X(0x18, CUSTOM, clc, -, 2) \
+    X(0x19, READ, ora, abs_y, 4 + M16 + X16) \
+    X(0x1A, ACCUMULATOR, inc, -, 2) \
+    X(0x1B, CUSTOM, tcs, -, 2) \
+    X(0x1C, RMW, trb, abs, 6 + 2 * M16) \
+    X(0x1D, READ, ora, abs_x, 4 + M16 + X16) \
+    X(0x1E, RMW, asl, abs_x, 7 + 2 * M16) \
+    X(0x1F, READ, ora, long_x, 5 + M16) \
+    X(0x20, CUSTOM, jsr, -, 6) \
+    X(0x21, READ, and, dp_x_indirect, 6 + M16) \
+    X(0x22, CUSTOM, jsl, -, 8) \
+    X(0x23, READ, and, sr, 4 + M16) \
+    X(0x24, READ, bit, dp, 3 + M16) \
+    X(0x25, READ, and, dp, 3 + M16) \
+    X(0x26, RMW, rol, dp, 5 + 2 * M16) \
+    X(0x27, READ, and, dp_indirect_long, 6 + M16) \
+    X(0x28, CUSTOM, plp, -, 4) \
+    X(0x29, IMMEDIATE, and, -, 2 + M16) \
+    X(0x2A, ACCUMULATOR, rol, -, 2) \
+    X(0x2B, CUSTOM, pld, -, 5) \
+    X(0x2C, READ, bit, abs, 4 + M16) \
+    X(0x2D, READ, and, abs, 4 + M16) \
+    X(0x2E, RMW, rol, abs, 6 + 2 * M16) \
+    X(0x2F, READ, and, long, 5 + M16) \
+    X(0x30, CUSTOM, bmi, -, 2) \
+    X(0x31, READ, and, dp_indirect_y, 5 + M16 + X16) \
+    X(0x32, READ, and, dp_indirect, 5 + M16) \
+    X(0x33, READ, and, sr_indirect_y, 7 + M16) \
+    X(0x34, READ, bit, dp_x, 4 + M16) \
+    X(0x35, READ, and, dp_x, 4 + M16) \
+    X(0x36, RMW, rol, dp_x, 6 + 2 * M16) \
+    X(0x37, READ, and, dp_indirect_long_y, 6 + M16) \
+    X(0x38, CUSTOM, sec, -, 2) \
+    X(0x39, READ, and, abs_y, 4 + M16 + X16) \
+    X(0x3A, ACCUMULATOR, dec, -, 2) \
+    X(0x3B, CUSTOM, tsc, -, 2) \
+    X(0x3C, READ, bit, abs_x, 4 + M16 + X16) \
+    X(0x3D, READ, and, abs_x, 4 + M16 + X16) \
+    X(0x3E, RMW, rol, abs_x, 7 + 2 * M16) \
+    X(0x3F, READ, and, long_x, 5 + M16) \
+    X(0x40, CUSTOM, rti, -, EMU ? 6 : 7) \
+    X(0x41, READ, eor, dp_x_indirect, 6 + M16) \
+    X(0x42, CUSTOM, wdm, -, 2) \
+    X(0x43, READ, eor, sr, 4 + M16) \
+    X(0x44, CUSTOM, mvp, -, 7) \
+    X(0x45, READ, eor, dp, 3 + M16) \
+    X(0x46, RMW, lsr, dp, 5 + 2 * M16) \
+    X(0x47, READ, eor, dp_indirect_long, 6 + M16) \
+    X(0x48, CUSTOM, pha, -, 3 + M16) \
+    X(0x49, IMMEDIATE, eor, -, 2 + M16) \
+    X(0x4A, ACCUMULATOR, lsr, -, 2) \
+    X(0x4B, CUSTOM, phk, -, 3) \
+    X(0x4C, CUSTOM, jmp, -, 3) \
+    X(0x4D, READ, eor, abs, 4 + M16) \
+    X(0x4E, RMW, lsr, abs, 6 + 2 * M16) \
+    X(0x4F, READ, eor, long, 5 + M16) \
+    X(0x50, CUSTOM, bvc, -, 2) \
+    X(0x51, READ, eor, dp_indirect_y, 5 + M16 + X16) \
+    X(0x52, READ, eor, dp_indirect, 5 + M16) \
+    X(0x53, READ, eor, sr_indirect_y, 7 + M16) \
+    X(0x54, CUSTOM, mvn, -, 7) \
+    X(0x55, READ, eor, dp_x, 4 + M16) \
+    X(0x56, RMW, lsr, dp_x, 6 + 2 * M16) \
+    X(0x57, READ, eor, dp_indirect_long_y, 6 + M16) \
+    X(0x58, CUSTOM, cli, -, 2) \
+    X(0x59, READ, eor, abs_y, 4 + M16 + X16) \
+    X(0x5A, CUSTOM, phy, -, 3 + X16) \
+    X(0x5B, CUSTOM, tcd, -, 2) \
+    X(0x5C, CUSTOM, jml, -, 4) \
+    X(0x5D, READ, eor, abs_x, 4 + M16 + X16) \
+    X(0x5E, RMW, lsr, abs_x, 7 + 2 * M16) \
+    X(0x5F, READ, eor, long_x, 5 + M16) \
+    X(0x60, CUSTOM, rts, -, 6) \
+    X(0x61, READ, adc, dp_x_indirect, 6 + M16) \
+    X(0x62, CUSTOM, per, -, 6) \
+    X(0x63, READ, adc, sr, 4 + M16) \
+    X(0x64, WRITE, stz, dp, 3 + M16) \
+    X(0x65, READ, adc, dp, 3 + M16) \
+    X(0x66, RMW, ror, dp, 5 + 2 * M16) \
+    X(0x67, READ, adc, dp_indirect_long, 6 + M16) \
+    X(0x68, CUSTOM, pla, -, 4 + M16) \
+    X(0x69, IMMEDIATE, adc, -, 2 + M16) \
+    X(0x6A, ACCUMULATOR, ror, -, 2) \
+    X(0x6B, CUSTOM, rtl, -, 6) \
+    X(0x6C, CUSTOM, jmp, -, 5) \
+    X(0x6D, READ, adc, abs, 4 + M16) \
+    X(0x6E, RMW, ror, abs, 6 + 2 * M16) \
+    X(0x6F, READ, adc, long, 5 + M16) \
+    X(0x70, CUSTOM, bvs, -, 2) \
+    X(0x71, READ, adc, dp_indirect_y, 5 + M16 + X16) \
+    X(0x72, READ, adc, dp_indirect, 5 + M16) \
+    X(0x73, READ, adc, sr_indirect_y, 7 + M16) \
+    X(0x74, WRITE, stz, dp_x, 4 + M16) \
+    X(0x75, READ, adc, dp_x, 4 + M16) \
+    X(0x76, RMW, ror, dp_x, 6 + 2 * M16) \
+    X(0x77, READ, adc, dp_indirect_long_y, 6 + M16) \
+    X(0x78, CUSTOM, sei, -, 2) \
+    X(0x79, READ, adc, abs_y, 4 + M16 + X16) \
+    X(0x7A, CUSTOM, ply, -, 4 + X16) \
+    X(0x7B, CUSTOM, tdc, -, 2) \
+    X(0x7C, CUSTOM, jmp, -, 6) \
+    X(0x7D, READ, adc, abs_x, 4 + M16 + X16) \
+    X(0x7E, RMW, ror, abs_x, 7 + 2 * M16) \
+    X(0x7F, READ, adc, long_x, 5 + M16) \
+    X(0x80, CUSTOM, bra, -, 2) \
+    X(0x81, WRITE, sta, dp_x_indirect, 6 + M16) \
+    X(0x82, CUSTOM, brl, -, 4) \
+    X(0x83, WRITE, sta, sr, 4 + M16) \
+    X(0x84, WRITE, sty, dp, 3 + X16) \
+    X(0x85, WRITE, sta, dp, 3 + M16) \
+    X(0x86, WRITE, stx, dp, 3 + X16) \
+    X(0x87, WRITE, sta, dp_indirect_long, 6 + M16) \
+    X(0x88, CUSTOM, dey, -, 2) \
+    X(0x89, CUSTOM, bit, -, 2 + M16) \
+    X(0x8A, CUSTOM, txa, -, 2) \
+    X(0x8B, CUSTOM, phb, -, 3) \
+    X(0x8C, WRITE, sty, abs, 4 + X16) \
+    X(0x8D, WRITE, sta, abs, 4 + M16) \
+    X(0x8E, WRITE, stx, abs, 4 + X16) \
+    X(0x8F, WRITE, sta, long, 5 + M16) \
+    X(0x90, CUSTOM, bcc, -, 2) \
+    X(0x91, WRITE, sta, dp_indirect_y, 6 + M16) \
+    X(0x92, WRITE, sta, dp_indirect, 5 + M16) \
+    X(0x93, WRITE, sta, sr_indirect_y, 7 + M16) \
+    X(0x94, WRITE, sty, dp_x, 4 + X16) \
+    X(0x95, WRITE, sta, dp_x, 4 + M16) \
+    X(0x96, WRITE, stx, dp_y, 4 + X16) \
+    X(0x97, WRITE, sta, dp_indirect_long_y, 6 + M16) \
+    X(0x98, CUSTOM, tya, -, 2) \
+    X(0x99, WRITE, sta, abs_y, 5 + M16) \
+    X(0x9A, CUSTOM, txs, -, 2) \
+    X(0x9B, CUSTOM, txy, -, 2) \
+    X(0x9C, WRITE, stz, abs, 4 + M16) \
+    X(0x9D, WRITE, sta, abs_x, 5 + M16) \
+    X(0x9E, WRITE, stz, abs_x, 5 + M16) \
+    X(0x9F, WRITE, sta, long_x, 5 + M16) \
+    X(0xA0, IMMEDIATE, ldy, -, 2 + X16) \
+    X(0xA1, READ, lda, dp_x_indirect, 6 + M16) \
+    X(0xA2, IMMEDIATE, ldx, -, 2 + X16) \
+    X(0xA3, READ, lda, sr, 4 + M16) \
+    X(0xA4, READ, ldy, dp, 3 + X16) \
+    X(0xA5, READ, lda, dp, 3 + M16) \
+    X(0xA6, READ, ldx, dp, 3 + X16) \
+    X(0xA7, READ, lda, dp_indirect_long, 6 + M16) \
+    X(0xA8, CUSTOM, tay, -, 2) \
+    X(0xA9, IMMEDIATE, lda, -, 2 + M16) \
+    X(0xAA, CUSTOM, tax, -, 2) \
+    X(0xAB, CUSTOM, plb, -, 4) \
+    X(0xAC, READ, ldy, abs, 4 + X16) \
+    X(0xAD, READ, lda, abs, 4 + M16) \
+    X(0xAE, READ, ldx, abs, 4 + X16) \
+    X(0xAF, READ, lda, long, 5 + M16) \
+    X(0xB0, CUSTOM, bcs, -, 2) \
+    X(0xB1, READ, lda, dp_indirect_y, 5 + M16 + X16) \
+    X(0xB2, READ, lda, dp_indirect, 5 + M16) \
+    X(0xB3, READ, lda, sr_indirect_y, 7 + M16) \
+    X(0xB4, READ, ldy, dp_x, 4 + X16) \
+    X(0xB5, READ, lda, dp_x, 4 + M16) \
+    X(0xB6, READ, ldx, dp_y, 4 + X16) \
+    X(0xB7, READ, lda, dp_indirect_long_y, 6 + M16) \
+    X(0xB8, CUSTOM, clv, -, 2) \
+    X(0xB9, READ, lda, abs_y, 4 + M16 + X16) \
+    X(0xBA, CUSTOM, tsx, -, 2) \
+    X(0xBB, CUSTOM, tyx, -, 2) \
+    X(0xBC, READ, ldy, abs_x, 4 + 2 * X16) \
+    X(0xBD, READ, lda, abs_x, 4 + M16 + X16) \
+    X(0xBE, READ, ldx, abs_y, 4 + 2 * X16) \
+    X(0xBF, READ, lda, long_x, 5 + M16) \
+    X(0xC0, IMMEDIATE, cpy, -, 2 + X16) \
+    X(0xC1, READ, cmp, dp_x_indirect, 6 + M16) \
+    X(0xC2, CUSTOM, rep, -, 3) \
+    X(0xC3, READ, cmp, sr, 4 + M16) \
+    X(0xC4, READ, cpy, dp, 3 + X16) \
+    X(0xC5, READ, cmp, dp, 3 + M16) \
+    X(0xC6, RMW, dec, dp, 5 + 2 * M16) \
+    X(0xC7, READ, cmp, dp_indirect_long, 6 + M16) \
+    X(0xC8, CUSTOM, iny, -, 2) \
+    X(0xC9, IMMEDIATE, cmp, -, 2 + M16) \
+    X(0xCA, CUSTOM, dex, -, 2) \
+    X(0xCB, CUSTOM, wai, -, 3) \
+    X(0xCC, READ, cpy, abs, 4 + X16) \
+    X(0xCD, READ, cmp, abs, 4 + M16) \
+    X(0xCE, RMW, dec, abs, 6 + 2 * M16) \
+    X(0xCF, READ, cmp, long, 5 + M16) \
+    X(0xD0, CUSTOM, bne, -, 2) \
+    X(0xD1, READ, cmp, dp_indirect_y, 5 + M16 + X16) \
+    X(0xD2, READ, cmp, dp_indirect, 5 + M16) \
+    X(0xD3, READ, cmp, sr_indirect_y, 7 + M16) \
+    X(0xD4, CUSTOM, pei, -, 6) \
+    X(0xD5, READ, cmp, dp_x, 4 + M16) \
+    X(0xD6, RMW, dec, dp_x, 6 + 2 * M16) \
+    X(0xD7, READ, cmp, dp_indirect_long_y, 6 + M16) \
+    X(0xD8, CUSTOM, cld, -, 2) \
+    X(0xD9, READ, cmp, abs_y, 4 + M16 + X16) \
+    X(0xDA, CUSTOM, phx, -, 3 + X16) \
+    X(0xDB, CUSTOM, stp, -, 3) \
+    X(0xDC, CUSTOM, jml, -, 6) \
+    X(0xDD, READ, cmp, abs_x, 4 + M16 + X16) \
+    X(0xDE, RMW, dec, abs_x, 7 + 2 * M16) \
+    X(0xDF, READ, cmp, long_x, 5 + M16) \
+    X(0xE0, IMMEDIATE, cpx, -, 2 + X16) \
+    X(0xE1, READ, sbc, dp_x_indirect, 6 + M16) \
+    X(0xE2, CUSTOM, sep, -, 3) \
+    X(0xE3, READ, sbc, sr, 4 + M16) \
+    X(0xE4, READ, cpx, dp, 3 + X16) \
+    X(0xE5, READ, sbc, dp, 3 + M16) \
+    X(0xE6, RMW, inc, dp, 5 + 2 * M16) \
+    X(0xE7, READ, sbc, dp_indirect_long, 6 + M16) \
+    X(0xE8, CUSTOM, inx, -, 2) \
+    X(0xE9, IMMEDIATE, sbc, -, 2 + M16) \
+    X(0xEA, CUSTOM, nop, -, 2) \
+    X(0xEB, CUSTOM, xba, -, 3) \
+    X(0xEC, READ, cpx, abs, 4 + X16) \
+    X(0xED, READ, sbc, abs, 4 + M16) \
+    X(0xEE, RMW, inc, abs, 6 + 2 * M16) \
+    X(0xEF, READ, sbc, long, 5 + M16) \
+    X(0xF0, CUSTOM, beq, -, 2) \
+    X(0xF1, READ, sbc, dp_indirect_y, 5 + M16 + X16) \
+    X(0xF2, READ, sbc, dp_indirect, 5 + M16) \
+    X(0xF3, READ, sbc, sr_indirect_y, 7 + M16) \
+    X(0xF4, CUSTOM, pea, -, 5) \
+    X(0xF5, READ, sbc, dp_x, 4 + M16) \
+    X(0xF6, RMW, inc, dp_x, 6 + 2 * M16) \
+    X(0xF7, READ, sbc, dp_indirect_long_y, 6 + M16) \
+    X(0xF8, CUSTOM, sed, -, 2) \
+    X(0xF9, READ, sbc, abs_y, 4 + M16 + X16) \
+    X(0xFA, CUSTOM, plx, -, 4 + X16) \
+    X(0xFB, CUSTOM, xce, -, 2) \
+    X(0xFC, CUSTOM, jsr, -, 8) \
+    X(0xFD, READ, sbc, abs_x, 4 + M16 + X16) \
+    X(0xFE, RMW, inc, abs_x, 7 + 2 * M16) \
+    X(0xFF, READ, sbc, long_x, 5 + M16)
+
+#define DEFINE_OPCODE(opcode, kind, kernel, mode, cycles) DEFINE_##kind(opcode, kernel, mode)
+#define HANDLER_ENTRY(opcode, kind, kernel, mode, cycles) [opcode] = OP(op_##opcode),
+#define CYCLES_ENTRY(opcode, kind, kernel, mode, cycles) [opcode] = (cycles),
+
+OPCODES(DEFINE_OPCODE)
+
+static const OpcodeHandler OP(opcode_handlers)[256] = { OPCODES(HANDLER_ENTRY) };
+static const uint8_t OP(opcode_cycles)[256] = { OPCODES(CYCLES_ENTRY) };
+
+#undef CPU_PASTE2
+#undef CPU_PASTE
+#undef OP
+#undef M_MASK
+#undef M_SIGN
+#undef WIDTH_ora
+#undef WIDTH_and
+#undef WIDTH_eor
+#undef WIDTH_adc
+#undef WIDTH_sbc
+#undef WIDTH_cmp
+#undef WIDTH_bit
+#undef WIDTH_lda
+#undef WIDTH_sta
+#undef WIDTH_stz
+#undef WIDTH_ldx
+#undef WIDTH_ldy
+#undef WIDTH_cpx
+#undef WIDTH_cpy
+#undef WIDTH_stx
+#undef WIDTH_sty
+#undef DEFINE_READ
+#undef DEFINE_IMMEDIATE
+#undef DEFINE_WRITE
+#undef DEFINE_RMW
+#undef DEFINE_ACCUMULATOR
+#undef DEFINE_CUSTOM
+#undef OPCODES
+#undef DEFINE_OPCODE
+#undef HANDLER_ENTRY
+#undef CYCLES_ENTRY
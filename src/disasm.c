@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include "disasm.h"
+
+const struct OpcodeInfo opcode_info[256] = {
+    // 0x
+    { "brk", MODE_IMMEDIATE_8 },
+    { "ora", MODE_DIRECT_X_INDIRECT },
+    { "cop", MODE_IMMEDIATE_8 },
+    { "ora", MODE_STACK_RELATIVE },
+    { "tsb", MODE_DIRECT },
+    { "ora", MODE_DIRECT },
+    { "asl", MODE_DIRECT },
+    { "ora", MODE_DIRECT_INDIRECT_LONG },
+    { "php", MODE_IMPLIED },
+    { "ora", MODE_IMMEDIATE_M },
+    { "asl", MODE_ACCUMULATOR },
+    { "phd", MODE_IMPLIED },
+    { "tsb", MODE_ABSOLUTE },
+    { "ora", MODE_ABSOLUTE },
+    { "asl", MODE_ABSOLUTE },
+    { "ora", MODE_ABSOLUTE_LONG },
+    // 1x
+    { "bpl", MODE_RELATIVE_8 },
+    { "ora", MODE_DIRECT_INDIRECT_Y },
+    { "ora", MODE_DIRECT_INDIRECT },
+    { "ora", MODE_STACK_RELATIVE_INDIRECT_Y },
+    { "trb", MODE_DIRECT },
+    { "ora", MODE_DIRECT_X },
+    { "asl", MODE_DIRECT_X },
+    { "ora", MODE_DIRECT_INDIRECT_LONG_Y },
+    { "clc", MODE_IMPLIED },
+    { "ora", MODE_ABSOLUTE_Y },
+    { "inc", MODE_ACCUMULATOR },
+    { "tcs", MODE_IMPLIED },
+    { "trb", MODE_ABSOLUTE },
+    { "ora", MODE_ABSOLUTE_X },
+    { "asl", MODE_ABSOLUTE_X },
+    { "ora", MODE_ABSOLUTE_LONG_X },
+    // 2x
+    { "jsr", MODE_ABSOLUTE },
+    { "and", MODE_DIRECT_X_INDIRECT },
+    { "jsl", MODE_ABSOLUTE_LONG },
+    { "and", MODE_STACK_RELATIVE },
+    { "bit", MODE_DIRECT },
+    { "and", MODE_DIRECT },
+    { "rol", MODE_DIRECT },
+    { "and", MODE_DIRECT_INDIRECT_LONG },
+    { "plp", MODE_IMPLIED },
+    { "and", MODE_IMMEDIATE_M },
+    { "rol", MODE_ACCUMULATOR },
+    { "pld", MODE_IMPLIED },
+    { "bit", MODE_ABSOLUTE },
+    { "and", MODE_ABSOLUTE },
+    { "rol", MODE_ABSOLUTE },
+    { "and", MODE_ABSOLUTE_LONG },
+    // 3x
+    { "bmi", MODE_RELATIVE_8 },
+    { "and", MODE_DIRECT_INDIRECT_Y },
+    { "and", MODE_DIRECT_INDIRECT },
+    { "and", MODE_STACK_RELATIVE_INDIRECT_Y },
+    { "bit", MODE_DIRECT_X },
+    { "and", MODE_DIRECT_X },
+    { "rol", MODE_DIRECT_X },
+    { "and", MODE_DIRECT_INDIRECT_LONG_Y },
+    { "sec", MODE_IMPLIED },
+    { "and", MODE_ABSOLUTE_Y },
+    { "dec", MODE_ACCUMULATOR },
+    { "tsc", MODE_IMPLIED },
+    { "bit", MODE_ABSOLUTE_X },
+    { "and", MODE_ABSOLUTE_X },
+    { "rol", MODE_ABSOLUTE_X },
+    { "and", MODE_ABSOLUTE_LONG_X },
+    // 4x
+    { "rti", MODE_IMPLIED },
+    { "eor", MODE_DIRECT_X_INDIRECT },
+    { "wdm", MODE_IMMEDIATE_8 },
+    { "eor", MODE_STACK_RELATIVE },
+    { "mvp", MODE_BLOCK_MOVE },
+    { "eor", MODE_DIRECT },
+    { "lsr", MODE_DIRECT },
+    { "eor", MODE_DIRECT_INDIRECT_LONG },
+    { "pha", MODE_IMPLIED },
+    { "eor", MODE_IMMEDIATE_M },
+    { "lsr", MODE_ACCUMULATOR },
+    { "phk", MODE_IMPLIED },
+    { "jmp", MODE_ABSOLUTE },
+    { "eor", MODE_ABSOLUTE },
+    { "lsr", MODE_ABSOLUTE },
+    { "eor", MODE_ABSOLUTE_LONG },
+    // 5x
+    { "bvc", MODE_RELATIVE_8 },
+    { "eor", MODE_DIRECT_INDIRECT_Y },
+    { "eor", MODE_DIRECT_INDIRECT },
+    { "eor", MODE_STACK_RELATIVE_INDIRECT_Y },
+    { "mvn", MODE_BLOCK_MOVE },
+    { "eor", MODE_DIRECT_X },
+    { "lsr", MODE_DIRECT_X },
+    { "eor", MODE_DIRECT_INDIRECT_LONG_Y },
+    { "cli", MODE_IMPLIED },
+    { "eor", MODE_ABSOLUTE_Y },
+    { "phy", MODE_IMPLIED },
+    { "tcd", MODE_IMPLIED },
+    { "jml", MODE_ABSOLUTE_LONG },
+    { "eor", MODE_ABSOLUTE_X },
+    { "lsr", MODE_ABSOLUTE_X },
+    { "eor", MODE_ABSOLUTE_LONG_X },
+    // 6x
+    { "rts", MODE_IMPLIED },
+    { "adc", MODE_DIRECT_X_INDIRECT },
+    { "per", MODE_RELATIVE_16 },
+    { "adc", MODE_STACK_RELATIVE },
+    { "stz", MODE_DIRECT },
+    { "adc", MODE_DIRECT },
+    { "ror", MODE_DIRECT },
+    { "adc", MODE_DIRECT_INDIRECT_LONG },
+    { "pla", MODE_IMPLIED },
+    { "adc", MODE_IMMEDIATE_M },
+    { "ror", MODE_ACCUMULATOR },
+    { "rtl", MODE_IMPLIED },
+    { "jmp", MODE_ABSOLUTE_INDIRECT },
+    { "adc", MODE_ABSOLUTE },
+    { "ror", MODE_ABSOLUTE },
+    { "adc", MODE_ABSOLUTE_LONG },
+    // 7x
+    { "bvs", MODE_RELATIVE_8 },
+    { "adc", MODE_DIRECT_INDIRECT_Y },
+    { "adc", MODE_DIRECT_INDIRECT },
+    { "adc", MODE_STACK_RELATIVE_INDIRECT_Y },
+    { "stz", MODE_DIRECT_X },
+    { "adc", MODE_DIRECT_X },
+    { "ror", MODE_DIRECT_X },
+    { "adc", MODE_DIRECT_INDIRECT_LONG_Y },
+    { "sei", MODE_IMPLIED },
+    { "adc", MODE_ABSOLUTE_Y },
+    { "ply", MODE_IMPLIED },
+    { "tdc", MODE_IMPLIED },
+    { "jmp", MODE_ABSOLUTE_X_INDIRECT },
+    { "adc", MODE_ABSOLUTE_X },
+    { "ror", MODE_ABSOLUTE_X },
+    { "adc", MODE_ABSOLUTE_LONG_X },
+    // 8x
+    { "bra", MODE_RELATIVE_8 },
+    { "sta", MODE_DIRECT_X_INDIRECT },
+    { "brl", MODE_RELATIVE_16 },
+    { "sta", MODE_STACK_RELATIVE },
+    { "sty", MODE_DIRECT },
+    { "sta", MODE_DIRECT },
+    { "stx", MODE_DIRECT },
+    { "sta", MODE_DIRECT_INDIRECT_LONG },
+    { "dey", MODE_IMPLIED },
+    { "bit", MODE_IMMEDIATE_M },
+    { "txa", MODE_IMPLIED },
+    { "phb", MODE_IMPLIED },
+    { "sty", MODE_ABSOLUTE },
+    { "sta", MODE_ABSOLUTE },
+    { "stx", MODE_ABSOLUTE },
+    { "sta", MODE_ABSOLUTE_LONG },
+    // 9x
+    { "bcc", MODE_RELATIVE_8 },
+    { "sta", MODE_DIRECT_INDIRECT_Y },
+    { "sta", MODE_DIRECT_INDIRECT },
+    { "sta", MODE_STACK_RELATIVE_INDIRECT_Y },
+    { "sty", MODE_DIRECT_X },
+    { "sta", MODE_DIRECT_X },
+    { "stx", MODE_DIRECT_Y },
+    { "sta", MODE_DIRECT_INDIRECT_LONG_Y },
+    { "tya", MODE_IMPLIED },
+    { "sta", MODE_ABSOLUTE_Y },
+    { "txs", MODE_IMPLIED },
+    { "txy", MODE_IMPLIED },
+    { "stz", MODE_ABSOLUTE },
+    { "sta", MODE_ABSOLUTE_X },
+    { "stz", MODE_ABSOLUTE_X },
+    { "sta", MODE_ABSOLUTE_LONG_X },
+    // Ax
+    { "ldy", MODE_IMMEDIATE_X },
+    { "lda", MODE_DIRECT_X_INDIRECT },
+    { "ldx", MODE_IMMEDIATE_X },
+    { "lda", MODE_STACK_RELATIVE },
+    { "ldy", MODE_DIRECT },
+    { "lda", MODE_DIRECT },
+    { "ldx", MODE_DIRECT },
+    { "lda", MODE_DIRECT_INDIRECT_LONG },
+    { "tay", MODE_IMPLIED },
+    { "lda", MODE_IMMEDIATE_M },
+    { "tax", MODE_IMPLIED },
+    { "plb", MODE_IMPLIED },
+    { "ldy", MODE_ABSOLUTE },
+    { "lda", MODE_ABSOLUTE },
+    { "ldx", MODE_ABSOLUTE },
+    { "lda", MODE_ABSOLUTE_LONG },
+    // Bx
+    { "bcs", MODE_RELATIVE_8 },
+    { "lda", MODE_DIRECT_INDIRECT_Y },
+    { "lda", MODE_DIRECT_INDIRECT },
+    { "lda", MODE_STACK_RELATIVE_INDIRECT_Y },
+    { "ldy", MODE_DIRECT_X },
+    { "lda", MODE_DIRECT_X },
+    { "ldx", MODE_DIRECT_Y },
+    { "lda", MODE_DIRECT_INDIRECT_LONG_Y },
+    { "clv", MODE_IMPLIED },
+    { "lda", MODE_ABSOLUTE_Y },
+    { "tsx", MODE_IMPLIED },
+    { "tyx", MODE_IMPLIED },
+    { "ldy", MODE_ABSOLUTE_X },
+    { "lda", MODE_ABSOLUTE_X },
+    { "ldx", MODE_ABSOLUTE_Y },
+    { "lda", MODE_ABSOLUTE_LONG_X },
+    // Cx
+    { "cpy", MODE_IMMEDIATE_X },
+    { "cmp", MODE_DIRECT_X_INDIRECT },
+    { "rep", MODE_IMMEDIATE_8 },
+    { "cmp", MODE_STACK_RELATIVE },
+    { "cpy", MODE_DIRECT },
+    { "cmp", MODE_DIRECT },
+    { "dec", MODE_DIRECT },
+    { "cmp", MODE_DIRECT_INDIRECT_LONG },
+    { "iny", MODE_IMPLIED },
+    { "cmp", MODE_IMMEDIATE_M },
+    { "dex", MODE_IMPLIED },
+    { "wai", MODE_IMPLIED },
+    { "cpy", MODE_ABSOLUTE },
+    { "cmp", MODE_ABSOLUTE },
+    { "dec", MODE_ABSOLUTE },
+    { "cmp", MODE_ABSOLUTE_LONG },
+    // Dx
+    { "bne", MODE_RELATIVE_8 },
+    { "cmp", MODE_DIRECT_INDIRECT_Y },
+    { "cmp", MODE_DIRECT_INDIRECT },
+    { "cmp", MODE_STACK_RELATIVE_INDIRECT_Y },
+    { "pei", MODE_DIRECT_INDIRECT },
+    { "cmp", MODE_DIRECT_X },
+    { "dec", MODE_DIRECT_X },
+    { "cmp", MODE_DIRECT_INDIRECT_LONG_Y },
+    { "cld", MODE_IMPLIED },
+    { "cmp", MODE_ABSOLUTE_Y },
+    { "phx", MODE_IMPLIED },
+    { "stp", MODE_IMPLIED },
+    { "jml", MODE_ABSOLUTE_INDIRECT_LONG },
+    { "cmp", MODE_ABSOLUTE_X },
+    { "dec", MODE_ABSOLUTE_X },
+    { "cmp", MODE_ABSOLUTE_LONG_X },
+    // Ex
+    { "cpx", MODE_IMMEDIATE_X },
+    { "sbc", MODE_DIRECT_X_INDIRECT },
+    { "sep", MODE_IMMEDIATE_8 },
+    { "sbc", MODE_STACK_RELATIVE },
+    { "cpx", MODE_DIRECT },
+    { "sbc", MODE_DIRECT },
+    { "inc", MODE_DIRECT },
+    { "sbc", MODE_DIRECT_INDIRECT_LONG },
+    { "inx", MODE_IMPLIED },
+    { "sbc", MODE_IMMEDIATE_M },
+    { "nop", MODE_IMPLIED },
+    { "xba", MODE_IMPLIED },
+    { "cpx", MODE_ABSOLUTE },
+    { "sbc", MODE_ABSOLUTE },
+    { "inc", MODE_ABSOLUTE },
+    { "sbc", MODE_ABSOLUTE_LONG },
+    // Fx
+    { "beq", MODE_RELATIVE_8 },
+    { "sbc", MODE_DIRECT_INDIRECT_Y },
+    { "sbc", MODE_DIRECT_INDIRECT },
+    { "sbc", MODE_STACK_RELATIVE_INDIRECT_Y },
+    { "pea", MODE_ABSOLUTE },
+    { "sbc", MODE_DIRECT_X },
+    { "inc", MODE_DIRECT_X },
+    { "sbc", MODE_DIRECT_INDIRECT_LONG_Y },
+    { "sed", MODE_IMPLIED },
+    { "sbc", MODE_ABSOLUTE_Y },
+    { "plx", MODE_IMPLIED },
+    { "xce", MODE_IMPLIED },
+    { "jsr", MODE_ABSOLUTE_X_INDIRECT },
+    { "sbc", MODE_ABSOLUTE_X },
+    { "inc", MODE_ABSOLUTE_X },
+    { "sbc", MODE_ABSOLUTE_LONG_X },
+};
+
+int opcode_length(uint8_t opcode, bool m8, bool x8) {
+    switch (opcode_info[opcode].mode) {
+        case MODE_IMPLIED:
+        case MODE_ACCUMULATOR:
+            return 1;
+        case MODE_IMMEDIATE_M:
+            return m8 ? 2 : 3;
+        case MODE_IMMEDIATE_X:
+            return x8 ? 2 : 3;
+        case MODE_IMMEDIATE_8:
+        case MODE_RELATIVE_8:
+        case MODE_DIRECT:
+        case MODE_DIRECT_X:
+        case MODE_DIRECT_Y:
+        case MODE_DIRECT_INDIRECT:
+        case MODE_DIRECT_X_INDIRECT:
+        case MODE_DIRECT_INDIRECT_Y:
+        case MODE_DIRECT_INDIRECT_LONG:
+        case MODE_DIRECT_INDIRECT_LONG_Y:
+        case MODE_STACK_RELATIVE:
+        case MODE_STACK_RELATIVE_INDIRECT_Y:
+            return 2;
+        case MODE_RELATIVE_16:
+        case MODE_ABSOLUTE:
+        case MODE_ABSOLUTE_X:
+        case MODE_ABSOLUTE_Y:
+        case MODE_ABSOLUTE_INDIRECT:
+        case MODE_ABSOLUTE_X_INDIRECT:
+        case MODE_ABSOLUTE_INDIRECT_LONG:
+        case MODE_BLOCK_MOVE:
+            return 3;
+        case MODE_ABSOLUTE_LONG:
+        case MODE_ABSOLUTE_LONG_X:
+            return 4;
+    }
+
+    return 1;
+}
+
+int disassemble(uint32_t pc, const uint8_t* bytes, bool m8, bool x8, char* buf, size_t size) {
+    const struct OpcodeInfo* info = &opcode_info[bytes[0]];
+    int length = opcode_length(bytes[0], m8, x8);
+
+    uint32_t u8 = bytes[1];
+    uint32_t u16 = bytes[1] | (bytes[2] << 8);
+    uint32_t u24 = u16 | (bytes[3] << 16);
+
+    // Branch targets stay in the program bank
+    uint32_t bank = pc & 0xFF0000;
+    uint32_t rel8 = bank | ((pc + 2 + (int8_t)u8) & 0xFFFF);
+    uint32_t rel16 = bank | ((pc + 3 + (int16_t)u16) & 0xFFFF);
+
+    const char* m = info->mnemonic;
+
+    switch (info->mode) {
+        case MODE_IMPLIED: snprintf(buf, size, "%s", m); break;
+        case MODE_ACCUMULATOR: snprintf(buf, size, "%s a", m); break;
+        case MODE_IMMEDIATE_M:
+        case MODE_IMMEDIATE_X:
+            if (length == 2) {
+                snprintf(buf, size, "%s #$%02x", m, u8);
+            } else {
+                snprintf(buf, size, "%s #$%04x", m, u16);
+            }
+            break;
+        case MODE_IMMEDIATE_8: snprintf(buf, size, "%s #$%02x", m, u8); break;
+        case MODE_RELATIVE_8: snprintf(buf, size, "%s $%06x", m, rel8); break;
+        case MODE_RELATIVE_16: snprintf(buf, size, "%s $%06x", m, rel16); break;
+        case MODE_DIRECT: snprintf(buf, size, "%s $%02x", m, u8); break;
+        case MODE_DIRECT_X: snprintf(buf, size, "%s $%02x,x", m, u8); break;
+        case MODE_DIRECT_Y: snprintf(buf, size, "%s $%02x,y", m, u8); break;
+        case MODE_DIRECT_INDIRECT: snprintf(buf, size, "%s ($%02x)", m, u8); break;
+        case MODE_DIRECT_X_INDIRECT: snprintf(buf, size, "%s ($%02x,x)", m, u8); break;
+        case MODE_DIRECT_INDIRECT_Y: snprintf(buf, size, "%s ($%02x),y", m, u8); break;
+        case MODE_DIRECT_INDIRECT_LONG: snprintf(buf, size, "%s [$%02x]", m, u8); break;
+        case MODE_DIRECT_INDIRECT_LONG_Y: snprintf(buf, size, "%s [$%02x],y", m, u8); break;
+        case MODE_ABSOLUTE: snprintf(buf, size, "%s $%04x", m, u16); break;
+        case MODE_ABSOLUTE_X: snprintf(buf, size, "%s $%04x,x", m, u16); break;
+        case MODE_ABSOLUTE_Y: snprintf(buf, size, "%s $%04x,y", m, u16); break;
+        case MODE_ABSOLUTE_LONG: snprintf(buf, size, "%s $%06x", m, u24); break;
+        case MODE_ABSOLUTE_LONG_X: snprintf(buf, size, "%s $%06x,x", m, u24); break;
+        case MODE_ABSOLUTE_INDIRECT: snprintf(buf, size, "%s ($%04x)", m, u16); break;
+        case MODE_ABSOLUTE_X_INDIRECT: snprintf(buf, size, "%s ($%04x,x)", m, u16); break;
+        case MODE_ABSOLUTE_INDIRECT_LONG: snprintf(buf, size, "%s [$%04x]", m, u16); break;
+        case MODE_STACK_RELATIVE: snprintf(buf, size, "%s $%02x,s", m, u8); break;
+        case MODE_STACK_RELATIVE_INDIRECT_Y: snprintf(buf, size, "%s ($%02x,s),y", m, u8); break;
+        // Operand bytes are dest bank then source bank, but it's written source first
+        case MODE_BLOCK_MOVE: snprintf(buf, size, "%s $%02x,$%02x", m, bytes[2], bytes[1]); break;
+    }
+
+    return length;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+enum AddressingMode {
+    MODE_IMPLIED,
+    MODE_ACCUMULATOR,
+    MODE_IMMEDIATE_M, // Width follows the M flag
+    MODE_IMMEDIATE_X, // Width follows the X flag
+    MODE_IMMEDIATE_8,
+    MODE_RELATIVE_8,
+    MODE_RELATIVE_16,
+    MODE_DIRECT,
+    MODE_DIRECT_X,
+    MODE_DIRECT_Y,
+    MODE_DIRECT_INDIRECT,
+    MODE_DIRECT_X_INDIRECT,
+    MODE_DIRECT_INDIRECT_Y,
+    MODE_DIRECT_INDIRECT_LONG,
+    MODE_DIRECT_INDIRECT_LONG_Y,
+    MODE_ABSOLUTE,
+    MODE_ABSOLUTE_X,
+    MODE_ABSOLUTE_Y,
+    MODE_ABSOLUTE_LONG,
+    MODE_ABSOLUTE_LONG_X,
+    MODE_ABSOLUTE_INDIRECT,
+    MODE_ABSOLUTE_X_INDIRECT,
+    MODE_ABSOLUTE_INDIRECT_LONG,
+    MODE_STACK_RELATIVE,
+    MODE_STACK_RELATIVE_INDIRECT_Y,
+    MODE_BLOCK_MOVE,
+};
+
+struct OpcodeInfo {
+    const char* mnemonic;
+    enum AddressingMode mode;
+};
+
+extern const struct OpcodeInfo opcode_info[256];
+
+// Instruction length in bytes, opcode included. `m8`/`x8` are the effective
+// register widths (so already forced on in emulation mode)
+int opcode_length(uint8_t opcode, bool m8, bool x8);
+
+// Formats the instruction at `pc` (whose bytes start at `bytes`) as i.e.
+// "lda $12,x", returning its length
+int disassemble(uint32_t pc, const uint8_t* bytes, bool m8, bool x8, char* buf, size_t size);
@@ -0,0 +1,672 @@
+#include <string.h>
+#include "dsp.h"
+#include "apu.h"
+#include "audio.h"
+
+#if defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+// Voice registers, at voice * 0x10 plus these
+enum {
+    V_VOLL,
+    V_VOLR,
+    V_PITCHL,
+    V_PITCHH,
+    V_SRCN,
+    V_ADSR1,
+    V_ADSR2,
+    V_GAIN,
+    V_ENVX,
+    V_OUTX,
+};
+
+enum {
+    R_MVOLL = 0x0C,
+    R_MVOLR = 0x1C,
+    R_EVOLL = 0x2C,
+    R_EVOLR = 0x3C,
+    R_KON = 0x4C,
+    R_KOFF = 0x5C,
+    R_FLG = 0x6C,
+    R_ENDX = 0x7C,
+    R_EFB = 0x0D,
+    R_PMON = 0x2D,
+    R_NON = 0x3D,
+    R_EON = 0x4D,
+    R_DIR = 0x5D,
+    R_ESA = 0x6D,
+    R_EDL = 0x7D,
+    R_FIR = 0x0F, // Coefficient i is at R_FIR + i * 0x10
+};
+
+#define FLG_RESET 0x80
+#define FLG_MUTE 0x40
+#define FLG_ECHO_OFF 0x20 // Echo buffer writes, that is. It's still read
+
+#define BRR_BLOCK_SIZE 9
+
+// The rate counter's period. Every rate divides it
+#define COUNTER_RANGE 0x7800
+
+// Envelope and noise rates, as periods of the rate counter and where in that
+// period they fire. Rate 0 never does
+static const uint16_t counter_rates[32] = {
+    COUNTER_RANGE + 1, 2048, 1536, 1280, 1024, 768, 640, 512, 384, 320, 256, 192, 160, 128, 96, 80,
+    64, 48, 40, 32, 24, 20, 16, 12, 10, 8, 6, 5, 4, 3, 2, 1,
+};
+
+static const uint16_t counter_offsets[32] = {
+    1, 0, 1040, 536, 0, 1040, 536, 0, 1040, 536, 0, 1040, 536, 0, 1040, 536,
+    0, 1040, 536, 0, 1040, 536, 0, 1040, 536, 0, 1040, 536, 0, 1040, 0, 0,
+};
+
+// The DSP's interpolation curve, straight out of its ROM. Taps oldest to newest
+// are weighted by entries 255 - i, 511 - i, 256 + i and i, where i is the top
+// 8 bits of the position between samples
+static const int16_t gauss[512] = {
+       0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+       1,    1,    1,    1,    1,    1,    1,    1,    1,    1,    1,    2,    2,    2,    2,    2,
+       2,    2,    3,    3,    3,    3,    3,    4,    4,    4,    4,    4,    5,    5,    5,    5,
+       6,    6,    6,    6,    7,    7,    7,    8,    8,    8,    9,    9,    9,   10,   10,   10,
+      11,   11,   11,   12,   12,   13,   13,   14,   14,   15,   15,   15,   16,   16,   17,   17,
+      18,   19,   19,   20,   20,   21,   21,   22,   23,   23,   24,   24,   25,   26,   27,   27,
+      28,   29,   29,   30,   31,   32,   32,   33,   34,   35,   36,   36,   37,   38,   39,   40,
+      41,   42,   43,   44,   45,   46,   47,   48,   49,   50,   51,   52,   53,   54,   55,   56,
+      58,   59,   60,   61,   62,   64,   65,   66,   67,   69,   70,   71,   73,   74,   76,   77,
+      78,   80,   81,   83,   84,   86,   87,   89,   90,   92,   94,   95,   97,   99,  100,  102,
+     104,  106,  107,  109,  111,  113,  115,  117,  118,  120,  122,  124,  126,  128,  130,  132,
+     134,  137,  139,  141,  143,  145,  147,  150,  152,  154,  156,  159,  161,  163,  166,  168,
+     171,  173,  175,  178,  180,  183,  186,  188,  191,  193,  196,  199,  201,  204,  207,  210,
+     212,  215,  218,  221,  224,  227,  230,  233,  236,  239,  242,  245,  248,  251,  254,  257,
+     260,  263,  267,  270,  273,  276,  280,  283,  286,  290,  293,  297,  300,  304,  307,  311,
+     314,  318,  321,  325,  328,  332,  336,  339,  343,  347,  351,  354,  358,  362,  366,  370,
+     374,  378,  381,  385,  389,  393,  397,  401,  405,  410,  414,  418,  422,  426,  430,  434,
+     439,  443,  447,  451,  456,  460,  464,  469,  473,  477,  482,  486,  491,  495,  499,  504,
+     508,  513,  517,  522,  527,  531,  536,  540,  545,  550,  554,  559,  563,  568,  573,  577,
+     582,  587,  592,  596,  601,  606,  611,  615,  620,  625,  630,  635,  640,  644,  649,  654,
+     659,  664,  669,  674,  678,  683,  688,  693,  698,  703,  708,  713,  718,  723,  728,  732,
+     737,  742,  747,  752,  757,  762,  767,  772,  777,  782,  787,  792,  797,  802,  806,  811,
+     816,  821,  826,  831,  836,  841,  846,  851,  855,  860,  865,  870,  875,  880,  884,  889,
+     894,  899,  904,  908,  913,  918,  923,  927,  932,  937,  941,  946,  951,  955,  960,  965,
+     969,  974,  978,  983,  988,  992,  997, 1001, 1005, 1010, 1014, 1019, 1023, 1027, 1032, 1036,
+    1040, 1045, 1049, 1053, 1057, 1061, 1066, 1070, 1074, 1078, 1082, 1086, 1090, 1094, 1098, 1102,
+    1106, 1109, 1113, 1117, 1121, 1125, 1128, 1132, 1136, 1139, 1143, 1146, 1150, 1153, 1157, 1160,
+    1164, 1167, 1170, 1174, 1177, 1180, 1183, 1186, 1190, 1193, 1196, 1199, 1202, 1205, 1207, 1210,
+    1213, 1216, 1219, 1221, 1224, 1227, 1229, 1232, 1234, 1237, 1239, 1241, 1244, 1246, 1248, 1251,
+    1253, 1255, 1257, 1259, 1261, 1263, 1265, 1267, 1269, 1270, 1272, 1274, 1275, 1277, 1279, 1280,
+    1282, 1283, 1284, 1286, 1287, 1288, 1290, 1291, 1292, 1293, 1294, 1295, 1296, 1297, 1297, 1298,
+    1299, 1300, 1300, 1301, 1302, 1302, 1303, 1303, 1303, 1304, 1304, 1304, 1304, 1304, 1305, 1305,
+};
+
+// Everything worked out for one block, one entry per sample
+struct MixBlock {
+    int count;
+    int32_t counter[DSP_BLOCK_SIZE];
+    int32_t noise[DSP_BLOCK_SIZE];
+
+    // The voice being worked on
+    _Alignas(32) int32_t taps[4][DSP_BLOCK_SIZE];
+    _Alignas(32) int32_t weights[4][DSP_BLOCK_SIZE];
+    _Alignas(32) int32_t env[DSP_BLOCK_SIZE];
+    // After the envelope. Odd and even voices take turns, so pitch modulation
+    // can see the voice before
+    _Alignas(32) int32_t output[2][DSP_BLOCK_SIZE];
+
+    // Left and right
+    _Alignas(32) int32_t main[2][DSP_BLOCK_SIZE];
+    _Alignas(32) int32_t echo[2][DSP_BLOCK_SIZE];
+    _Alignas(32) int32_t echo_in[2][DSP_BLOCK_SIZE];
+    // The 7 samples from before the block, then the block's
+    _Alignas(32) int32_t echo_history[2][7 + DSP_BLOCK_SIZE];
+};
+
+static inline int32_t clamp16(int32_t value) {
+    return value < -0x8000 ? -0x8000 : value > 0x7FFF ? 0x7FFF : value;
+}
+
+static inline bool counter_fires(int32_t counter, int rate) {
+    return (counter + counter_offsets[rate]) % counter_rates[rate] == 0;
+}
+
+static inline uint16_t read_u16(const struct Apu* apu, uint16_t addr) {
+    return apu_read_aram(apu, addr) | (apu_read_aram(apu, addr + 1) << 8);
+}
+
+// Start and loop addresses of sample `srcn`, from the directory at DIR
+static inline uint16_t sample_address(const struct Apu* apu, uint8_t srcn, bool loop) {
+    return read_u16(apu, (apu->dsp.regs[R_DIR] << 8) + srcn * 4 + loop * 2);
+}
+
+// Moves a voice on to the block after the one with this header
+static void next_brr_block(struct Apu* apu, int index, uint8_t header) {
+    struct DspVoice* voice = &apu->dsp.voices[index];
+    if (header & 1) {
+        // End of the sample. It carries on from the loop point either way, but
+        // without the loop flag the voice goes quiet
+        apu->dsp.regs[R_ENDX] |= 1 << index;
+        voice->brr_addr = sample_address(apu, apu->dsp.regs[index * 0x10 + V_SRCN], true);
+        if (!(header & 2)) {
+            voice->env_mode = DSP_ENV_RELEASE;
+            voice->env = 0;
+        }
+    } else {
+        voice->brr_addr += BRR_BLOCK_SIZE;
+    }
+}
+
+// 16 samples at a time, each one filtered against the two before
+static void decode_brr_block(struct Apu* apu, int index) {
+    struct DspVoice* voice = &apu->dsp.voices[index];
+    uint8_t header = apu_read_aram(apu, voice->brr_addr);
+    int shift = header >> 4;
+    int filter = (header >> 2) & 3;
+
+    for (int i = 0; i < 16; i++) {
+        uint8_t byte = apu_read_aram(apu, voice->brr_addr + 1 + i / 2);
+        int32_t s = (int8_t)(i & 1 ? byte << 4 : byte) >> 4;
+        // Ranges past 12 just leave the sign
+        s = shift <= 12 ? (s * (1 << shift)) >> 1 : (s < 0 ? -0x800 : 0);
+
+        // Samples are kept doubled, so p1 is twice the size the filter wants
+        int32_t p1 = voice->ring[(voice->decoded - 1) % DSP_BRR_RING];
+        int32_t p2 = voice->ring[(voice->decoded - 2) % DSP_BRR_RING] >> 1;
+        switch (filter) {
+            case 1:
+                s += p1 >> 1;
+                s += -p1 >> 5;
+                break;
+            case 2:
+                s += p1 - p2;
+                s += p2 >> 4;
+                s += (p1 * -3) >> 6;
+                break;
+            case 3:
+                s += p1 - p2;
+                s += (p1 * -13) >> 7;
+                s += (p2 * 3) >> 4;
+                break;
+        }
+
+        voice->ring[voice->decoded++ % DSP_BRR_RING] = (int16_t)(clamp16(s) * 2);
+    }
+
+    next_brr_block(apu, index, header);
+}
+
+// Just the header's part of decode_brr_block(), for when nobody's going to
+// hear the samples. The ring's left as it was
+static void skip_brr_block(struct Apu* apu, int index) {
+    struct DspVoice* voice = &apu->dsp.voices[index];
+    voice->decoded += 16;
+    next_brr_block(apu, index, apu_read_aram(apu, voice->brr_addr));
+}
+
+// One sample's step of ADSR or GAIN
+static void run_envelope(struct DspVoice* voice, const uint8_t* regs, int32_t counter) {
+    int32_t env = voice->env;
+    if (voice->env_mode == DSP_ENV_RELEASE) {
+        env -= 0x8;
+        voice->env = env < 0 ? 0 : env;
+        return;
+    }
+
+    int rate;
+    // Holds the sustain level in its top 3 bits, for the check further down.
+    // GAIN mode checks against GAIN's top bits instead, same as the hardware
+    uint8_t data = regs[V_ADSR2];
+    uint8_t adsr1 = regs[V_ADSR1];
+
+    if (adsr1 & 0x80) {
+        if (voice->env_mode >= DSP_ENV_DECAY) {
+            // Exponential
+            env--;
+            env -= env >> 8;
+            rate = voice->env_mode == DSP_ENV_DECAY ? ((adsr1 >> 3) & 0x0E) + 0x10 : data & 0x1F;
+        } else {
+            rate = (adsr1 & 0x0F) * 2 + 1;
+            env += rate < 31 ? 0x20 : 0x400;
+        }
+    } else {
+        data = regs[V_GAIN];
+        int mode = data >> 5;
+        if (mode < 4) {
+            // Direct
+            env = data * 0x10;
+            rate = 31;
+        } else {
+            rate = data & 0x1F;
+            if (mode == 4) {
+                env -= 0x20;
+            } else if (mode == 5) {
+                env--;
+                env -= env >> 8;
+            } else {
+                env += 0x20;
+                // Bent line, slows down 3/4 of the way up
+                if (mode == 7 && (uint16_t)voice->hidden_env >= 0x600) env += 0x8 - 0x20;
+            }
+        }
+    }
+
+    if ((env >> 8) == (data >> 5) && voice->env_mode == DSP_ENV_DECAY) voice->env_mode = DSP_ENV_SUSTAIN;
+    voice->hidden_env = env;
+
+    if (env < 0 || env > 0x7FF) {
+        env = env < 0 ? 0 : 0x7FF;
+        if (voice->env_mode == DSP_ENV_ATTACK) voice->env_mode = DSP_ENV_DECAY;
+    }
+
+    if (counter_fires(counter, rate)) voice->env = env;
+}
+
+static void key_on(struct Apu* apu, int index) {
+    struct DspVoice* voice = &apu->dsp.voices[index];
+    voice->brr_addr = sample_address(apu, apu->dsp.regs[index * 0x10 + V_SRCN], false);
+    voice->decoded = 0;
+    voice->position = 0;
+    voice->fraction = 0;
+    voice->env = 0;
+    voice->hidden_env = 0;
+    voice->env_mode = DSP_ENV_ATTACK;
+    voice->kon_delay = 5;
+}
+
+// Kernels. Each goes through the block a vector at a time where it can, with
+// the same thing one sample at a time for the rest
+
+static inline int32_t interpolate_one(const struct MixBlock* block, int n) {
+    int32_t out = (block->taps[0][n] * block->weights[0][n]) >> 11;
+    out += (block->taps[1][n] * block->weights[1][n]) >> 11;
+    out += (block->taps[2][n] * block->weights[2][n]) >> 11;
+    // Wraps before the newest tap goes in
+    out = (int16_t)out;
+    out += (block->taps[3][n] * block->weights[3][n]) >> 11;
+    return clamp16(out) & ~1;
+}
+
+static void interpolate(const struct MixBlock* block, int32_t* out) {
+    int n = 0;
+#if defined(__AVX2__)
+    for (; n + 8 <= block->count; n += 8) {
+        __m256i sum = _mm256_setzero_si256();
+        for (int t = 0; t < 3; t++) {
+            __m256i taps = _mm256_load_si256((const __m256i*)&block->taps[t][n]);
+            __m256i weights = _mm256_load_si256((const __m256i*)&block->weights[t][n]);
+            sum = _mm256_add_epi32(sum, _mm256_srai_epi32(_mm256_mullo_epi32(taps, weights), 11));
+        }
+        sum = _mm256_srai_epi32(_mm256_slli_epi32(sum, 16), 16);
+        __m256i taps = _mm256_load_si256((const __m256i*)&block->taps[3][n]);
+        __m256i weights = _mm256_load_si256((const __m256i*)&block->weights[3][n]);
+        sum = _mm256_add_epi32(sum, _mm256_srai_epi32(_mm256_mullo_epi32(taps, weights), 11));
+        sum = _mm256_min_epi32(_mm256_max_epi32(sum, _mm256_set1_epi32(-0x8000)), _mm256_set1_epi32(0x7FFF));
+        _mm256_store_si256((__m256i*)&out[n], _mm256_and_si256(sum, _mm256_set1_epi32(~1)));
+    }
+#elif defined(__SSE4_1__)
+    for (; n + 4 <= block->count; n += 4) {
+        __m128i sum = _mm_setzero_si128();
+        for (int t = 0; t < 3; t++) {
+            __m128i taps = _mm_load_si128((const __m128i*)&block->taps[t][n]);
+            __m128i weights = _mm_load_si128((const __m128i*)&block->weights[t][n]);
+            sum = _mm_add_epi32(sum, _mm_srai_epi32(_mm_mullo_epi32(taps, weights), 11));
+        }
+        sum = _mm_srai_epi32(_mm_slli_epi32(sum, 16), 16);
+        __m128i taps = _mm_load_si128((const __m128i*)&block->taps[3][n]);
+        __m128i weights = _mm_load_si128((const __m128i*)&block->weights[3][n]);
+        sum = _mm_add_epi32(sum, _mm_srai_epi32(_mm_mullo_epi32(taps, weights), 11));
+        sum = _mm_min_epi32(_mm_max_epi32(sum, _mm_set1_epi32(-0x8000)), _mm_set1_epi32(0x7FFF));
+        _mm_store_si128((__m128i*)&out[n], _mm_and_si128(sum, _mm_set1_epi32(~1)));
+    }
+#endif
+    for (; n < block->count; n++) {
+        out[n] = interpolate_one(block, n);
+    }
+}
+
+// samples = (samples * env) >> 11, low bit cleared
+static void apply_envelope(int32_t* samples, const int32_t* env, int count) {
+    int n = 0;
+#if defined(__AVX2__)
+    for (; n + 8 <= count; n += 8) {
+        __m256i product = _mm256_mullo_epi32(_mm256_load_si256((const __m256i*)&samples[n]), _mm256_load_si256((const __m256i*)&env[n]));
+        _mm256_store_si256((__m256i*)&samples[n], _mm256_and_si256(_mm256_srai_epi32(product, 11), _mm256_set1_epi32(~1)));
+    }
+#elif defined(__SSE4_1__)
+    for (; n + 4 <= count; n += 4) {
+        __m128i product = _mm_mullo_epi32(_mm_load_si128((const __m128i*)&samples[n]), _mm_load_si128((const __m128i*)&env[n]));
+        _mm_store_si128((__m128i*)&samples[n], _mm_and_si128(_mm_srai_epi32(product, 11), _mm_set1_epi32(~1)));
+    }
+#endif
+    for (; n < count; n++) {
+        samples[n] = ((samples[n] * env[n]) >> 11) & ~1;
+    }
+}
+
+// mix += (samples * volume) >> 7, clamping after every voice like the hardware
+static void mix_voice(int32_t* mix, const int32_t* samples, int8_t volume, int count) {
+    int n = 0;
+#if defined(__AVX2__)
+    __m256i volumes = _mm256_set1_epi32(volume);
+    for (; n + 8 <= count; n += 8) {
+        __m256i amp = _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_load_si256((const __m256i*)&samples[n]), volumes), 7);
+        __m256i sum = _mm256_add_epi32(_mm256_load_si256((const __m256i*)&mix[n]), amp);
+        sum = _mm256_min_epi32(_mm256_max_epi32(sum, _mm256_set1_epi32(-0x8000)), _mm256_set1_epi32(0x7FFF));
+        _mm256_store_si256((__m256i*)&mix[n], sum);
+    }
+#elif defined(__SSE4_1__)
+    __m128i volumes = _mm_set1_epi32(volume);
+    for (; n + 4 <= count; n += 4) {
+        __m128i amp = _mm_srai_epi32(_mm_mullo_epi32(_mm_load_si128((const __m128i*)&samples[n]), volumes), 7);
+        __m128i sum = _mm_add_epi32(_mm_load_si128((const __m128i*)&mix[n]), amp);
+        sum = _mm_min_epi32(_mm_max_epi32(sum, _mm_set1_epi32(-0x8000)), _mm_set1_epi32(0x7FFF));
+        _mm_store_si128((__m128i*)&mix[n], sum);
+    }
+#endif
+    for (; n < count; n++) {
+        mix[n] = clamp16(mix[n] + ((samples[n] * volume) >> 7));
+    }
+}
+
+static inline int32_t fir_one(const int32_t* history, const int32_t* fir) {
+    int32_t out = 0;
+    for (int i = 0; i < 7; i++) {
+        out += (history[i] * fir[i]) >> 6;
+    }
+    // Wraps before the newest tap goes in, same as interpolation
+    out = (int16_t)out;
+    out += (int16_t)((history[7] * fir[7]) >> 6);
+    return clamp16(out) & ~1;
+}
+
+// 8 taps over `history`, oldest first. Output n is from history[n] to [n + 7]
+static void echo_fir(const int32_t* history, const int32_t* fir, int count, int32_t* out) {
+    int n = 0;
+#if defined(__AVX2__)
+    for (; n + 8 <= count; n += 8) {
+        __m256i sum = _mm256_setzero_si256();
+        for (int i = 0; i < 7; i++) {
+            __m256i taps = _mm256_loadu_si256((const __m256i*)&history[n + i]);
+            sum = _mm256_add_epi32(sum, _mm256_srai_epi32(_mm256_mullo_epi32(taps, _mm256_set1_epi32(fir[i])), 6));
+        }
+        sum = _mm256_srai_epi32(_mm256_slli_epi32(sum, 16), 16);
+        __m256i last = _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)&history[n + 7]), _mm256_set1_epi32(fir[7])), 6);
+        sum = _mm256_add_epi32(sum, _mm256_srai_epi32(_mm256_slli_epi32(last, 16), 16));
+        sum = _mm256_min_epi32(_mm256_max_epi32(sum, _mm256_set1_epi32(-0x8000)), _mm256_set1_epi32(0x7FFF));
+        _mm256_store_si256((__m256i*)&out[n], _mm256_and_si256(sum, _mm256_set1_epi32(~1)));
+    }
+#elif defined(__SSE4_1__)
+    for (; n + 4 <= count; n += 4) {
+        __m128i sum = _mm_setzero_si128();
+        for (int i = 0; i < 7; i++) {
+            __m128i taps = _mm_loadu_si128((const __m128i*)&history[n + i]);
+            sum = _mm_add_epi32(sum, _mm_srai_epi32(_mm_mullo_epi32(taps, _mm_set1_epi32(fir[i])), 6));
+        }
+        sum = _mm_srai_epi32(_mm_slli_epi32(sum, 16), 16);
+        __m128i last = _mm_srai_epi32(_mm_mullo_epi32(_mm_loadu_si128((const __m128i*)&history[n + 7]), _mm_set1_epi32(fir[7])), 6);
+        sum = _mm_add_epi32(sum, _mm_srai_epi32(_mm_slli_epi32(last, 16), 16));
+        sum = _mm_min_epi32(_mm_max_epi32(sum, _mm_set1_epi32(-0x8000)), _mm_set1_epi32(0x7FFF));
+        _mm_store_si128((__m128i*)&out[n], _mm_and_si128(sum, _mm_set1_epi32(~1)));
+    }
+#endif
+    for (; n < count; n++) {
+        out[n] = fir_one(&history[n], fir);
+    }
+}
+
+// The per-sample part of a voice: its envelope, where it's up to in the
+// sample and what the interpolation taps are. Returns false if it's silent
+// the whole way through, so there's nothing to mix
+static bool step_voice(struct Apu* apu, int index, struct MixBlock* block) {
+    struct Dsp* dsp = &apu->dsp;
+    struct DspVoice* voice = &dsp->voices[index];
+    const uint8_t* regs = &dsp->regs[index * 0x10];
+    uint8_t bit = 1 << index;
+
+    int32_t pitch = (regs[V_PITCHL] | (regs[V_PITCHH] << 8)) & 0x3FFF;
+    // Voice 0 has nothing before it to be modulated by
+    bool modulated = index && (dsp->regs[R_PMON] & bit);
+    bool noise = dsp->regs[R_NON] & bit;
+    const int32_t* before = block->output[(index - 1) & 1];
+    bool audible = false;
+
+    for (int n = 0; n < block->count; n++) {
+        if (voice->kon_delay) {
+            voice->kon_delay--;
+            block->env[n] = 0;
+            for (int t = 0; t < 4; t++) block->taps[t][n] = block->weights[t][n] = 0;
+            continue;
+        }
+
+        block->env[n] = voice->env;
+        audible |= voice->env != 0;
+
+        while ((int32_t)(voice->decoded - voice->position) < 4) decode_brr_block(apu, index);
+        // Noise takes the place of the interpolated sample, see mix_voice_block()
+        if (!noise) {
+            int i = voice->fraction >> 4;
+            for (int t = 0; t < 4; t++) block->taps[t][n] = voice->ring[(voice->position + t) % DSP_BRR_RING];
+            block->weights[0][n] = gauss[255 - i];
+            block->weights[1][n] = gauss[511 - i];
+            block->weights[2][n] = gauss[256 + i];
+            block->weights[3][n] = gauss[i];
+        }
+
+        int32_t step = pitch;
+        if (modulated) step += ((before[n] >> 5) * pitch) >> 10;
+        step += voice->fraction;
+        voice->position += step >> 12;
+        voice->fraction = step & 0xFFF;
+
+        run_envelope(voice, regs, block->counter[n]);
+    }
+
+    return audible;
+}
+
+// A voice that's been keyed off and faded out stays silent until it's keyed
+// on again, so there's no point going a sample at a time
+static inline bool voice_idle(const struct DspVoice* voice) {
+    return voice->env_mode == DSP_ENV_RELEASE && !voice->env && !voice->kon_delay;
+}
+
+// step_voice() for when there's no sound to make. The envelope, ENDX and where
+// the voice is up to all carry on as they would, except for pitch modulation,
+// which needs the voice before's output
+static void skip_voice(struct Apu* apu, int index, const struct MixBlock* block) {
+    struct DspVoice* voice = &apu->dsp.voices[index];
+    uint8_t* regs = &apu->dsp.regs[index * 0x10];
+    int32_t pitch = (regs[V_PITCHL] | (regs[V_PITCHH] << 8)) & 0x3FFF;
+
+    for (int n = 0; n < block->count; n++) {
+        if (voice_idle(voice)) {
+            // It only has to get through enough BRR blocks for the last sample
+            // of the block, the ones before need fewer
+            int left = block->count - n;
+            uint32_t last = voice->position + ((voice->fraction + pitch * (left - 1)) >> 12);
+            while ((int32_t)(voice->decoded - last) < 4) skip_brr_block(apu, index);
+            int32_t step = voice->fraction + pitch * left;
+            voice->position += step >> 12;
+            voice->fraction = step & 0xFFF;
+            break;
+        }
+        if (voice->kon_delay) {
+            voice->kon_delay--;
+            continue;
+        }
+
+        while ((int32_t)(voice->decoded - voice->position) < 4) skip_brr_block(apu, index);
+        int32_t step = pitch + voice->fraction;
+        voice->position += step >> 12;
+        voice->fraction = step & 0xFFF;
+
+        run_envelope(voice, regs, block->counter[n]);
+    }
+
+    regs[V_ENVX] = voice->env >> 4;
+    regs[V_OUTX] = 0;
+}
+
+static void mix_voice_block(struct Apu* apu, int index, struct MixBlock* block) {
+    struct Dsp* dsp = &apu->dsp;
+    uint8_t* regs = &dsp->regs[index * 0x10];
+    int32_t* output = block->output[index & 1];
+    int count = block->count;
+
+    if (step_voice(apu, index, block)) {
+        if (dsp->regs[R_NON] & (1 << index)) {
+            for (int n = 0; n < count; n++) output[n] = (int16_t)(block->noise[n] * 2);
+        } else {
+            interpolate(block, output);
+        }
+        apply_envelope(output, block->env, count);
+
+        mix_voice(block->main[0], output, regs[V_VOLL], count);
+        mix_voice(block->main[1], output, regs[V_VOLR], count);
+        if (dsp->regs[R_EON] & (1 << index)) {
+            mix_voice(block->echo[0], output, regs[V_VOLL], count);
+            mix_voice(block->echo[1], output, regs[V_VOLR], count);
+        }
+    } else {
+        memset(output, 0, count * sizeof(output[0]));
+    }
+
+    regs[V_ENVX] = dsp->voices[index].env >> 4;
+    regs[V_OUTX] = output[count - 1] >> 8;
+}
+
+// Reads the block's worth of echo buffer back, filters it, and writes the
+// feedback over it. Blocks never run past the end of the buffer, and nothing's
+// read twice in one, so the reads can all go first
+static void run_echo(struct Apu* apu, struct MixBlock* block, int16_t (*out)[2]) {
+    struct Dsp* dsp = &apu->dsp;
+    const uint8_t* regs = dsp->regs;
+    int count = block->count;
+    uint16_t base = (regs[R_ESA] << 8) + dsp->echo_offset;
+    bool writes = !(regs[R_FLG] & FLG_ECHO_OFF);
+    // A 0 length buffer is just the one sample at ESA
+    int stride = dsp->echo_length ? 4 : 0;
+
+    int32_t fir[8];
+    for (int i = 0; i < 8; i++) fir[i] = (int8_t)regs[R_FIR + i * 0x10];
+
+    for (int c = 0; c < 2; c++) {
+        int32_t* history = block->echo_history[c];
+        memcpy(history, dsp->echo_history[c], sizeof(dsp->echo_history[c]));
+        for (int n = 0; n < count; n++) {
+            history[7 + n] = (int16_t)read_u16(apu, base + n * stride + c * 2) >> 1;
+        }
+        echo_fir(history, fir, count, block->echo_in[c]);
+        memcpy(dsp->echo_history[c], &history[count], sizeof(dsp->echo_history[c]));
+    }
+
+    for (int n = 0; n < count; n++) {
+        for (int c = 0; c < 2; c++) {
+            int32_t main = (int16_t)((block->main[c][n] * (int8_t)regs[c ? R_MVOLR : R_MVOLL]) >> 7);
+            int32_t echo = (int16_t)((block->echo_in[c][n] * (int8_t)regs[c ? R_EVOLR : R_EVOLL]) >> 7);
+            out[n][c] = regs[R_FLG] & FLG_MUTE ? 0 : clamp16(main + echo);
+
+            if (!writes) continue;
+            int32_t feedback = clamp16(block->echo[c][n] + (int16_t)((block->echo_in[c][n] * (int8_t)regs[R_EFB]) >> 7)) & ~1;
+            uint16_t addr = base + n * stride + c * 2;
+            apu_write_aram(apu, addr, feedback & 0xFF);
+            apu_write_aram(apu, addr + 1, feedback >> 8);
+        }
+    }
+
+    if (dsp->echo_length) {
+        dsp->echo_offset += count * 4;
+        if (dsp->echo_offset >= dsp->echo_length) dsp->echo_offset = 0;
+    }
+}
+
+static void mix_block(struct Apu* apu, int count) {
+    struct Dsp* dsp = &apu->dsp;
+    struct MixBlock block;
+    block.count = count;
+
+    // Key on/off only get looked at between blocks, which is fine since the
+    // registers can't change inside one
+    if (dsp->regs[R_FLG] & FLG_RESET) {
+        for (int i = 0; i < DSP_VOICES; i++) {
+            dsp->voices[i].env_mode = DSP_ENV_RELEASE;
+            dsp->voices[i].env = 0;
+        }
+    }
+    for (int i = 0; i < DSP_VOICES; i++) {
+        if (dsp->regs[R_KOFF] & (1 << i)) dsp->voices[i].env_mode = DSP_ENV_RELEASE;
+        if (dsp->kon & (1 << i)) key_on(apu, i);
+    }
+    dsp->regs[R_ENDX] &= ~dsp->kon;
+    dsp->kon = 0;
+
+    for (int n = 0; n < count; n++) {
+        if (--dsp->counter < 0) dsp->counter = COUNTER_RANGE - 1;
+        block.counter[n] = dsp->counter;
+        if (counter_fires(dsp->counter, dsp->regs[R_FLG] & 0x1F)) {
+            int feedback = (dsp->noise << 13) ^ (dsp->noise << 14);
+            dsp->noise = (feedback & 0x4000) ^ (dsp->noise >> 1);
+        }
+        block.noise[n] = dsp->noise;
+    }
+
+    if (apu->fast) {
+        for (int i = 0; i < DSP_VOICES; i++) {
+            skip_voice(apu, i, &block);
+        }
+        // Still in step with the SPC700 for whoever's listening, just quiet
+        if (apu->audio) {
+            static const int16_t silence[DSP_BLOCK_SIZE][2];
+            audio_ring_push(apu->audio, silence, count);
+        }
+        return;
+    }
+
+    memset(block.main, 0, sizeof(block.main));
+    memset(block.echo, 0, sizeof(block.echo));
+    for (int i = 0; i < DSP_VOICES; i++) {
+        mix_voice_block(apu, i, &block);
+    }
+
+    int16_t out[DSP_BLOCK_SIZE][2];
+    run_echo(apu, &block, out);
+    if (apu->audio) audio_ring_push(apu->audio, (const int16_t (*)[2])out, count);
+}
+
+void dsp_reset(struct Dsp* dsp) {
+    memset(dsp, 0, sizeof(*dsp));
+    dsp->regs[R_FLG] = FLG_RESET | FLG_MUTE | FLG_ECHO_OFF;
+    dsp->noise = 0x4000;
+}
+
+void dsp_run(struct Apu* apu, uint64_t samples) {
+    struct Dsp* dsp = &apu->dsp;
+
+    while (dsp->samples < samples) {
+        int count = samples - dsp->samples < DSP_BLOCK_SIZE ? samples - dsp->samples : DSP_BLOCK_SIZE;
+
+        // Echo buffer size changes only take once it comes back round to the start
+        if (!dsp->echo_offset) dsp->echo_length = (dsp->regs[R_EDL] & 0x0F) * 0x800;
+        // Each block stays inside one pass over the echo buffer. A 0 length one
+        // is written every sample and read back the next, unless writes are off.
+        // None of that matters in fast mode, which leaves the echo unit alone
+        int left = dsp->echo_length ? (dsp->echo_length - dsp->echo_offset) / 4 : 1;
+        bool echo = dsp->echo_length || !(dsp->regs[R_FLG] & FLG_ECHO_OFF);
+        if (!apu->fast && echo && left < count) count = left;
+
+        mix_block(apu, count);
+        dsp->samples += count;
+    }
+}
+
+void dsp_write(struct Dsp* dsp, uint8_t addr, uint8_t value) {
+    switch (addr) {
+        case R_KON:
+            dsp->kon |= value;
+            break;
+        case R_ENDX:
+            // Any write clears it
+            value = 0;
+            break;
+    }
+    dsp->regs[addr] = value;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// S-DSP: eight voices playing BRR compressed samples out of ARAM, each with an
+// ADSR or GAIN envelope and 4-tap Gaussian interpolation, plus noise, pitch
+// modulation and an echo unit with an 8-tap FIR filter. One stereo sample
+// every 32 SPC700 cycles, 32 kHz.
+//
+// Like the SPC700 it's only run when something needs it: when the SPC700 goes
+// to touch a DSP register and at the end of every frame. Everything in between
+// is done in blocks of up to DSP_BLOCK_SIZE samples. The per-sample bookkeeping
+// (envelopes, BRR decoding, where each voice is up to) is worked out first for
+// the whole block, then interpolation, mixing and the echo filter go through
+// the block a vector at a time.
+//
+// Lives inside struct Apu, so it gets saved, rewound and forked along with it.
+//
+// With apu->fast set it stops making sound and only keeps up what the SPC700
+// can see: envelopes (ENVX), ENDX and key on/off, with each voice walking
+// through its BRR blocks' headers at its pitch but not decoding them. OUTX
+// reads 0, pitch modulation is ignored and the echo unit's left alone, so its
+// buffer in ARAM isn't written. Voices that have faded out skip ahead a block
+// at a time. Switching back mid-sound can click for a moment while the voices'
+// decoded samples catch up.
+
+#define DSP_SAMPLE_RATE 32000
+#define DSP_CYCLES_PER_SAMPLE 32
+#define DSP_VOICES 8
+#define DSP_BLOCK_SIZE 32
+
+// Decoded samples kept per voice, a power of two. Has to hold a whole BRR
+// block on top of the 4 interpolation taps
+#define DSP_BRR_RING 32
+
+enum DspEnvelopeMode {
+    DSP_ENV_RELEASE,
+    DSP_ENV_ATTACK,
+    DSP_ENV_DECAY,
+    DSP_ENV_SUSTAIN,
+};
+
+struct DspVoice {
+    // Decoded samples, indexed by how far into the sample they are
+    int16_t ring[DSP_BRR_RING];
+    uint32_t decoded; // Samples decoded since key on
+    uint32_t position; // The first interpolation tap
+    uint16_t fraction; // Between it and the next, 12 bits
+    uint16_t brr_addr; // Next block to decode
+
+    int16_t env; // 11 bits
+    int16_t hidden_env; // Where it'd be if it wasn't clamped, for the bent GAIN mode
+    uint8_t env_mode;
+    uint8_t kon_delay; // Silent samples left after a key on
+};
+
+struct Dsp {
+    uint8_t regs[128];
+    struct DspVoice voices[DSP_VOICES];
+
+    uint8_t kon; // Written to KON since the last block, not acted on yet
+    int32_t counter; // Drives the envelope and noise rates, counts down from 0x77FF
+    uint16_t noise; // 15-bit LFSR
+
+    uint16_t echo_offset; // Bytes into the echo buffer
+    uint16_t echo_length; // Only picked up from EDL when the offset wraps
+    // The last 7 samples read back from the echo buffer, oldest first, for the FIR
+    int32_t echo_history[2][7];
+
+    uint64_t samples; // Generated since reset
+};
+
+struct Apu;
+
+void dsp_reset(struct Dsp* dsp);
+// Generates samples until it's made `samples` since reset
+void dsp_run(struct Apu* apu, uint64_t samples);
+// The SPC700's side of $F3, once it's caught up
+void dsp_write(struct Dsp* dsp, uint8_t addr, uint8_t value);
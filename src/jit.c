@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "jit.h"
+
+#if defined(JIT_ENABLED) && defined(__x86_64__)
+
+void jit_init(struct Jit* jit) {
+    jit->threshold = JIT_THRESHOLD;
+    const char* setting = getenv("CLSNES_JIT");
+    if (setting && !strcmp(setting, "0")) return;
+
+    // The cache gets mapped when the first block's compiled, short lived
+    // instances (forks) often never get that far
+    jit->enabled = true;
+}
+
+// Never writable and executable at once. The whole cache starts out writable,
+// and the pages a block went into become executable instead once it's done
+static bool map_cache(struct Jit* jit) {
+    jit->buffer = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buffer == MAP_FAILED) {
+        fprintf(stderr, "Couldn't map the JIT code cache, interpreting everything\n");
+        jit->buffer = NULL;
+        jit->enabled = false;
+        return false;
+    }
+    return true;
+}
+
+void jit_shutdown(struct Jit* jit) {
+    if (jit->buffer) munmap(jit->buffer, JIT_CACHE_SIZE);
+    jit->buffer = NULL;
+    jit->enabled = false;
+}
+
+static void emit_u8(struct Jit* jit, uint8_t value) {
+    *jit->cursor++ = value;
+}
+
+static void emit_u32(struct Jit* jit, uint32_t value) {
+    memcpy(jit->cursor, &value, 4);
+    jit->cursor += 4;
+}
+
+static void emit_u64(struct Jit* jit, uint64_t value) {
+    memcpy(jit->cursor, &value, 8);
+    jit->cursor += 8;
+}
+
+// The context lives in rbx for the whole function. Emits the opcode bytes and
+// a [rbx + disp32] ModRM with `reg` in the middle
+static void emit_context_operand(struct Jit* jit, uint8_t reg, int32_t offset) {
+    emit_u8(jit, 0x83 | (reg << 3));
+    emit_u32(jit, offset);
+}
+
+// Sets the pages under the next JIT_MAX_BLOCK_SIZE bytes from `start`. The
+// first can still have the end of the last block on it, which can't run while
+// it's writable, but nothing runs while a block's being compiled anyway
+static bool protect_block(struct Jit* jit, uint8_t* start, int protection) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t first = (uintptr_t)start & ~(page_size - 1);
+    uintptr_t last = ((uintptr_t)start + JIT_MAX_BLOCK_SIZE + page_size - 1) & ~(page_size - 1);
+    if (last > (uintptr_t)jit->buffer + JIT_CACHE_SIZE) last = (uintptr_t)jit->buffer + JIT_CACHE_SIZE;
+    return !mprotect((void*)first, last - first, protection);
+}
+
+bool jit_begin(struct Jit* jit) {
+    if (!jit->buffer && !map_cache(jit)) return false;
+    if (jit->used + JIT_MAX_BLOCK_SIZE > JIT_CACHE_SIZE) return false;
+
+    jit->start = jit->buffer + jit->used;
+    jit->cursor = jit->start;
+    if (!protect_block(jit, jit->start, PROT_READ | PROT_WRITE)) {
+        fprintf(stderr, "Couldn't make the JIT code cache writable, interpreting everything\n");
+        jit->enabled = false;
+        return false;
+    }
+
+    // push rbx (which also gets the stack 16 byte aligned for calls out)
+    // mov rbx, rdi
+    emit_u8(jit, 0x53);
+    emit_u8(jit, 0x48);
+    emit_u8(jit, 0x89);
+    emit_u8(jit, 0xFB);
+    return true;
+}
+
+JitFunction jit_end(struct Jit* jit) {
+    // pop rbx, ret
+    emit_u8(jit, 0x5B);
+    emit_u8(jit, 0xC3);
+
+    jit->used = jit->cursor - jit->buffer;
+    if (!protect_block(jit, jit->start, PROT_READ | PROT_EXEC)) {
+        fprintf(stderr, "Couldn't make the JIT code cache executable, interpreting everything\n");
+        jit->enabled = false;
+        return NULL;
+    }
+    jit->compiled++;
+    return (JitFunction)(uintptr_t)jit->start;
+}
+
+void jit_reset(struct Jit* jit) {
+    jit->used = 0;
+    jit->flushes++;
+}
+
+void jit_emit_add_u64(struct Jit* jit, int32_t offset, int32_t value) {
+    // add qword [rbx + offset], imm32
+    emit_u8(jit, 0x48);
+    emit_u8(jit, 0x81);
+    emit_context_operand(jit, 0, offset);
+    emit_u32(jit, value);
+}
+
+void jit_emit_store_u32(struct Jit* jit, int32_t offset, uint32_t value) {
+    // mov dword [rbx + offset], imm32
+    emit_u8(jit, 0xC7);
+    emit_context_operand(jit, 0, offset);
+    emit_u32(jit, value);
+}
+
+void jit_emit_store_u16(struct Jit* jit, int32_t offset, uint16_t value) {
+    // mov word [rbx + offset], imm16
+    emit_u8(jit, 0x66);
+    emit_u8(jit, 0xC7);
+    emit_context_operand(jit, 0, offset);
+    emit_u8(jit, value & 0xFF);
+    emit_u8(jit, value >> 8);
+}
+
+void jit_emit_store_u8(struct Jit* jit, int32_t offset, uint8_t value) {
+    // mov byte [rbx + offset], imm8
+    emit_u8(jit, 0xC6);
+    emit_context_operand(jit, 0, offset);
+    emit_u8(jit, value);
+}
+
+void jit_emit_and_u8(struct Jit* jit, int32_t offset, uint8_t value) {
+    // and byte [rbx + offset], imm8
+    emit_u8(jit, 0x80);
+    emit_context_operand(jit, 4, offset);
+    emit_u8(jit, value);
+}
+
+void jit_emit_or_u8(struct Jit* jit, int32_t offset, uint8_t value) {
+    // or byte [rbx + offset], imm8
+    emit_u8(jit, 0x80);
+    emit_context_operand(jit, 1, offset);
+    emit_u8(jit, value);
+}
+
+void jit_emit_call(struct Jit* jit, JitCallee function, uint32_t argument) {
+    // mov rdi, rbx ; mov esi, imm32 ; movabs rax, function ; call rax
+    emit_u8(jit, 0x48);
+    emit_u8(jit, 0x89);
+    emit_u8(jit, 0xDF);
+    emit_u8(jit, 0xBE);
+    emit_u32(jit, argument);
+    emit_u8(jit, 0x48);
+    emit_u8(jit, 0xB8);
+    emit_u64(jit, (uintptr_t)function);
+    emit_u8(jit, 0xFF);
+    emit_u8(jit, 0xD0);
+}
+
+void jit_emit_return_if_set(struct Jit* jit, int32_t offset) {
+    // cmp byte [rbx + offset], 0 ; je over ; pop rbx ; ret
+    emit_u8(jit, 0x80);
+    emit_context_operand(jit, 7, offset);
+    emit_u8(jit, 0x00);
+    emit_u8(jit, 0x74);
+    emit_u8(jit, 0x02);
+    emit_u8(jit, 0x5B);
+    emit_u8(jit, 0xC3);
+}
+
+void jit_emit_return_if_reached(struct Jit* jit, int32_t offset, int32_t limit_offset) {
+    // mov rax, [rbx + offset] ; cmp rax, [rbx + limit_offset] ; jb over ; pop rbx ; ret
+    emit_u8(jit, 0x48);
+    emit_u8(jit, 0x8B);
+    emit_context_operand(jit, 0, offset);
+    emit_u8(jit, 0x48);
+    emit_u8(jit, 0x3B);
+    emit_context_operand(jit, 0, limit_offset);
+    emit_u8(jit, 0x72);
+    emit_u8(jit, 0x02);
+    emit_u8(jit, 0x5B);
+    emit_u8(jit, 0xC3);
+}
+
+#else
+
+// No native code here, jit->enabled stays false and nothing below gets called
+void jit_init(struct Jit* jit) {}
+void jit_shutdown(struct Jit* jit) {}
+bool jit_begin(struct Jit* jit) { return false; }
+JitFunction jit_end(struct Jit* jit) { return NULL; }
+void jit_reset(struct Jit* jit) {}
+void jit_emit_add_u64(struct Jit* jit, int32_t offset, int32_t value) {}
+void jit_emit_store_u32(struct Jit* jit, int32_t offset, uint32_t value) {}
+void jit_emit_store_u16(struct Jit* jit, int32_t offset, uint16_t value) {}
+void jit_emit_store_u8(struct Jit* jit, int32_t offset, uint8_t value) {}
+void jit_emit_and_u8(struct Jit* jit, int32_t offset, uint8_t value) {}
+void jit_emit_or_u8(struct Jit* jit, int32_t offset, uint8_t value) {}
+void jit_emit_call(struct Jit* jit, JitCallee function, uint32_t argument) {}
+void jit_emit_return_if_set(struct Jit* jit, int32_t offset) {}
+void jit_emit_return_if_reached(struct Jit* jit, int32_t offset, int32_t limit_offset) {}
+
+#endif
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Native code tier for hot blocks. This side is just a code cache (one mmap'd
+// buffer, bump allocated and thrown away whole when it fills up) and the
+// handful of x86-64 instructions main.c needs to stitch a block together.
+// What to emit for each opcode is decided over there. The cache is W^X: pages
+// are only writable while a block's going into them, and executable after.
+//
+// So far only flag ops and immediate loads are written out natively. Every
+// other instruction is a call to its interpreter handler, so all a block saves
+// is the dispatch between them, and that hasn't measured as any faster than
+// the interpreter's block cache yet. It's the groundwork for inlining loads,
+// stores and branches.
+//
+// Emitted functions take a context pointer (the emulator instance) and every
+// access is an offset from it, so the code itself doesn't care which instance
+// runs it. Each instance still keeps its own cache, as blocks are per instance.
+//
+// Built with JIT_ENABLED (make JIT=1, the default) on x86-64 only, and
+// CLSNES_JIT=0 turns it off at runtime. jit.enabled is false in either case.
+
+// Don't bother compiling a block until it's been run this many times
+#define JIT_THRESHOLD 32
+
+#define JIT_CACHE_SIZE (16 * 1024 * 1024)
+
+// Room one block can take at most, jit_begin() refuses if it isn't there
+#define JIT_MAX_BLOCK_SIZE 4096
+
+typedef void (*JitFunction)(void* context);
+// Anything called from emitted code gets (context, argument)
+typedef void (*JitCallee)();
+
+struct Jit {
+    bool enabled;
+    // Runs before a block gets compiled, JIT_THRESHOLD unless --verify wants them all
+    uint16_t threshold;
+
+    uint8_t* buffer;
+    size_t used;
+
+    // Where the current function started and where the next byte goes
+    uint8_t* start;
+    uint8_t* cursor;
+
+    uint64_t compiled;
+    uint64_t flushes;
+};
+
+void jit_init(struct Jit* jit);
+void jit_shutdown(struct Jit* jit);
+
+// false when the cache is full. The caller has to drop every pointer it holds
+// into the cache before jit_reset() throws it away
+bool jit_begin(struct Jit* jit);
+JitFunction jit_end(struct Jit* jit);
+void jit_reset(struct Jit* jit);
+
+// Targets are byte offsets into the context
+void jit_emit_add_u64(struct Jit* jit, int32_t offset, int32_t value);
+void jit_emit_store_u32(struct Jit* jit, int32_t offset, uint32_t value);
+void jit_emit_store_u16(struct Jit* jit, int32_t offset, uint16_t value);
+void jit_emit_store_u8(struct Jit* jit, int32_t offset, uint8_t value);
+void jit_emit_and_u8(struct Jit* jit, int32_t offset, uint8_t value);
+void jit_emit_or_u8(struct Jit* jit, int32_t offset, uint8_t value);
+void jit_emit_call(struct Jit* jit, JitCallee function, uint32_t argument);
+// Returns out of the function if the byte at offset is nonzero
+void jit_emit_return_if_set(struct Jit* jit, int32_t offset);
+// Returns out of the function if the u64 at offset has got to the one at limit_offset
+void jit_emit_return_if_reached(struct Jit* jit, int32_t offset, int32_t limit_offset);
@@ -1,18 +1,63 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifndef HEADLESS
 #include "raylib.h"
+#endif
 #include "Claire/Assert.h"
-
+#include "trace.h"
+#include "scheduler.h"
+#include "disasm.h"
+#include "jit.h"
+#include "pool.h"
+#include "shared_page.h"
+#include "rom.h"
+#include "snapshot.h"
+#include "rewind.h"
+#include "ppu.h"
+#include "ppu_thread.h"
+#include "apu.h"
+#include "audio.h"
+#include "profile.h"
+
+#define DEFAULT_HEADLESS_FRAMES 600
+#define DEFAULT_REWIND_MB 64
+#define NTSC_FRAME_RATE 60.0988
+
+#define WRAM_SIZE 0x20000
+
+// Where the header is for each memory map, which is also how build_memory_map()
+// tells them apart
 #define LO_ROM_OFFSET 0x7FC0
 #define HI_ROM_OFFSET 0xFFC0
+#define EX_HI_ROM_OFFSET 0x40FFC0
 
 struct RomFile {
-    uint8_t* data;
+    const char* path;
+    // Shared with every other instance running the same cart, never written
+    struct Rom* rom;
+    const uint8_t* data;
     size_t size;
-    uint16_t header_offset;
-} rom_file;
+    uint32_t header_offset;
+
+    uint8_t* sram;
+    size_t sram_size;
+    // Battery backed SRAM is a shared mapping of its .srm file, so writes land
+    // in the page cache as they happen and outlive the process. Otherwise it's
+    // just malloc'd
+    bool sram_battery;
+    // Written since the last frame ended. Clean battery backed SRAM has no
+    // write pointers in the page table, so it's the first write that sets it
+    bool sram_dirty;
+};
 
 struct Registers {
     uint32_t PC;
@@ -39,22 +84,55 @@ struct Registers {
         uint8_t byte;
     } status;
 
-} registers;
+};
+
+#define DMA_CHANNELS 8
+
+// DMAP bits
+#define DMAP_PATTERN 0x07 // Which B-bus ports a transfer goes through, see dma_ports
+#define DMAP_FIXED 0x08 // A-bus address doesn't move
+#define DMAP_DECREMENT 0x10
+#define DMAP_INDIRECT 0x40 // HDMA table holds addresses of the data instead of the data
+#define DMAP_TO_A 0x80 // B-bus to A-bus
+
+// One channel's $43x0-$43xF. General purpose DMA and HDMA share the registers
+struct DmaChannel {
+    uint8_t DMAP;
+    uint8_t BBAD; // B-bus port, $21xx
+    uint16_t A1T; // A-bus address, or where the HDMA table starts
+    uint8_t A1B; // A-bus bank, for the HDMA table too
+    uint16_t DAS; // Bytes left (0 is 64 KiB), or the HDMA indirect address
+    uint8_t DASB; // HDMA indirect bank
+    uint16_t A2A; // Where HDMA is in the table
+    uint8_t NLTR; // HDMA lines left in this entry, bit 7 to transfer on every one of them
+    uint8_t UNUSED; // $43xB/$43xF, plain R/W
+
+    // HDMA state that isn't in any register
+    bool hdma_do_transfer;
+    bool hdma_terminated;
+};
 
 struct Memory {
-    uint8_t WRAM[0xFFFF * 2];
-
     union {
         struct {
             uint8_t JOYPAD_ENABLE : 1;
             uint8_t _UNUSED_0 : 3;
-            uint8_t H_V_IRQ : 1;
+            uint8_t H_IRQ : 1;
+            uint8_t V_IRQ : 1;
             uint8_t _UNUSED_1 : 1;
             uint8_t VBLANK_NMI_ENABLE : 1;
         } flags;
         uint8_t byte;
     } NMITIMEN;
 
+    uint16_t HTIME;
+    uint16_t VTIME;
+    uint8_t MEMSEL;
+
+    // The latched bit 7s of RDNMI and TIMEUP, both cleared by reading
+    bool nmi_flag;
+    bool irq_flag;
+
     union {
         struct {
             uint8_t CHANNEL_0 : 1;
@@ -83,671 +161,2998 @@ struct Memory {
         uint8_t byte;
     } MDMAEN_HBLANK_DMA;
 
-    uint8_t APUIO0;
-    uint8_t APUIO1;
-    uint8_t APUIO2;
-    uint8_t APUIO3;
-
-    union {
-        struct {
-            uint8_t MASTER_BRIGHTNESS : 3;
-            uint8_t _UNUSED : 2;
-            uint8_t FORCED_BLANKING : 1;
-        } flags;
-        uint8_t byte;
-    } INIDISP;
-
-    union {
-        struct {
-            uint8_t OBJ_SIZE : 3;
-            uint8_t OBJ_GAP : 1;
-            uint8_t TILE_BASE : 2;
-        } flags;
-        uint8_t byte;
-    } OBSEL;
-} memory;
+    struct DmaChannel dma[DMA_CHANNELS];
+
+    // Where WMDATA ($2180) goes next in WRAM, 17 bits
+    uint32_t WMADD;
+
+    // Multiplier/divider. The real thing takes 8 or 16 CPU cycles, the results
+    // are just there straight away here
+    uint8_t WRMPYA;
+    uint16_t WRDIV;
+    uint16_t RDDIV;
+    uint16_t RDMPY;
+};
+
+// The 24-bit address space is carved into 4 KiB pages. Every page either points
+// straight at host memory (WRAM, ROM, SRAM) or names a handler for the slow path,
+// so ordinary RAM/ROM accesses are just an indexed load. Built once by
+// build_memory_map(emu) after the header has been located.
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#define PAGE_COUNT (1 << (24 - PAGE_SHIFT))
+
+enum PageHandler {
+    PAGE_UNMAPPED = 0,
+    PAGE_DIRECT,
+    PAGE_ROM, // Readable directly, writes are dropped
+    PAGE_IO,
+    PAGE_SRAM, // Readable directly unless it's smaller than a page, writes are too unless it's clean battery backed SRAM
+};
+
+struct MemoryMap {
+    // Host pointer to the first byte of each page, or NULL if the access has to
+    // go through the page's handler
+    uint8_t* read[PAGE_COUNT];
+    uint8_t* write[PAGE_COUNT];
+
+    uint8_t handler[PAGE_COUNT];
+    // Master cycles an access to the page costs on top of MASTER_CYCLES_FAST
+    uint8_t wait[PAGE_COUNT];
+    // Handler specific, i.e. the SRAM offset of the page for PAGE_SRAM
+    uint32_t offset[PAGE_COUNT];
+    // Which WRAM page this is, -1 if it isn't one
+    int8_t wram_page[PAGE_COUNT];
+};
+
+struct Timing {
+    uint16_t V;
+    uint64_t line_start; // Master clock at H=0 of the current line
+    uint64_t frame;
+
+    // Taken at the next instruction boundary
+    bool nmi_pending;
+    // Parked on a WAI, an interrupt returns to the instruction after it
+    bool waiting;
+    // The CPU's stopped for general purpose DMA, interrupts wait until it's done
+    bool in_dma;
+};
+
+// Opcodes are dispatched through one of these tables, picked whenever P or E
+// changes so handlers never have to look at the register widths themselves
+enum CpuMode {
+    CPU_MODE_M16_X16,
+    CPU_MODE_M16_X8,
+    CPU_MODE_M8_X16,
+    CPU_MODE_M8_X8,
+    CPU_MODE_EMULATION,
+
+    CPU_MODE_COUNT,
+};
+
+_Static_assert(CPU_MODE_COUNT == PROFILE_MODES, "The profile keeps counts for every CPU mode");
+
+struct Emulator;
+typedef void (*OpcodeHandler)(struct Emulator* emu, uint32_t operand);
+
+struct DispatchTable {
+    OpcodeHandler handlers[256];
+    // Base CPU cycles, handlers add whatever depends on runtime state
+    uint8_t cycles[256];
+    // Instruction length, opcode included
+    uint8_t lengths[256];
+};
+
+// Counters for the stats printed at the end of a run
+struct RunStats {
+    // Run this session, timing.frame is the console's own count
+    uint64_t frames;
+    uint64_t instructions;
+    uint64_t blocks_built;
+    uint64_t wram_copies;
+    // General purpose DMA, and how much of it went down the fast paths
+    uint64_t dma_bytes;
+    uint64_t dma_fast_bytes;
+    // Frames that ended with battery backed SRAM to write out
+    uint64_t sram_flushes;
+};
+
+// Decoded basic blocks, so straight line code doesn't get fetched and decoded
+// byte by byte every time through. Keyed by PC and CPU mode, and a block always
+// ends on anything that can jump or change the mode, so everything in it runs
+// off the same dispatch table.
+//
+// Only ROM and WRAM code gets cached. WRAM pages holding cached code have their
+// write pointers taken out of the page table, so the first write to one goes
+// down the slow path and bumps the page's generation, which is what a block
+// checks before it's reused.
+#define BLOCK_CACHE_SIZE 4096
+#define BLOCK_MAX_INSTRUCTIONS 16
+#define WRAM_PAGES (WRAM_SIZE / PAGE_SIZE)
+
+struct BlockInstruction {
+    OpcodeHandler handler;
+    uint32_t operand;
+    uint32_t next_pc;
+    // Master cycles, fetch waits included
+    uint16_t cycles;
+    uint8_t opcode;
+};
+
+struct Block {
+    uint32_t key; // BLOCK_KEY(), BLOCK_EMPTY if unused
+    int16_t wram_page; // -1 when the block is in ROM
+    uint32_t generation;
+
+    uint16_t cycles; // Total of the instructions below
+    uint8_t length;
+    struct BlockInstruction instructions[BLOCK_MAX_INSTRUCTIONS];
+
+    // Times run, until it gets hot enough to compile
+    uint16_t runs;
+    JitFunction native;
+};
+
+// Mode's off by one so a zeroed cache is an empty one
+#define BLOCK_KEY(pc, mode) ((pc) | ((uint32_t)(mode) + 1) << 24)
+#define BLOCK_MODE(key) ((enum CpuMode)(((key) >> 24) - 1))
+#define BLOCK_EMPTY 0
+
+struct BlockCache {
+    // BLOCK_CACHE_SIZE of them, mapped on their own so a new instance only
+    // pays for the ones it gets around to using
+    struct Block* blocks;
+
+    uint32_t wram_generation[WRAM_PAGES];
+    bool wram_has_code[WRAM_PAGES];
+
+    // Set when a write hits cached code, so a block that rewrote itself stops
+    bool stale;
+    // Everything goes through the interpreter instead, for --verify's reference copy
+    bool disabled;
+};
+
+_Static_assert(PAGE_SIZE == SHARED_PAGE_SIZE, "WRAM pages are mapped straight into the page table");
+
+// WRAM lives in shared pages, so forking an instance costs nothing up front.
+// A page only gets a write pointer in the page table once it's private, dirty
+// and free of cached code; until then the first write to it goes down the slow
+// path, which sorts all three out.
+struct Wram {
+    struct SharedPage* pages[WRAM_PAGES];
+    // Written since the last clear_wram_dirty()
+    bool dirty[WRAM_PAGES];
+};
+
+// Everything one console needs. Nothing in here is shared between instances
+// (bar the read-only ROM and copy-on-write WRAM, VRAM and ARAM), so any number
+// of them can run side by side
+struct Emulator {
+    struct RomFile rom_file;
+    struct Registers registers;
+    struct Memory memory;
+    struct Wram wram;
+    struct MemoryMap memory_map;
+    struct Timing timing;
+    struct Scheduler scheduler;
+    struct Ppu ppu;
+    // Separate so the PPU state stays one block that's cheap to copy around
+    struct TileCache* tile_cache;
+    struct Framebuffer* framebuffer;
+    // NULL when rendering inline. Otherwise it owns tile_cache and framebuffer
+    struct PpuThread* ppu_thread;
+    struct Apu apu;
+    // Headless runs' --wav, fed from apu.audio after every frame
+    struct WavWriter wav;
+
+    enum CpuMode cpu_mode;
+    const struct DispatchTable* dispatch;
+
+    struct BlockCache block_cache;
+    struct Jit jit;
+    struct RunStats run_stats;
+
+    // NULL unless rewind's on
+    struct RewindState* rewind;
+    // Or --profile
+    struct Profile* profile;
+};
+
+// Set by --verbose, up here since ROM loading wants it
+bool verbose_enabled;
+
+// --verbose chatter. Goes to stderr along with every other diagnostic, so
+// it never gets mixed up with --stats -
+void verbose(const char* format, ...) {
+    if (!verbose_enabled) return;
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
 
 void breakpoint() {
     getchar();
 }
 
-void load_rom(const char* path) {
-    FILE* fp = fopen(path, "rb");
-    ASSERT(fp, "Couldn't load ROM");
-
-    fseek(fp, 0, SEEK_END);
-    rom_file.size = ftell(fp);
+void load_rom(struct Emulator* emu, const char* path) {
+    emu->rom_file.path = path;
+    emu->rom_file.rom = rom_acquire(path);
+    ASSERT(emu->rom_file.rom, "Couldn't load ROM");
 
-    if (rom_file.size % 1024 == 512) {
-        // We need to skip a header prepended by a copier device or the like. Oughta be 512 bytes
-        fseek(fp, 512, SEEK_SET);
-        rom_file.size -= 512;
-        printf("Note: Headered rom\n");
-    } else {
-        fseek(fp, 0, SEEK_SET);
-    }
-
-    rom_file.data = malloc(rom_file.size);
-    size_t bytes_read = fread(rom_file.data, 1, rom_file.size, fp);
-    ASSERT(bytes_read == rom_file.size, "Didn't read full rom.. what's up with that..?");
-
-    fclose(fp);
+    emu->rom_file.data = emu->rom_file.rom->data;
+    emu->rom_file.size = emu->rom_file.rom->size;
 }
 
-uint16_t read_u16_raw(uint8_t* source) {
+uint16_t read_u16_raw(const uint8_t* source) {
     uint8_t a = *(source++);
     uint8_t b = *source;
 
     return (b << 8) | a;
 }
 
-int get_heuristic_score_for_header_candidate(size_t offset) {
-    int score = 0;
+// Where a ROM offset ends up. A cart that isn't a power of two in size mirrors
+// what's past the biggest power of two that fits into the rest, then the same
+// again for whatever's left over, the way its address decoding works out
+size_t mirror_rom_offset(size_t offset, size_t size) {
+    size_t base = 0;
+    while (offset >= size) {
+        size_t top = (size_t)1 << (63 - __builtin_clzll(offset));
+        offset -= top;
+        if (size > top) {
+            size -= top;
+            base += top;
+        }
+    }
+    return base + offset;
+}
 
-    uint8_t* header = rom_file.data + offset;
+// The sum of every byte, as if the ROM was mirrored up to the next power of two
+uint16_t rom_checksum(const uint8_t* data, size_t size) {
+    size_t full = 1;
+    while (full < size) full <<= 1;
+
+    uint32_t sum = 0;
+    for (size_t i = 0; i < size; i++) sum += data[i];
+    // Mirrored in page sized pieces. Nothing smaller than a page gets mirrored
+    for (size_t offset = size; offset < full; offset += PAGE_SIZE) {
+        const uint8_t* page = data + mirror_rom_offset(offset, size);
+        for (int i = 0; i < PAGE_SIZE; i++) sum += page[i];
+    }
+    return sum;
+}
+
+// Where the 65816 would find ROM address `addr` of bank 00 with the header at `offset`
+size_t bank_zero_rom_offset(size_t offset, uint16_t addr) {
+    if (offset == LO_ROM_OFFSET) return addr & 0x7FFF;
+    if (offset == HI_ROM_OFFSET) return addr;
+    return 0x400000 + addr;
+}
+
+int get_heuristic_score_for_header_candidate(struct Emulator* emu, size_t offset) {
+    const uint8_t* data = emu->rom_file.data;
+    size_t size = emu->rom_file.size;
+    // Past the end, it can't be this one
+    if (offset + 0x40 > size) return -1000;
+
+    int score = 0;
+    const uint8_t* header = data + offset;
 
     uint8_t speed_and_map_mode = *(header + 0x15);
     uint8_t map_mode = speed_and_map_mode & 0b00001111;
 
-    if (map_mode == 0b00) {
-        score += (offset == LO_ROM_OFFSET) ? 1 : -10;
-    } else if (map_mode == 0b01) {
-        score += (offset == HI_ROM_OFFSET) ? 1 : -10;
-    } else if (map_mode == 0b11) {
-        ASSERT_NOT_REACHED("Unimplemented: ExHiROM");
+    if (map_mode == 0x0) {
+        score += (offset == LO_ROM_OFFSET) ? 2 : -10;
+    } else if (map_mode == 0x1) {
+        score += (offset == HI_ROM_OFFSET) ? 2 : -10;
+    } else if (map_mode == 0x5) {
+        score += (offset == EX_HI_ROM_OFFSET) ? 2 : -10;
     } else {
-        printf("[%lx] Weird map mode\n", offset);
-        score -= 100;
+        score -= 10;
+    }
+
+    // The checksum and its complement should add up, and the checksum should
+    // actually be the ROM's. Only the real header gets the second one right
+    uint16_t complement = read_u16_raw(header + 0x1C);
+    uint16_t checksum = read_u16_raw(header + 0x1E);
+    if ((uint16_t)(checksum + complement) == 0xFFFF) {
+        score += 4;
+        if (checksum == rom_checksum(data, size)) score += 8;
     }
 
-    uint16_t reset_vector = read_u16_raw((uint8_t*)(rom_file.data + offset + 0x3C));
+    // Rounded up to a power of two, so somewhere between the size and double it
+    uint8_t rom_size_byte = *(header + 0x17);
+    if (rom_size_byte >= 7 && rom_size_byte <= 13) {
+        size_t claimed = (size_t)1024 << rom_size_byte;
+        if (claimed >= size && claimed / 2 < size) score += 2;
+    } else {
+        score -= 2;
+    }
 
-    if (offset == LO_ROM_OFFSET) {
-        if (reset_vector < 0x8000) score -= 10;
-    } else if (offset == HI_ROM_OFFSET) {
-        if (reset_vector < 0xC000) score -= 10;
+    // Has to land in ROM, and the first instruction there is nearly always
+    // setting up the CPU or jumping somewhere that does
+    uint16_t reset_vector = read_u16_raw(header + 0x3C);
+    if (reset_vector < 0x8000) {
+        score -= 10;
     } else {
-        ASSERT_NOT_REACHED("Unknown offset");
+        uint8_t opcode = data[mirror_rom_offset(bank_zero_rom_offset(offset, reset_vector), size)];
+        switch (opcode) {
+            case 0x78: // SEI
+            case 0x18: // CLC
+            case 0xC2: // REP
+            case 0xE2: // SEP
+            case 0x9C: // STZ
+            case 0x4C: // JMP
+            case 0x5C: // JML
+                score += 2;
+                break;
+            case 0x00: // BRK
+            case 0x02: // COP
+            case 0xDB: // STP
+            case 0xFF:
+                score -= 4;
+                break;
+        }
     }
 
     return score;
 }
 
-void locate_header() {
-    size_t winning_offset = LO_ROM_OFFSET;
-    int winning_score = get_heuristic_score_for_header_candidate(LO_ROM_OFFSET);
+void map_page(struct Emulator* emu, uint8_t bank, uint16_t addr, enum PageHandler handler, uint8_t* read, uint8_t* write) {
+    uint32_t page = ((bank << 16) | addr) >> PAGE_SHIFT;
+    emu->memory_map.handler[page] = handler;
+    emu->memory_map.read[page] = read;
+    emu->memory_map.write[page] = write;
+    emu->memory_map.offset[page] = 0;
+    emu->memory_map.wram_page[page] = -1;
+}
+
+// Maps [addr_start, addr_end] of each bank in the range onto `size` bytes of
+// `base`, mirroring if the window is bigger than the buffer. `bank_stride` is how
+// many bytes of the buffer each bank covers (0 to have every bank alias the same data).
+void map_region(
+    struct Emulator* emu,
+    uint8_t bank_start,
+    uint8_t bank_end,
+    uint16_t addr_start,
+    uint16_t addr_end,
+    enum PageHandler handler,
+    uint8_t* base,
+    size_t size,
+    size_t bank_stride,
+    bool writable
+) {
+    for (int bank = bank_start; bank <= bank_end; bank++) {
+        for (int addr = addr_start; addr <= addr_end; addr += PAGE_SIZE) {
+            if (!base) {
+                map_page(emu, bank, addr, handler, NULL, NULL);
+                continue;
+            }
 
-    int other_score = get_heuristic_score_for_header_candidate(HI_ROM_OFFSET);
-    if (other_score > winning_score) {
-        printf("%d > %d\n", other_score, winning_score);
-        winning_offset = HI_ROM_OFFSET;
-        winning_score = other_score;
+            size_t offset = mirror_rom_offset((bank - bank_start) * bank_stride + (addr - addr_start), size);
+            if (size < PAGE_SIZE) {
+                // Too small to hand out a pointer, the handler will mirror it
+                map_page(emu, bank, addr, handler, NULL, NULL);
+            } else {
+                uint8_t* page = base + offset;
+                map_page(emu, bank, addr, handler, page, writable ? page : NULL);
+            }
+            emu->memory_map.offset[((bank << 16) | addr) >> PAGE_SHIFT] = offset;
+        }
     }
+}
 
-    printf("Determined winning offset: %lx\n", winning_offset);
+void refresh_wram_page(struct Emulator* emu, int wram_page);
 
-    rom_file.header_offset = winning_offset;
+// Like map_region, onto the first `size` bytes of WRAM. The pointers get filled
+// in by refresh_wram_page as WRAM pages come and go
+void map_wram(struct Emulator* emu, uint8_t bank_start, uint8_t bank_end, uint16_t addr_start, uint16_t addr_end, size_t size, size_t bank_stride) {
+    for (int bank = bank_start; bank <= bank_end; bank++) {
+        for (int addr = addr_start; addr <= addr_end; addr += PAGE_SIZE) {
+            size_t offset = ((bank - bank_start) * bank_stride + (addr - addr_start)) % size;
+            map_page(emu, bank, addr, PAGE_DIRECT, NULL, NULL);
+            emu->memory_map.wram_page[((bank << 16) | addr) >> PAGE_SHIFT] = offset / PAGE_SIZE;
+        }
+    }
+}
 
-    char* game_name = malloc(22);
-    memcpy(game_name, rom_file.data + rom_file.header_offset, 21);
-    game_name[21] = '\0';
-    printf("Hello '%s'\n", game_name);
+void map_system_area(struct Emulator* emu, uint8_t bank_start, uint8_t bank_end) {
+    // First 8 KiB of WRAM is mirrored into the low pages of every system bank
+    map_wram(emu, bank_start, bank_end, 0x0000, 0x1FFF, 0x2000, 0);
+    map_region(emu, bank_start, bank_end, 0x2000, 0x5FFF, PAGE_IO, NULL, 0, 0, false);
+    map_region(emu, bank_start, bank_end, 0x6000, 0x7FFF, PAGE_UNMAPPED, NULL, 0, 0, false);
 }
 
-bool is_acc_16() {
-    return (!registers.status.flags.M) && (!registers.E_flag);
+// Wherever the cart's map type puts SRAM. Forks use it to point theirs at their
+// own, and it's redone whenever battery backed SRAM goes dirty or gets flushed
+void map_sram(struct Emulator* emu) {
+    uint8_t* sram = emu->rom_file.sram;
+    size_t size = emu->rom_file.sram_size;
+    bool writable = !emu->rom_file.sram_battery || emu->rom_file.sram_dirty;
+    if (emu->rom_file.header_offset == LO_ROM_OFFSET) {
+        map_region(emu, 0x70, 0x7D, 0x0000, 0x7FFF, PAGE_SRAM, sram, size, 0x8000, writable);
+        map_region(emu, 0xF0, 0xFF, 0x0000, 0x7FFF, PAGE_SRAM, sram, size, 0x8000, writable);
+    } else {
+        // HiROM and ExHiROM have it 8 KiB at a time, at 6000-7FFF of 20-3F and A0-BF
+        map_region(emu, 0x20, 0x3F, 0x6000, 0x7FFF, PAGE_SRAM, sram, size, 0x2000, writable);
+        map_region(emu, 0xA0, 0xBF, 0x6000, 0x7FFF, PAGE_SRAM, sram, size, 0x2000, writable);
+    }
 }
 
-bool is_index_16() {
-    return (!registers.status.flags.X) && (!registers.E_flag);
+// Battery backed SRAM's been written. Writes go straight through until the
+// frame's over
+void mark_sram_dirty(struct Emulator* emu) {
+    if (!emu->rom_file.sram_battery || emu->rom_file.sram_dirty) return;
+    emu->rom_file.sram_dirty = true;
+    map_sram(emu);
 }
 
+// At the end of a frame that wrote to battery backed SRAM. The data's already in
+// the page cache, safe from the emulator crashing, so MS_ASYNC just gets the
+// kernel started on writing it out rather than waiting on the disk every frame
+void flush_sram(struct Emulator* emu) {
+    msync(emu->rom_file.sram, emu->rom_file.sram_size, MS_ASYNC);
+    emu->rom_file.sram_dirty = false;
+    map_sram(emu);
+    emu->run_stats.sram_flushes++;
+}
 
-void handle_io_write(uint16_t addr, uint8_t value) {
-    switch (addr) {
-        case 0x2100: memory.INIDISP.byte = value; break;
-        case 0x2101: memory.OBSEL.byte = value; break;
-        case 0x2140:
-             memory.APUIO0 = value;
-             printf("[0] WROTE %x\n", value);
-             break;
-        case 0x2141:
-             memory.APUIO1 = value;
-             printf("[1] WROTE %x\n", value);
-             break;
-        case 0x2142:
-             memory.APUIO2 = value;
-             printf("[2] WROTE %x\n", value);
-             break;
-        case 0x2143:
-             memory.APUIO3 = value;
-             printf("[3] WROTE %x\n", value);
-             break;
-        case 0x4200: memory.NMITIMEN.byte = value; break;
-        case 0x420B: memory.MDMAEN_GENERAL_PURPOSE.byte = value; break;
-        case 0x420C: memory.MDMAEN_HBLANK_DMA.byte = value; break;
-        default:
-            ASSERT_NOT_REACHED("Unsure how to handle write to I/O register %x (val %x)", addr, value);
-    }
+// Swaps SRAM for a shared mapping of `path`, which is made or grown to fit.
+// Whatever's in the file is what the cart starts with
+bool attach_battery(struct Emulator* emu, const char* path) {
+    size_t size = emu->rom_file.sram_size;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return false;
+
+    // A bigger file's fine, only the start of it gets used
+    struct stat info;
+    bool ok = !fstat(fd, &info) && (info.st_size >= (off_t)size || !ftruncate(fd, size));
+    uint8_t* sram = ok ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (sram == MAP_FAILED) return false;
+
+    free(emu->rom_file.sram);
+    emu->rom_file.sram = sram;
+    emu->rom_file.sram_battery = true;
+    emu->rom_file.sram_dirty = false;
+    map_sram(emu);
+    return true;
 }
 
-uint8_t handle_io_read(uint16_t addr) {
-    if (is_acc_16()) {
-        switch (addr) {
-            case 0x2140: return (memory.APUIO1 << 8) | memory.APUIO0;
-            case 0x2141: return (memory.APUIO2 << 8) | memory.APUIO1;
-            default:
-                ASSERT_NOT_REACHED("[ACC16] Unsure how to handle read from I/O register %x)", addr);
+void build_lorom_map(struct Emulator* emu) {
+    // ROM lives in the upper half of every bank, 32 KiB at a time. The mapping's
+    // read-only, so it only ever goes in as a read pointer
+    uint8_t* rom = (uint8_t*)emu->rom_file.data;
+    map_region(emu, 0x00, 0x7F, 0x8000, 0xFFFF, PAGE_ROM, rom, emu->rom_file.size, 0x8000, false);
+    map_region(emu, 0x80, 0xFF, 0x8000, 0xFFFF, PAGE_ROM, rom, emu->rom_file.size, 0x8000, false);
+
+    // ...and the lower halves of 40-6F mirror it
+    for (int bank = 0x40; bank <= 0x6F; bank++) {
+        for (int addr = 0x0000; addr < 0x8000; addr += PAGE_SIZE) {
+            uint8_t* page = emu->memory_map.read[((bank << 16) | (addr + 0x8000)) >> PAGE_SHIFT];
+            map_page(emu, bank, addr, PAGE_ROM, page, NULL);
+            map_page(emu, bank | 0x80, addr, PAGE_ROM, page, NULL);
         }
     }
 
-    switch (addr) {
-        case 0x2140: return memory.APUIO0;
-        case 0x2141: return memory.APUIO1;
-        case 0x2142: return memory.APUIO2;
-        case 0x2143: return memory.APUIO3;
-        default:
-            ASSERT_NOT_REACHED("Unsure how to handle read from I/O register %x)", addr);
-    }
-}
+    if (emu->rom_file.sram_size) map_sram(emu);
 
-uint8_t read_mem(uint32_t loc) {
-    uint8_t bank = loc >> 16;
-    uint16_t addr = loc & 0xFFFF;
+    map_system_area(emu, 0x00, 0x3F);
+    map_system_area(emu, 0x80, 0xBF);
+}
 
-    if (rom_file.header_offset == LO_ROM_OFFSET) {
-        if (bank <= 0x3F || (bank >= 0x80 && bank <= 0xBF)) {
-            if (addr < 0x2000) {
-                return memory.WRAM[addr];
-            } else if (addr < 0x6000) {
-                return handle_io_read(addr);
-            }
+// Whole 64 KiB banks of ROM, starting `offset` bytes in
+void map_rom_banks(struct Emulator* emu, uint8_t bank_start, uint8_t bank_end, size_t offset) {
+    uint8_t* rom = (uint8_t*)emu->rom_file.data;
+    for (int bank = bank_start; bank <= bank_end; bank++) {
+        for (int addr = 0x0000; addr <= 0xFFFF; addr += PAGE_SIZE) {
+            size_t at = mirror_rom_offset(offset + (bank - bank_start) * 0x10000 + addr, emu->rom_file.size);
+            map_page(emu, bank, addr, PAGE_ROM, rom + at, NULL);
         }
+    }
+}
 
-        if (addr >= 0x8000) {
-            // LoROM
-            uint32_t rom_read = addr - 0x8000 + (bank * 0x8000);
-            return *(rom_file.data + rom_read);
+void build_hirom_map(struct Emulator* emu, bool extended) {
+    // ROM fills whole banks at 40-7F and C0-FF. ExHiROM puts its first 4 MiB
+    // at C0-FF and the rest at 40-7F, plain HiROM has them both the same
+    map_rom_banks(emu, 0xC0, 0xFF, 0);
+    map_rom_banks(emu, 0x40, 0x7F, extended ? 0x400000 : 0);
+
+    // The upper halves of the system banks mirror the same halves 40 banks up
+    for (int bank = 0x00; bank <= 0x3F; bank++) {
+        for (int addr = 0x8000; addr <= 0xFFFF; addr += PAGE_SIZE) {
+            map_page(emu, bank, addr, PAGE_ROM, emu->memory_map.read[(((bank | 0x40) << 16) | addr) >> PAGE_SHIFT], NULL);
+            map_page(emu, bank | 0x80, addr, PAGE_ROM, emu->memory_map.read[(((bank | 0xC0) << 16) | addr) >> PAGE_SHIFT], NULL);
         }
-    } else if (rom_file.header_offset == HI_ROM_OFFSET) {
-        // HiROM
-        printf("HIROM\n");
+    }
 
-    } else {
-        ASSERT_NOT_REACHED("Bad header offset");
+    map_system_area(emu, 0x00, 0x3F);
+    map_system_area(emu, 0x80, 0xBF);
+    // Over the top of the system areas' 6000-7FFF
+    if (emu->rom_file.sram_size) map_sram(emu);
+}
+
+// How slow each region is. $4000-$41FF (XSlow) shares a page with fast
+// registers, the I/O slow path tops that up
+uint8_t region_wait(struct Emulator* emu, uint8_t bank, uint16_t addr) {
+    if ((bank & 0x7F) < 0x40 && addr < 0x8000) {
+        if (addr < 0x2000) return MASTER_CYCLES_SLOW - MASTER_CYCLES_FAST;
+        if (addr < 0x6000) return 0;
+        return MASTER_CYCLES_SLOW - MASTER_CYCLES_FAST;
     }
 
-    ASSERT_NOT_REACHED("Unsure how to read %x", loc);
+    // Upper banks are FastROM if MEMSEL asks for it
+    if (bank >= 0x80 && (emu->memory.MEMSEL & 1)) return 0;
+
+    return MASTER_CYCLES_SLOW - MASTER_CYCLES_FAST;
 }
 
-uint16_t read_u16(uint32_t addr) {
-    uint8_t a = read_mem(addr);
-    uint8_t b = read_mem(addr + 1);
+void flush_block_cache(struct Emulator* emu);
 
-    return (b << 8) | a;
+void update_access_timing(struct Emulator* emu) {
+    for (uint32_t page = 0; page < PAGE_COUNT; page++) {
+        uint32_t loc = page << PAGE_SHIFT;
+        emu->memory_map.wait[page] = region_wait(emu, loc >> 16, loc & 0xFFFF);
+    }
+
+    // Cached blocks have the fetch waits baked in
+    flush_block_cache(emu);
 }
 
-void write_u8(uint32_t loc, uint8_t value) {
-    ASSERT(rom_file.header_offset == LO_ROM_OFFSET, "Unsure how to write to HiROM");
-    uint8_t bank = loc >> 16;
-    uint16_t addr = loc & 0xFFFF;
+void build_memory_map(struct Emulator* emu) {
+    memset(&emu->memory_map, 0, sizeof(emu->memory_map));
+    memset(emu->memory_map.wram_page, -1, sizeof(emu->memory_map.wram_page));
 
-    if (bank <= 0x3F || (bank >= 0x80 && bank <= 0xBF)) {
-        if (addr < 0x2000) {
-            memory.WRAM[addr] = value;
-            return;
-        } else if (addr < 0x6000) {
-            handle_io_write(addr, value);
-            return;
-        }
+    if (emu->rom_file.header_offset == LO_ROM_OFFSET) {
+        build_lorom_map(emu);
+    } else if (emu->rom_file.header_offset == HI_ROM_OFFSET) {
+        build_hirom_map(emu, false);
+    } else if (emu->rom_file.header_offset == EX_HI_ROM_OFFSET) {
+        build_hirom_map(emu, true);
+    } else {
+        ASSERT_NOT_REACHED("Bad header offset");
     }
 
-    if (bank == 0x7E) {
-        memory.WRAM[addr] = value;
-        return;
-    } else if (bank == 0x7F) {
-        memory.WRAM[addr + 0x10000] = value;
-        return;
+    // Both WRAM banks, wherever the cart puts things
+    map_wram(emu, 0x7E, 0x7F, 0x0000, 0xFFFF, WRAM_SIZE, 0x10000);
+    for (int i = 0; i < (int)WRAM_PAGES; i++) {
+        refresh_wram_page(emu, i);
     }
 
-    ASSERT_NOT_REACHED("Unimplemented write to %x", loc);
+    update_access_timing(emu);
 }
 
-void write_u16(uint32_t loc, uint16_t value) {
-    write_u8(loc, value >> 8);
-    write_u8(loc + 1, value & 0xFF);
-}
+void locate_header(struct Emulator* emu) {
+    // Mirroring and the checksum both go a page at a time
+    ASSERT(emu->rom_file.size && emu->rom_file.size % PAGE_SIZE == 0, "ROM size %lx isn't a multiple of the page size", emu->rom_file.size);
 
-uint8_t eat_u8() {
-    uint8_t out = read_mem(registers.PC++);
-    printf(" %x", out);
-    return out;
-}
+    // Ties go to the earlier one
+    static const size_t candidates[] = { LO_ROM_OFFSET, HI_ROM_OFFSET, EX_HI_ROM_OFFSET };
+    size_t winning_offset = LO_ROM_OFFSET;
+    int winning_score = get_heuristic_score_for_header_candidate(emu, LO_ROM_OFFSET);
+
+    for (int i = 1; i < 3; i++) {
+        int other_score = get_heuristic_score_for_header_candidate(emu, candidates[i]);
+        if (other_score > winning_score) {
+            verbose("Header at %lx scores %d, beating %d\n", candidates[i], other_score, winning_score);
+            winning_offset = candidates[i];
+            winning_score = other_score;
+        }
+    }
 
-uint16_t eat_u16() {
-    uint8_t a = read_mem(registers.PC++);
-    uint8_t b = read_mem(registers.PC++);
+    verbose("Header at %lx\n", winning_offset);
 
-    uint16_t out = (b << 8) | a;
-    printf(" %x", out);
-    return out;
-}
+    emu->rom_file.header_offset = winning_offset;
 
-uint32_t eat_u24() {
-    uint8_t a = eat_u8();
-    uint8_t b = eat_u8();
-    uint8_t c = eat_u8();
+    char game_name[22];
+    memcpy(game_name, emu->rom_file.data + emu->rom_file.header_offset, 21);
+    game_name[21] = '\0';
+    verbose("Title '%s'\n", game_name);
+    if (emu->rom_file.rom->header_size) verbose("Skipped a %lu byte copier header\n", emu->rom_file.rom->header_size);
+
+    // 2 KiB up to 256 KiB, anything past that is a bad header
+    uint8_t sram_size_byte = *(emu->rom_file.data + emu->rom_file.header_offset + 0x18);
+    if (sram_size_byte && sram_size_byte <= 8) {
+        emu->rom_file.sram_size = 1024 << sram_size_byte;
+        emu->rom_file.sram = calloc(emu->rom_file.sram_size, 1);
+        verbose("SRAM: %lu bytes\n", emu->rom_file.sram_size);
+    }
 
-    return 0x000000 | (c << 16) | (b << 8) | a;
+    build_memory_map(emu);
 }
 
-void eat_cycles(int count) {
-    // ...
-}
 
-void set_register(uint16_t* reg, uint16_t value) {
-    if (is_acc_16()) {
-        *(reg) = value;
-        registers.status.flags.N = !!(value >> 15);
-        registers.status.flags.Z = value == 0;
+// APU ports get their own trace category, they're far too chatty to lump in with the rest
+#define IO_TRACE_CATEGORY(addr) ((((addr) & 0xFFC0) == 0x2140) ? TRACE_APU : TRACE_IO)
+
+// (Re)computes when the next H/V IRQ fires from NMITIMEN, HTIME and VTIME
+void schedule_hv_irq(struct Emulator* emu) {
+    bool h = emu->memory.NMITIMEN.flags.H_IRQ;
+    bool v = emu->memory.NMITIMEN.flags.V_IRQ;
+
+    if ((!h && !v) || (h && emu->memory.HTIME > 339) || (v && emu->memory.VTIME >= LINES_PER_FRAME)) {
+        cancel_event(&emu->scheduler, EVENT_HV_IRQ);
+        return;
+    }
+
+    uint64_t h_offset = h ? emu->memory.HTIME * 4 : 0;
+    uint64_t time;
+
+    if (!v) {
+        // Every line
+        time = emu->timing.line_start + h_offset;
+        if (time <= emu->scheduler.now) time += MASTER_CYCLES_PER_LINE;
     } else {
-        uint8_t val_8 = value & 0xFF;
-        *(reg) = (*reg & 0xFF00) | val_8;
-        registers.status.flags.N = !!(val_8 & 0b10000000);
-        registers.status.flags.Z = val_8 == 0;
+        uint32_t lines_ahead = (emu->memory.VTIME + LINES_PER_FRAME - emu->timing.V) % LINES_PER_FRAME;
+        time = emu->timing.line_start + lines_ahead * MASTER_CYCLES_PER_LINE + h_offset;
+        if (time <= emu->scheduler.now) time += LINES_PER_FRAME * MASTER_CYCLES_PER_LINE;
     }
+
+    schedule_event(&emu->scheduler, EVENT_HV_IRQ, time);
 }
 
-uint32_t addr_from_absolute(uint16_t addr) {
-    return (registers.DBR << 16) | addr;
+// Interrupts are only ever taken between instructions, so anything that
+// raises or unmasks one mid-instruction just asks the run loop to look
+void request_interrupt_check(struct Emulator* emu) {
+    schedule_event(&emu->scheduler, EVENT_INTERRUPT_CHECK, emu->scheduler.now);
 }
 
-void set_low_byte(uint16_t* loc, uint8_t value) {
-    (*loc) = (*loc & 0xFF00) | (value & 0xFF);
+void write_dma_register(struct Emulator* emu, uint16_t addr, uint8_t value) {
+    struct DmaChannel* channel = &emu->memory.dma[(addr >> 4) & 7];
+
+    switch (addr & 0xF) {
+        case 0x0: channel->DMAP = value; break;
+        case 0x1: channel->BBAD = value; break;
+        case 0x2: channel->A1T = (channel->A1T & 0xFF00) | value; break;
+        case 0x3: channel->A1T = (channel->A1T & 0x00FF) | (value << 8); break;
+        case 0x4: channel->A1B = value; break;
+        case 0x5: channel->DAS = (channel->DAS & 0xFF00) | value; break;
+        case 0x6: channel->DAS = (channel->DAS & 0x00FF) | (value << 8); break;
+        case 0x7: channel->DASB = value; break;
+        case 0x8: channel->A2A = (channel->A2A & 0xFF00) | value; break;
+        case 0x9: channel->A2A = (channel->A2A & 0x00FF) | (value << 8); break;
+        case 0xA: channel->NLTR = value; break;
+        case 0xB: case 0xF: channel->UNUSED = value; break;
+    }
 }
 
-void set_high_byte(uint16_t* loc, uint8_t value) {
-    (*loc) = (value << 16) | (*loc & 0xFF);
+uint8_t read_dma_register(struct Emulator* emu, uint16_t addr) {
+    struct DmaChannel* channel = &emu->memory.dma[(addr >> 4) & 7];
+
+    switch (addr & 0xF) {
+        case 0x0: return channel->DMAP;
+        case 0x1: return channel->BBAD;
+        case 0x2: return channel->A1T & 0xFF;
+        case 0x3: return channel->A1T >> 8;
+        case 0x4: return channel->A1B;
+        case 0x5: return channel->DAS & 0xFF;
+        case 0x6: return channel->DAS >> 8;
+        case 0x7: return channel->DASB;
+        case 0x8: return channel->A2A & 0xFF;
+        case 0x9: return channel->A2A >> 8;
+        case 0xA: return channel->NLTR;
+        case 0xB: case 0xF: return channel->UNUSED;
+    }
+    // $43xC-$43xE are open bus
+    return 0;
 }
 
-bool auto_negative(uint16_t value) {
-    int bits = is_acc_16() ? 15 : 7;
-    return !!(value & (0b1 << bits));
+void touch_wram_page(struct Emulator* emu, int wram_page);
+
+// WMDATA. Goes straight to WRAM, without the wait a CPU access to it would have
+uint8_t read_wram_port(struct Emulator* emu) {
+    uint32_t loc = 0x7E0000 + emu->memory.WMADD;
+    emu->memory.WMADD = (emu->memory.WMADD + 1) & (WRAM_SIZE - 1);
+    return emu->memory_map.read[loc >> PAGE_SHIFT][loc & PAGE_MASK];
 }
 
-bool auto_zero(uint16_t value) {
-    if (!is_acc_16()) value = value & 0x00FF;
-    return value == 0;
+void write_wram_port(struct Emulator* emu, uint8_t value) {
+    uint32_t loc = 0x7E0000 + emu->memory.WMADD;
+    uint32_t page = loc >> PAGE_SHIFT;
+    emu->memory.WMADD = (emu->memory.WMADD + 1) & (WRAM_SIZE - 1);
+
+    if (!emu->memory_map.write[page]) touch_wram_page(emu, emu->memory_map.wram_page[page]);
+    emu->memory_map.write[page][loc & PAGE_MASK] = value;
 }
 
-void push_u8_to_stack(uint8_t value) {
-    write_u8(registers.S--, value);
+void run_general_dma(struct Emulator* emu, uint8_t channels);
+
+// Runs the APU up to the S-CPU's present, so the ports are as it should see them
+void catch_up_apu(struct Emulator* emu) {
+    apu_run(&emu->apu, emu->scheduler.now * APU_CYCLES_NUMERATOR / APU_CYCLES_DENOMINATOR);
 }
 
-void push_u16_to_stack(uint16_t value) {
-    write_u8(registers.S--, value >> 8);
-    write_u8(registers.S--, value & 0xFF);
+// What a read gets when nothing answers it, which is whatever was last on the
+// data bus. Without keeping track of every read, that's taken to be the high
+// byte of the address, the last operand byte fetched for an absolute access
+static inline uint8_t open_bus(uint32_t loc) {
+    return loc >> 8;
 }
 
-void increment(uint16_t* reg, int32_t sign) {
-    eat_cycles(2);
-    if (is_index_16()) {
-        (*reg) = *reg+ sign;
-        registers.status.flags.Z = !(*reg);
-        registers.status.flags.N = !!(*reg>> 15);
-    } else {
-        uint8_t val = (*reg& 0xFF) + sign;
-        set_low_byte(reg, val);
-        registers.status.flags.Z = !val;
-        registers.status.flags.N = !!(val >> 7);
+void handle_io_write(struct Emulator* emu, uint16_t addr, uint8_t value) {
+    if (addr >= 0x2100 && addr <= 0x213F) {
+        ppu_write(&emu->ppu, addr, value);
+        if (emu->ppu_thread) ppu_thread_push(emu->ppu_thread, PPU_COMMAND_WRITE, emu->scheduler.now, addr, value);
+        return;
+    }
+    if ((addr & 0xFFC0) == 0x2140) {
+        // $2144-$217F mirror the four ports
+        catch_up_apu(emu);
+        apu_write_port(&emu->apu, addr & 3, value);
+        return;
+    }
+    if ((addr & 0xFF80) == 0x4300) {
+        write_dma_register(emu, addr, value);
+        return;
     }
-}
 
-void execute_opcode(uint8_t opcode) {
-    switch (opcode) {
-       case 0x08: {
-            eat_cycles(3);
-            push_u8_to_stack(registers.status.byte);
-            break;
-       } case 0x48: {
-            eat_cycles(3);
-            if (is_acc_16()) {
-                eat_cycles(1);
-                push_u16_to_stack(registers.A);
-            } else {
-                push_u8_to_stack(registers.A);
+    switch (addr) {
+        case 0x2180: write_wram_port(emu, value); break;
+        case 0x2181: emu->memory.WMADD = (emu->memory.WMADD & 0x1FF00) | value; break;
+        case 0x2182: emu->memory.WMADD = (emu->memory.WMADD & 0x100FF) | (value << 8); break;
+        case 0x2183: emu->memory.WMADD = (emu->memory.WMADD & 0x0FFFF) | ((value & 1) << 16); break;
+        case 0x4200: {
+            bool nmi_was_enabled = emu->memory.NMITIMEN.flags.VBLANK_NMI_ENABLE;
+            emu->memory.NMITIMEN.byte = value;
+
+            if (!emu->memory.NMITIMEN.flags.H_IRQ && !emu->memory.NMITIMEN.flags.V_IRQ) emu->memory.irq_flag = false;
+
+            // Enabling NMIs partway through vblank fires one right away
+            if (!nmi_was_enabled && emu->memory.NMITIMEN.flags.VBLANK_NMI_ENABLE && emu->memory.nmi_flag) {
+                emu->timing.nmi_pending = true;
+                request_interrupt_check(emu);
             }
+
+            schedule_hv_irq(emu);
             break;
-       } case 0x8B: {
-            eat_cycles(3);
-            push_u8_to_stack(registers.DBR);
+        }
+        // Joypad latch and programmable I/O, neither goes anywhere yet
+        case 0x4016: break;
+        case 0x4201: break;
+        case 0x4202: emu->memory.WRMPYA = value; break;
+        case 0x4203:
+            emu->memory.RDMPY = emu->memory.WRMPYA * value;
+            // Multiplying leaves the multiplicand B in the quotient
+            emu->memory.RDDIV = value;
             break;
-       } case 0x0B: {
-            eat_cycles(4);
-            push_u8_to_stack(registers.D);
+        case 0x4204: emu->memory.WRDIV = (emu->memory.WRDIV & 0xFF00) | value; break;
+        case 0x4205: emu->memory.WRDIV = (emu->memory.WRDIV & 0x00FF) | (value << 8); break;
+        case 0x4206:
+            // Dividing by zero gives $FFFF with the dividend left as the remainder
+            emu->memory.RDDIV = value ? emu->memory.WRDIV / value : 0xFFFF;
+            emu->memory.RDMPY = value ? emu->memory.WRDIV % value : emu->memory.WRDIV;
             break;
-       } case 0x4B: {
-            eat_cycles(3);
-            // PBR
-            push_u8_to_stack(read_mem(0x3034));
+        case 0x4207: emu->memory.HTIME = (emu->memory.HTIME & 0x100) | value; schedule_hv_irq(emu); break;
+        case 0x4208: emu->memory.HTIME = (emu->memory.HTIME & 0xFF) | ((value & 1) << 8); schedule_hv_irq(emu); break;
+        case 0x4209: emu->memory.VTIME = (emu->memory.VTIME & 0x100) | value; schedule_hv_irq(emu); break;
+        case 0x420A: emu->memory.VTIME = (emu->memory.VTIME & 0xFF) | ((value & 1) << 8); schedule_hv_irq(emu); break;
+        case 0x420B:
+            emu->memory.MDMAEN_GENERAL_PURPOSE.byte = value;
+            if (value) run_general_dma(emu, value);
             break;
-       } case 0xDA: {
-            eat_cycles(3);
-            if (is_index_16()) {
-                eat_cycles(1);
-                push_u16_to_stack(registers.X);
-            } else {
-                push_u8_to_stack(registers.X);
+        case 0x420C:
+            emu->memory.MDMAEN_HBLANK_DMA.byte = value;
+            // Still time to get this line's in
+            if (value && emu->timing.V < VBLANK_START_LINE && emu->scheduler.now < emu->timing.line_start + HBLANK_START_MASTER) {
+                schedule_event(&emu->scheduler, EVENT_HBLANK, emu->timing.line_start + HBLANK_START_MASTER);
             }
             break;
-       } case 0x5A: {
-            eat_cycles(3);
-            if (is_index_16()) {
-                eat_cycles(1);
-                push_u16_to_stack(registers.Y);
-            } else {
-                push_u8_to_stack(registers.Y);
-            }
+        case 0x420D:
+            emu->memory.MEMSEL = value & 1;
+            update_access_timing(emu);
+            break;
+        default:
+            // Read only, or nothing there ($2184-$21FF and the gaps in $4xxx)
             break;
-       } case 0x10: {
-            bool take_branch = !registers.status.flags.N;
-            eat_cycles(2);
+    }
+}
 
-            int8_t relative = (int8_t)eat_u8();
+uint8_t handle_io_read(struct Emulator* emu, uint16_t addr) {
+    if (addr >= 0x2100 && addr <= 0x213F) {
+        // Reading SLHV latches where the beam is
+        if (addr == 0x2137) ppu_latch_counters(&emu->ppu, (emu->scheduler.now - emu->timing.line_start) / 4, emu->timing.V);
+        // OAM, VRAM and CGRAM reads move the address along, which the render side needs to follow
+        if (emu->ppu_thread && addr >= 0x2138 && addr <= 0x213B) {
+            ppu_thread_push(emu->ppu_thread, PPU_COMMAND_READ, emu->scheduler.now, addr, 0);
+        }
+        return ppu_read(&emu->ppu, addr);
+    }
+    if ((addr & 0xFFC0) == 0x2140) {
+        catch_up_apu(emu);
+        return apu_read_port(&emu->apu, addr & 3);
+    }
+    if ((addr & 0xFF80) == 0x4300) return read_dma_register(emu, addr);
+    // Joypads, serial ($4016/$4017) and auto-read ($4218-$421F). No controllers
+    // yet, so nothing's ever held down
+    if (addr == 0x4016 || addr == 0x4017 || (addr >= 0x4218 && addr <= 0x421F)) return 0;
 
-            if (registers.E_flag) eat_cycles(1);
-            if (take_branch) {
-                eat_cycles(1);
-                registers.PC += relative;
-            }
-            break;
-       } case 0xD0: {
-            bool take_branch = !registers.status.flags.Z;
-            eat_cycles(2);
+    switch (addr) {
+        case 0x2180: return read_wram_port(emu);
+        case 0x4210: {
+            // Low bits are the CPU version
+            uint8_t out = (emu->memory.nmi_flag << 7) | 0x02;
+            emu->memory.nmi_flag = false;
+            return out;
+        }
+        case 0x4211: {
+            uint8_t out = emu->memory.irq_flag << 7;
+            emu->memory.irq_flag = false;
+            return out;
+        }
+        case 0x4212: {
+            bool vblank = emu->timing.V >= VBLANK_START_LINE;
+            bool hblank = emu->scheduler.now - emu->timing.line_start >= HBLANK_START_MASTER;
+            return (vblank << 7) | (hblank << 6);
+        }
+        case 0x4214: return emu->memory.RDDIV & 0xFF;
+        case 0x4215: return emu->memory.RDDIV >> 8;
+        case 0x4216: return emu->memory.RDMPY & 0xFF;
+        case 0x4217: return emu->memory.RDMPY >> 8;
+        default:
+            // Write only, or nothing there
+            return open_bus(addr);
+    }
+}
 
-            int8_t relative = (int8_t)eat_u8();
+uint8_t read_mem_slow(struct Emulator* emu, uint32_t loc) {
+    uint32_t page = loc >> PAGE_SHIFT;
 
-            if (registers.E_flag) eat_cycles(1);
-            if (take_branch) {
-                eat_cycles(1);
-                registers.PC += relative;
-            }
-            break;
-       } case 0x80: {
-            // TODO: Make brnaching generic
-            eat_cycles(registers.E_flag ? 4 : 3);
-            int8_t relative = (int8_t)eat_u8();
-            registers.PC += relative;
-            break;
-       } case 0x20: {
-            eat_cycles(6);
-            uint32_t loc = addr_from_absolute(eat_u16());
-            uint16_t return_addr = registers.PC - 1;
+    switch (emu->memory_map.handler[page]) {
+        case PAGE_IO: {
+            if ((loc & 0xFE00) == 0x4000) emu->scheduler.now += MASTER_CYCLES_XSLOW - MASTER_CYCLES_FAST;
+            uint8_t value = handle_io_read(emu, loc & 0xFFFF);
+            TRACE(IO_TRACE_CATEGORY(loc & 0xFFFF), TRACE_READ, loc, value);
+            return value;
+        }
+        case PAGE_SRAM:
+            return emu->rom_file.sram[(emu->memory_map.offset[page] + (loc & PAGE_MASK)) & (emu->rom_file.sram_size - 1)];
+    }
 
-            push_u16_to_stack(return_addr);
+    // Nothing mapped there
+    return open_bus(loc);
+}
 
-            registers.PC = loc;
-            break;
-       } case 0x18: {
-            eat_cycles(2);
-            registers.status.flags.C = 0;
-            break;
-       } case 0x58: {
-            eat_cycles(2);
-            registers.status.flags.I = 0;
-            break;
-       } case 0xB8: {
-            eat_cycles(2);
-            registers.status.flags.V = 0;
-            break;
-       } case 0xD8: {
-            eat_cycles(2);
-            registers.status.flags.D = 0;
-            break;
-       } case 0x38: { // SEC
-            eat_cycles(2);
-            registers.status.flags.C = 1;
-            break;
-       } case 0x78: { // SEI
-            eat_cycles(2);
-            registers.status.flags.I = 1;
-            break;
-       } case 0xF8: { // SED
-            eat_cycles(2);
-            registers.status.flags.D = 1;
-            break;
-       } case 0xCD: {
-            eat_cycles(is_acc_16() ? 5 : 4);
-            uint32_t addr = addr_from_absolute(eat_u16());
-            uint16_t value = is_acc_16() ? read_u16(addr) : read_mem(addr);
-            uint16_t a = registers.A & (is_acc_16() ? 0xFFFF : 0xFF);
-            uint16_t out = a - value;
-            printf("CD with %x in A, have val%x \n", registers.A, value);
-
-            registers.status.flags.N = auto_negative(out);
-            registers.status.flags.Z = a == value;
-            registers.status.flags.C = a >= value;
+uint8_t read_mem(struct Emulator* emu, uint32_t loc) {
+    loc &= 0xFFFFFF;
+    emu->scheduler.now += emu->memory_map.wait[loc >> PAGE_SHIFT];
 
-            break;
-       } case 0xE2: {
-            eat_cycles(3);
-            registers.status.byte |= eat_u8();
-            if (registers.status.flags.X) {
-                set_high_byte(&registers.X, 0x00);
-                set_high_byte(&registers.Y, 0x00);
-            }
-            break;
-       } case 0xE9: { // SBC #const
-            eat_cycles(is_acc_16() ? 3 : 2);
-            uint16_t val = is_acc_16() ? eat_u16() : (0 | eat_u8());
+    uint8_t* page = emu->memory_map.read[loc >> PAGE_SHIFT];
+    if (page) return page[loc & PAGE_MASK];
+    return read_mem_slow(emu, loc);
+}
 
-            if (registers.status.flags.D && !is_acc_16()) {
-                // ...
-                ASSERT_NOT_REACHED("Decimal subtraction not implemented");
-            } else {
-                uint16_t max_mask = is_acc_16() ? 0xFFFF : 0xFF;
-                uint16_t old_a = registers.A;
+// Reads without side effects, for debugging aids. Anything behind a handler reads as 0
+uint8_t peek_mem(struct Emulator* emu, uint32_t loc) {
+    loc &= 0xFFFFFF;
+    uint8_t* page = emu->memory_map.read[loc >> PAGE_SHIFT];
+    return page ? page[loc & PAGE_MASK] : 0;
+}
 
-                uint32_t unclamped = registers.A + (~val) + registers.status.flags.C;
-                registers.A = unclamped & max_mask;
-                
-                registers.status.flags.C = unclamped > (uint32_t)max_mask;
+uint16_t read_u16(struct Emulator* emu, uint32_t addr) {
+    uint8_t a = read_mem(emu, addr);
+    uint8_t b = read_mem(emu, addr + 1);
 
-                // Totally stole this. Basically determines if for C = A - B, where sign(A) != sign(B), sign(C) == sign(B)
-                registers.status.flags.V = !!(((old_a ^ val) & (old_a ^ registers.A)) & (is_acc_16() ? 0x8000 : 0x80));
-            }
+    return (b << 8) | a;
+}
 
-            registers.status.flags.N = auto_negative(registers.A);
-            registers.status.flags.Z = auto_zero(registers.A);
+void write_u8_slow(struct Emulator* emu, uint32_t loc, uint8_t value) {
+    uint32_t page = loc >> PAGE_SHIFT;
 
-            break;
-       } case 0xAA: {
-            eat_cycles(2);
-            if (registers.status.flags.X) {
-                set_low_byte(&registers.X, registers.A);
-                registers.status.flags.N = !!(registers.A & (0b1 << 7));
-                registers.status.flags.Z = !(registers.A & 0xFF);
-            } else {
-                registers.X = registers.A;
-                registers.status.flags.N = !!(registers.A & (0b1 << 15));
-                registers.status.flags.Z = registers.A == 0;
-            }
-            break;
-       } case 0xA8: {
-            eat_cycles(2);
-            if (registers.status.flags.X) {
-                set_low_byte(&registers.Y, registers.A);
-                registers.status.flags.N = !!(registers.A & (0b1 << 7));
-                registers.status.flags.Z = !(registers.A & 0xFF);
-            } else {
-                registers.Y = registers.A;
-                registers.status.flags.N = !!(registers.A & (0b1 << 15));
-                registers.status.flags.Z = registers.A == 0;
-            }
-            break;
-       } case 0x5B: {
-            eat_cycles(2);
-            registers.D = registers.A;
-            registers.status.flags.N = registers.A >> 15;
-            registers.status.flags.Z = registers.A == 0;
-            break;
-       } case 0x1B: {
-            eat_cycles(2);
-            registers.S = registers.A;
-            registers.status.flags.N = registers.A >> 15;
-            registers.status.flags.Z = registers.A == 0;
-            break;
-       } case 0xCA: {
-           increment(&registers.X, -1);
-            break;
-       } case 0x88: {
-           increment(&registers.Y, -1);
-            break;
-       } case 0xE8: {
-           increment(&registers.X, 1);
-            break;
-       } case 0xC8: {
-           increment(&registers.Y, 1);
-            break;
-       } case 0x8D: {
-            eat_cycles(is_acc_16() ? 5 : 4);
-            uint32_t loc = addr_from_absolute(eat_u16());
-            write_u16(loc, registers.A & (is_acc_16() ? 0xFFFF : 0xFF));
-            break;
-       } case 0x8F: {
-            eat_cycles(is_acc_16() ? 6 : 5);
-            uint32_t loc = eat_u24();
-            write_u16(loc, registers.A & (is_acc_16() ? 0xFFFF : 0xFF));
-            break;
-       } case 0x98: {
-            eat_cycles(2);
-            if (is_acc_16()) {
-                registers.A = registers.Y;
-            } else {
-                registers.A = (registers.A & 0xFF00) | (registers.Y & 0xFF);
-            }
-            registers.status.flags.N = auto_negative(registers.A);
-            registers.status.flags.Z = auto_zero(registers.A);
-            break;
-       } case 0x9C: { // STZ addr
-            eat_cycles(is_acc_16() ? 5 : 4);
-            uint32_t loc = addr_from_absolute(eat_u16());
-            if (is_acc_16()) {
-                write_u16(loc, 0x0000);
-            } else {
-                write_u8(loc, 0x00);
-            }
-            break;
-       } case 0x9F: {
-            eat_cycles(is_acc_16() ? 6 : 5);
-            uint32_t loc = eat_u24() + registers.X;
-            if (is_acc_16()) {
-                write_u16(loc, registers.X);
-            } else {
-                write_u8(loc, registers.X & 0xFF);
-            }
-            break;
-       } case 0xA0: {
-            eat_cycles(is_acc_16() ? 3 : 2);
-            uint16_t value = is_acc_16() ? eat_u16() : eat_u8();
-            set_register(&registers.Y, value);
-            break;
-       } case 0xA2: {
-            eat_cycles(is_acc_16() ? 3 : 2);
-            uint16_t value = is_acc_16() ? eat_u16() : eat_u8();
-            set_register(&registers.X, value);
-            break;
-       } case 0xA9: {
-            eat_cycles(is_acc_16() ? 3 : 2);
-            uint16_t value = is_acc_16() ? eat_u16() : eat_u8();
-            set_register(&registers.A, value);
-            break;
-       } case 0xB7: {
-            eat_cycles(is_acc_16() ? 7 : 6);
-            uint32_t loc = addr_from_absolute(eat_u8());
-            uint16_t y = is_acc_16() ? registers.Y : (registers.Y & 0xFF);
-            loc += y;
-
-            uint16_t value = is_acc_16() ? read_u16(loc) : read_mem(loc);
-            set_register(&registers.A, value);
-            break;
-       } case 0xC2: {
-            eat_cycles(3);
-            registers.status.byte = registers.status.byte & (~eat_u8());
-            if (registers.E_flag) {
-                registers.status.flags.X = 1;
-                registers.status.flags.M = 1;
-            }
-            break;
-       } case 0xFB: {
-            eat_cycles(2);
-            uint8_t old_e = registers.E_flag;
-            registers.E_flag = registers.status.flags.C;
-            registers.status.flags.C = old_e;
-
-            if (registers.E_flag) {
-                registers.status.flags.M = 1;
-                registers.status.flags.X = 1;
-                registers.S = 0x0100 | (registers.S & 0xFF);
-                registers.X = 0x0000 | (registers.X & 0xFF);
-                registers.Y = 0x0000 | (registers.Y & 0xFF);
-            }
-            break;
-        break;
-       } default:
-            ASSERT_NOT_REACHED("Undefined opcode: 0x%x", opcode);
-            break;
+    switch (emu->memory_map.handler[page]) {
+        case PAGE_DIRECT:
+            // A write protected WRAM page. Shared, clean, or with cached code on it
+            touch_wram_page(emu, emu->memory_map.wram_page[page]);
+            emu->memory_map.read[page][loc & PAGE_MASK] = value;
+            return;
+        case PAGE_ROM:
+            // Nothing listens for writes on the ROM chip
+            return;
+        case PAGE_IO:
+            if ((loc & 0xFE00) == 0x4000) emu->scheduler.now += MASTER_CYCLES_XSLOW - MASTER_CYCLES_FAST;
+            TRACE(IO_TRACE_CATEGORY(loc & 0xFFFF), TRACE_WRITE, loc, value);
+            handle_io_write(emu, loc & 0xFFFF, value);
+            return;
+        case PAGE_SRAM:
+            emu->rom_file.sram[(emu->memory_map.offset[page] + (loc & PAGE_MASK)) & (emu->rom_file.sram_size - 1)] = value;
+            mark_sram_dirty(emu);
+            return;
+        case PAGE_UNMAPPED:
+            // Nothing to hear it
+            return;
+    }
+}
+
+void write_u8(struct Emulator* emu, uint32_t loc, uint8_t value) {
+    loc &= 0xFFFFFF;
+    emu->scheduler.now += emu->memory_map.wait[loc >> PAGE_SHIFT];
+
+    uint8_t* page = emu->memory_map.write[loc >> PAGE_SHIFT];
+    if (page) {
+        page[loc & PAGE_MASK] = value;
+        return;
+    }
+    write_u8_slow(emu, loc, value);
+}
+
+void write_u16(struct Emulator* emu, uint32_t loc, uint16_t value) {
+    write_u8(emu, loc, value & 0xFF);
+    write_u8(emu, loc + 1, value >> 8);
+}
+
+// DMA. General purpose transfers stop the CPU and run start to finish when
+// $420B is written, HDMA does a little on every visible line at hblank. Both
+// go between the A-bus (the CPU's address space) and a B-bus port ($21xx).
+//
+// Every byte costs the same 8 master cycles wherever it goes, so a general
+// purpose transfer knows up front how many bytes fit before the next event,
+// and does that many at once. The ones that go to VRAM or WRAM out of plain
+// memory are just copies, the rest go byte by byte through the I/O handlers.
+#define DMA_BYTE_CYCLES 8
+#define DMA_CHANNEL_CYCLES 8
+// Roughly, it depends where it starts relative to the CPU clock
+#define DMA_START_CYCLES 16
+#define HDMA_START_CYCLES 18
+#define HDMA_INDIRECT_CYCLES 16
+
+void run_due_events(struct Emulator* emu);
+
+// B-bus port offsets from BBAD for each byte of a unit, per DMAP pattern
+static const uint8_t dma_ports[8][4] = {
+    { 0, 0, 0, 0 },
+    { 0, 1, 0, 1 },
+    { 0, 0, 0, 0 },
+    { 0, 0, 1, 1 },
+    { 0, 1, 2, 3 },
+    { 0, 1, 0, 1 },
+    { 0, 0, 0, 0 },
+    { 0, 0, 1, 1 },
+};
+
+// Bytes HDMA moves a line
+static const uint8_t dma_unit_sizes[8] = { 1, 2, 2, 4, 4, 4, 2, 4 };
+
+// The A side can't see any of the I/O registers, they read as nothing and
+// writes to them go nowhere
+static uint8_t read_a_bus(struct Emulator* emu, uint32_t loc) {
+    uint8_t* page = emu->memory_map.read[loc >> PAGE_SHIFT];
+    if (page) return page[loc & PAGE_MASK];
+    if (emu->memory_map.handler[loc >> PAGE_SHIFT] == PAGE_IO) return 0;
+    return read_mem_slow(emu, loc);
+}
+
+static void write_a_bus(struct Emulator* emu, uint32_t loc, uint8_t value) {
+    uint8_t* page = emu->memory_map.write[loc >> PAGE_SHIFT];
+    if (page) {
+        page[loc & PAGE_MASK] = value;
+        return;
+    }
+    if (emu->memory_map.handler[loc >> PAGE_SHIFT] == PAGE_IO) return;
+    write_u8_slow(emu, loc, value);
+}
+
+// A channel's transfer direction, between a resolved A-bus address and B-bus port
+static inline void dma_move(struct Emulator* emu, const struct DmaChannel* channel, uint32_t loc, uint8_t port) {
+    if (channel->DMAP & DMAP_TO_A) {
+        write_a_bus(emu, loc, handle_io_read(emu, 0x2100 | port));
+    } else {
+        handle_io_write(emu, 0x2100 | port, read_a_bus(emu, loc));
     }
 }
 
-void run() {
-    uint16_t reset_vector = read_u16_raw((uint8_t*)(rom_file.data + rom_file.header_offset + 0x3C));
-    registers.PC = 0x000000 | (uint32_t)reset_vector;
-    printf("PC: %x\n", registers.PC);
-    size_t op_count = 0;
+// Byte `index` of a general purpose transfer
+static void dma_transfer_byte(struct Emulator* emu, struct DmaChannel* channel, uint32_t index) {
+    uint8_t port = channel->BBAD + dma_ports[channel->DMAP & DMAP_PATTERN][index & 3];
+    dma_move(emu, channel, (channel->A1B << 16) | channel->A1T, port);
+
+    if (!(channel->DMAP & DMAP_FIXED)) channel->A1T += (channel->DMAP & DMAP_DECREMENT) ? -1 : 1;
+    channel->DAS--;
+    emu->scheduler.now += DMA_BYTE_CYCLES;
+}
 
-    while (true) {
-        op_count++;
-        printf("[x::%x] ::", registers.PC);
-        
-        // TOTAL HACK FOR SMW
-        if (op_count == 10) {
-            memory.APUIO0 = 0xAA;
-            memory.APUIO1 = 0xBB;
+// WMDATA, a run at a time
+static void write_wram_port_block(struct Emulator* emu, const uint8_t* data, uint32_t size, bool fixed) {
+    while (size) {
+        uint32_t loc = 0x7E0000 + emu->memory.WMADD;
+        uint32_t page = loc >> PAGE_SHIFT;
+        uint32_t run = PAGE_SIZE - (loc & PAGE_MASK);
+        if (run > size) run = size;
+
+        if (!emu->memory_map.write[page]) touch_wram_page(emu, emu->memory_map.wram_page[page]);
+        if (fixed) {
+            memset(emu->memory_map.write[page] + (loc & PAGE_MASK), data[0], run);
+        } else {
+            memcpy(emu->memory_map.write[page] + (loc & PAGE_MASK), data, run);
+            data += run;
         }
 
-        uint8_t opcode = eat_u8();
-        execute_opcode(opcode);
-        printf("\n");
+        emu->memory.WMADD = (emu->memory.WMADD + run) & (WRAM_SIZE - 1);
+        size -= run;
+    }
+}
+
+// The general purpose transfers worth doing as copies: out of plain memory,
+// into WRAM through $2180 (from anywhere but WRAM) or into VRAM a word at a
+// time. Does as much of `size` bytes from `index` on as it can in one go, which
+// is 0 if it's not one of those
+static uint32_t dma_transfer_fast(struct Emulator* emu, struct DmaChannel* channel, uint32_t index, uint32_t size) {
+    if (channel->DMAP & (DMAP_TO_A | DMAP_DECREMENT)) return 0;
+
+    uint8_t pattern = channel->DMAP & DMAP_PATTERN;
+    bool to_wram = channel->BBAD == 0x80 && (pattern == 0 || pattern == 2 || pattern == 6);
+    bool to_vram = channel->BBAD == 0x18 && (pattern == 1 || pattern == 5) && (emu->ppu.vmain & 0x8F) == 0x80;
+    if (!to_wram && !to_vram) return 0;
+    // Low then high, a whole word at a time
+    if (to_vram && (index & 1)) return 0;
+
+    uint32_t loc = (channel->A1B << 16) | channel->A1T;
+    // WRAM can't be read and written in the same DMA on the real thing, so
+    // that's one for the byte path rather than a copy
+    if (to_wram && emu->memory_map.wram_page[loc >> PAGE_SHIFT] >= 0) return 0;
+    const uint8_t* source = emu->memory_map.read[loc >> PAGE_SHIFT];
+    if (!source) return 0;
+    source += loc & PAGE_MASK;
+
+    bool fixed = channel->DMAP & DMAP_FIXED;
+    // The next page over could be anywhere in host memory
+    if (!fixed && size > PAGE_SIZE - (loc & PAGE_MASK)) size = PAGE_SIZE - (loc & PAGE_MASK);
+
+    if (to_wram) {
+        write_wram_port_block(emu, source, size, fixed);
+    } else {
+        size &= ~1u;
+        if (!size) return 0;
+        ppu_write_vram_block(&emu->ppu, source, size, fixed);
+        if (emu->ppu_thread) ppu_thread_write_vram_block(emu->ppu_thread, source, size, fixed);
+    }
+
+    if (!fixed) channel->A1T += size;
+    channel->DAS -= size;
+    emu->scheduler.now += size * DMA_BYTE_CYCLES;
+    emu->run_stats.dma_fast_bytes += size;
+    return size;
+}
+
+// MDMAEN. Channels go lowest first, each until its DAS runs out. Events that
+// come due partway through still go off on time (HDMA included), but any
+// interrupt they raise waits for the end
+void run_general_dma(struct Emulator* emu, uint8_t channels) {
+    emu->timing.in_dma = true;
+    emu->scheduler.now += DMA_START_CYCLES;
+
+    for (int i = 0; i < DMA_CHANNELS; i++) {
+        if (!(channels & (1 << i))) continue;
+        struct DmaChannel* channel = &emu->memory.dma[i];
+        emu->scheduler.now += DMA_CHANNEL_CYCLES;
+
+        uint32_t count = channel->DAS ? channel->DAS : 0x10000;
+        emu->run_stats.dma_bytes += count;
+
+        uint32_t index = 0;
+        while (index < count) {
+            if (emu->scheduler.now >= emu->scheduler.deadline) run_due_events(emu);
+
+            // As far as the next event, which can be further off than 32 bits of bytes
+            uint64_t span = (emu->scheduler.deadline - emu->scheduler.now + DMA_BYTE_CYCLES - 1) / DMA_BYTE_CYCLES;
+            uint32_t size = span > count - index ? count - index : span;
+
+            uint32_t done = dma_transfer_fast(emu, channel, index, size);
+            if (!done) {
+                // One at a time, so a copy that's just out of line (VRAM from a
+                // high byte) can go back to being one straight after
+                dma_transfer_byte(emu, channel, index);
+                done = 1;
+            }
+            index += done;
+        }
     }
+
+    emu->memory.MDMAEN_GENERAL_PURPOSE.byte = 0;
+    emu->timing.in_dma = false;
+    request_interrupt_check(emu);
 }
 
-void setup_cpu() {
-    registers.DBR = 0x00;
-    registers.status.flags.M = 1;
-    registers.status.flags.X = 1;
-    registers.status.flags.D = 0;
-    registers.status.flags.I = 1;
-    registers.E_flag = 1;
+// Next entry of a channel's HDMA table: the line count, then where the data is if it's indirect
+static void next_hdma_entry(struct Emulator* emu, struct DmaChannel* channel) {
+    uint32_t table = channel->A1B << 16;
+    channel->NLTR = read_a_bus(emu, table | channel->A2A++);
+
+    if (channel->DMAP & DMAP_INDIRECT) {
+        uint8_t low = read_a_bus(emu, table | channel->A2A++);
+        uint8_t high = read_a_bus(emu, table | channel->A2A++);
+        channel->DAS = (high << 8) | low;
+        emu->scheduler.now += HDMA_INDIRECT_CYCLES;
+    }
+
+    channel->hdma_terminated = !channel->NLTR;
+    channel->hdma_do_transfer = true;
+    emu->scheduler.now += DMA_BYTE_CYCLES;
 }
 
-int main() {
-    printf("Hello world\n");
-    setup_cpu();
-    load_rom("mairo.smc");
-    locate_header();
-    run();
+// Top of the frame, every enabled channel goes back to the start of its table
+void start_hdma_frame(struct Emulator* emu) {
+    uint8_t channels = emu->memory.MDMAEN_HBLANK_DMA.byte;
+    if (!channels) return;
+    emu->scheduler.now += HDMA_START_CYCLES;
+
+    for (int i = 0; i < DMA_CHANNELS; i++) {
+        if (!(channels & (1 << i))) continue;
+        struct DmaChannel* channel = &emu->memory.dma[i];
+        channel->A2A = channel->A1T;
+        next_hdma_entry(emu, channel);
+        emu->scheduler.now += DMA_CHANNEL_CYCLES;
+    }
+}
 
-    SetTraceLogLevel(LOG_WARNING);
-    InitWindow(300, 300, "Claire's SNES Emulator");
-    SetTargetFPS(60);
+// Hblank of a visible line, so it's in time for the next one to be drawn
+void run_hdma_line(struct Emulator* emu) {
+    uint8_t channels = emu->memory.MDMAEN_HBLANK_DMA.byte;
+    bool started = false;
+
+    for (int i = 0; i < DMA_CHANNELS; i++) {
+        struct DmaChannel* channel = &emu->memory.dma[i];
+        if (!(channels & (1 << i)) || channel->hdma_terminated) continue;
+
+        if (!started) emu->scheduler.now += HDMA_START_CYCLES;
+        started = true;
+        emu->scheduler.now += DMA_CHANNEL_CYCLES;
+
+        if (channel->hdma_do_transfer) {
+            uint8_t pattern = channel->DMAP & DMAP_PATTERN;
+            for (int j = 0; j < dma_unit_sizes[pattern]; j++) {
+                uint32_t loc = (channel->DMAP & DMAP_INDIRECT)
+                    ? (channel->DASB << 16) | channel->DAS++
+                    : (channel->A1B << 16) | channel->A2A++;
+                dma_move(emu, channel, loc, channel->BBAD + dma_ports[pattern][j]);
+            }
+            emu->scheduler.now += dma_unit_sizes[pattern] * DMA_BYTE_CYCLES;
+        }
 
-    while (!WindowShouldClose()) {
-        BeginDrawing();
-            ClearBackground(WHITE);
-        EndDrawing();
+        // Repeat entries transfer on every line, the rest just on the first
+        channel->NLTR--;
+        channel->hdma_do_transfer = channel->NLTR & 0x80;
+        if (!(channel->NLTR & 0x7F)) next_hdma_entry(emu, channel);
     }
+}
+
+// PC wraps within its bank, it never carries into PBR
+static inline uint8_t fetch_pc_u8(struct Emulator* emu) {
+    uint8_t out = read_mem(emu, emu->registers.PC);
+    emu->registers.PC = (emu->registers.PC & 0xFF0000) | ((emu->registers.PC + 1) & 0xFFFF);
+    return out;
+}
+
+uint8_t eat_u8(struct Emulator* emu) {
+    uint32_t pc = emu->registers.PC;
+    uint8_t out = fetch_pc_u8(emu);
+    TRACE(TRACE_FETCH, 0, pc, out);
+    return out;
+}
 
-    free(rom_file.data);
+uint16_t eat_u16(struct Emulator* emu) {
+    uint32_t pc = emu->registers.PC;
+    uint8_t a = fetch_pc_u8(emu);
+    uint8_t b = fetch_pc_u8(emu);
+
+    uint16_t out = (b << 8) | a;
+    TRACE(TRACE_FETCH, TRACE_WIDE, pc, out);
+    return out;
+}
+
+uint32_t eat_u24(struct Emulator* emu) {
+    uint8_t a = eat_u8(emu);
+    uint8_t b = eat_u8(emu);
+    uint8_t c = eat_u8(emu);
+
+    return 0x000000 | (c << 16) | (b << 8) | a;
+}
+
+// Opcodes count every cycle as a fast (6 master cycle) one here, memory
+// accesses top that up with their page's wait on the way through
+void eat_cycles(struct Emulator* emu, int count) {
+    emu->scheduler.now += count * MASTER_CYCLES_FAST;
+}
+
+uint32_t addr_from_absolute(struct Emulator* emu, uint16_t addr) {
+    return (emu->registers.DBR << 16) | addr;
+}
+
+uint32_t read_u24(struct Emulator* emu, uint32_t addr) {
+    return read_u16(emu, addr) | (read_mem(emu, addr + 2) << 16);
+}
+
+// Indirect addresses. The bytes after the first wrap within its bank instead of
+// carrying into the next, so a pointer at $00:FFFF gets its high byte from $00:0000
+uint16_t read_pointer_u16(struct Emulator* emu, uint32_t addr) {
+    uint32_t bank = addr & 0xFF0000;
+    return read_mem(emu, addr) | (read_mem(emu, bank | ((addr + 1) & 0xFFFF)) << 8);
+}
+
+uint32_t read_pointer_u24(struct Emulator* emu, uint32_t addr) {
+    uint32_t bank = addr & 0xFF0000;
+    return read_pointer_u16(emu, addr) | (read_mem(emu, bank | ((addr + 2) & 0xFFFF)) << 16);
+}
+
+// Opcode handlers have their own per-mode copies of these, this is for the
+// interrupt entry. Emulation mode keeps the stack in page 1
+void push_u8_to_stack(struct Emulator* emu, uint8_t value) {
+    write_u8(emu, emu->registers.S, value);
+    emu->registers.S = emu->registers.E_flag ? (0x0100 | ((emu->registers.S - 1) & 0xFF)) : (emu->registers.S - 1);
+}
+
+void push_u16_to_stack(struct Emulator* emu, uint16_t value) {
+    push_u8_to_stack(emu, value >> 8);
+    push_u8_to_stack(emu, value & 0xFF);
+}
+
+// Width generic helpers. Opcode handlers are instantiated per CPU mode and
+// always pass a constant for `wide`, so these fold down to a single path
+static inline void set_nz(struct Emulator* emu, uint16_t value, bool wide) {
+    if (wide) {
+        emu->registers.status.flags.N = !!(value & 0x8000);
+        emu->registers.status.flags.Z = value == 0;
+    } else {
+        emu->registers.status.flags.N = !!(value & 0x80);
+        emu->registers.status.flags.Z = (value & 0xFF) == 0;
+    }
+}
+
+// Loads the low byte only when narrow, the high byte is left alone
+static inline void load_register(struct Emulator* emu, uint16_t* reg, uint16_t value, bool wide) {
+    if (wide) {
+        *reg = value;
+    } else {
+        *reg = (*reg & 0xFF00) | (value & 0xFF);
+    }
+    set_nz(emu, value, wide);
+}
+
+static inline uint16_t read_data(struct Emulator* emu, uint32_t loc, bool wide) {
+    return wide ? read_u16(emu, loc) : read_mem(emu, loc);
+}
+
+static inline void write_data(struct Emulator* emu, uint32_t loc, uint16_t value, bool wide) {
+    if (wide) {
+        write_u16(emu, loc, value);
+    } else {
+        write_u8(emu, loc, value & 0xFF);
+    }
+}
+
+static inline void compare(struct Emulator* emu, uint16_t reg, uint16_t value, bool wide) {
+    uint16_t mask = wide ? 0xFFFF : 0xFF;
+    emu->registers.status.flags.C = (reg & mask) >= (value & mask);
+    set_nz(emu, (reg - value) & mask, wide);
+}
+
+// The two base cycles come out of the cycle table, this is just the extras
+static inline void branch(struct Emulator* emu, bool take, uint32_t operand, bool emulation) {
+    if (!take) return;
+
+    eat_cycles(emu, 1);
+    uint16_t target = emu->registers.PC + (int8_t)operand;
+
+    // Emulation mode pays for crossing a page
+    if (emulation && (target & 0xFF00) != (emu->registers.PC & 0xFF00)) eat_cycles(emu, 1);
+    emu->registers.PC = (emu->registers.PC & 0xFF0000) | target;
+}
+
+void update_cpu_mode(struct Emulator* emu);
+void enter_interrupt(struct Emulator* emu, uint16_t native_vector, uint16_t emulation_vector, bool software);
+void wait_for_interrupt(struct Emulator* emu);
+
+// Shared by every instance, they never change once built
+struct DispatchTable dispatch_tables[CPU_MODE_COUNT];
+
+#define CPU_MODE_SUFFIX m16x16
+#define M16 1
+#define X16 1
+#define EMU 0
+#include "cpu_ops.h"
+#undef CPU_MODE_SUFFIX
+#undef M16
+#undef X16
+#undef EMU
+
+#define CPU_MODE_SUFFIX m16x8
+#define M16 1
+#define X16 0
+#define EMU 0
+#include "cpu_ops.h"
+#undef CPU_MODE_SUFFIX
+#undef M16
+#undef X16
+#undef EMU
+
+#define CPU_MODE_SUFFIX m8x16
+#define M16 0
+#define X16 1
+#define EMU 0
+#include "cpu_ops.h"
+#undef CPU_MODE_SUFFIX
+#undef M16
+#undef X16
+#undef EMU
+
+#define CPU_MODE_SUFFIX m8x8
+#define M16 0
+#define X16 0
+#define EMU 0
+#include "cpu_ops.h"
+#undef CPU_MODE_SUFFIX
+#undef M16
+#undef X16
+#undef EMU
+
+#define CPU_MODE_SUFFIX emulation
+#define M16 0
+#define X16 0
+#define EMU 1
+#include "cpu_ops.h"
+#undef CPU_MODE_SUFFIX
+#undef M16
+#undef X16
+#undef EMU
+
+void build_dispatch_tables() {
+    const OpcodeHandler* handlers[CPU_MODE_COUNT] = {
+        [CPU_MODE_M16_X16] = opcode_handlers_m16x16,
+        [CPU_MODE_M16_X8] = opcode_handlers_m16x8,
+        [CPU_MODE_M8_X16] = opcode_handlers_m8x16,
+        [CPU_MODE_M8_X8] = opcode_handlers_m8x8,
+        [CPU_MODE_EMULATION] = opcode_handlers_emulation,
+    };
+    const uint8_t* cycles[CPU_MODE_COUNT] = {
+        [CPU_MODE_M16_X16] = opcode_cycles_m16x16,
+        [CPU_MODE_M16_X8] = opcode_cycles_m16x8,
+        [CPU_MODE_M8_X16] = opcode_cycles_m8x16,
+        [CPU_MODE_M8_X8] = opcode_cycles_m8x8,
+        [CPU_MODE_EMULATION] = opcode_cycles_emulation,
+    };
+
+    for (int mode = 0; mode < CPU_MODE_COUNT; mode++) {
+        bool m8 = mode == CPU_MODE_M8_X16 || mode == CPU_MODE_M8_X8 || mode == CPU_MODE_EMULATION;
+        bool x8 = mode == CPU_MODE_M16_X8 || mode == CPU_MODE_M8_X8 || mode == CPU_MODE_EMULATION;
+        struct DispatchTable* table = &dispatch_tables[mode];
+
+        for (int opcode = 0; opcode < 256; opcode++) {
+            table->handlers[opcode] = handlers[mode][opcode];
+            table->cycles[opcode] = cycles[mode][opcode];
+            table->lengths[opcode] = opcode_length(opcode, m8, x8);
+        }
+    }
+}
+
+// Call after anything that can touch M, X or E
+void update_cpu_mode(struct Emulator* emu) {
+    if (emu->registers.E_flag) {
+        emu->cpu_mode = CPU_MODE_EMULATION;
+    } else {
+        emu->cpu_mode = (emu->registers.status.flags.M << 1) | emu->registers.status.flags.X;
+    }
+    emu->dispatch = &dispatch_tables[emu->cpu_mode];
+}
+
+uint32_t eat_operand(struct Emulator* emu, int length) {
+    switch (length) {
+        case 1: return eat_u8(emu);
+        case 2: return eat_u16(emu);
+        case 3: return eat_u24(emu);
+    }
+    return 0;
+}
+
+void execute_opcode(struct Emulator* emu, uint8_t opcode) {
+    eat_cycles(emu, emu->dispatch->cycles[opcode]);
+    uint32_t operand = eat_operand(emu, emu->dispatch->lengths[opcode] - 1);
+    emu->dispatch->handlers[opcode](emu, operand);
+}
+
+static const bool ends_block[256] = {
+    // Branches, jumps, calls and returns
+    [0x10] = true, [0x30] = true, [0x50] = true, [0x70] = true, [0x80] = true,
+    [0x82] = true, [0x90] = true, [0xB0] = true, [0xD0] = true, [0xF0] = true,
+    [0x4C] = true, [0x5C] = true, [0x6C] = true, [0x7C] = true, [0xDC] = true,
+    [0x20] = true, [0x22] = true, [0xFC] = true,
+    [0x40] = true, [0x60] = true, [0x6B] = true,
+    // Interrupts, waiting, and block moves rewinding PC
+    [0x00] = true, [0x02] = true, [0xCB] = true, [0xDB] = true, [0x44] = true, [0x54] = true,
+    // Anything touching M, X, E or I
+    [0x28] = true, [0xC2] = true, [0xE2] = true, [0xFB] = true, [0x58] = true, [0x78] = true,
+};
+
+static inline bool wram_page_writable(struct Emulator* emu, int wram_page) {
+    return shared_page_private(emu->wram.pages[wram_page])
+        && emu->wram.dirty[wram_page]
+        && !emu->block_cache.wram_has_code[wram_page];
+}
+
+// Points every mapping of a WRAM page (the low 8 KiB is mirrored all over) at
+// wherever it lives now, writable only if nothing needs to see the next write
+void refresh_wram_page(struct Emulator* emu, int wram_page) {
+    uint8_t* host = emu->wram.pages[wram_page]->data;
+    uint8_t* write = wram_page_writable(emu, wram_page) ? host : NULL;
+
+    for (uint32_t page = 0; page < PAGE_COUNT; page++) {
+        if (emu->memory_map.wram_page[page] != wram_page) continue;
+        emu->memory_map.read[page] = host;
+        emu->memory_map.write[page] = write;
+    }
+}
+
+// All of them in one pass over the page table
+void refresh_wram_map(struct Emulator* emu) {
+    uint8_t* write[WRAM_PAGES];
+    for (int i = 0; i < (int)WRAM_PAGES; i++) {
+        write[i] = wram_page_writable(emu, i) ? emu->wram.pages[i]->data : NULL;
+    }
+
+    for (uint32_t page = 0; page < PAGE_COUNT; page++) {
+        int wram_page = emu->memory_map.wram_page[page];
+        if (wram_page < 0) continue;
+        emu->memory_map.read[page] = emu->wram.pages[wram_page]->data;
+        emu->memory_map.write[page] = write[wram_page];
+    }
+}
+
+// Gives this instance its own copy of a WRAM page, if it doesn't have one
+void unshare_wram_page(struct Emulator* emu, int wram_page, bool copy) {
+    if (unshare_page(&emu->wram.pages[wram_page], copy)) emu->run_stats.wram_copies++;
+}
+
+void clear_wram_dirty(struct Emulator* emu) {
+    memset(emu->wram.dirty, 0, sizeof(emu->wram.dirty));
+    refresh_wram_map(emu);
+}
+
+void invalidate_wram_code(struct Emulator* emu, int wram_page);
+
+// First write to a write protected WRAM page
+void touch_wram_page(struct Emulator* emu, int wram_page) {
+    unshare_wram_page(emu, wram_page, true);
+    emu->wram.dirty[wram_page] = true;
+    if (emu->block_cache.wram_has_code[wram_page]) invalidate_wram_code(emu, wram_page);
+    refresh_wram_page(emu, wram_page);
+}
+
+void flush_block_cache(struct Emulator* emu) {
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        emu->block_cache.blocks[i].key = BLOCK_EMPTY;
+    }
+
+    for (int i = 0; i < (int)WRAM_PAGES; i++) {
+        if (!emu->block_cache.wram_has_code[i]) continue;
+        emu->block_cache.wram_has_code[i] = false;
+        refresh_wram_page(emu, i);
+    }
+    emu->block_cache.stale = true;
+}
+
+void invalidate_wram_code(struct Emulator* emu, int wram_page) {
+    emu->block_cache.wram_generation[wram_page]++;
+    emu->block_cache.wram_has_code[wram_page] = false;
+    emu->block_cache.stale = true;
+    refresh_wram_page(emu, wram_page);
+}
+
+// Decodes from PC up to the end of the block, the page or the instruction limit,
+// whichever comes first. NULL if there's nothing here that can be cached
+struct Block* build_block(struct Emulator* emu, struct Block* block, uint32_t pc, uint32_t key) {
+    uint32_t page = pc >> PAGE_SHIFT;
+    uint8_t* host = emu->memory_map.read[page];
+    if (!host) return NULL;
+
+    int wram_page = emu->memory_map.wram_page[page];
+    if (wram_page < 0 && emu->memory_map.handler[page] != PAGE_ROM) return NULL;
+
+    uint16_t offset = pc & PAGE_MASK;
+    uint8_t wait = emu->memory_map.wait[page];
+    block->length = 0;
+    block->cycles = 0;
+    block->runs = 0;
+    block->native = NULL;
+
+    while (block->length < BLOCK_MAX_INSTRUCTIONS) {
+        uint8_t opcode = host[offset];
+        uint8_t length = emu->dispatch->lengths[opcode];
+        if (offset + length > PAGE_SIZE) break;
+
+        uint32_t operand = 0;
+        for (int i = length - 1; i > 0; i--) {
+            operand = (operand << 8) | host[offset + i];
+        }
+
+        struct BlockInstruction* instruction = &block->instructions[block->length++];
+        instruction->handler = emu->dispatch->handlers[opcode];
+        instruction->operand = operand;
+        instruction->cycles = emu->dispatch->cycles[opcode] * MASTER_CYCLES_FAST + length * wait;
+        instruction->next_pc = (pc & 0xFF0000) | (((page << PAGE_SHIFT) + offset + length) & 0xFFFF);
+        instruction->opcode = opcode;
+        block->cycles += instruction->cycles;
+
+        offset += length;
+        if (ends_block[opcode]) break;
+    }
+
+    // The slot's been written over, so whatever it held before can't be found any more
+    if (!block->length) {
+        block->key = BLOCK_EMPTY;
+        return NULL;
+    }
+
+    block->key = key;
+    block->wram_page = wram_page;
+    if (wram_page >= 0) {
+        block->generation = emu->block_cache.wram_generation[wram_page];
+        if (!emu->block_cache.wram_has_code[wram_page]) {
+            emu->block_cache.wram_has_code[wram_page] = true;
+            refresh_wram_page(emu, wram_page);
+        }
+    }
+
+    return block;
+}
+
+static inline struct Block* lookup_block(struct Emulator* emu, uint32_t pc) {
+    uint32_t key = BLOCK_KEY(pc, emu->cpu_mode);
+    struct Block* block = &emu->block_cache.blocks[(pc ^ (pc >> 12) ^ (emu->cpu_mode << 9)) & (BLOCK_CACHE_SIZE - 1)];
+
+    if (block->key == key && (block->wram_page < 0 || block->generation == emu->block_cache.wram_generation[block->wram_page])) {
+        return block;
+    }
+    emu->run_stats.blocks_built++;
+    return build_block(emu, block, pc, key);
+}
+
+#define CONTEXT_OFFSET(member) ((int32_t)offsetof(struct Emulator, member))
+
+// The few opcodes simple enough to write out natively. Everything else is a
+// call into the same handler the interpreter would use
+bool emit_native_opcode(struct Emulator* emu, struct BlockInstruction* instruction, bool m16, bool x16) {
+    struct Jit* jit = &emu->jit;
+    int32_t status = CONTEXT_OFFSET(registers.status.byte);
+
+    switch (instruction->opcode) {
+        case 0x18: jit_emit_and_u8(jit, status, (uint8_t)~0x01); return true; // CLC
+        case 0x38: jit_emit_or_u8(jit, status, 0x01); return true; // SEC
+        case 0x78: jit_emit_or_u8(jit, status, 0x04); return true; // SEI
+        case 0xB8: jit_emit_and_u8(jit, status, (uint8_t)~0x40); return true; // CLV
+        case 0xD8: jit_emit_and_u8(jit, status, (uint8_t)~0x08); return true; // CLD
+        case 0xF8: jit_emit_or_u8(jit, status, 0x08); return true; // SED
+        case 0xEA: return true; // NOP
+
+        // Immediate loads, where the flags are known up front too
+        case 0xA9:
+        case 0xA2:
+        case 0xA0: {
+            int32_t reg = instruction->opcode == 0xA9 ? CONTEXT_OFFSET(registers.A)
+                : instruction->opcode == 0xA2 ? CONTEXT_OFFSET(registers.X)
+                : CONTEXT_OFFSET(registers.Y);
+            bool wide = instruction->opcode == 0xA9 ? m16 : x16;
+            uint16_t value = instruction->operand;
+
+            if (wide) {
+                jit_emit_store_u16(jit, reg, value);
+            } else {
+                jit_emit_store_u8(jit, reg, value & 0xFF);
+            }
+
+            bool negative = value & (wide ? 0x8000 : 0x80);
+            bool zero = !(value & (wide ? 0xFFFF : 0xFF));
+            jit_emit_and_u8(jit, status, (uint8_t)~0x82);
+            jit_emit_or_u8(jit, status, (negative ? 0x80 : 0) | (zero ? 0x02 : 0));
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Same thing run_block does, with the loop unrolled into native code
+void compile_block(struct Emulator* emu, struct Block* block) {
+    struct Jit* jit = &emu->jit;
+
+    if (!jit_begin(jit)) {
+        // Out of room, start over. Every block pointing into the cache goes too
+        flush_block_cache(emu);
+        jit_reset(jit);
+        return;
+    }
+
+    enum CpuMode mode = BLOCK_MODE(block->key);
+    bool m16 = mode == CPU_MODE_M16_X16 || mode == CPU_MODE_M16_X8;
+    bool x16 = mode == CPU_MODE_M16_X16 || mode == CPU_MODE_M8_X16;
+
+    jit_emit_store_u8(jit, CONTEXT_OFFSET(block_cache.stale), false);
+    for (int i = 0; i < block->length; i++) {
+        struct BlockInstruction* instruction = &block->instructions[i];
+        jit_emit_add_u64(jit, CONTEXT_OFFSET(scheduler.now), instruction->cycles);
+        jit_emit_store_u32(jit, CONTEXT_OFFSET(registers.PC), instruction->next_pc);
+
+        if (emit_native_opcode(emu, instruction, m16, x16)) continue;
+
+        jit_emit_call(jit, (JitCallee)instruction->handler, instruction->operand);
+        jit_emit_return_if_set(jit, CONTEXT_OFFSET(block_cache.stale));
+        // Only a handler can bring the next event forward, see run_block()
+        jit_emit_return_if_reached(jit, CONTEXT_OFFSET(scheduler.now), CONTEXT_OFFSET(scheduler.deadline));
+    }
+
+    block->native = jit_end(jit);
+}
+
+// Only run when the whole block fits before the next event. An I/O write can
+// schedule one partway through (an NMI or IRQ getting unmasked, say), and then
+// the block stops right there, same as the interpreter would
+void run_block(struct Emulator* emu, struct Block* block) {
+    if (block->native) {
+        block->native(emu);
+        return;
+    }
+
+    if (emu->jit.enabled && ++block->runs == emu->jit.threshold) {
+        compile_block(emu, block);
+        if (block->native) {
+            block->native(emu);
+            return;
+        }
+    }
+
+    emu->block_cache.stale = false;
+
+    for (int i = 0; i < block->length; i++) {
+        struct BlockInstruction* instruction = &block->instructions[i];
+        emu->scheduler.now += instruction->cycles;
+        emu->registers.PC = instruction->next_pc;
+        instruction->handler(emu, instruction->operand);
+
+        if (emu->block_cache.stale || emu->scheduler.now >= emu->scheduler.deadline) return;
+    }
+}
+
+void record_exec_trace(struct Emulator* emu, uint32_t pc) {
+    struct ExecTraceRecord* record = exec_trace_next();
+
+    record->PC = pc;
+    record->opcode = peek_mem(emu, pc);
+    for (int i = 0; i < 3; i++) {
+        record->operands[i] = peek_mem(emu, pc + 1 + i);
+    }
+
+    record->A = emu->registers.A;
+    record->X = emu->registers.X;
+    record->Y = emu->registers.Y;
+    record->S = emu->registers.S;
+    record->D = emu->registers.D;
+    record->DBR = emu->registers.DBR;
+    record->P = emu->registers.status.byte;
+    record->E = emu->registers.E_flag;
+    record->cycles = emu->scheduler.now;
+}
+
+// BRK and COP get their cycles from the opcode table, hardware interrupts
+// pay for themselves in service_interrupts
+void enter_interrupt(struct Emulator* emu, uint16_t native_vector, uint16_t emulation_vector, bool software) {
+    if (!emu->registers.E_flag) push_u8_to_stack(emu, emu->registers.PC >> 16);
+    push_u16_to_stack(emu, emu->registers.PC & 0xFFFF);
+
+    // In emulation mode bit 4 is B, set only for BRK
+    uint8_t status = emu->registers.status.byte;
+    if (emu->registers.E_flag) status = software ? (status | 0x10) : (status & ~0x10);
+    push_u8_to_stack(emu, status);
+
+    emu->registers.status.flags.I = 1;
+    emu->registers.status.flags.D = 0;
+    emu->registers.PC = read_u16(emu, emu->registers.E_flag ? emulation_vector : native_vector);
+}
+
+void take_interrupt(struct Emulator* emu, uint16_t native_vector, uint16_t emulation_vector) {
+    if (emu->timing.waiting) {
+        emu->timing.waiting = false;
+        emu->registers.PC = (emu->registers.PC & 0xFF0000) | ((emu->registers.PC + 1) & 0xFFFF);
+    }
+
+    enter_interrupt(emu, native_vector, emulation_vector, false);
+    eat_cycles(emu, emu->registers.E_flag ? 7 : 8);
+    if (emu->profile) {
+        enum ProfileFrameKind kind = native_vector == 0xFFEA ? PROFILE_FRAME_NMI : PROFILE_FRAME_IRQ;
+        profile_interrupt(emu->profile, kind, emu->registers.PC, emu->registers.S);
+    }
+}
+
+void service_interrupts(struct Emulator* emu) {
+    if (emu->timing.in_dma) return;
+
+    if (emu->timing.nmi_pending) {
+        emu->timing.nmi_pending = false;
+        take_interrupt(emu, 0xFFEA, 0xFFFA);
+    } else if (emu->memory.irq_flag && !emu->registers.status.flags.I) {
+        take_interrupt(emu, 0xFFEE, 0xFFFE);
+    }
+}
+
+void handle_event(struct Emulator* emu, enum EventType type) {
+    switch (type) {
+        case EVENT_SCANLINE:
+            emu->timing.line_start += MASTER_CYCLES_PER_LINE;
+            emu->timing.V++;
+
+            if (emu->timing.V == LINES_PER_FRAME) {
+                emu->timing.V = 0;
+                emu->timing.frame++;
+                emu->memory.nmi_flag = false;
+                start_hdma_frame(emu);
+            }
+
+            if (emu->timing.V >= 1 && emu->timing.V <= PPU_VISIBLE_LINES) {
+                if (emu->ppu_thread) {
+                    ppu_thread_push(emu->ppu_thread, PPU_COMMAND_LINE, emu->timing.line_start, emu->timing.V, 0);
+                } else {
+                    ppu_render_line(&emu->ppu, emu->tile_cache, emu->framebuffer, emu->timing.V);
+                }
+            }
+
+            if (emu->timing.V == VBLANK_START_LINE) {
+                if (emu->ppu_thread) {
+                    ppu_thread_push(emu->ppu_thread, PPU_COMMAND_END_FRAME, emu->timing.line_start, 0, 0);
+                } else {
+                    ppu_end_frame(&emu->ppu, emu->framebuffer);
+                }
+                emu->memory.nmi_flag = true;
+                if (emu->memory.NMITIMEN.flags.VBLANK_NMI_ENABLE) emu->timing.nmi_pending = true;
+            }
+
+            if (emu->timing.V < VBLANK_START_LINE && emu->memory.MDMAEN_HBLANK_DMA.byte) {
+                schedule_event(&emu->scheduler, EVENT_HBLANK, emu->timing.line_start + HBLANK_START_MASTER);
+            }
+            schedule_event(&emu->scheduler, EVENT_SCANLINE, emu->timing.line_start + MASTER_CYCLES_PER_LINE);
+            service_interrupts(emu);
+            break;
+        case EVENT_HBLANK:
+            run_hdma_line(emu);
+            break;
+        case EVENT_HV_IRQ:
+            emu->memory.irq_flag = true;
+            schedule_hv_irq(emu);
+            service_interrupts(emu);
+            break;
+        case EVENT_INTERRUPT_CHECK:
+            service_interrupts(emu);
+            break;
+    }
+}
+
+void run_due_events(struct Emulator* emu) {
+    enum EventType type;
+    while (pop_due_event(&emu->scheduler, &type)) handle_event(emu, type);
+}
+
+// WAI. Parks on the WAI and skips ahead to the next event, which is the only
+// place an interrupt can come from. An IRQ wakes it even with I set
+void wait_for_interrupt(struct Emulator* emu) {
+    if (emu->memory.irq_flag) {
+        emu->timing.waiting = false;
+        return;
+    }
+
+    emu->timing.waiting = true;
+    emu->registers.PC = (emu->registers.PC & 0xFF0000) | ((emu->registers.PC - 1) & 0xFFFF);
+    if (emu->scheduler.now < emu->scheduler.deadline) emu->scheduler.now = emu->scheduler.deadline;
+}
+
+void reset_cpu(struct Emulator* emu) {
+    uint16_t reset_vector = read_u16_raw(emu->rom_file.data + emu->rom_file.header_offset + 0x3C);
+    emu->registers.PC = 0x000000 | (uint32_t)reset_vector;
+    verbose("Reset vector %04x\n", reset_vector);
+
+    scheduler_reset(&emu->scheduler);
+    schedule_event(&emu->scheduler, EVENT_SCANLINE, MASTER_CYCLES_PER_LINE);
+}
+
+void rewind_frame_done(struct Emulator* emu);
+
+// Runs until the frame counter ticks over
+void run_frame(struct Emulator* emu) {
+    uint64_t frame = emu->timing.frame;
+
+    while (emu->timing.frame == frame) {
+        // Nothing can happen before the deadline, so no checks in here
+        while (emu->scheduler.now < emu->scheduler.deadline) {
+            // Tracing and profiling want to see every instruction go by, so skip the cache
+            if (!TRACE_ON(TRACE_EXEC | TRACE_DISASM | TRACE_FETCH) && !emu->profile && !emu->block_cache.disabled) {
+                struct Block* block = lookup_block(emu, emu->registers.PC);
+                if (block && emu->scheduler.now + block->cycles <= emu->scheduler.deadline) {
+                    emu->run_stats.instructions += block->length;
+                    run_block(emu, block);
+                    continue;
+                }
+            }
+
+            emu->run_stats.instructions++;
+            uint32_t pc = emu->registers.PC;
+            if (TRACE_ON(TRACE_EXEC)) record_exec_trace(emu, pc);
+
+            uint64_t start = emu->scheduler.now;
+            enum CpuMode mode = emu->cpu_mode;
+
+            uint8_t opcode = eat_u8(emu);
+            TRACE(TRACE_DISASM, 0, pc, opcode);
+            execute_opcode(emu, opcode);
+
+            if (emu->profile) {
+                profile_record(emu->profile, pc, opcode, mode, emu->scheduler.now - start,
+                    ends_block[opcode], emu->registers.PC, emu->registers.S);
+            }
+        }
+
+        run_due_events(emu);
+    }
+
+    // Whatever the APU got up to this frame, it's done by the end of it, and
+    // so's its sound
+    catch_up_apu(emu);
+    apu_sync_dsp(&emu->apu);
+    if (emu->rom_file.sram_dirty) flush_sram(emu);
+    emu->run_stats.frames++;
+    if (emu->rewind) rewind_frame_done(emu);
+}
+
+void setup_cpu(struct Emulator* emu) {
+    emu->registers.DBR = 0x00;
+    emu->registers.status.flags.M = 1;
+    emu->registers.status.flags.X = 1;
+    emu->registers.status.flags.D = 0;
+    emu->registers.status.flags.I = 1;
+    emu->registers.E_flag = 1;
+
+    update_cpu_mode(emu);
+}
+
+// Save states. Every section is one of the structs above as-is, so bump
+// SNAPSHOT_VERSION when any of them changes. The page table, dispatch pointer
+// and caches are all derived, and get rebuilt or invalidated on load
+#define STATE_TAG(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+enum StateSection {
+    STATE_REGISTERS = STATE_TAG('R', 'E', 'G', 'S'),
+    STATE_MEMORY = STATE_TAG('M', 'E', 'M', 'O'),
+    STATE_WRAM = STATE_TAG('W', 'R', 'A', 'M'),
+    STATE_TIMING = STATE_TAG('T', 'I', 'M', 'E'),
+    STATE_SCHEDULER = STATE_TAG('S', 'C', 'H', 'D'),
+    STATE_SRAM = STATE_TAG('S', 'R', 'A', 'M'),
+    STATE_PPU = STATE_TAG('P', 'P', 'U', ' '),
+    STATE_VRAM = STATE_TAG('V', 'R', 'A', 'M'),
+    STATE_APU = STATE_TAG('A', 'P', 'U', ' '),
+    STATE_ARAM = STATE_TAG('A', 'R', 'A', 'M'),
+};
+
+void save_state(struct Emulator* emu, struct Snapshot* snapshot) {
+    snapshot_begin(snapshot, emu->rom_file.rom->hash);
+    snapshot_write(snapshot, STATE_REGISTERS, &emu->registers, sizeof(emu->registers));
+    snapshot_write(snapshot, STATE_MEMORY, &emu->memory, sizeof(emu->memory));
+    uint8_t* wram = snapshot_add(snapshot, STATE_WRAM, WRAM_SIZE);
+    for (int i = 0; i < (int)WRAM_PAGES; i++) {
+        memcpy(wram + i * PAGE_SIZE, emu->wram.pages[i]->data, PAGE_SIZE);
+    }
+    snapshot_write(snapshot, STATE_TIMING, &emu->timing, sizeof(emu->timing));
+    snapshot_write(snapshot, STATE_SCHEDULER, &emu->scheduler, sizeof(emu->scheduler));
+    snapshot_write(snapshot, STATE_PPU, &emu->ppu, PPU_REGISTERS_SIZE);
+    uint8_t* vram = snapshot_add(snapshot, STATE_VRAM, VRAM_SIZE);
+    for (int i = 0; i < VRAM_PAGES; i++) {
+        memcpy(vram + i * VRAM_PAGE_SIZE, emu->ppu.vram[i]->data, VRAM_PAGE_SIZE);
+    }
+    snapshot_write(snapshot, STATE_APU, &emu->apu, APU_REGISTERS_SIZE);
+    uint8_t* aram = snapshot_add(snapshot, STATE_ARAM, ARAM_SIZE);
+    for (int i = 0; i < ARAM_PAGES; i++) {
+        memcpy(aram + i * ARAM_PAGE_SIZE, emu->apu.aram[i]->data, ARAM_PAGE_SIZE);
+    }
+    if (emu->rom_file.sram_size) {
+        snapshot_write(snapshot, STATE_SRAM, emu->rom_file.sram, emu->rom_file.sram_size);
+    }
+    snapshot_end(snapshot);
+}
+
+// Puts all of WRAM back to `wram`. Pages that already match stay as they are,
+// still shared and with any cached code on them still good
+void replace_wram(struct Emulator* emu, const uint8_t* wram) {
+    for (int i = 0; i < (int)WRAM_PAGES; i++) {
+        const uint8_t* data = wram + i * PAGE_SIZE;
+        if (!memcmp(emu->wram.pages[i]->data, data, PAGE_SIZE)) continue;
+
+        unshare_wram_page(emu, i, false);
+        memcpy(emu->wram.pages[i]->data, data, PAGE_SIZE);
+        emu->wram.dirty[i] = true;
+        if (emu->block_cache.wram_has_code[i]) {
+            emu->block_cache.wram_generation[i]++;
+            emu->block_cache.wram_has_code[i] = false;
+        }
+    }
+    refresh_wram_map(emu);
+}
+
+// Catches everything derived up with registers and memory that just got swapped
+// out from under it, by a save state or rewinding. ROM blocks are still good
+void machine_state_replaced(struct Emulator* emu, uint8_t old_memsel) {
+    update_cpu_mode(emu);
+    // Only a MEMSEL change moves any wait states, and that's a full flush
+    if (emu->memory.MEMSEL != old_memsel) update_access_timing(emu);
+    emu->block_cache.stale = true;
+    if (emu->ppu_thread) ppu_thread_reload(emu->ppu_thread, &emu->ppu);
+    // SRAM came along with everything else, so it's due a flush
+    if (emu->rom_file.sram_size) mark_sram_dirty(emu);
+}
+
+// Returns NULL on success or why it couldn't. A snapshot that passes the header
+// checks but is missing a section leaves the console half loaded
+const char* load_state(struct Emulator* emu, const struct Snapshot* snapshot) {
+    const char* error = snapshot_check(snapshot, emu->rom_file.rom->hash);
+    if (error) return error;
+
+    uint8_t old_memsel = emu->memory.MEMSEL;
+
+    const uint8_t* wram = snapshot_find(snapshot, STATE_WRAM, WRAM_SIZE);
+    const uint8_t* vram = snapshot_find(snapshot, STATE_VRAM, VRAM_SIZE);
+    const uint8_t* aram = snapshot_find(snapshot, STATE_ARAM, ARAM_SIZE);
+    bool ok = wram && vram && aram
+        && snapshot_read(snapshot, STATE_REGISTERS, &emu->registers, sizeof(emu->registers))
+        && snapshot_read(snapshot, STATE_MEMORY, &emu->memory, sizeof(emu->memory))
+        && snapshot_read(snapshot, STATE_TIMING, &emu->timing, sizeof(emu->timing))
+        && snapshot_read(snapshot, STATE_SCHEDULER, &emu->scheduler, sizeof(emu->scheduler))
+        && snapshot_read(snapshot, STATE_PPU, &emu->ppu, PPU_REGISTERS_SIZE)
+        && snapshot_read(snapshot, STATE_APU, &emu->apu, APU_REGISTERS_SIZE);
+    if (ok && emu->rom_file.sram_size) {
+        ok = snapshot_read(snapshot, STATE_SRAM, emu->rom_file.sram, emu->rom_file.sram_size);
+    }
+    if (!ok) return "snapshot is missing state";
+
+    replace_wram(emu, wram);
+    ppu_replace_vram(&emu->ppu, vram);
+    apu_replace_aram(&emu->apu, aram);
+    machine_state_replaced(emu, old_memsel);
+    return NULL;
+}
+
+double seconds_since(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Rewind. Every `interval` frames the registers and whatever WRAM and VRAM
+// pages got dirtied since last time go into the ring, with every page going in
+// at each keyframe. Stepping back rebuilds memory from the nearest keyframe
+// before the target through each delta up to it.
+//
+// Anything that changes WRAM without going through write_u8, VRAM without
+// going through the PPU, or ARAM behind the APU's back, has to mark the page
+// dirty itself, or it won't make it into the history
+#define REWIND_KEYFRAME_INTERVAL 30
+
+// Page numbers in an entry. WRAM's come first, then VRAM's, then ARAM's
+#define REWIND_PAGES (WRAM_PAGES + VRAM_PAGES + ARAM_PAGES)
+
+struct RewindState {
+    struct Rewind ring;
+    int interval;
+    // Entries since the last keyframe, next one's due at REWIND_KEYFRAME_INTERVAL
+    int since_keyframe;
+    // WRAM, VRAM then ARAM as of the newest entry, what deltas are taken against
+    uint8_t shadow[WRAM_SIZE + VRAM_SIZE + ARAM_SIZE];
+
+    uint64_t captures;
+    uint64_t capture_nanoseconds;
+};
+
+// Leads every entry, SRAM and then the pages follow
+struct RewindHeader {
+    struct Registers registers;
+    struct Memory memory;
+    struct Timing timing;
+    struct Scheduler scheduler;
+    uint8_t ppu[PPU_REGISTERS_SIZE];
+    uint8_t apu[APU_REGISTERS_SIZE];
+    uint8_t page_count;
+};
+
+struct RewindPage {
+    uint16_t size; // Compressed
+    uint8_t index;
+};
+
+#define REWIND_MAX_ENTRY_SIZE(sram_size) \
+    (sizeof(struct RewindHeader) + (sram_size) + REWIND_PAGES * (sizeof(struct RewindPage) + REWIND_COMPRESS_BOUND(PAGE_SIZE)))
+
+// VRAM and ARAM pages are the same size as WRAM's, so they share the numbering
+const uint8_t* rewind_page(struct Emulator* emu, int index) {
+    if (index < (int)WRAM_PAGES) return emu->wram.pages[index]->data;
+    index -= WRAM_PAGES;
+    if (index < (int)VRAM_PAGES) return emu->ppu.vram[index]->data;
+    return emu->apu.aram[index - VRAM_PAGES]->data;
+}
+
+bool rewind_page_dirty(struct Emulator* emu, int index) {
+    if (index < (int)WRAM_PAGES) return emu->wram.dirty[index];
+    index -= WRAM_PAGES;
+    if (index < (int)VRAM_PAGES) return emu->ppu.vram_dirty[index];
+    return emu->apu.aram_dirty[index - VRAM_PAGES];
+}
+
+bool enable_rewind(struct Emulator* emu, int interval, size_t capacity) {
+    if (capacity < REWIND_MAX_ENTRY_SIZE(emu->rom_file.sram_size)) return false;
+
+    struct RewindState* state = calloc(1, sizeof(struct RewindState));
+    if (!state) return false;
+    if (!rewind_init(&state->ring, capacity)) {
+        free(state);
+        return false;
+    }
+
+    state->interval = interval;
+    emu->rewind = state;
+    return true;
+}
+
+void disable_rewind(struct Emulator* emu) {
+    if (!emu->rewind) return;
+    rewind_free(&emu->rewind->ring);
+    free(emu->rewind);
+    emu->rewind = NULL;
+}
+
+void capture_rewind(struct Emulator* emu) {
+    struct RewindState* state = emu->rewind;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t sram_size = emu->rom_file.sram_size;
+    uint8_t* out = rewind_begin(&state->ring, REWIND_MAX_ENTRY_SIZE(sram_size));
+    // Making room can take the last keyframe with it, and then nothing can be
+    // rewound to until there's another
+    if (!rewind_entry(&state->ring, 0)) state->since_keyframe = 0;
+    bool keyframe = state->since_keyframe == 0;
+
+    struct RewindHeader header = {
+        .registers = emu->registers,
+        .memory = emu->memory,
+        .timing = emu->timing,
+        .scheduler = emu->scheduler,
+    };
+    memcpy(header.ppu, &emu->ppu, PPU_REGISTERS_SIZE);
+    memcpy(header.apu, &emu->apu, APU_REGISTERS_SIZE);
+    size_t size = sizeof(header);
+    memcpy(out + size, emu->rom_file.sram, sram_size);
+    size += sram_size;
+
+    for (int i = 0; i < REWIND_PAGES; i++) {
+        const uint8_t* data = rewind_page(emu, i);
+        uint8_t* shadow = state->shadow + i * PAGE_SIZE;
+        if (!keyframe && (!rewind_page_dirty(emu, i) || !memcmp(data, shadow, PAGE_SIZE))) continue;
+
+        // Deltas go in XORed against the last entry, which is mostly zeros
+        uint8_t delta[PAGE_SIZE];
+        if (!keyframe) {
+            for (int j = 0; j < PAGE_SIZE; j++) delta[j] = data[j] ^ shadow[j];
+        }
+
+        struct RewindPage page = { .index = i };
+        page.size = rewind_compress(keyframe ? data : delta, PAGE_SIZE, out + size + sizeof(page));
+        memcpy(out + size, &page, sizeof(page));
+        size += sizeof(page) + page.size;
+
+        memcpy(shadow, data, PAGE_SIZE);
+        header.page_count++;
+    }
+
+    memcpy(out, &header, sizeof(header));
+    rewind_commit(&state->ring, emu->timing.frame, keyframe, size);
+    state->since_keyframe = (state->since_keyframe + 1) % REWIND_KEYFRAME_INTERVAL;
+    clear_wram_dirty(emu);
+    ppu_clear_vram_dirty(&emu->ppu);
+    apu_clear_aram_dirty(&emu->apu);
+
+    state->captures++;
+    state->capture_nanoseconds += seconds_since(&start) * 1e9;
+}
+
+void rewind_frame_done(struct Emulator* emu) {
+    if (emu->run_stats.frames % emu->rewind->interval == 0) capture_rewind(emu);
+}
+
+// Goes through an entry's pages, and applies them to the shadow if `apply`.
+// Returns false if the entry's corrupt, which is only safe to find out without
+// applying, as that'd leave the shadow half done
+bool walk_rewind_pages(struct RewindState* state, const struct RewindEntry* entry, size_t sram_size, bool apply) {
+    const uint8_t* data = rewind_data(&state->ring, entry);
+    struct RewindHeader header;
+    size_t offset = sizeof(header) + sram_size;
+    if (offset > entry->size) return false;
+    memcpy(&header, data, sizeof(header));
+
+    for (int i = 0; i < header.page_count; i++) {
+        struct RewindPage page;
+        if (offset + sizeof(page) > entry->size) return false;
+        memcpy(&page, data + offset, sizeof(page));
+        offset += sizeof(page);
+        if (page.index >= REWIND_PAGES || offset + page.size > entry->size) return false;
+
+        uint8_t decoded[PAGE_SIZE];
+        if (!rewind_decompress(data + offset, page.size, decoded, PAGE_SIZE)) return false;
+        offset += page.size;
+        if (!apply) continue;
+
+        uint8_t* shadow = state->shadow + page.index * PAGE_SIZE;
+        if (entry->keyframe) {
+            memcpy(shadow, decoded, PAGE_SIZE);
+        } else {
+            for (int j = 0; j < PAGE_SIZE; j++) shadow[j] ^= decoded[j];
+        }
+    }
+
+    return true;
+}
+
+// Puts the machine back how it was at entry `index` (0 the oldest) and forgets
+// everything after it
+bool rewind_to(struct Emulator* emu, int index) {
+    struct RewindState* state = emu->rewind;
+    const struct RewindEntry* target = rewind_entry(&state->ring, index);
+    if (!target) return false;
+
+    int keyframe = index;
+    while (!rewind_entry(&state->ring, keyframe)->keyframe) keyframe--;
+
+    // All of them checked before any go into the shadow
+    for (int i = keyframe; i <= index; i++) {
+        if (!walk_rewind_pages(state, rewind_entry(&state->ring, i), emu->rom_file.sram_size, false)) return false;
+    }
+    for (int i = keyframe; i <= index; i++) {
+        walk_rewind_pages(state, rewind_entry(&state->ring, i), emu->rom_file.sram_size, true);
+    }
+
+    const uint8_t* data = rewind_data(&state->ring, target);
+    struct RewindHeader header;
+    memcpy(&header, data, sizeof(header));
+
+    uint8_t old_memsel = emu->memory.MEMSEL;
+    emu->registers = header.registers;
+    emu->memory = header.memory;
+    emu->timing = header.timing;
+    emu->scheduler = header.scheduler;
+    memcpy(&emu->ppu, header.ppu, PPU_REGISTERS_SIZE);
+    memcpy(&emu->apu, header.apu, APU_REGISTERS_SIZE);
+    memcpy(emu->rom_file.sram, data + sizeof(header), emu->rom_file.sram_size);
+    ppu_replace_vram(&emu->ppu, state->shadow + WRAM_SIZE);
+    apu_replace_aram(&emu->apu, state->shadow + WRAM_SIZE + VRAM_SIZE);
+
+    replace_wram(emu, state->shadow);
+    machine_state_replaced(emu, old_memsel);
+
+    rewind_truncate(&state->ring, index + 1);
+    state->since_keyframe = (index - keyframe + 1) % REWIND_KEYFRAME_INTERVAL;
+    clear_wram_dirty(emu);
+    ppu_clear_vram_dirty(&emu->ppu);
+    apu_clear_aram_dirty(&emu->apu);
+    return true;
+}
+
+// One entry back. If the machine's moved on since the newest one, that's where it goes
+bool rewind_step(struct Emulator* emu) {
+    struct Rewind* ring = &emu->rewind->ring;
+    if (!ring->count) return false;
+
+    int index = ring->count - 1;
+    if (rewind_entry(ring, index)->frame >= emu->timing.frame) index--;
+    return index >= 0 && rewind_to(emu, index);
+}
+
+#define MAX_ROMS 64
+
+struct Options {
+    const char* rom_paths[MAX_ROMS];
+    int rom_count;
+    bool headless;
+    uint64_t frames; // 0 to run until the window's closed
+    int instances;
+    int threads;
+    const char* stats_path;
+    const char* wram_path;
+    const char* screenshot_path;
+    const char* load_state_path;
+    const char* save_state_path;
+    const char* delta_base_path;
+    const char* wav_path;
+    const char* srm_path;
+    const char* profile_path;
+    bool verify;
+    uint64_t fork_bench; // Forks to make, 0 for none
+    bool fast_apu;
+    bool ppu_thread;
+    int rewind_interval; // 0 for off
+    size_t rewind_size;
+} options = {
+    .instances = 1,
+    .rewind_size = DEFAULT_REWIND_MB << 20,
+#ifdef HEADLESS
+    .headless = true,
+#endif
+};
+
+void print_usage(const char* name) {
+    printf("Usage: %s [options] [rom...]\n", name);
+    printf("  --headless        No window, run as fast as possible\n");
+    printf("  --frames N        Stop after N frames (%d by default when headless)\n", DEFAULT_HEADLESS_FRAMES);
+    printf("  --instances N     Run N consoles at once, cycling through the ROMs given (headless)\n");
+    printf("  --threads N       Worker threads for them, one per core by default\n");
+    printf("  --stats FILE      Write per-run stats to FILE, - for stdout\n");
+    printf("  --dump-wram FILE  Write WRAM to FILE when done (FILE.N for instance N > 0)\n");
+    printf("  --screenshot FILE Write the last frame to FILE as a PPM when done (FILE.N as above)\n");
+    printf("  --load-state FILE Start every instance from the save state in FILE\n");
+    printf("  --save-state FILE Write a save state to FILE when done (FILE.N as above)\n");
+    printf("  --delta-base FILE Write save states as deltas against the full save state in FILE,\n");
+    printf("                    and load a delta given to --load-state on top of it\n");
+    printf("  --wav FILE        Write the sound to FILE (FILE.N as above), headless only\n");
+    printf("  --fast-apu        Run the APU without making any sound (M toggles it in the window)\n");
+    printf("  --srm FILE        Keep battery backed SRAM in FILE (FILE.N as above). Windowed\n");
+    printf("                    runs keep it next to the ROM without this\n");
+    printf("  --profile FILE    Count every instruction by opcode, PC and call stack and write the\n");
+    printf("                    hottest to FILE, with FILE.folded for flamegraph.pl (FILE.N as above).\n");
+    printf("                    Runs everything through the interpreter, so it's a lot slower\n");
+    printf("  --verify          Run a copy of every instance through the interpreter alone and\n");
+    printf("                    stop if registers, cycles or WRAM ever differ at the end of a frame\n");
+    printf("  --fork-bench N    After the run, fork the first instance N times, checking each fork\n");
+    printf("                    and its parent don't see each other's writes, and time the forks (on stderr)\n");
+    printf("  --ppu-thread      Render on a thread of its own per instance\n");
+    printf("  --verbose         Say what was found in each ROM's header, on stderr\n");
+    printf("  --rewind N        Keep rewind history every N frames, hold backspace to go back\n");
+    printf("  --rewind-mb N     Memory for it per instance (%d MiB by default)\n", DEFAULT_REWIND_MB);
+    printf("\n");
+    printf("  CLSNES_JIT=0      Don't compile hot blocks to native code. Only flag ops and immediate\n");
+    printf("                    loads are native so far, the rest call the interpreter's handlers,\n");
+    printf("                    and it isn't measurably faster than without yet\n");
+}
+
+void parse_options(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (!strcmp(arg, "--headless")) {
+            options.headless = true;
+        } else if (!strcmp(arg, "--frames") && has_value) {
+            options.frames = strtoull(argv[++i], NULL, 0);
+        } else if (!strcmp(arg, "--instances") && has_value) {
+            options.instances = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--threads") && has_value) {
+            options.threads = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--stats") && has_value) {
+            options.stats_path = argv[++i];
+        } else if (!strcmp(arg, "--dump-wram") && has_value) {
+            options.wram_path = argv[++i];
+        } else if (!strcmp(arg, "--ppu-thread")) {
+            options.ppu_thread = true;
+        } else if (!strcmp(arg, "--screenshot") && has_value) {
+            options.screenshot_path = argv[++i];
+        } else if (!strcmp(arg, "--load-state") && has_value) {
+            options.load_state_path = argv[++i];
+        } else if (!strcmp(arg, "--save-state") && has_value) {
+            options.save_state_path = argv[++i];
+        } else if (!strcmp(arg, "--delta-base") && has_value) {
+            options.delta_base_path = argv[++i];
+        } else if (!strcmp(arg, "--wav") && has_value) {
+            options.wav_path = argv[++i];
+        } else if (!strcmp(arg, "--srm") && has_value) {
+            options.srm_path = argv[++i];
+        } else if (!strcmp(arg, "--profile") && has_value) {
+            options.profile_path = argv[++i];
+        } else if (!strcmp(arg, "--verbose")) {
+            verbose_enabled = true;
+        } else if (!strcmp(arg, "--verify")) {
+            options.verify = true;
+        } else if (!strcmp(arg, "--fork-bench") && has_value) {
+            options.fork_bench = strtoull(argv[++i], NULL, 0);
+        } else if (!strcmp(arg, "--fast-apu")) {
+            options.fast_apu = true;
+        } else if (!strcmp(arg, "--rewind") && has_value) {
+            options.rewind_interval = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--rewind-mb") && has_value) {
+            options.rewind_size = strtoull(argv[++i], NULL, 0) << 20;
+        } else if (!strcmp(arg, "--help") || !strcmp(arg, "-h")) {
+            print_usage(argv[0]);
+            exit(0);
+        } else if (arg[0] == '-' || options.rom_count == MAX_ROMS) {
+            print_usage(argv[0]);
+            exit(1);
+        } else {
+            options.rom_paths[options.rom_count++] = arg;
+        }
+    }
+
+    if (!options.rom_count) options.rom_paths[options.rom_count++] = "mairo.smc";
+    if (options.instances < 1) options.instances = 1;
+    if (options.threads < 1) options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+#ifdef HEADLESS
+    options.headless = true;
+#endif
+    // Only ever one window
+    if (options.instances > 1 || options.verify || options.fork_bench) options.headless = true;
+    if (options.headless && !options.frames) options.frames = DEFAULT_HEADLESS_FRAMES;
+}
+
+// Zeroed is empty, see BLOCK_KEY
+struct Block* map_block_cache() {
+    void* blocks = mmap(NULL, BLOCK_CACHE_SIZE * sizeof(struct Block), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT(blocks != MAP_FAILED, "Couldn't map the block cache");
+    return blocks;
+}
+
+struct Emulator* create_emulator(const char* rom_path) {
+    struct Emulator* emu = calloc(1, sizeof(struct Emulator));
+    ASSERT(emu, "Couldn't allocate an emulator");
+    emu->block_cache.blocks = map_block_cache();
+
+    for (int i = 0; i < (int)WRAM_PAGES; i++) {
+        emu->wram.pages[i] = new_shared_page();
+        memset(emu->wram.pages[i]->data, 0, PAGE_SIZE);
+        emu->wram.dirty[i] = true;
+    }
+
+    ppu_reset(&emu->ppu);
+    apu_reset(&emu->apu);
+    emu->tile_cache = malloc(sizeof(struct TileCache));
+    emu->framebuffer = calloc(1, sizeof(struct Framebuffer));
+    ASSERT(emu->tile_cache && emu->framebuffer, "Couldn't allocate a framebuffer");
+
+    jit_init(&emu->jit);
+    setup_cpu(emu);
+    load_rom(emu, rom_path);
+    locate_header(emu);
+    reset_cpu(emu);
+    return emu;
+}
+
+// A copy of a running instance, for branching off from it. WRAM, VRAM and ARAM
+// are shared copy-on-write and the ROM is shared anyway, so this is mostly the
+// page table.
+// The fork starts with an empty block cache and JIT of its own. The parent
+// mustn't be running while it's forked, but the two can run on separate
+// threads from then on
+struct Emulator* fork_emulator(struct Emulator* parent) {
+    struct Emulator* emu = calloc(1, sizeof(struct Emulator));
+    ASSERT(emu, "Couldn't allocate an emulator");
+    emu->block_cache.blocks = map_block_cache();
+
+    emu->rom_file = parent->rom_file;
+    rom_retain(emu->rom_file.rom);
+    if (emu->rom_file.sram_size) {
+        emu->rom_file.sram = malloc(emu->rom_file.sram_size);
+        ASSERT(emu->rom_file.sram, "Couldn't allocate SRAM");
+        memcpy(emu->rom_file.sram, parent->rom_file.sram, emu->rom_file.sram_size);
+        // Only the parent saves to the battery
+        emu->rom_file.sram_battery = false;
+        emu->rom_file.sram_dirty = false;
+    }
+
+    emu->registers = parent->registers;
+    emu->memory = parent->memory;
+    emu->timing = parent->timing;
+    emu->scheduler = parent->scheduler;
+    ppu_copy(&emu->ppu, &parent->ppu);
+    emu->cpu_mode = parent->cpu_mode;
+    emu->dispatch = parent->dispatch;
+    apu_copy(&emu->apu, &parent->apu);
+    // Its samples would only get mixed up with the parent's
+    emu->apu.audio = NULL;
+
+    for (int i = 0; i < (int)WRAM_PAGES; i++) {
+        emu->wram.pages[i] = retain_shared_page(parent->wram.pages[i]);
+        emu->wram.dirty[i] = parent->wram.dirty[i];
+    }
+
+    // Same map bar the SRAM pages, and every WRAM page is shared now so both
+    // sides lose their write pointers
+    emu->memory_map = parent->memory_map;
+    if (emu->rom_file.sram_size) map_sram(emu);
+    refresh_wram_map(emu);
+    refresh_wram_map(parent);
+
+    // Starts blank, there's a whole frame drawn by the time anyone looks. The
+    // tile cache starts empty too, so every tile's due a decode
+    emu->tile_cache = malloc(sizeof(struct TileCache));
+    emu->framebuffer = calloc(1, sizeof(struct Framebuffer));
+    ASSERT(emu->tile_cache && emu->framebuffer, "Couldn't allocate a framebuffer");
+    ppu_mark_vram_dirty(&emu->ppu, 0, VRAM_SIZE);
+
+    jit_init(&emu->jit);
+    return emu;
+}
+
+void destroy_emulator(struct Emulator* emu) {
+    disable_rewind(emu);
+    if (emu->ppu_thread) ppu_thread_stop(emu->ppu_thread);
+    jit_shutdown(&emu->jit);
+    munmap(emu->block_cache.blocks, BLOCK_CACHE_SIZE * sizeof(struct Block));
+    rom_release(emu->rom_file.rom);
+    for (int i = 0; i < (int)WRAM_PAGES; i++) {
+        release_shared_page(emu->wram.pages[i]);
+    }
+    ppu_free(&emu->ppu);
+    apu_free(&emu->apu);
+    if (emu->rom_file.sram_battery) {
+        // Now it has to be on the disk
+        msync(emu->rom_file.sram, emu->rom_file.sram_size, MS_SYNC);
+        munmap(emu->rom_file.sram, emu->rom_file.sram_size);
+    } else {
+        free(emu->rom_file.sram);
+    }
+    free(emu->tile_cache);
+    free(emu->framebuffer);
+    audio_ring_free(emu->apu.audio);
+    profile_free(emu->profile);
+    free(emu);
+}
+
+// Moves whatever's in the audio ring out to the WAV file
+void drain_audio(struct Emulator* emu) {
+    int16_t frames[1024][2];
+    int count;
+    while ((count = audio_ring_pop(emu->apu.audio, frames, 1024))) {
+        wav_write(&emu->wav, (const int16_t (*)[2])frames, count);
+    }
+}
+
+// One frame per step, for the pool
+bool step_emulator(void* job) {
+    struct Emulator* emu = job;
+    run_frame(emu);
+    if (emu->wav.file) drain_audio(emu);
+    return emu->run_stats.frames < options.frames;
+}
+
+// What differs between an instance and its reference copy, NULL if nothing does
+const char* compare_instances(struct Emulator* a, struct Emulator* b) {
+    struct Registers* x = &a->registers;
+    struct Registers* y = &b->registers;
+    if (x->PC != y->PC) return "PC";
+    if (x->A != y->A || x->X != y->X || x->Y != y->Y) return "A, X or Y";
+    if (x->S != y->S || x->D != y->D || x->DBR != y->DBR) return "S, D or DBR";
+    if (x->status.byte != y->status.byte || x->E_flag != y->E_flag) return "P or E";
+    if (a->scheduler.now != b->scheduler.now) return "master cycles";
+
+    for (int i = 0; i < (int)WRAM_PAGES; i++) {
+        if (a->wram.pages[i] != b->wram.pages[i] && memcmp(a->wram.pages[i]->data, b->wram.pages[i]->data, PAGE_SIZE)) {
+            return "WRAM";
+        }
+    }
+    return NULL;
+}
+
+// --verify. Each instance gets a fork that runs everything through the
+// interpreter, and the two have to agree after every frame. Slow, and single
+// threaded, it's only for checking the block cache and JIT haven't drifted
+void verify_instances(struct Emulator** emus, int count) {
+    struct Emulator** references = calloc(count, sizeof(struct Emulator*));
+    ASSERT(references, "Couldn't allocate reference instances");
+    for (int i = 0; i < count; i++) {
+        references[i] = fork_emulator(emus[i]);
+        references[i]->block_cache.disabled = true;
+        // Every block native from its first run, so all of them get checked
+        emus[i]->jit.threshold = 1;
+    }
+
+    bool running = true;
+    while (running) {
+        for (int i = 0; i < count; i++) {
+            running = step_emulator(emus[i]);
+            run_frame(references[i]);
+
+            const char* difference = compare_instances(emus[i], references[i]);
+            if (difference) {
+                fprintf(stderr, "Instance %d's %s differs from the interpreter's after frame %lu\n",
+                    i, difference, emus[i]->timing.frame);
+                exit(1);
+            }
+        }
+    }
+
+    fprintf(stderr, "Verified %lu frames of %d instances against the interpreter\n", options.frames, count);
+    for (int i = 0; i < count; i++) destroy_emulator(references[i]);
+    free(references);
+}
+
+// WRAM, VRAM and ARAM end to end, numbered the way rewind numbers the pages
+void copy_memory(struct Emulator* emu, uint8_t* out) {
+    for (int i = 0; i < REWIND_PAGES; i++) memcpy(out + i * PAGE_SIZE, rewind_page(emu, i), PAGE_SIZE);
+}
+
+// --fork-bench. Forks an instance over and over once its run is over and
+// written out, timing the forks and checking they really are apart: the fork
+// runs a frame and the parent's memory mustn't change, then the parent runs one
+// and the fork's mustn't. Moves the parent on a frame per fork, and reports on
+// stderr so it stays out of --stats -
+void fork_bench(struct Emulator* emu, uint64_t count) {
+    uint8_t* before = malloc(REWIND_PAGES * PAGE_SIZE);
+    uint8_t* after = malloc(REWIND_PAGES * PAGE_SIZE);
+    ASSERT(before && after, "Couldn't allocate memory images");
+
+    uint64_t start_copies = emu->run_stats.wram_copies + emu->ppu.vram_copies + emu->apu.aram_copies;
+    uint64_t copies = 0;
+    double fork_seconds = 0;
+
+    for (uint64_t i = 0; i < count; i++) {
+        copy_memory(emu, before);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        struct Emulator* fork = fork_emulator(emu);
+        fork_seconds += seconds_since(&start);
+
+        run_frame(fork);
+        copy_memory(emu, after);
+        if (memcmp(before, after, REWIND_PAGES * PAGE_SIZE)) {
+            fprintf(stderr, "Fork %lu's writes showed up in its parent\n", i);
+            exit(1);
+        }
+
+        copy_memory(fork, before);
+        run_frame(emu);
+        copy_memory(fork, after);
+        if (memcmp(before, after, REWIND_PAGES * PAGE_SIZE)) {
+            fprintf(stderr, "Fork %lu saw its parent's writes\n", i);
+            exit(1);
+        }
+
+        copies += fork->run_stats.wram_copies + fork->ppu.vram_copies + fork->apu.aram_copies;
+        destroy_emulator(fork);
+    }
+    copies += emu->run_stats.wram_copies + emu->ppu.vram_copies + emu->apu.aram_copies - start_copies;
+
+    fprintf(stderr, "forks %lu\n", count);
+    fprintf(stderr, "fork_us %.1f\n", count ? fork_seconds * 1e6 / count : 0.0);
+    fprintf(stderr, "page_copies_per_fork %.1f\n", count ? (double)copies / count : 0.0);
+    free(before);
+    free(after);
+}
+
+void write_stats(struct Emulator** emus, int count, double seconds) {
+    FILE* out = strcmp(options.stats_path, "-") ? fopen(options.stats_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Couldn't open stats file '%s'\n", options.stats_path);
+        return;
+    }
+
+    uint64_t frames = 0;
+    uint64_t instructions = 0;
+    uint64_t master_cycles = 0;
+    uint64_t blocks_built = 0;
+    uint64_t jit_blocks = 0;
+    uint64_t jit_flushes = 0;
+    uint64_t wram_copies = 0;
+    uint64_t vram_copies = 0;
+    uint64_t aram_copies = 0;
+    uint64_t dma_bytes = 0;
+    uint64_t dma_fast_bytes = 0;
+    uint64_t tile_decodes = 0;
+    uint64_t apu_cycles = 0;
+    uint64_t audio_samples = 0;
+    uint64_t audio_dropped = 0;
+    uint64_t sram_flushes = 0;
+    bool batteries = false;
+    uint64_t ppu_stalls = 0;
+    uint64_t rewind_captures = 0;
+    uint64_t rewind_nanoseconds = 0;
+    uint64_t rewind_bytes = 0;
+
+    for (int i = 0; i < count; i++) {
+        frames += emus[i]->run_stats.frames;
+        instructions += emus[i]->run_stats.instructions;
+        master_cycles += emus[i]->scheduler.now;
+        blocks_built += emus[i]->run_stats.blocks_built;
+        jit_blocks += emus[i]->jit.compiled;
+        jit_flushes += emus[i]->jit.flushes;
+        wram_copies += emus[i]->run_stats.wram_copies;
+        vram_copies += emus[i]->ppu.vram_copies;
+        aram_copies += emus[i]->apu.aram_copies;
+        dma_bytes += emus[i]->run_stats.dma_bytes;
+        dma_fast_bytes += emus[i]->run_stats.dma_fast_bytes;
+        tile_decodes += emus[i]->tile_cache->decodes;
+        apu_cycles += emus[i]->apu.cycles;
+        audio_samples += emus[i]->apu.dsp.samples;
+        if (emus[i]->apu.audio) audio_dropped += emus[i]->apu.audio->dropped;
+        sram_flushes += emus[i]->run_stats.sram_flushes;
+        batteries |= emus[i]->rom_file.sram_battery;
+        if (emus[i]->ppu_thread) ppu_stalls += ppu_thread_stalls(emus[i]->ppu_thread);
+        if (emus[i]->rewind) {
+            struct RewindState* state = emus[i]->rewind;
+            rewind_captures += state->captures;
+            rewind_nanoseconds += state->capture_nanoseconds;
+            for (int j = 0; j < state->ring.count; j++) rewind_bytes += rewind_entry(&state->ring, j)->size;
+        }
+    }
+
+    // Totals across every instance
+    double fps = seconds > 0 ? frames / seconds : 0;
+    fprintf(out, "rom %s\n", emus[0]->rom_file.path);
+    fprintf(out, "instances %d\n", count);
+    fprintf(out, "threads %d\n", count > 1 ? options.threads : 1);
+    fprintf(out, "frames %lu\n", frames);
+    fprintf(out, "instructions %lu\n", instructions);
+    fprintf(out, "master_cycles %lu\n", master_cycles);
+    fprintf(out, "seconds %.3f\n", seconds);
+    fprintf(out, "fps %.1f\n", fps);
+    fprintf(out, "speed %.2fx\n", fps / NTSC_FRAME_RATE);
+    fprintf(out, "blocks_built %lu\n", blocks_built);
+    fprintf(out, "jit_blocks %lu\n", jit_blocks);
+    fprintf(out, "jit_flushes %lu\n", jit_flushes);
+    fprintf(out, "wram_copies %lu\n", wram_copies);
+    fprintf(out, "vram_copies %lu\n", vram_copies);
+    fprintf(out, "aram_copies %lu\n", aram_copies);
+    fprintf(out, "dma_bytes %lu\n", dma_bytes);
+    fprintf(out, "dma_fast_bytes %lu\n", dma_fast_bytes);
+    fprintf(out, "tile_decodes %lu\n", tile_decodes);
+    fprintf(out, "apu_cycles %lu\n", apu_cycles);
+    fprintf(out, "audio_samples %lu\n", audio_samples);
+    if (options.wav_path) fprintf(out, "audio_dropped %lu\n", audio_dropped);
+    if (batteries) fprintf(out, "sram_flushes %lu\n", sram_flushes);
+    if (options.ppu_thread) fprintf(out, "ppu_thread_stalls %lu\n", ppu_stalls);
+    if (rewind_captures) {
+        fprintf(out, "rewind_captures %lu\n", rewind_captures);
+        fprintf(out, "rewind_capture_us %.1f\n", rewind_nanoseconds / 1e3 / rewind_captures);
+        fprintf(out, "rewind_bytes %lu\n", rewind_bytes);
+    }
+
+    if (count > 1) {
+        for (int i = 0; i < count; i++) {
+            struct Emulator* emu = emus[i];
+            fprintf(out, "instance %d rom %s frames %lu instructions %lu blocks_built %lu jit_blocks %lu\n",
+                i, emu->rom_file.path, emu->run_stats.frames, emu->run_stats.instructions,
+                emu->run_stats.blocks_built, emu->jit.compiled);
+        }
+    }
+
+    if (out != stdout) fclose(out);
+}
+
+// Instance 0 gets the path as given, the rest get .N tacked on
+void instance_path(char* path, size_t size, const char* base, int index) {
+    if (index) {
+        snprintf(path, size, "%s.%d", base, index);
+    } else {
+        snprintf(path, size, "%s", base);
+    }
+}
+
+void dump_wram(struct Emulator* emu, int index) {
+    char path[4096];
+    instance_path(path, sizeof(path), options.wram_path, index);
+
+    FILE* out = fopen(path, "wb");
+    bool ok = out != NULL;
+    for (int i = 0; ok && i < (int)WRAM_PAGES; i++) {
+        ok = fwrite(emu->wram.pages[i]->data, PAGE_SIZE, 1, out) == 1;
+    }
+    if (!ok) fprintf(stderr, "Couldn't write WRAM to '%s'\n", path);
+    if (out) fclose(out);
+}
+
+void write_screenshot(struct Emulator* emu, int index) {
+    char path[4096];
+    instance_path(path, sizeof(path), options.screenshot_path, index);
+
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        fprintf(stderr, "Couldn't write a screenshot to '%s'\n", path);
+        return;
+    }
+
+    if (emu->ppu_thread) ppu_thread_sync(emu->ppu_thread);
+
+    // Nothing's been drawn if it never got to vblank
+    struct Framebuffer* framebuffer = emu->framebuffer;
+    int width = framebuffer->width ? framebuffer->width : 256;
+    int height = framebuffer->height ? framebuffer->height : PPU_VISIBLE_LINES;
+
+    fprintf(out, "P6\n%d %d\n255\n", width, height);
+    for (int y = 0; y < height; y++) {
+        uint8_t row[FRAMEBUFFER_WIDTH * 3];
+        for (int x = 0; x < width; x++) {
+            uint32_t pixel = framebuffer->pixels[y * FRAMEBUFFER_WIDTH + x];
+            row[x * 3] = pixel & 0xFF;
+            row[x * 3 + 1] = (pixel >> 8) & 0xFF;
+            row[x * 3 + 2] = (pixel >> 16) & 0xFF;
+        }
+        fwrite(row, 3, width, out);
+    }
+    fclose(out);
+}
+
+void load_delta_base(struct Snapshot* base) {
+    if (!snapshot_load_file(base, options.delta_base_path)) {
+        fprintf(stderr, "Couldn't read save state '%s'\n", options.delta_base_path);
+        exit(1);
+    }
+}
+
+void load_state_file(struct Emulator** emus, int count) {
+    struct Snapshot snapshot = { 0 };
+    if (!snapshot_load_file(&snapshot, options.load_state_path)) {
+        fprintf(stderr, "Couldn't read save state '%s'\n", options.load_state_path);
+        exit(1);
+    }
+
+    if (snapshot_is_delta(&snapshot)) {
+        if (!options.delta_base_path) {
+            fprintf(stderr, "Save state '%s' is a delta, it needs --delta-base\n", options.load_state_path);
+            exit(1);
+        }
+
+        struct Snapshot base = { 0 };
+        struct Snapshot full = { 0 };
+        load_delta_base(&base);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!snapshot_apply_delta(&base, &snapshot, &full)) {
+            fprintf(stderr, "Save state '%s' isn't a delta of '%s'\n", options.load_state_path, options.delta_base_path);
+            exit(1);
+        }
+        verbose("Applied a %lu byte delta in %.1f us\n", snapshot.size, seconds_since(&start) * 1e6);
+
+        snapshot_free(&snapshot);
+        snapshot_free(&base);
+        snapshot = full;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const char* error = load_state(emus[i], &snapshot);
+        if (error) {
+            fprintf(stderr, "Couldn't load '%s' into instance %d: %s\n", options.load_state_path, i, error);
+            exit(1);
+        }
+    }
+
+    snapshot_free(&snapshot);
+}
+
+void save_state_file(struct Emulator* emu, int index) {
+    char path[4096];
+    instance_path(path, sizeof(path), options.save_state_path, index);
+
+    struct Snapshot snapshot = { 0 };
+    save_state(emu, &snapshot);
+
+    if (options.delta_base_path) {
+        struct Snapshot base = { 0 };
+        struct Snapshot delta = { 0 };
+        load_delta_base(&base);
+        const char* error = snapshot_check(&base, emu->rom_file.rom->hash);
+        if (error) {
+            fprintf(stderr, "Can't write deltas against '%s': %s\n", options.delta_base_path, error);
+            exit(1);
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        snapshot_delta(&base, &snapshot, &delta);
+        verbose("Encoded a %lu byte delta of %lu bytes in %.1f us\n", delta.size, snapshot.size, seconds_since(&start) * 1e6);
+
+        // Cheap next to writing it out, and a delta that doesn't give back
+        // what went in is worse than none
+        struct Snapshot check = { 0 };
+        bool round_trip = snapshot_apply_delta(&base, &delta, &check) && check.size == snapshot.size &&
+            !memcmp(check.data, snapshot.data, snapshot.size);
+        ASSERT(round_trip, "Delta against '%s' doesn't give back the save state", options.delta_base_path);
+
+        snapshot_free(&check);
+        snapshot_free(&base);
+        snapshot_free(&snapshot);
+        snapshot = delta;
+    }
+
+    if (!snapshot_save_file(&snapshot, path)) fprintf(stderr, "Couldn't write save state to '%s'\n", path);
+    snapshot_free(&snapshot);
+}
+
+void start_wav(struct Emulator* emu, int index) {
+    char path[4096];
+    instance_path(path, sizeof(path), options.wav_path, index);
+
+    emu->apu.audio = audio_ring_create();
+    ASSERT(emu->apu.audio, "Couldn't allocate an audio ring");
+    if (!wav_open(&emu->wav, path, DSP_SAMPLE_RATE)) {
+        fprintf(stderr, "Couldn't write sound to '%s'\n", path);
+        exit(1);
+    }
+}
+
+void write_profile(struct Emulator* emu, int index) {
+    char path[4096];
+    instance_path(path, sizeof(path), options.profile_path, index);
+
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Couldn't write a profile to '%s'\n", path);
+        return;
+    }
+    profile_write_report(emu->profile, out, emu->rom_file.path);
+    fclose(out);
+
+    char folded_path[4096 + 8];
+    snprintf(folded_path, sizeof(folded_path), "%s.folded", path);
+    out = fopen(folded_path, "w");
+    if (!out) {
+        fprintf(stderr, "Couldn't write a profile to '%s'\n", folded_path);
+        return;
+    }
+    profile_write_folded(emu->profile, out);
+    fclose(out);
+}
+
+// The ROM's path with its extension swapped for .srm
+void rom_srm_path(char* path, size_t size, const char* rom_path) {
+    const char* dot = strrchr(rom_path, '.');
+    const char* slash = strrchr(rom_path, '/');
+    int length = dot && (!slash || dot > slash) ? dot - rom_path : (int)strlen(rom_path);
+    snprintf(path, size, "%.*s.srm", length, rom_path);
+}
+
+// Headless runs only keep SRAM around if they're asked to
+void start_battery(struct Emulator* emu, int index) {
+    char path[4096];
+    if (options.srm_path) {
+        instance_path(path, sizeof(path), options.srm_path, index);
+    } else if (!options.headless) {
+        rom_srm_path(path, sizeof(path), emu->rom_file.path);
+    } else {
+        return;
+    }
+
+    if (!attach_battery(emu, path)) {
+        fprintf(stderr, "Couldn't keep SRAM in '%s'\n", path);
+        exit(1);
+    }
+    verbose("SRAM kept in '%s'\n", path);
+}
+
+#ifndef HEADLESS
+// raylib calls this from its own audio thread whenever it wants more
+struct AudioRing* playback_ring;
+
+void fill_audio_stream(void* buffer, unsigned int count) {
+    static int16_t last[2];
+    int16_t (*frames)[2] = buffer;
+
+    int got = audio_ring_pop(playback_ring, frames, count);
+    if (got) memcpy(last, frames[got - 1], sizeof(last));
+    // Ran dry. Holding the last sample doesn't click like dropping to 0 would
+    for (unsigned int i = got; i < count; i++) memcpy(frames[i], last, sizeof(last));
+}
+#endif
+
+int main(int argc, char** argv) {
+    parse_options(argc, argv);
+
+    // The trace ring and exec trace file are process wide, so they'd only be
+    // a tangle of every instance at once
+    if (options.instances == 1) {
+        trace_init();
+    } else if (getenv("CLSNES_TRACE")) {
+        fprintf(stderr, "Note: tracing is off with more than one instance\n");
+    }
+    build_dispatch_tables();
+
+    struct Emulator** emus = calloc(options.instances, sizeof(struct Emulator*));
+    for (int i = 0; i < options.instances; i++) {
+        emus[i] = create_emulator(options.rom_paths[i % options.rom_count]);
+    }
+    // Before any save state, which brings its own SRAM that then gets kept
+    for (int i = 0; i < options.instances; i++) {
+        if (emus[i]->rom_file.sram_size) start_battery(emus[i], i);
+    }
+    if (options.load_state_path) load_state_file(emus, options.instances);
+    for (int i = 0; i < options.instances; i++) {
+        emus[i]->apu.fast = options.fast_apu;
+    }
+    for (int i = 0; options.profile_path && i < options.instances; i++) {
+        emus[i]->profile = profile_create();
+        ASSERT(emus[i]->profile, "Couldn't allocate a profile");
+    }
+    for (int i = 0; options.ppu_thread && i < options.instances; i++) {
+        emus[i]->ppu_thread = ppu_thread_start(&emus[i]->ppu, emus[i]->tile_cache, emus[i]->framebuffer);
+        if (!emus[i]->ppu_thread) {
+            fprintf(stderr, "Couldn't start a render thread\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; options.rewind_interval > 0 && i < options.instances; i++) {
+        if (!enable_rewind(emus[i], options.rewind_interval, options.rewind_size)) {
+            fprintf(stderr, "Couldn't set up %lu bytes of rewind history\n", options.rewind_size);
+            exit(1);
+        }
+    }
+
+    for (int i = 0; options.headless && options.wav_path && i < options.instances; i++) {
+        start_wav(emus[i], i);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (options.verify) {
+        verify_instances(emus, options.instances);
+    } else if (options.headless) {
+        pool_run((void**)emus, options.instances, options.threads, step_emulator);
+    } else {
+#ifndef HEADLESS
+        struct Emulator* emu = emus[0];
+
+        SetTraceLogLevel(LOG_WARNING);
+        InitWindow(FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT, "Claire's SNES Emulator");
+        SetTargetFPS(60);
+
+        InitAudioDevice();
+        playback_ring = emu->apu.audio = audio_ring_create();
+        ASSERT(playback_ring, "Couldn't allocate an audio ring");
+        AudioStream stream = LoadAudioStream(DSP_SAMPLE_RATE, 16, 2);
+        SetAudioStreamCallback(stream, fill_audio_stream);
+        PlayAudioStream(stream);
+
+        Image image = {
+            .data = emu->framebuffer->pixels,
+            .width = FRAMEBUFFER_WIDTH,
+            .height = FRAMEBUFFER_HEIGHT,
+            .mipmaps = 1,
+            .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+        };
+        Texture2D screen = LoadTextureFromImage(image);
+
+        while (!WindowShouldClose() && (!options.frames || emu->run_stats.frames < options.frames)) {
+            if (IsKeyPressed(KEY_M)) emu->apu.fast = !emu->apu.fast;
+            if (emu->rewind && IsKeyDown(KEY_BACKSPACE)) {
+                rewind_step(emu);
+            } else {
+                run_frame(emu);
+            }
+
+            // Whatever size the frame was, it gets stretched to fill the window
+            if (emu->ppu_thread) ppu_thread_sync(emu->ppu_thread);
+            struct Framebuffer* framebuffer = emu->framebuffer;
+            UpdateTexture(screen, framebuffer->pixels);
+            Rectangle source = { 0, 0, framebuffer->width, framebuffer->height };
+            Rectangle dest = { 0, 0, FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT };
+
+            BeginDrawing();
+                ClearBackground(BLACK);
+                DrawTexturePro(screen, source, dest, (Vector2) { 0, 0 }, 0, WHITE);
+            EndDrawing();
+        }
+
+        UnloadAudioStream(stream);
+        CloseAudioDevice();
+        UnloadTexture(screen);
+        CloseWindow();
+#endif
+    }
+
+    // Done once the last frame's drawn too
+    for (int i = 0; i < options.instances; i++) {
+        if (emus[i]->ppu_thread) ppu_thread_sync(emus[i]->ppu_thread);
+    }
+
+    if (options.stats_path) write_stats(emus, options.instances, seconds_since(&start));
+
+    for (int i = 0; i < options.instances; i++) {
+        if (options.wram_path) dump_wram(emus[i], i);
+        if (options.screenshot_path) write_screenshot(emus[i], i);
+        if (emus[i]->profile) write_profile(emus[i], i);
+        if (options.save_state_path) save_state_file(emus[i], i);
+        if (emus[i]->wav.file) {
+            drain_audio(emus[i]);
+            wav_close(&emus[i]->wav);
+        }
+        // Last, it moves the instance on and none of that's part of the run
+        if (i == 0 && options.fork_bench) fork_bench(emus[i], options.fork_bench);
+        destroy_emulator(emus[i]);
+    }
+    free(emus);
     return 0;
 }
@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "pool.h"
+
+// A worker's queue of job indices. Owner works the front, thieves take the back.
+// Steps are whole frames, so a plain mutex per queue costs next to nothing
+struct WorkQueue {
+    pthread_mutex_t lock;
+    int* jobs;
+    int capacity;
+    int head;
+    int count;
+};
+
+struct Pool {
+    void** jobs;
+    PoolStep step;
+
+    struct WorkQueue* queues;
+    int queue_count;
+
+    // Jobs that haven't finished yet, workers quit once this hits 0
+    int remaining;
+};
+
+struct Worker {
+    struct Pool* pool;
+    int index;
+};
+
+static void push_back(struct WorkQueue* queue, int job) {
+    pthread_mutex_lock(&queue->lock);
+    queue->jobs[(queue->head + queue->count++) % queue->capacity] = job;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static bool pop_front(struct WorkQueue* queue, int* job) {
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->count > 0;
+    if (found) {
+        *job = queue->jobs[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+static bool pop_back(struct WorkQueue* queue, int* job) {
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->count > 0;
+    if (found) {
+        queue->count--;
+        *job = queue->jobs[(queue->head + queue->count) % queue->capacity];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+static bool steal(struct Pool* pool, int thief, int* job) {
+    for (int i = 1; i < pool->queue_count; i++) {
+        int victim = (thief + i) % pool->queue_count;
+        if (pop_back(&pool->queues[victim], job)) return true;
+    }
+    return false;
+}
+
+static void* worker_main(void* arg) {
+    struct Worker* worker = arg;
+    struct Pool* pool = worker->pool;
+    struct WorkQueue* own = &pool->queues[worker->index];
+
+    while (__atomic_load_n(&pool->remaining, __ATOMIC_ACQUIRE) > 0) {
+        int job;
+        if (!pop_front(own, &job) && !steal(pool, worker->index, &job)) {
+            // Everything left is mid-step on another thread
+            sched_yield();
+            continue;
+        }
+
+        if (pool->step(pool->jobs[job])) {
+            push_back(own, job);
+        } else {
+            __atomic_sub_fetch(&pool->remaining, 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    return NULL;
+}
+
+void pool_run(void** jobs, int job_count, int thread_count, PoolStep step) {
+    if (thread_count < 1) thread_count = 1;
+    if (thread_count > job_count) thread_count = job_count;
+
+    struct Pool pool = {
+        .jobs = jobs,
+        .step = step,
+        .queues = calloc(thread_count, sizeof(struct WorkQueue)),
+        .queue_count = thread_count,
+        .remaining = job_count,
+    };
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        pool.queues[i].jobs = malloc(job_count * sizeof(int));
+        pool.queues[i].capacity = job_count;
+    }
+
+    for (int job = 0; job < job_count; job++) {
+        push_back(&pool.queues[job % thread_count], job);
+    }
+
+    pthread_t* threads = malloc(thread_count * sizeof(pthread_t));
+    struct Worker* workers = malloc(thread_count * sizeof(struct Worker));
+
+    // The calling thread is worker 0
+    for (int i = 0; i < thread_count; i++) {
+        workers[i] = (struct Worker) { .pool = &pool, .index = i };
+        if (i) pthread_create(&threads[i], NULL, worker_main, &workers[i]);
+    }
+    worker_main(&workers[0]);
+
+    for (int i = 1; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+        free(pool.queues[i].jobs);
+    }
+    free(pool.queues);
+    free(threads);
+    free(workers);
+}
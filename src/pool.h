@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Runs a bunch of independent jobs across worker threads, one step at a time
+// (a frame, for emulator instances). Jobs are dealt out evenly to start with
+// and each worker cycles through its own. A worker that runs dry steals from
+// the back of someone else's queue between steps, so a couple of slow ROMs
+// don't leave the rest of the cores idle.
+
+// Runs one step of `job`, returns false once the job's finished
+typedef bool (*PoolStep)(void* job);
+
+void pool_run(void** jobs, int job_count, int thread_count, PoolStep step);
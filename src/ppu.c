@@ -0,0 +1,1097 @@
+#include <string.h>
+#include "ppu.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Layers, in the order the TM/TS/CGADSUB bits go
+enum {
+    LAYER_BG1,
+    LAYER_BG2,
+    LAYER_BG3,
+    LAYER_BG4,
+    LAYER_OBJ,
+    LAYER_COUNT,
+
+    LAYER_BACKDROP = LAYER_COUNT,
+    // Only for windows
+    LAYER_COLOR = LAYER_COUNT,
+};
+
+// Room either side of a line for tiles hanging off the edges
+#define LINE_PAD 16
+
+struct Layer {
+    uint16_t color[FRAMEBUFFER_WIDTH + LINE_PAD * 2];
+    // 0 is transparent, otherwise bigger is nearer. See bg_depth/obj_depth
+    uint8_t depth[FRAMEBUFFER_WIDTH + LINE_PAD * 2];
+};
+
+struct Line {
+    struct Layer layers[LAYER_COUNT];
+    // Sprites with palettes 4-7, the only ones colour math applies to
+    bool obj_math[256];
+    // Inside the window for each layer, colour window last
+    bool window[LAYER_COUNT + 1][256];
+};
+
+// Mode 1 with BG3 brought to the front gets a row of its own
+#define MODE_1_BG3_PRIORITY 8
+
+// How near each BG is at tile priority 0 and 1, per mode. 0 for BGs the mode doesn't have
+static const uint8_t bg_depth[9][4][2] = {
+    [0] = { { 8, 11 }, { 7, 10 }, { 2, 5 }, { 1, 4 } },
+    [1] = { { 6, 9 }, { 5, 8 }, { 1, 3 } },
+    [2] = { { 3, 7 }, { 1, 5 } },
+    [3] = { { 3, 7 }, { 1, 5 } },
+    [4] = { { 3, 7 }, { 1, 5 } },
+    [5] = { { 3, 7 }, { 1, 5 } },
+    [6] = { { 3, 7 } },
+    [7] = { { 3, 3 }, { 1, 5 } },
+    [MODE_1_BG3_PRIORITY] = { { 5, 8 }, { 4, 7 }, { 1, 10 } },
+};
+
+// Same for sprites, at each of their 4 priorities
+static const uint8_t obj_depth[9][4] = {
+    [0] = { 3, 6, 9, 12 },
+    [1] = { 2, 4, 7, 10 },
+    [2] = { 2, 4, 6, 8 },
+    [3] = { 2, 4, 6, 8 },
+    [4] = { 2, 4, 6, 8 },
+    [5] = { 2, 4, 6, 8 },
+    [6] = { 2, 4, 6, 8 },
+    [7] = { 2, 4, 6, 7 },
+    [MODE_1_BG3_PRIORITY] = { 2, 3, 6, 9 },
+};
+
+static const uint8_t bg_bpp[8][4] = {
+    { 2, 2, 2, 2 },
+    { 4, 4, 2, 0 },
+    { 4, 4, 0, 0 },
+    { 8, 4, 0, 0 },
+    { 8, 2, 0, 0 },
+    { 4, 2, 0, 0 },
+    { 4, 0, 0, 0 },
+    { 8, 0, 0, 0 },
+};
+
+// Small and large sprite sizes for each OBSEL size setting
+static const uint8_t obj_sizes[8][2][2] = {
+    { { 8, 8 }, { 16, 16 } },
+    { { 8, 8 }, { 32, 32 } },
+    { { 8, 8 }, { 64, 64 } },
+    { { 16, 16 }, { 32, 32 } },
+    { { 16, 16 }, { 64, 64 } },
+    { { 32, 32 }, { 64, 64 } },
+    { { 16, 32 }, { 32, 64 } },
+    { { 16, 32 }, { 32, 32 } },
+};
+
+#define OBJ_PER_LINE 32
+
+static const uint16_t vram_increments[4] = { 1, 32, 128, 128 };
+
+void ppu_reset(struct Ppu* ppu) {
+    memset(ppu, 0, sizeof(*ppu));
+    for (int i = 0; i < VRAM_PAGES; i++) {
+        ppu->vram[i] = new_shared_page();
+        memset(ppu->vram[i]->data, 0, VRAM_PAGE_SIZE);
+    }
+    // Forced blank until the game says otherwise
+    ppu->inidisp = 0x80;
+    ppu_mark_vram_dirty(ppu, 0, VRAM_SIZE);
+}
+
+void ppu_copy(struct Ppu* ppu, const struct Ppu* from) {
+    for (int i = 0; i < VRAM_PAGES; i++) {
+        retain_shared_page(from->vram[i]);
+        if (ppu->vram[i]) release_shared_page(ppu->vram[i]);
+    }
+    *ppu = *from;
+}
+
+void ppu_free(struct Ppu* ppu) {
+    for (int i = 0; i < VRAM_PAGES; i++) {
+        release_shared_page(ppu->vram[i]);
+        ppu->vram[i] = NULL;
+    }
+}
+
+uint8_t* ppu_vram_page_for_write(struct Ppu* ppu, int page) {
+    if (unshare_page(&ppu->vram[page], true)) ppu->vram_copies++;
+    return ppu->vram[page]->data;
+}
+
+void ppu_replace_vram(struct Ppu* ppu, const uint8_t* vram) {
+    for (int i = 0; i < VRAM_PAGES; i++) {
+        const uint8_t* data = vram + i * VRAM_PAGE_SIZE;
+        if (!memcmp(ppu->vram[i]->data, data, VRAM_PAGE_SIZE)) continue;
+
+        if (unshare_page(&ppu->vram[i], false)) ppu->vram_copies++;
+        memcpy(ppu->vram[i]->data, data, VRAM_PAGE_SIZE);
+        ppu_mark_vram_dirty(ppu, i * VRAM_PAGE_SIZE, VRAM_PAGE_SIZE);
+    }
+}
+
+void ppu_clear_vram_dirty(struct Ppu* ppu) {
+    memset(ppu->vram_dirty, 0, sizeof(ppu->vram_dirty));
+}
+
+void ppu_mark_vram_dirty(struct Ppu* ppu, uint32_t addr, uint32_t size) {
+    if (!size) return;
+    uint32_t last = addr + size - 1;
+
+    for (uint32_t page = addr / VRAM_PAGE_SIZE; page <= last / VRAM_PAGE_SIZE; page++) {
+        ppu->vram_dirty[page] = true;
+    }
+
+    // Tiles are 16, 32 and 64 bytes at 2, 4 and 8bpp
+    for (int depth = 0; depth < TILE_DEPTHS; depth++) {
+        for (uint32_t tile = addr >> (4 + depth); tile <= last >> (4 + depth); tile++) {
+            ppu->tile_dirty[depth][tile / 64] |= 1ull << (tile % 64);
+        }
+    }
+}
+
+// Where byte address `byte` is for reading. Good for up to the end of its page
+static inline const uint8_t* vram_bytes(const struct Ppu* ppu, uint32_t byte) {
+    return ppu->vram[byte / VRAM_PAGE_SIZE]->data + byte % VRAM_PAGE_SIZE;
+}
+
+static inline uint16_t vram_word(const struct Ppu* ppu, uint16_t addr) {
+    const uint8_t* bytes = vram_bytes(ppu, (addr & 0x7FFF) * 2);
+    return bytes[0] | (bytes[1] << 8);
+}
+
+// VMAIN's address translation, for writing bitmaps into tile layouts
+static uint16_t remap_vram_addr(const struct Ppu* ppu) {
+    uint16_t addr = ppu->vram_addr;
+    switch ((ppu->vmain >> 2) & 3) {
+        case 1: addr = (addr & 0xFF00) | ((addr & 0x001F) << 3) | ((addr >> 5) & 7); break;
+        case 2: addr = (addr & 0xFE00) | ((addr & 0x003F) << 3) | ((addr >> 6) & 7); break;
+        case 3: addr = (addr & 0xFC00) | ((addr & 0x007F) << 3) | ((addr >> 7) & 7); break;
+    }
+    return addr & 0x7FFF;
+}
+
+static void write_vram(struct Ppu* ppu, bool high, uint8_t value) {
+    uint32_t byte = remap_vram_addr(ppu) * 2 + high;
+    ppu_vram_page_for_write(ppu, byte / VRAM_PAGE_SIZE)[byte % VRAM_PAGE_SIZE] = value;
+    ppu_mark_vram_dirty(ppu, byte, 1);
+
+    if (high == ((ppu->vmain & 0x80) != 0)) ppu->vram_addr += vram_increments[ppu->vmain & 3];
+}
+
+static uint8_t read_vram(struct Ppu* ppu, bool high) {
+    uint8_t out = high ? ppu->vram_prefetch >> 8 : ppu->vram_prefetch & 0xFF;
+
+    if (high == ((ppu->vmain & 0x80) != 0)) {
+        ppu->vram_prefetch = vram_word(ppu, remap_vram_addr(ppu));
+        ppu->vram_addr += vram_increments[ppu->vmain & 3];
+    }
+    return out;
+}
+
+static void write_oam(struct Ppu* ppu, uint8_t value) {
+    uint16_t addr = ppu->oam_addr;
+
+    if (addr >= 0x200) {
+        ppu->oam[0x200 + (addr & 0x1F)] = value;
+    } else if (!(addr & 1)) {
+        ppu->oam_latch = value;
+    } else {
+        // The low table only takes whole words
+        ppu->oam[addr - 1] = ppu->oam_latch;
+        ppu->oam[addr] = value;
+    }
+    ppu->oam_addr = (addr + 1) & 0x3FF;
+}
+
+static uint8_t read_oam(struct Ppu* ppu) {
+    uint16_t addr = ppu->oam_addr;
+    ppu->oam_addr = (addr + 1) & 0x3FF;
+    return addr >= 0x200 ? ppu->oam[0x200 + (addr & 0x1F)] : ppu->oam[addr];
+}
+
+// Mode 7 registers are 16 bits made of this write and the last one
+static int16_t write_m7(struct Ppu* ppu, uint8_t value) {
+    int16_t out = (value << 8) | ppu->m7_latch;
+    ppu->m7_latch = value;
+    return out;
+}
+
+// M7X/M7Y and the mode 7 scrolls are 13 bit signed
+static inline int32_t sign_extend_13(int32_t value) {
+    return (int32_t)((uint32_t)value << 19) >> 19;
+}
+
+void ppu_write(struct Ppu* ppu, uint16_t addr, uint8_t value) {
+    switch (addr) {
+        case 0x2100: ppu->inidisp = value; break;
+        case 0x2101: ppu->obsel = value; break;
+        case 0x2102:
+            ppu->oam_reload = (ppu->oam_reload & 0x200) | (value << 1);
+            ppu->oam_addr = ppu->oam_reload;
+            break;
+        case 0x2103:
+            ppu->oam_reload = (ppu->oam_reload & 0x1FE) | ((value & 1) << 9);
+            ppu->oam_priority = value & 0x80;
+            ppu->oam_addr = ppu->oam_reload;
+            break;
+        case 0x2104: write_oam(ppu, value); break;
+        case 0x2105: ppu->bgmode = value; break;
+        case 0x2106: ppu->mosaic = value; break;
+        case 0x2107: case 0x2108: case 0x2109: case 0x210A:
+            ppu->bg_sc[addr - 0x2107] = value;
+            break;
+        case 0x210B: ppu->bg_nba[0] = value; break;
+        case 0x210C: ppu->bg_nba[1] = value; break;
+        case 0x210D: case 0x210F: case 0x2111: case 0x2113: {
+            int bg = (addr - 0x210D) / 2;
+            ppu->bg_hofs[bg] = ((value << 8) | (ppu->ofs_latch & ~7) | (ppu->hofs_latch & 7)) & 0x3FF;
+            ppu->ofs_latch = value;
+            ppu->hofs_latch = value;
+            // BG1's doubles as the mode 7 one, with a latch of its own
+            if (bg == 0) ppu->m7hofs = write_m7(ppu, value);
+            break;
+        }
+        case 0x210E: case 0x2110: case 0x2112: case 0x2114: {
+            int bg = (addr - 0x210E) / 2;
+            ppu->bg_vofs[bg] = ((value << 8) | ppu->ofs_latch) & 0x3FF;
+            ppu->ofs_latch = value;
+            if (bg == 0) ppu->m7vofs = write_m7(ppu, value);
+            break;
+        }
+        case 0x2115: ppu->vmain = value; break;
+        case 0x2116:
+            ppu->vram_addr = (ppu->vram_addr & 0xFF00) | value;
+            ppu->vram_prefetch = vram_word(ppu, remap_vram_addr(ppu));
+            break;
+        case 0x2117:
+            ppu->vram_addr = (ppu->vram_addr & 0x00FF) | (value << 8);
+            ppu->vram_prefetch = vram_word(ppu, remap_vram_addr(ppu));
+            break;
+        case 0x2118: write_vram(ppu, false, value); break;
+        case 0x2119: write_vram(ppu, true, value); break;
+        case 0x211A: ppu->m7sel = value; break;
+        case 0x211B: ppu->m7a = write_m7(ppu, value); break;
+        case 0x211C: ppu->m7b = write_m7(ppu, value); break;
+        case 0x211D: ppu->m7c = write_m7(ppu, value); break;
+        case 0x211E: ppu->m7d = write_m7(ppu, value); break;
+        case 0x211F: ppu->m7x = write_m7(ppu, value); break;
+        case 0x2120: ppu->m7y = write_m7(ppu, value); break;
+        case 0x2121:
+            ppu->cg_addr = value;
+            ppu->cg_high = false;
+            break;
+        case 0x2122:
+            if (!ppu->cg_high) {
+                ppu->cg_latch = value;
+            } else {
+                ppu->cgram[ppu->cg_addr++] = ((value & 0x7F) << 8) | ppu->cg_latch;
+            }
+            ppu->cg_high = !ppu->cg_high;
+            break;
+        case 0x2123: ppu->w12sel = value; break;
+        case 0x2124: ppu->w34sel = value; break;
+        case 0x2125: ppu->wobjsel = value; break;
+        case 0x2126: case 0x2127: case 0x2128: case 0x2129:
+            ppu->wh[addr - 0x2126] = value;
+            break;
+        case 0x212A: ppu->wbglog = value; break;
+        case 0x212B: ppu->wobjlog = value; break;
+        case 0x212C: ppu->tm = value; break;
+        case 0x212D: ppu->ts = value; break;
+        case 0x212E: ppu->tmw = value; break;
+        case 0x212F: ppu->tsw = value; break;
+        case 0x2130: ppu->cgwsel = value; break;
+        case 0x2131: ppu->cgadsub = value; break;
+        case 0x2132: {
+            // Any of the three channels at once, to the same intensity
+            uint16_t intensity = value & 0x1F;
+            if (value & 0x20) ppu->fixed_color = (ppu->fixed_color & ~0x001F) | intensity;
+            if (value & 0x40) ppu->fixed_color = (ppu->fixed_color & ~0x03E0) | (intensity << 5);
+            if (value & 0x80) ppu->fixed_color = (ppu->fixed_color & ~0x7C00) | (intensity << 10);
+            break;
+        }
+        case 0x2133: ppu->setini = value; break;
+        // Everything else down here is read only
+    }
+}
+
+void ppu_write_vram_block(struct Ppu* ppu, const uint8_t* data, uint32_t size, bool fixed) {
+    while (size) {
+        // A page at a time
+        uint32_t byte = (ppu->vram_addr & 0x7FFF) * 2;
+        uint32_t left = VRAM_PAGE_SIZE - byte % VRAM_PAGE_SIZE;
+        uint32_t run = size < left ? size : left;
+        uint8_t* out = ppu_vram_page_for_write(ppu, byte / VRAM_PAGE_SIZE) + byte % VRAM_PAGE_SIZE;
+
+        if (fixed) {
+            memset(out, data[0], run);
+        } else {
+            memcpy(out, data, run);
+            data += run;
+        }
+        ppu_mark_vram_dirty(ppu, byte, run);
+
+        ppu->vram_addr += run / 2;
+        size -= run;
+    }
+}
+
+uint8_t ppu_read(struct Ppu* ppu, uint16_t addr) {
+    uint8_t out = ppu->open_bus;
+
+    switch (addr) {
+        case 0x2134: case 0x2135: case 0x2136: {
+            int32_t product = ppu->m7a * (int8_t)(ppu->m7b >> 8);
+            out = product >> ((addr - 0x2134) * 8);
+            break;
+        }
+        case 0x2137:
+            // main.c latches the counters before this gets here
+            return ppu->open_bus;
+        case 0x2138: out = read_oam(ppu); break;
+        case 0x2139: out = read_vram(ppu, false); break;
+        case 0x213A: out = read_vram(ppu, true); break;
+        case 0x213B:
+            if (!ppu->cg_high) {
+                out = ppu->cgram[ppu->cg_addr] & 0xFF;
+            } else {
+                out = (ppu->cgram[ppu->cg_addr++] >> 8) | (ppu->open_bus & 0x80);
+            }
+            ppu->cg_high = !ppu->cg_high;
+            break;
+        case 0x213C:
+            out = ppu->h_high ? ((ppu->h_latch >> 8) & 1) | (ppu->open_bus & 0xFE) : ppu->h_latch & 0xFF;
+            ppu->h_high = !ppu->h_high;
+            break;
+        case 0x213D:
+            out = ppu->v_high ? ((ppu->v_latch >> 8) & 1) | (ppu->open_bus & 0xFE) : ppu->v_latch & 0xFF;
+            ppu->v_high = !ppu->v_high;
+            break;
+        case 0x213E:
+            // PPU1 version 1, no time or range overs reported
+            out = 0x01;
+            break;
+        case 0x213F:
+            // PPU2 version 3, NTSC
+            out = (ppu->field << 7) | (ppu->counters_latched << 6) | 0x03;
+            ppu->counters_latched = false;
+            ppu->h_high = false;
+            ppu->v_high = false;
+            break;
+        default:
+            return ppu->open_bus;
+    }
+
+    ppu->open_bus = out;
+    return out;
+}
+
+void ppu_latch_counters(struct Ppu* ppu, uint16_t h, uint16_t v) {
+    ppu->h_latch = h;
+    ppu->v_latch = v;
+    ppu->counters_latched = true;
+}
+
+// Tile decoding. A tile row is 8 pixels spread over 2, 4 or 8 bitplanes, pixel
+// x being bit 7 - x of each. `planes` is one byte per plane, in plane order
+static inline void decode_row(const uint8_t* planes, int bpp, uint8_t* out) {
+#if defined(__SSE2__)
+    // Test every plane byte against all 8 bit positions at once, then fold
+    // each plane's matches in at its own bit
+    const __m128i bits = _mm_setr_epi8((char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i pixels = _mm_setzero_si128();
+
+    for (int p = 0; p < bpp; p++) {
+        __m128i plane = _mm_set1_epi8((char)planes[p]);
+        __m128i set = _mm_cmpeq_epi8(_mm_and_si128(plane, bits), bits);
+        pixels = _mm_or_si128(pixels, _mm_and_si128(set, _mm_set1_epi8((char)(1 << p))));
+    }
+
+    _mm_storel_epi64((__m128i*)out, pixels);
+#else
+    for (int x = 0; x < 8; x++) {
+        uint8_t index = 0;
+        for (int p = 0; p < bpp; p++) {
+            index |= ((planes[p] >> (7 - x)) & 1) << p;
+        }
+        out[x] = index;
+    }
+#endif
+}
+
+static inline int tile_depth(int bpp) {
+    return bpp >> 2;
+}
+
+// VRAM word address of a tile's first row -> its number at that depth
+static inline uint16_t tile_number(uint16_t addr, int bpp) {
+    return (addr & 0x7FFF) >> (tile_depth(bpp) + 3);
+}
+
+static uint8_t (*cache_tiles(struct TileCache* cache, int depth))[64] {
+    switch (depth) {
+        case 0: return cache->bpp2;
+        case 1: return cache->bpp4;
+    }
+    return cache->bpp8;
+}
+
+// A tile row as 8 palette indices, decoded again first if VRAM under it has
+// been written since last time. `addr` is the tile's first row
+static inline const uint8_t* tile_row(struct Ppu* ppu, struct TileCache* cache, uint16_t addr, int bpp, int y) {
+    int depth = tile_depth(bpp);
+    uint16_t tile = tile_number(addr, bpp);
+    uint8_t* pixels = cache_tiles(cache, depth)[tile];
+
+    uint64_t* dirty = &ppu->tile_dirty[depth][tile / 64];
+    uint64_t bit = 1ull << (tile % 64);
+    if (*dirty & bit) {
+        // Planes come in pairs, 8 words apart. Tiles never straddle a page
+        const uint8_t* data = vram_bytes(ppu, (addr & 0x7FFF) * 2);
+        for (int row = 0; row < 8; row++) {
+            uint8_t planes[8];
+            for (int pair = 0; pair < bpp / 2; pair++) {
+                planes[pair * 2] = data[pair * 16 + row * 2];
+                planes[pair * 2 + 1] = data[pair * 16 + row * 2 + 1];
+            }
+            decode_row(planes, bpp, pixels + row * 8);
+        }
+        *dirty &= ~bit;
+        cache->decodes++;
+    }
+
+    return pixels + y * 8;
+}
+
+static inline void flip_row(const uint8_t* in, uint8_t* out) {
+#if defined(__SSSE3__)
+    const __m128i reverse = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 8, 9, 10, 11, 12, 13, 14, 15);
+    _mm_storel_epi64((__m128i*)out, _mm_shuffle_epi8(_mm_loadl_epi64((const __m128i*)in), reverse));
+#else
+    for (int x = 0; x < 8; x++) out[x] = in[7 - x];
+#endif
+}
+
+// 8bpp BGs can take their colours straight from the pixel instead of CGRAM
+static inline uint16_t direct_color(uint8_t index, uint8_t palette) {
+    uint16_t r = ((index & 0x07) << 2) | ((palette & 1) << 1);
+    uint16_t g = ((index & 0x38) >> 1) | (palette & 2);
+    uint16_t b = ((index & 0xC0) >> 3) | ((palette & 4) << 1);
+    return r | (g << 5) | (b << 10);
+}
+
+// Looks 8 pixels' palette indices up into a layer. Index 0 is transparent. An
+// index plus `palette` wraps within CGRAM's 256 entries, never off the end
+static inline void draw_row(
+    const struct Ppu* ppu,
+    const uint8_t* index,
+    uint16_t palette,
+    uint8_t depth,
+    uint16_t* color,
+    uint8_t* out_depth
+) {
+#if defined(__AVX2__)
+    __m256i lanes = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)index)), _mm256_set1_epi32(palette));
+    lanes = _mm256_and_si256(lanes, _mm256_set1_epi32(0xFF));
+    __m256i entries = _mm256_i32gather_epi32((const int*)ppu->cgram, lanes, 2);
+    entries = _mm256_and_si256(entries, _mm256_set1_epi32(0xFFFF));
+    __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(entries), _mm256_extracti128_si256(entries, 1));
+    _mm_storeu_si128((__m128i*)color, packed);
+#else
+    for (int x = 0; x < 8; x++) {
+        color[x] = ppu->cgram[(palette + index[x]) & 0xFF];
+    }
+#endif
+
+#if defined(__SSE2__)
+    __m128i transparent = _mm_cmpeq_epi8(_mm_loadl_epi64((const __m128i*)index), _mm_setzero_si128());
+    _mm_storel_epi64((__m128i*)out_depth, _mm_andnot_si128(transparent, _mm_set1_epi8((char)depth)));
+#else
+    for (int x = 0; x < 8; x++) {
+        out_depth[x] = index[x] ? depth : 0;
+    }
+#endif
+}
+
+static inline uint16_t map_entry(const struct Ppu* ppu, int bg, int tx, int ty) {
+    uint8_t sc = ppu->bg_sc[bg];
+    uint16_t addr = ((sc & 0xFC) << 8) + ((ty & 31) << 5) + (tx & 31);
+    if ((tx & 32) && (sc & 1)) addr += 0x400;
+    if ((ty & 32) && (sc & 2)) addr += (sc & 1) ? 0x800 : 0x400;
+    return vram_word(ppu, addr);
+}
+
+static inline bool mosaic_on(const struct Ppu* ppu, int bg) {
+    return (ppu->mosaic & (1 << bg)) && (ppu->mosaic >> 4);
+}
+
+// Horizontal mosaic, every block of `size` pixels takes its first one's colour
+static void apply_mosaic(struct Layer* layer, int size, int width) {
+    for (int x = 0; x < width; x++) {
+        int from = LINE_PAD + x - x % size;
+        layer->color[LINE_PAD + x] = layer->color[from];
+        layer->depth[LINE_PAD + x] = layer->depth[from];
+    }
+}
+
+// Offset-per-tile (modes 2, 4 and 6): BG3's tilemap holds scroll values for
+// every column of BG1 and BG2 past the first
+static void offset_per_tile(const struct Ppu* ppu, int bg, int mode, int column, int* hofs, int* vofs) {
+    if (column == 0) return;
+
+    int x = (column - 1) * 8 + (ppu->bg_hofs[2] & ~7);
+    int ty = ppu->bg_vofs[2] >> 3;
+    uint16_t applies = 0x2000 << bg;
+
+    uint16_t first = map_entry(ppu, 2, x >> 3, ty);
+    if (mode == 4) {
+        if (!(first & applies)) return;
+        if (first & 0x8000) {
+            *vofs = first & 0x3FF;
+        } else {
+            *hofs = (first & 0x3F8) | (*hofs & 7);
+        }
+        return;
+    }
+
+    uint16_t second = map_entry(ppu, 2, x >> 3, ty + 1);
+    if (first & applies) *hofs = (first & 0x3F8) | (*hofs & 7);
+    if (second & applies) *vofs = second & 0x3FF;
+}
+
+static void draw_bg(struct Ppu* ppu, struct TileCache* cache, struct Layer* layer, int bg, int mode, int variant, int row, bool hires) {
+    int bpp = bg_bpp[mode][bg];
+    uint16_t char_base = ((ppu->bg_nba[bg >> 1] >> ((bg & 1) * 4)) & 0xF) << 12;
+    bool big = ppu->bgmode & (0x10 << bg);
+    // Hires modes always use 16 pixel wide tiles, at half the width a pixel
+    int tile_w = (big || hires) ? 16 : 8;
+    int tile_h = big ? 16 : 8;
+    int tile_w_shift = tile_w == 16 ? 4 : 3;
+    int tile_h_shift = tile_h == 16 ? 4 : 3;
+    int width = hires ? 512 : 256;
+    bool opt = mode == 2 || mode == 4 || mode == 6;
+    bool direct = bpp == 8 && (ppu->cgwsel & 1);
+
+    uint16_t palette_base = mode == 0 ? bg * 32 : 0;
+
+    int y = row;
+    int mosaic_size = (ppu->mosaic >> 4) + 1;
+    if (mosaic_on(ppu, bg)) y -= y % mosaic_size;
+    if (hires && (ppu->setini & 1)) y = y * 2 + ppu->field;
+
+    uint8_t depth_low = bg_depth[variant][bg][0];
+    uint8_t depth_high = bg_depth[variant][bg][1];
+
+    for (int column = 0; column <= width / 8; column++) {
+        int hofs = ppu->bg_hofs[bg];
+        int vofs = ppu->bg_vofs[bg];
+        if (opt && bg < 2) offset_per_tile(ppu, bg, mode, column, &hofs, &vofs);
+        if (hires) hofs *= 2;
+
+        int x = column * 8 + (hofs & ~7);
+        int map_y = y + vofs;
+        uint16_t entry = map_entry(ppu, bg, x >> tile_w_shift, map_y >> tile_h_shift);
+
+        bool hflip = entry & 0x4000;
+        bool vflip = entry & 0x8000;
+        int fine_y = map_y & (tile_h - 1);
+        if (vflip) fine_y = tile_h - 1 - fine_y;
+        int half = (x & (tile_w - 1)) >> 3;
+        if (hflip && tile_w == 16) half ^= 1;
+
+        uint16_t tile = (entry & 0x3FF) + half + (fine_y >> 3) * 16;
+        const uint8_t* index = tile_row(ppu, cache, char_base + tile * bpp * 4, bpp, fine_y & 7);
+        uint8_t flipped[8];
+        if (hflip) {
+            flip_row(index, flipped);
+            index = flipped;
+        }
+
+        int out = LINE_PAD + column * 8 - (hofs & 7);
+        uint8_t palette = (entry >> 10) & 7;
+        uint8_t depth = (entry & 0x2000) ? depth_high : depth_low;
+        // 8bpp tiles already cover all of CGRAM, their palette bits only mean anything to direct colour
+        uint16_t palette_offset = bpp == 8 ? 0 : palette << bpp;
+        draw_row(ppu, index, palette_base + palette_offset, depth, &layer->color[out], &layer->depth[out]);
+
+        if (direct) {
+            for (int i = 0; i < 8; i++) layer->color[out + i] = direct_color(index[i], palette);
+        }
+    }
+
+    if (mosaic_on(ppu, bg)) apply_mosaic(layer, hires ? mosaic_size * 2 : mosaic_size, width);
+}
+
+// Mode 7's pre-multiply clip, keeps the scroll minus centre in 10 bits and sign
+static inline int32_t m7_clip(int32_t value) {
+    return (value & 0x2000) ? (value | ~0x3FF) : (value & 0x3FF);
+}
+
+#if defined(__AVX2__)
+// The VRAM byte at each lane's byte address. VRAM being in pages, that's a
+// gather of the pages' pointers and then one of the aligned dword around each
+// byte, which keeps it from reading off the end of a page
+static inline __m256i gather_vram(const struct Ppu* ppu, __m256i byte) {
+    const long long* pages = (const long long*)ppu->vram;
+    __m256i page = _mm256_srli_epi32(byte, 12);
+    __m256i offset = _mm256_add_epi32(
+        _mm256_and_si256(byte, _mm256_set1_epi32(VRAM_PAGE_SIZE - 4)),
+        _mm256_set1_epi32(offsetof(struct SharedPage, data)));
+
+    __m256i low = _mm256_add_epi64(
+        _mm256_i32gather_epi64(pages, _mm256_castsi256_si128(page), 8),
+        _mm256_cvtepu32_epi64(_mm256_castsi256_si128(offset)));
+    __m256i high = _mm256_add_epi64(
+        _mm256_i32gather_epi64(pages, _mm256_extracti128_si256(page, 1), 8),
+        _mm256_cvtepu32_epi64(_mm256_extracti128_si256(offset, 1)));
+    __m256i dwords = _mm256_set_m128i(_mm256_i64gather_epi32(NULL, high, 1), _mm256_i64gather_epi32(NULL, low, 1));
+
+    __m256i shift = _mm256_slli_epi32(_mm256_and_si256(byte, _mm256_set1_epi32(3)), 3);
+    return _mm256_and_si256(_mm256_srlv_epi32(dwords, shift), _mm256_set1_epi32(0xFF));
+}
+#endif
+
+// Mode 7's 1024x1024 plane as raw 8 bit pixels, for a line whose first pixel
+// is at (x, y) in 8.8 fixed point with each one after it (step_x, step_y) on.
+// `over` is M7SEL's screen over setting
+static void mode7_pixels(const struct Ppu* ppu, int32_t x, int32_t y, int32_t step_x, int32_t step_y, int over, uint8_t* out) {
+#if defined(__AVX2__)
+    // 8 pixels at a time: the tilemap byte and then the pixel byte are both gathers
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i outside_bits = _mm256_set1_epi32(~0x3FF);
+    const __m256i seven = _mm256_set1_epi32(7);
+    const __m256i mask_127 = _mm256_set1_epi32(127);
+    const __m256i one = _mm256_set1_epi32(1);
+
+    __m256i px = _mm256_add_epi32(_mm256_set1_epi32(x), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(step_x)));
+    __m256i py = _mm256_add_epi32(_mm256_set1_epi32(y), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(step_y)));
+    const __m256i step_8x = _mm256_set1_epi32(step_x * 8);
+    const __m256i step_8y = _mm256_set1_epi32(step_y * 8);
+
+    for (int i = 0; i < 256; i += 8) {
+        __m256i tx = _mm256_srai_epi32(px, 8);
+        __m256i ty = _mm256_srai_epi32(py, 8);
+        __m256i inside = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_or_si256(tx, ty), outside_bits), _mm256_setzero_si256());
+
+        __m256i map = _mm256_or_si256(
+            _mm256_slli_epi32(_mm256_and_si256(_mm256_srai_epi32(ty, 3), mask_127), 7),
+            _mm256_and_si256(_mm256_srai_epi32(tx, 3), mask_127));
+        __m256i tile = gather_vram(ppu, _mm256_slli_epi32(map, 1));
+        if (over == 3) tile = _mm256_and_si256(tile, inside);
+
+        __m256i addr = _mm256_or_si256(
+            _mm256_or_si256(_mm256_slli_epi32(tile, 6), _mm256_slli_epi32(_mm256_and_si256(ty, seven), 3)),
+            _mm256_and_si256(tx, seven));
+        __m256i pixel = gather_vram(ppu, _mm256_or_si256(_mm256_slli_epi32(addr, 1), one));
+        if (over == 2) pixel = _mm256_and_si256(pixel, inside);
+
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(pixel), _mm256_extracti128_si256(pixel, 1));
+        _mm_storel_epi64((__m128i*)&out[i], _mm_packus_epi16(words, words));
+
+        px = _mm256_add_epi32(px, step_8x);
+        py = _mm256_add_epi32(py, step_8y);
+    }
+#else
+    for (int i = 0; i < 256; i++, x += step_x, y += step_y) {
+        int32_t tx = x >> 8;
+        int32_t ty = y >> 8;
+        bool outside = (tx | ty) & ~0x3FF;
+
+        uint8_t tile = 0;
+        if (!outside || over < 3) tile = *vram_bytes(ppu, ((((ty >> 3) & 127) << 7) | ((tx >> 3) & 127)) * 2);
+        out[i] = outside && over == 2 ? 0 : *vram_bytes(ppu, ((tile << 6) | ((ty & 7) << 3) | (tx & 7)) * 2 + 1);
+    }
+#endif
+}
+
+// BG1 (and BG2 with EXTBG) in mode 7: one 1024x1024 8bpp plane, rotated and
+// scaled by the matrix. The matrix is picked up fresh every line, so HDMA or
+// an IRQ changing it between lines (for perspective) just works. The start of
+// the line gets worked out in full, after that it's adding A and C per pixel
+static void draw_mode7(const struct Ppu* ppu, struct Layer* bg1, struct Layer* bg2, int row) {
+    int32_t a = ppu->m7a;
+    int32_t b = ppu->m7b;
+    int32_t c = ppu->m7c;
+    int32_t d = ppu->m7d;
+    int32_t cx = sign_extend_13(ppu->m7x);
+    int32_t cy = sign_extend_13(ppu->m7y);
+    int32_t hofs = sign_extend_13(ppu->m7hofs);
+    int32_t vofs = sign_extend_13(ppu->m7vofs);
+
+    int mosaic_size = (ppu->mosaic >> 4) + 1;
+    if (mosaic_on(ppu, 0)) row -= row % mosaic_size;
+
+    int y = (ppu->m7sel & 2) ? 255 - row : row;
+    int32_t start_x = ((a * m7_clip(hofs - cx)) & ~63) + ((b * m7_clip(vofs - cy)) & ~63) + ((b * y) & ~63) + cx * 256;
+    int32_t start_y = ((c * m7_clip(hofs - cx)) & ~63) + ((d * m7_clip(vofs - cy)) & ~63) + ((d * y) & ~63) + cy * 256;
+
+    // Flipped, the line's walked from its far end
+    if (ppu->m7sel & 1) {
+        start_x += a * 255;
+        start_y += c * 255;
+        a = -a;
+        c = -c;
+    }
+
+    uint8_t pixels[256];
+    mode7_pixels(ppu, start_x, start_y, a, c, ppu->m7sel >> 6, pixels);
+
+    if (ppu->cgwsel & 1) {
+        for (int x = 0; x < 256; x++) {
+            bg1->color[LINE_PAD + x] = direct_color(pixels[x], 0);
+            bg1->depth[LINE_PAD + x] = pixels[x] ? bg_depth[7][0][0] : 0;
+        }
+    } else {
+        for (int x = 0; x < 256; x += 8) {
+            draw_row(ppu, &pixels[x], 0, bg_depth[7][0][0], &bg1->color[LINE_PAD + x], &bg1->depth[LINE_PAD + x]);
+        }
+    }
+    if (mosaic_on(ppu, 0)) apply_mosaic(bg1, mosaic_size, 256);
+
+    // EXTBG: the same pixels again as BG2, with the top bit for priority
+    if (ppu->setini & 0x40) {
+        for (int x = 0; x < 256; x++) {
+            uint8_t index = pixels[x] & 0x7F;
+            bg2->color[LINE_PAD + x] = ppu->cgram[index];
+            bg2->depth[LINE_PAD + x] = index ? bg_depth[7][1][pixels[x] >> 7] : 0;
+        }
+        if (mosaic_on(ppu, 1)) apply_mosaic(bg2, mosaic_size, 256);
+    }
+}
+
+static void draw_obj(struct Ppu* ppu, struct TileCache* cache, struct Line* line, int variant, int row) {
+    struct Layer* layer = &line->layers[LAYER_OBJ];
+    int size_select = ppu->obsel >> 5;
+    uint16_t base = (ppu->obsel & 7) << 13;
+    uint16_t gap = (((ppu->obsel >> 3) & 3) + 1) << 12;
+
+    // Sprites on this line, in OAM order from the first one
+    int found[OBJ_PER_LINE];
+    int count = 0;
+    int first = ppu->oam_priority ? (ppu->oam_reload >> 2) & 127 : 0;
+
+    for (int i = 0; i < 128 && count < OBJ_PER_LINE; i++) {
+        int n = (first + i) & 127;
+        uint8_t high = ppu->oam[0x200 + n / 4] >> ((n & 3) * 2);
+        const uint8_t* size = obj_sizes[size_select][(high >> 1) & 1];
+
+        uint8_t dy = row - ppu->oam[n * 4 + 1];
+        if (dy >= size[1]) continue;
+
+        int x = ppu->oam[n * 4] | ((high & 1) << 8);
+        if (x >= 256) x -= 512;
+        if (x + size[0] <= 0 && x != -256) continue;
+
+        found[count++] = n;
+    }
+
+    // Earlier sprites win whatever their priority, so they go down last
+    for (int i = count - 1; i >= 0; i--) {
+        int n = found[i];
+        const uint8_t* entry = &ppu->oam[n * 4];
+        uint8_t high = ppu->oam[0x200 + n / 4] >> ((n & 3) * 2);
+        const uint8_t* size = obj_sizes[size_select][(high >> 1) & 1];
+
+        int x = entry[0] | ((high & 1) << 8);
+        if (x >= 256) x -= 512;
+
+        uint8_t tile = entry[2];
+        uint8_t attr = entry[3];
+        bool hflip = attr & 0x40;
+        uint8_t palette = (attr >> 1) & 7;
+        uint8_t depth = obj_depth[variant][(attr >> 4) & 3];
+
+        int fine_y = (uint8_t)(row - entry[1]);
+        if (attr & 0x80) fine_y = size[1] - 1 - fine_y;
+
+        int tiles = size[0] / 8;
+        for (int t = 0; t < tiles; t++) {
+            int sx = x + t * 8;
+            if (sx <= -8 || sx >= 256) continue;
+
+            int column = hflip ? tiles - 1 - t : t;
+            uint8_t name = (tile & 0xF0) + ((tile + column) & 0x0F) + ((fine_y >> 3) << 4);
+            const uint8_t* index = tile_row(ppu, cache, base + ((attr & 1) ? gap : 0) + name * 16, 4, fine_y & 7);
+            uint8_t flipped[8];
+            if (hflip) {
+                flip_row(index, flipped);
+                index = flipped;
+            }
+
+            uint16_t color[8];
+            uint8_t pixel_depth[8];
+            draw_row(ppu, index, 128 + palette * 16, depth, color, pixel_depth);
+
+            for (int p = 0; p < 8; p++) {
+                int px = sx + p;
+                if (px < 0 || px >= 256 || !pixel_depth[p]) continue;
+                layer->color[LINE_PAD + px] = color[p];
+                layer->depth[LINE_PAD + px] = pixel_depth[p];
+                line->obj_math[px] = palette >= 4;
+            }
+        }
+    }
+}
+
+// One layer's window: `settings` is its nibble of W12SEL/W34SEL/WOBJSEL and
+// `logic` its two bits of WBGLOG/WOBJLOG
+static void build_window(const struct Ppu* ppu, uint8_t settings, uint8_t logic, bool* out) {
+    bool use_1 = settings & 0x02;
+    bool use_2 = settings & 0x08;
+    if (!use_1 && !use_2) {
+        memset(out, 0, 256);
+        return;
+    }
+
+    for (int x = 0; x < 256; x++) {
+        bool in_1 = (x >= ppu->wh[0] && x <= ppu->wh[1]) ^ ((settings & 0x01) != 0);
+        bool in_2 = (x >= ppu->wh[2] && x <= ppu->wh[3]) ^ ((settings & 0x04) != 0);
+
+        if (!use_2) {
+            out[x] = in_1;
+        } else if (!use_1) {
+            out[x] = in_2;
+        } else {
+            switch (logic & 3) {
+                case 0: out[x] = in_1 || in_2; break;
+                case 1: out[x] = in_1 && in_2; break;
+                case 2: out[x] = in_1 != in_2; break;
+                case 3: out[x] = in_1 == in_2; break;
+            }
+        }
+    }
+}
+
+// CGWSEL's region settings: never, outside the colour window, inside it, always
+static inline bool in_region(uint8_t setting, bool in_window) {
+    switch (setting & 3) {
+        case 0: return false;
+        case 1: return !in_window;
+        case 2: return in_window;
+    }
+    return true;
+}
+
+// All three channels at once, clamped. The carries/borrows out of each
+// channel land in bits 5, 10 and 15 and get spread back over it as a mask
+static inline uint16_t blend(uint16_t a, uint16_t b, bool subtract, bool half) {
+    if (!subtract) {
+        if (half) return (a + b - ((a ^ b) & 0x0421)) >> 1;
+        uint32_t sum = a + b;
+        uint32_t carries = (sum - ((a ^ b) & 0x0421)) & 0x8420;
+        return (sum - carries) | (carries - (carries >> 5));
+    }
+
+    uint32_t diff = a - b + 0x8420;
+    uint32_t borrows = (diff - ((a ^ b) & 0x8420)) & 0x8420;
+    uint16_t out = (diff - borrows) & (borrows - (borrows >> 5));
+    return half ? (out & 0x7BDE) >> 1 : out;
+}
+
+// One of the main or sub screens, what's nearest at each pixel
+struct Screen {
+    uint16_t color[256];
+    uint8_t layer[256];
+};
+
+static const bool no_window[256];
+
+// Layer at a time rather than pixel at a time, so it goes 16 pixels at once. In
+// hires BGs have twice the pixels, and `offset` picks which of each pair
+static void pick_screen(const struct Line* line, uint8_t enabled, uint8_t windowed, bool hires, int offset, struct Screen* out) {
+    uint8_t best[256];
+    uint16_t* color = out->color;
+    uint8_t* which = out->layer;
+    memset(best, 0, sizeof(best));
+    memset(which, LAYER_BACKDROP, 256);
+
+    for (int l = 0; l < LAYER_COUNT; l++) {
+        if (!(enabled & (1 << l))) continue;
+
+        const uint16_t* layer_color = &line->layers[l].color[LINE_PAD];
+        const uint8_t* depth = &line->layers[l].depth[LINE_PAD];
+        const bool* window = (windowed & (1 << l)) ? line->window[l] : no_window;
+        int stride = (hires && l != LAYER_OBJ) ? 2 : 1;
+        if (stride == 2) {
+            layer_color += offset;
+            depth += offset;
+        }
+
+        if (stride == 1) {
+#if defined(__SSE2__)
+            // 16 pixels at a time. Depths are all well under 128, so a signed compare does
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i number = _mm_set1_epi8(l);
+            for (int x = 0; x < 256; x += 16) {
+                __m128i outside = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&window[x]), zero);
+                __m128i d = _mm_and_si128(_mm_loadu_si128((const __m128i*)&depth[x]), outside);
+                __m128i old_best = _mm_loadu_si128((const __m128i*)&best[x]);
+                __m128i nearer = _mm_cmpgt_epi8(d, old_best);
+                _mm_storeu_si128((__m128i*)&best[x], _mm_max_epu8(d, old_best));
+
+                __m128i old_which = _mm_loadu_si128((const __m128i*)&which[x]);
+                _mm_storeu_si128((__m128i*)&which[x], _mm_or_si128(_mm_and_si128(nearer, number), _mm_andnot_si128(nearer, old_which)));
+
+                for (int half = 0; half < 2; half++) {
+                    __m128i mask = half ? _mm_unpackhi_epi8(nearer, nearer) : _mm_unpacklo_epi8(nearer, nearer);
+                    __m128i new_color = _mm_loadu_si128((const __m128i*)&layer_color[x + half * 8]);
+                    __m128i old_color = _mm_loadu_si128((const __m128i*)&color[x + half * 8]);
+                    __m128i merged = _mm_or_si128(_mm_and_si128(mask, new_color), _mm_andnot_si128(mask, old_color));
+                    _mm_storeu_si128((__m128i*)&color[x + half * 8], merged);
+                }
+            }
+#else
+            for (int x = 0; x < 256; x++) {
+                uint8_t d = window[x] ? 0 : depth[x];
+                bool nearer = d > best[x];
+                best[x] = nearer ? d : best[x];
+                color[x] = nearer ? layer_color[x] : color[x];
+                which[x] = nearer ? l : which[x];
+            }
+#endif
+        } else {
+            for (int x = 0; x < 256; x++) {
+                uint8_t d = window[x] ? 0 : depth[x * 2];
+                bool nearer = d > best[x];
+                best[x] = nearer ? d : best[x];
+                color[x] = nearer ? layer_color[x * 2] : color[x];
+                which[x] = nearer ? l : which[x];
+            }
+        }
+    }
+}
+
+static inline uint32_t to_rgba(uint16_t color, const uint8_t* levels) {
+    return 0xFF000000 | (levels[(color >> 10) & 0x1F] << 16) | (levels[(color >> 5) & 0x1F] << 8) | levels[color & 0x1F];
+}
+
+void ppu_render_line(struct Ppu* ppu, struct TileCache* cache, struct Framebuffer* framebuffer, int line_number) {
+    int row = line_number - 1;
+    bool interlace = ppu->setini & 1;
+    int fb_row = interlace ? row * 2 + ppu->field : row;
+    uint32_t* out = &framebuffer->pixels[fb_row * FRAMEBUFFER_WIDTH];
+
+    if (ppu->inidisp & 0x80) {
+        for (int x = 0; x < 256; x++) out[x] = 0xFF000000;
+        framebuffer->line_hires[fb_row] = false;
+        return;
+    }
+
+    int mode = ppu->bgmode & 7;
+    int variant = (mode == 1 && (ppu->bgmode & 0x08)) ? MODE_1_BG3_PRIORITY : mode;
+    bool hires = mode == 5 || mode == 6;
+    bool pseudo_hires = ppu->setini & 0x08;
+    uint8_t used = ppu->tm | ppu->ts;
+
+    struct Line line;
+    for (int l = 0; l < LAYER_COUNT; l++) {
+        if (used & (1 << l)) memset(line.layers[l].depth, 0, sizeof(line.layers[l].depth));
+    }
+
+    if (mode == 7) {
+        if (used & 0x03) draw_mode7(ppu, &line.layers[LAYER_BG1], &line.layers[LAYER_BG2], row);
+        if (!(ppu->setini & 0x40)) memset(line.layers[LAYER_BG2].depth, 0, sizeof(line.layers[LAYER_BG2].depth));
+    } else {
+        for (int bg = 0; bg < 4; bg++) {
+            if ((used & (1 << bg)) && bg_bpp[mode][bg]) draw_bg(ppu, cache, &line.layers[bg], bg, mode, variant, row, hires);
+        }
+    }
+
+    if (used & 0x10) {
+        memset(line.obj_math, 0, sizeof(line.obj_math));
+        draw_obj(ppu, cache, &line, variant, row);
+    }
+
+    uint8_t windowed = ppu->tmw | ppu->tsw;
+    const uint8_t window_settings[LAYER_COUNT + 1] = {
+        ppu->w12sel & 0xF, ppu->w12sel >> 4, ppu->w34sel & 0xF, ppu->w34sel >> 4, ppu->wobjsel & 0xF, ppu->wobjsel >> 4,
+    };
+    const uint8_t window_logic[LAYER_COUNT + 1] = {
+        ppu->wbglog, ppu->wbglog >> 2, ppu->wbglog >> 4, ppu->wbglog >> 6, ppu->wobjlog, ppu->wobjlog >> 2,
+    };
+    for (int l = 0; l < LAYER_COUNT; l++) {
+        if (windowed & (1 << l)) build_window(ppu, window_settings[l], window_logic[l], line.window[l]);
+    }
+    build_window(ppu, window_settings[LAYER_COLOR], window_logic[LAYER_COLOR], line.window[LAYER_COLOR]);
+
+    // Brightness scales the 5 bit channels on the way out
+    uint8_t levels[32];
+    int brightness = ppu->inidisp & 0xF;
+    for (int i = 0; i < 32; i++) {
+        levels[i] = ((i << 3) | (i >> 2)) * (brightness + 1) / 16;
+    }
+
+    bool subtract = ppu->cgadsub & 0x80;
+    bool halve = ppu->cgadsub & 0x40;
+    bool add_subscreen = ppu->cgwsel & 0x02;
+    bool wide = hires || pseudo_hires;
+
+    struct Screen main;
+    struct Screen sub;
+    pick_screen(&line, ppu->tm, ppu->tmw, hires, 1, &main);
+    // The sub screen's only needed for blending with, or as the other half of hires pixels
+    bool need_sub = wide || (add_subscreen && (ppu->cgadsub & 0x3F));
+    if (need_sub) pick_screen(&line, ppu->ts, ppu->tsw, hires, 0, &sub);
+
+    for (int x = 0; x < 256; x++) {
+        uint8_t layer = main.layer[x];
+        uint16_t color = layer == LAYER_BACKDROP ? ppu->cgram[0] : main.color[x];
+        bool sub_backdrop = !need_sub || sub.layer[x] == LAYER_BACKDROP;
+        uint16_t sub_color = sub_backdrop ? ppu->fixed_color : sub.color[x];
+
+        bool in_color_window = line.window[LAYER_COLOR][x];
+        bool black = in_region(ppu->cgwsel >> 6, in_color_window);
+        if (black) color = 0;
+
+        bool math = (ppu->cgadsub & (1 << layer))
+            && !in_region(ppu->cgwsel >> 4, in_color_window)
+            && (layer != LAYER_OBJ || line.obj_math[x]);
+        if (math) {
+            uint16_t other = add_subscreen ? sub_color : ppu->fixed_color;
+            bool half = halve && !black && !(add_subscreen && sub_backdrop);
+            color = blend(color, other, subtract, half);
+        }
+
+        if (wide) {
+            out[x * 2] = to_rgba(sub_color, levels);
+            out[x * 2 + 1] = to_rgba(color, levels);
+        } else {
+            out[x] = to_rgba(color, levels);
+        }
+    }
+
+    framebuffer->line_hires[fb_row] = wide;
+    if (wide) framebuffer->any_hires = true;
+}
+
+void ppu_end_frame(struct Ppu* ppu, struct Framebuffer* framebuffer) {
+    bool interlace = ppu->setini & 1;
+    int height = interlace ? FRAMEBUFFER_HEIGHT : PPU_VISIBLE_LINES;
+
+    // Mixed frames get their normal lines doubled up to match, right to left so it can be in place
+    if (framebuffer->any_hires) {
+        for (int y = 0; y < height; y++) {
+            if (framebuffer->line_hires[y]) continue;
+            uint32_t* line = &framebuffer->pixels[y * FRAMEBUFFER_WIDTH];
+            for (int x = 255; x >= 0; x--) {
+                line[x * 2] = line[x];
+                line[x * 2 + 1] = line[x];
+            }
+            framebuffer->line_hires[y] = true;
+        }
+    }
+
+    framebuffer->width = framebuffer->any_hires ? 512 : 256;
+    framebuffer->height = height;
+    framebuffer->any_hires = false;
+    memset(framebuffer->line_hires, 0, sizeof(framebuffer->line_hires));
+    framebuffer->frames++;
+
+    if (!(ppu->inidisp & 0x80)) ppu->oam_addr = ppu->oam_reload;
+    ppu->field = !ppu->field;
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "shared_page.h"
+
+// Picture processing unit. The CPU gets at it through ppu_write()/ppu_read()
+// for $2100-$213F, and main.c draws each visible line whole with
+// ppu_render_line() as the line starts, then calls ppu_end_frame() at vblank.
+// Anything changed partway through a line only shows up from the next one.
+//
+// Lines are built up a layer at a time (BG1-4 and sprites) into colour + depth
+// buffers, then the main and sub screens are picked out of those per pixel and
+// blended for colour math. Tile rows are decoded 8 pixels at a time with SSE2,
+// and AVX2 does the palette lookups as a gather when it's there.
+//
+// Decoded tiles are kept in a TileCache, one byte per pixel, at every depth the
+// same bytes could be read as. VRAM writes mark the tiles under them dirty, and
+// only those get decoded again when next drawn.
+//
+// VRAM is in shared pages (see shared_page.h), so copies of a Ppu, for a forked
+// instance or the render thread, share it until one side writes. Everything
+// that writes VRAM goes through ppu_vram_page_for_write() for that.
+
+#define VRAM_SIZE 0x10000
+#define VRAM_PAGE_SIZE 0x1000
+#define VRAM_PAGES (VRAM_SIZE / VRAM_PAGE_SIZE)
+#define OAM_SIZE 544
+
+// 2, 4 and 8bpp
+#define TILE_DEPTHS 3
+#define TILE_COUNT_2BPP (VRAM_SIZE / 16)
+#define TILE_COUNT_4BPP (VRAM_SIZE / 32)
+#define TILE_COUNT_8BPP (VRAM_SIZE / 64)
+
+// Overscan isn't handled, the picture's always this tall
+#define PPU_VISIBLE_LINES 224
+
+// Big enough for hires and interlace. Normal frames use the top left 256x224
+#define FRAMEBUFFER_WIDTH 512
+#define FRAMEBUFFER_HEIGHT 448
+
+struct Ppu {
+    uint8_t inidisp;
+    uint8_t obsel;
+    uint8_t bgmode;
+    uint8_t mosaic;
+    uint8_t setini;
+
+    uint16_t oam_addr; // Byte address
+    uint16_t oam_reload; // What OAMADD was set to, OAM address goes back here at vblank
+    uint8_t oam_latch;
+    bool oam_priority; // Sprite at oam_reload goes first
+
+    uint8_t bg_sc[4];
+    uint8_t bg_nba[2];
+    uint16_t bg_hofs[4];
+    uint16_t bg_vofs[4];
+    // BGnxOFS writes are made out of the last two bytes written to any of them
+    uint8_t ofs_latch;
+    uint8_t hofs_latch;
+
+    uint8_t vmain;
+    uint16_t vram_addr; // Word address
+    uint16_t vram_prefetch;
+
+    uint8_t m7sel;
+    int16_t m7a;
+    int16_t m7b;
+    int16_t m7c;
+    int16_t m7d;
+    int16_t m7x;
+    int16_t m7y;
+    uint16_t m7hofs;
+    uint16_t m7vofs;
+    uint8_t m7_latch;
+
+    uint8_t cg_addr;
+    bool cg_high; // Next CGDATA access is the high byte
+    uint8_t cg_latch;
+
+    uint8_t w12sel;
+    uint8_t w34sel;
+    uint8_t wobjsel;
+    uint8_t wh[4];
+    uint8_t wbglog;
+    uint8_t wobjlog;
+    uint8_t tm;
+    uint8_t ts;
+    uint8_t tmw;
+    uint8_t tsw;
+    uint8_t cgwsel;
+    uint8_t cgadsub;
+    uint16_t fixed_color; // BGR555
+
+    uint16_t h_latch;
+    uint16_t v_latch;
+    bool h_high; // OPHCT/OPVCT read the low byte first
+    bool v_high;
+    bool counters_latched;
+    bool field; // Interlace field being drawn
+
+    uint8_t open_bus;
+
+    // One spare at the end, so a 32 bit gather off the last entry stays inside
+    uint16_t cgram[256 + 1];
+    uint8_t oam[OAM_SIZE];
+
+    // Everything above is small enough to just copy around whole, VRAM goes by page
+    struct SharedPage* vram[VRAM_PAGES];
+    // Pages written since ppu_clear_vram_dirty()
+    bool vram_dirty[VRAM_PAGES];
+    // Tiles at each depth written since the TileCache last decoded them
+    uint64_t tile_dirty[TILE_DEPTHS][TILE_COUNT_2BPP / 64];
+    // Pages it had to copy because they were shared
+    uint64_t vram_copies;
+};
+
+// Goes with one Ppu, whose tile_dirty says what in here is stale
+struct TileCache {
+    uint8_t bpp2[TILE_COUNT_2BPP][64];
+    uint8_t bpp4[TILE_COUNT_4BPP][64];
+    uint8_t bpp8[TILE_COUNT_8BPP][64];
+    uint64_t decodes;
+};
+
+#define PPU_REGISTERS_SIZE offsetof(struct Ppu, vram)
+
+struct Framebuffer {
+    // RGBA8, rows always FRAMEBUFFER_WIDTH apart
+    uint32_t pixels[FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT];
+    // Of the last finished frame
+    int width;
+    int height;
+    uint64_t frames;
+
+    // Lines drawn at 512 so far this frame. The rest get stretched at the end if there are any
+    bool line_hires[FRAMEBUFFER_HEIGHT];
+    bool any_hires;
+};
+
+// Power on, with zeroed VRAM pages of its own. For a Ppu that hasn't got any yet
+void ppu_reset(struct Ppu* ppu);
+// Makes `ppu` a copy of `from`, sharing its VRAM, and lets go of whatever
+// pages `ppu` had before (NULL ones are fine)
+void ppu_copy(struct Ppu* ppu, const struct Ppu* from);
+void ppu_free(struct Ppu* ppu);
+void ppu_write(struct Ppu* ppu, uint16_t addr, uint8_t value);
+uint8_t ppu_read(struct Ppu* ppu, uint16_t addr);
+// DMA fast path, `size` bytes (an even number) of low/high pairs through
+// $2118/$2119 with VMAIN at $80: no remapping, a word at a time. `fixed`
+// repeats data[0] for the lot
+void ppu_write_vram_block(struct Ppu* ppu, const uint8_t* data, uint32_t size, bool fixed);
+// SLHV, with where the beam is right now
+void ppu_latch_counters(struct Ppu* ppu, uint16_t h, uint16_t v);
+
+// `line` is V, 1 to PPU_VISIBLE_LINES
+void ppu_render_line(struct Ppu* ppu, struct TileCache* cache, struct Framebuffer* framebuffer, int line);
+void ppu_end_frame(struct Ppu* ppu, struct Framebuffer* framebuffer);
+
+void ppu_clear_vram_dirty(struct Ppu* ppu);
+// For anything that changes VRAM behind the PPU's back (DMA fast paths, loading
+// state). Byte address and size
+void ppu_mark_vram_dirty(struct Ppu* ppu, uint32_t addr, uint32_t size);
+// VRAM page `page`, copied first if it's shared. Marks nothing dirty
+uint8_t* ppu_vram_page_for_write(struct Ppu* ppu, int page);
+// Puts all of VRAM back to `vram`. Pages that already match stay shared and
+// don't get marked dirty
+void ppu_replace_vram(struct Ppu* ppu, const uint8_t* vram);
+
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "ppu_thread.h"
+
+// Yields the render thread does on an empty ring before it goes to sleep. A
+// line comes along every 64us, so it's normally awake again well before this
+#define SPIN_LIMIT 256
+
+// Commands the render thread gets through before telling the CPU side about
+// the room it's made, so the two aren't bouncing the same cache line every time
+#define PUBLISH_BATCH 64
+
+struct PpuThread {
+    // CPU side. head is the next slot to fill, cached_tail how far it last
+    // saw the render side get
+    _Alignas(64) uint64_t head;
+    uint64_t cached_tail;
+    uint64_t stalls;
+
+    // Render side
+    _Alignas(64) uint64_t tail;
+    bool sleeping;
+    bool quit;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+
+    struct Ppu ppu;
+    struct TileCache* cache;
+    struct Framebuffer* framebuffer;
+
+    struct PpuCommand ring[PPU_RING_SIZE];
+};
+
+static void run_command(struct PpuThread* thread, const struct PpuCommand* command) {
+    switch (command->type) {
+        case PPU_COMMAND_WRITE: ppu_write(&thread->ppu, command->addr, command->value); break;
+        case PPU_COMMAND_READ: ppu_read(&thread->ppu, command->addr); break;
+        case PPU_COMMAND_LINE: ppu_render_line(&thread->ppu, thread->cache, thread->framebuffer, command->addr); break;
+        case PPU_COMMAND_END_FRAME: ppu_end_frame(&thread->ppu, thread->framebuffer); break;
+    }
+}
+
+// Sleeps until there's something in the ring or it's time to quit. Returns false for quitting
+static bool wait_for_commands(struct PpuThread* thread) {
+    pthread_mutex_lock(&thread->lock);
+    // Pairs with the fence in wake_render_thread(): either this sees the new
+    // head, or the CPU side sees sleeping and signals
+    __atomic_store_n(&thread->sleeping, true, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&thread->head, __ATOMIC_SEQ_CST) == thread->tail && !thread->quit) {
+        pthread_cond_wait(&thread->wake, &thread->lock);
+    }
+    __atomic_store_n(&thread->sleeping, false, __ATOMIC_RELAXED);
+    bool quit = thread->quit && __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE) == thread->tail;
+    pthread_mutex_unlock(&thread->lock);
+    return !quit;
+}
+
+static void* render_main(void* arg) {
+    struct PpuThread* thread = arg;
+    int spins = 0;
+
+    while (true) {
+        uint64_t head = __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = thread->tail;
+
+        if (tail == head) {
+            if (spins++ < SPIN_LIMIT) {
+                sched_yield();
+            } else {
+                spins = 0;
+                if (!wait_for_commands(thread)) break;
+            }
+            continue;
+        }
+        spins = 0;
+
+        while (tail != head) {
+            run_command(thread, &thread->ring[tail % PPU_RING_SIZE]);
+            tail++;
+            if (tail % PUBLISH_BATCH == 0) __atomic_store_n(&thread->tail, tail, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&thread->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static void wake_render_thread(struct PpuThread* thread) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&thread->sleeping, __ATOMIC_SEQ_CST)) return;
+
+    pthread_mutex_lock(&thread->lock);
+    pthread_cond_signal(&thread->wake);
+    pthread_mutex_unlock(&thread->lock);
+}
+
+struct PpuThread* ppu_thread_start(const struct Ppu* ppu, struct TileCache* cache, struct Framebuffer* framebuffer) {
+    struct PpuThread* thread = aligned_alloc(64, sizeof(struct PpuThread));
+    if (!thread) return NULL;
+
+    thread->head = 0;
+    thread->cached_tail = 0;
+    thread->stalls = 0;
+    thread->tail = 0;
+    thread->sleeping = false;
+    thread->quit = false;
+    memset(&thread->ppu, 0, sizeof(thread->ppu));
+    ppu_copy(&thread->ppu, ppu);
+    thread->cache = cache;
+    thread->framebuffer = framebuffer;
+    // Whatever's in the cache went with some other copy of the PPU
+    ppu_mark_vram_dirty(&thread->ppu, 0, VRAM_SIZE);
+
+    pthread_mutex_init(&thread->lock, NULL);
+    pthread_cond_init(&thread->wake, NULL);
+    if (pthread_create(&thread->thread, NULL, render_main, thread)) {
+        ppu_free(&thread->ppu);
+        free(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void ppu_thread_stop(struct PpuThread* thread) {
+    pthread_mutex_lock(&thread->lock);
+    thread->quit = true;
+    pthread_cond_signal(&thread->wake);
+    pthread_mutex_unlock(&thread->lock);
+
+    pthread_join(thread->thread, NULL);
+    pthread_mutex_destroy(&thread->lock);
+    pthread_cond_destroy(&thread->wake);
+    ppu_free(&thread->ppu);
+    free(thread);
+}
+
+void ppu_thread_push(struct PpuThread* thread, enum PpuCommandType type, uint64_t time, uint16_t addr, uint8_t value) {
+    uint64_t head = thread->head;
+
+    if (head - thread->cached_tail >= PPU_RING_SIZE) {
+        thread->cached_tail = __atomic_load_n(&thread->tail, __ATOMIC_ACQUIRE);
+        if (head - thread->cached_tail >= PPU_RING_SIZE) thread->stalls++;
+
+        while (head - thread->cached_tail >= PPU_RING_SIZE) {
+            wake_render_thread(thread);
+            sched_yield();
+            thread->cached_tail = __atomic_load_n(&thread->tail, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    thread->ring[head % PPU_RING_SIZE] = (struct PpuCommand) {
+        .time = time,
+        .addr = addr,
+        .value = value,
+        .type = type,
+    };
+    __atomic_store_n(&thread->head, head + 1, __ATOMIC_RELEASE);
+
+    // Writes on their own never need drawing, so only lines are worth waking it up for
+    if (type == PPU_COMMAND_LINE || type == PPU_COMMAND_END_FRAME) wake_render_thread(thread);
+}
+
+void ppu_thread_sync(struct PpuThread* thread) {
+    wake_render_thread(thread);
+    while (__atomic_load_n(&thread->tail, __ATOMIC_ACQUIRE) != thread->head) sched_yield();
+    thread->cached_tail = thread->head;
+}
+
+void ppu_thread_write_vram_block(struct PpuThread* thread, const uint8_t* data, uint32_t size, bool fixed) {
+    ppu_thread_sync(thread);
+    ppu_write_vram_block(&thread->ppu, data, size, fixed);
+}
+
+void ppu_thread_reload(struct PpuThread* thread, const struct Ppu* ppu) {
+    ppu_thread_sync(thread);
+    // Nothing's queued, so the render side won't touch its copy until the next push
+    ppu_copy(&thread->ppu, ppu);
+    ppu_mark_vram_dirty(&thread->ppu, 0, VRAM_SIZE);
+}
+
+uint64_t ppu_thread_stalls(const struct PpuThread* thread) {
+    return thread->stalls;
+}
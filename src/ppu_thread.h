@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ppu.h"
+
+// Renders on a thread of its own, off the CPU's critical path. The render
+// thread keeps its own copy of the PPU, and the CPU side keeps running the real
+// one (so reads still see the right thing) while sending every write, and every
+// read that moves an address along, down a lock-free single producer/single
+// consumer ring. A line gets rendered once the command for it comes through,
+// which the CPU side sends as the line starts, same as when rendering inline.
+//
+// The ring's big enough for several frames of writes, so the CPU side only ever
+// waits if rendering's fallen a long way behind. Anything that wants to look at
+// the framebuffer calls ppu_thread_sync() first.
+
+// Commands, a power of two
+#define PPU_RING_SIZE (1 << 16)
+
+enum PpuCommandType {
+    PPU_COMMAND_WRITE,
+    PPU_COMMAND_READ, // Just for the side effects
+    PPU_COMMAND_LINE,
+    PPU_COMMAND_END_FRAME,
+};
+
+struct PpuCommand {
+    uint64_t time; // Master clock when it happened
+    uint16_t addr; // Line number for PPU_COMMAND_LINE
+    uint8_t value;
+    uint8_t type;
+};
+
+struct PpuThread;
+
+// The render side starts off as a copy of `ppu`, and draws into `cache` and
+// `framebuffer`, which nobody else should touch without syncing
+struct PpuThread* ppu_thread_start(const struct Ppu* ppu, struct TileCache* cache, struct Framebuffer* framebuffer);
+// Finishes what's queued first
+void ppu_thread_stop(struct PpuThread* thread);
+
+void ppu_thread_push(struct PpuThread* thread, enum PpuCommandType type, uint64_t time, uint16_t addr, uint8_t value);
+// ppu_write_vram_block() on the render side's copy. Too much to go down the
+// ring, so this waits for the render side to catch up and does it from here
+void ppu_thread_write_vram_block(struct PpuThread* thread, const uint8_t* data, uint32_t size, bool fixed);
+// Waits until everything pushed so far is done
+void ppu_thread_sync(struct PpuThread* thread);
+// After the CPU side's PPU has been swapped out wholesale (loading state, rewind)
+void ppu_thread_reload(struct PpuThread* thread, const struct Ppu* ppu);
+
+// Times the CPU side found the ring full and had to wait
+uint64_t ppu_thread_stalls(const struct PpuThread* thread);
@@ -0,0 +1,371 @@
+#include <stdlib.h>
+#include "profile.h"
+#include "disasm.h"
+
+#define PROFILE_INITIAL_PCS 4096
+#define PROFILE_INITIAL_NODES 256
+// How many of each the report lists
+#define PROFILE_REPORT_ROWS 64
+
+static const char* mode_names[PROFILE_MODES] = { "m16x16", "m16x8", "m8x16", "m8x8", "emu" };
+
+static inline uint32_t hash_slot(uint64_t key, uint32_t capacity) {
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (capacity - 1);
+}
+
+static void* alloc_zeroed(size_t count, size_t size) {
+    void* out = calloc(count, size);
+    if (!out) {
+        fprintf(stderr, "Couldn't grow a profile to %lu bytes\n", count * size);
+        exit(1);
+    }
+    return out;
+}
+
+static void grow_pcs(struct Profile* profile) {
+    uint32_t* old_keys = profile->pc_keys;
+    struct ProfilePc* old_pcs = profile->pcs;
+    uint32_t old_capacity = profile->pc_capacity;
+
+    profile->pc_capacity = old_capacity ? old_capacity * 2 : PROFILE_INITIAL_PCS;
+    profile->pc_keys = alloc_zeroed(profile->pc_capacity, sizeof(uint32_t));
+    profile->pcs = alloc_zeroed(profile->pc_capacity, sizeof(struct ProfilePc));
+
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (!old_keys[i]) continue;
+        uint32_t slot = hash_slot(old_keys[i], profile->pc_capacity);
+        while (profile->pc_keys[slot]) slot = (slot + 1) & (profile->pc_capacity - 1);
+        profile->pc_keys[slot] = old_keys[i];
+        profile->pcs[slot] = old_pcs[i];
+    }
+
+    free(old_keys);
+    free(old_pcs);
+}
+
+static inline struct ProfilePc* find_pc(struct Profile* profile, uint32_t pc) {
+    uint32_t key = pc + 1;
+    uint32_t slot = hash_slot(key, profile->pc_capacity);
+    while (profile->pc_keys[slot]) {
+        if (profile->pc_keys[slot] == key) return &profile->pcs[slot];
+        slot = (slot + 1) & (profile->pc_capacity - 1);
+    }
+
+    if ((profile->pc_count + 1) * 2 > profile->pc_capacity) {
+        grow_pcs(profile);
+        return find_pc(profile, pc);
+    }
+
+    profile->pc_count++;
+    profile->pc_keys[slot] = key;
+    return &profile->pcs[slot];
+}
+
+static uint32_t new_node(struct Profile* profile, uint32_t parent, enum ProfileFrameKind kind, uint32_t addr) {
+    if (profile->node_count == profile->node_capacity) {
+        profile->node_capacity = profile->node_capacity ? profile->node_capacity * 2 : PROFILE_INITIAL_NODES;
+        profile->nodes = realloc(profile->nodes, profile->node_capacity * sizeof(struct ProfileNode));
+        if (!profile->nodes) {
+            fprintf(stderr, "Couldn't grow a profile to %u call stacks\n", profile->node_capacity);
+            exit(1);
+        }
+    }
+
+    uint32_t index = profile->node_count++;
+    profile->nodes[index] = (struct ProfileNode) { .parent = parent, .addr = addr, .kind = kind };
+    return index;
+}
+
+static void grow_children(struct Profile* profile) {
+    uint64_t* old_keys = profile->child_keys;
+    uint32_t* old_children = profile->children;
+    uint32_t old_capacity = profile->child_capacity;
+
+    profile->child_capacity = old_capacity ? old_capacity * 2 : PROFILE_INITIAL_NODES * 2;
+    profile->child_keys = alloc_zeroed(profile->child_capacity, sizeof(uint64_t));
+    profile->children = alloc_zeroed(profile->child_capacity, sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (!old_keys[i]) continue;
+        uint32_t slot = hash_slot(old_keys[i], profile->child_capacity);
+        while (profile->child_keys[slot]) slot = (slot + 1) & (profile->child_capacity - 1);
+        profile->child_keys[slot] = old_keys[i];
+        profile->children[slot] = old_children[i];
+    }
+
+    free(old_keys);
+    free(old_children);
+}
+
+// Never 0, a child's kind never is
+static inline uint64_t child_key(uint32_t parent, enum ProfileFrameKind kind, uint32_t addr) {
+    return ((uint64_t)parent << 32) | ((uint64_t)kind << 24) | (addr & 0xFFFFFF);
+}
+
+static uint32_t find_child(struct Profile* profile, uint32_t parent, enum ProfileFrameKind kind, uint32_t addr) {
+    uint64_t key = child_key(parent, kind, addr);
+    uint32_t slot = hash_slot(key, profile->child_capacity);
+    while (profile->child_keys[slot]) {
+        if (profile->child_keys[slot] == key) return profile->children[slot];
+        slot = (slot + 1) & (profile->child_capacity - 1);
+    }
+
+    if ((profile->node_count + 1) * 2 > profile->child_capacity) {
+        grow_children(profile);
+        return find_child(profile, parent, kind, addr);
+    }
+
+    profile->child_keys[slot] = key;
+    profile->children[slot] = new_node(profile, parent, kind, addr);
+    return profile->children[slot];
+}
+
+struct Profile* profile_create() {
+    struct Profile* profile = calloc(1, sizeof(struct Profile));
+    if (!profile) return NULL;
+
+    grow_pcs(profile);
+    grow_children(profile);
+    new_node(profile, 0, PROFILE_FRAME_ROOT, 0);
+    profile->fallthrough = ~0u;
+    return profile;
+}
+
+void profile_free(struct Profile* profile) {
+    if (!profile) return;
+    free(profile->pc_keys);
+    free(profile->pcs);
+    free(profile->nodes);
+    free(profile->child_keys);
+    free(profile->children);
+    free(profile);
+}
+
+static void push_frame(struct Profile* profile, enum ProfileFrameKind kind, uint32_t addr, uint16_t S) {
+    if (profile->depth == PROFILE_MAX_DEPTH) return;
+
+    uint32_t node = find_child(profile, profile->node, kind, addr);
+    profile->nodes[node].calls++;
+    profile->stack[profile->depth++] = (struct ProfileFrame) { .node = node, .S = S };
+    profile->node = node;
+}
+
+// Everything whose return address is now above the stack has returned
+static void pop_frames(struct Profile* profile, uint16_t S) {
+    while (profile->depth && profile->stack[profile->depth - 1].S < S) profile->depth--;
+    profile->node = profile->depth ? profile->stack[profile->depth - 1].node : 0;
+}
+
+void profile_record(struct Profile* profile, uint32_t pc, uint8_t opcode, int mode, uint32_t cycles,
+    bool ends_block, uint32_t next_pc, uint16_t S) {
+    profile->count++;
+    profile->cycles += cycles;
+
+    struct ProfileOpcode* op = &profile->opcodes[mode][opcode];
+    op->count++;
+    op->cycles += cycles;
+
+    struct ProfilePc* entry = find_pc(profile, pc);
+    entry->count++;
+    entry->cycles += cycles;
+    entry->opcode = opcode;
+    if (pc != profile->fallthrough) entry->block_starts++;
+    profile->fallthrough = ends_block ? ~0u : next_pc;
+
+    // Before any frame change, so a call's cycles go to the caller and a return's to the callee
+    struct ProfileNode* node = &profile->nodes[profile->node];
+    node->count++;
+    node->cycles += cycles;
+
+    switch (opcode) {
+        case 0x20: case 0x22: case 0xFC: push_frame(profile, PROFILE_FRAME_CALL, next_pc, S); break;
+        case 0x00: push_frame(profile, PROFILE_FRAME_BRK, next_pc, S); break;
+        case 0x02: push_frame(profile, PROFILE_FRAME_COP, next_pc, S); break;
+        case 0x40: case 0x60: case 0x6B: pop_frames(profile, S); break;
+    }
+}
+
+void profile_interrupt(struct Profile* profile, enum ProfileFrameKind kind, uint32_t handler_pc, uint16_t S) {
+    profile->fallthrough = ~0u;
+    push_frame(profile, kind, handler_pc, S);
+}
+
+static void format_frame(const struct ProfileNode* node, char* buf, size_t size) {
+    static const char* prefixes[] = {
+        [PROFILE_FRAME_CALL] = "",
+        [PROFILE_FRAME_NMI] = "nmi@",
+        [PROFILE_FRAME_IRQ] = "irq@",
+        [PROFILE_FRAME_BRK] = "brk@",
+        [PROFILE_FRAME_COP] = "cop@",
+    };
+
+    if (node->kind == PROFILE_FRAME_ROOT) {
+        snprintf(buf, size, "root");
+    } else {
+        snprintf(buf, size, "%s%02X:%04X", prefixes[node->kind], node->addr >> 16, node->addr & 0xFFFF);
+    }
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * part / whole : 0;
+}
+
+// Sorted through an index, for qsort without anywhere to pass the profile
+struct ReportRow {
+    uint64_t sort_key;
+    uint32_t index;
+};
+
+static int compare_rows(const void* a, const void* b) {
+    uint64_t x = ((const struct ReportRow*)a)->sort_key;
+    uint64_t y = ((const struct ReportRow*)b)->sort_key;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void write_opcodes(struct Profile* profile, FILE* out) {
+    struct ReportRow rows[PROFILE_MODES * 256];
+    int count = 0;
+    for (int i = 0; i < PROFILE_MODES * 256; i++) {
+        struct ProfileOpcode* op = &profile->opcodes[i / 256][i % 256];
+        if (op->count) rows[count++] = (struct ReportRow) { op->cycles, i };
+    }
+    qsort(rows, count, sizeof(rows[0]), compare_rows);
+
+    fprintf(out, "\nopcodes by cycles\n");
+    fprintf(out, "  op  name mode           count         cycles  cyc/op      %%\n");
+    for (int i = 0; i < count; i++) {
+        int mode = rows[i].index / 256;
+        int opcode = rows[i].index % 256;
+        struct ProfileOpcode* op = &profile->opcodes[mode][opcode];
+        fprintf(out, "  %02X  %-4s %-6s %12lu %14lu %7.2f %6.2f\n", opcode, opcode_info[opcode].mnemonic,
+            mode_names[mode], op->count, op->cycles, (double)op->cycles / op->count, percent(op->cycles, profile->cycles));
+    }
+}
+
+static void write_pcs(struct Profile* profile, FILE* out, bool by_block_starts) {
+    struct ReportRow* rows = alloc_zeroed(profile->pc_count, sizeof(struct ReportRow));
+    int count = 0;
+    for (uint32_t i = 0; i < profile->pc_capacity; i++) {
+        if (!profile->pc_keys[i]) continue;
+        struct ProfilePc* entry = &profile->pcs[i];
+        uint64_t key = by_block_starts ? entry->block_starts : entry->cycles;
+        if (key) rows[count++] = (struct ReportRow) { key, i };
+    }
+    qsort(rows, count, sizeof(rows[0]), compare_rows);
+
+    if (by_block_starts) {
+        fprintf(out, "\nblock starts, top %d of %d\n", PROFILE_REPORT_ROWS, count);
+    } else {
+        fprintf(out, "\npcs by cycles, top %d of %u\n", PROFILE_REPORT_ROWS, profile->pc_count);
+    }
+    fprintf(out, "  pc       name        count         cycles      %%  block_starts\n");
+    for (int i = 0; i < count && i < PROFILE_REPORT_ROWS; i++) {
+        uint32_t pc = profile->pc_keys[rows[i].index] - 1;
+        struct ProfilePc* entry = &profile->pcs[rows[i].index];
+        fprintf(out, "  %02X:%04X  %-4s %12lu %14lu %6.2f  %12u\n", pc >> 16, pc & 0xFFFF, opcode_info[entry->opcode].mnemonic,
+            entry->count, entry->cycles, percent(entry->cycles, profile->cycles), entry->block_starts);
+    }
+    free(rows);
+}
+
+static bool same_routine(const struct ProfileNode* a, const struct ProfileNode* b) {
+    return a->kind == b->kind && a->addr == b->addr;
+}
+
+// Every call tree node of the same routine rolled into one. Inclusive cycles
+// only come from the outermost of a recursive run, so they're not counted twice
+static void write_routines(struct Profile* profile, FILE* out) {
+    uint32_t count = profile->node_count;
+    // Children always come after their parents, so one pass backwards totals them up
+    uint64_t* inclusive = alloc_zeroed(count, sizeof(uint64_t));
+    for (uint32_t i = count; i-- > 0;) {
+        inclusive[i] += profile->nodes[i].cycles;
+        if (i) inclusive[profile->nodes[i].parent] += inclusive[i];
+    }
+
+    // Sorted by routine so each one's nodes end up next to each other
+    struct ReportRow* nodes = alloc_zeroed(count, sizeof(struct ReportRow));
+    for (uint32_t i = 0; i < count; i++) {
+        nodes[i] = (struct ReportRow) { child_key(0, profile->nodes[i].kind, profile->nodes[i].addr), i };
+    }
+    qsort(nodes, count, sizeof(nodes[0]), compare_rows);
+
+    struct RoutineRow {
+        uint32_t node; // Any one of them, for the name
+        uint64_t calls;
+        uint64_t self;
+        uint64_t inclusive;
+    };
+    struct RoutineRow* routines = alloc_zeroed(count, sizeof(struct RoutineRow));
+    struct ReportRow* rows = alloc_zeroed(count, sizeof(struct ReportRow));
+    int routine_count = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!i || nodes[i].sort_key != nodes[i - 1].sort_key) routines[routine_count++].node = nodes[i].index;
+        struct RoutineRow* routine = &routines[routine_count - 1];
+
+        uint32_t index = nodes[i].index;
+        struct ProfileNode* node = &profile->nodes[index];
+        routine->calls += node->calls;
+        routine->self += node->cycles;
+
+        bool recursive = false;
+        for (uint32_t parent = index; parent && !recursive;) {
+            parent = profile->nodes[parent].parent;
+            recursive = same_routine(&profile->nodes[parent], node);
+        }
+        if (!recursive) routine->inclusive += inclusive[index];
+    }
+
+    for (int i = 0; i < routine_count; i++) rows[i] = (struct ReportRow) { routines[i].inclusive, i };
+    qsort(rows, routine_count, sizeof(rows[0]), compare_rows);
+
+    fprintf(out, "\nroutines by inclusive cycles, top %d of %d\n", PROFILE_REPORT_ROWS, routine_count);
+    fprintf(out, "  routine            calls      inclusive      %%           self      %%\n");
+    for (int i = 0; i < routine_count && i < PROFILE_REPORT_ROWS; i++) {
+        struct RoutineRow* routine = &routines[rows[i].index];
+        char name[32];
+        format_frame(&profile->nodes[routine->node], name, sizeof(name));
+        fprintf(out, "  %-14s %9lu %14lu %6.2f %14lu %6.2f\n", name, routine->calls, routine->inclusive,
+            percent(routine->inclusive, profile->cycles), routine->self, percent(routine->self, profile->cycles));
+    }
+
+    free(inclusive);
+    free(nodes);
+    free(routines);
+    free(rows);
+}
+
+void profile_write_report(struct Profile* profile, FILE* out, const char* title) {
+    fprintf(out, "profile %s\n", title);
+    fprintf(out, "instructions %lu\n", profile->count);
+    fprintf(out, "cycles %lu\n", profile->cycles);
+    fprintf(out, "pcs %u\n", profile->pc_count);
+    fprintf(out, "call_stacks %u\n", profile->node_count);
+
+    write_opcodes(profile, out);
+    write_pcs(profile, out, false);
+    write_pcs(profile, out, true);
+    write_routines(profile, out);
+}
+
+void profile_write_folded(struct Profile* profile, FILE* out) {
+    for (uint32_t i = 0; i < profile->node_count; i++) {
+        if (!profile->nodes[i].cycles) continue;
+
+        // Walked up from the leaf, written out from the root
+        uint32_t path[PROFILE_MAX_DEPTH + 1];
+        int length = 0;
+        for (uint32_t node = i;; node = profile->nodes[node].parent) {
+            path[length++] = node;
+            if (!node) break;
+        }
+
+        for (int j = length - 1; j >= 0; j--) {
+            char name[32];
+            format_frame(&profile->nodes[path[j]], name, sizeof(name));
+            fprintf(out, "%s%c", name, j ? ';' : ' ');
+        }
+        fprintf(out, "%lu\n", profile->nodes[i].cycles);
+    }
+}
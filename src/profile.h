@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Execution profile of one instance: every instruction the interpreter runs,
+// counted and timed in master cycles three ways.
+//
+// - By opcode and CPU mode, which is which handler ran
+// - By 24-bit PC, in an open addressed table that only grows with the code
+//   that actually runs. The PCs are kept apart from their counts so probing
+//   goes through 16 to a cache line. Also counts how often each PC started a
+//   block the way the block cache splits them (bar its length and page
+//   limits), to check the JIT's choice of hot blocks against
+// - By call stack. JSR/JSL push a frame and RTS/RTL pop it, the same for
+//   interrupts and RTI. Frames are popped by where S has got back to rather
+//   than one per return, so a routine that drops its return address and
+//   returns for its caller, or an RTS used as a jump, doesn't throw it off
+//
+// A cycle is only counted when an instruction's done, so the time it took
+// includes whatever DMA it set off or wait it went into. Hardware interrupts'
+// own 7 or 8 cycles aren't counted.
+
+#define PROFILE_MODES 5
+// Frames deeper than this are run as part of the one above
+#define PROFILE_MAX_DEPTH 64
+
+enum ProfileFrameKind {
+    PROFILE_FRAME_ROOT,
+    PROFILE_FRAME_CALL,
+    PROFILE_FRAME_NMI,
+    PROFILE_FRAME_IRQ,
+    PROFILE_FRAME_BRK,
+    PROFILE_FRAME_COP,
+};
+
+struct ProfileOpcode {
+    uint64_t count;
+    uint64_t cycles;
+};
+
+struct ProfilePc {
+    uint64_t count;
+    uint64_t cycles;
+    uint32_t block_starts;
+    uint8_t opcode; // The last one seen there, code in RAM can change
+};
+
+// One place in the call tree, a routine as called from one particular stack
+struct ProfileNode {
+    uint32_t parent;
+    uint32_t addr;
+    uint8_t kind;
+    uint64_t calls;
+    uint64_t count;
+    uint64_t cycles; // Only the instructions in it, not the ones it called
+};
+
+struct ProfileFrame {
+    uint32_t node;
+    uint16_t S; // Just after the return address went on
+};
+
+struct Profile {
+    struct ProfileOpcode opcodes[PROFILE_MODES][256];
+    uint64_t count;
+    uint64_t cycles;
+
+    // PC + 1, 0 is empty. Power of two sized, never more than half full
+    uint32_t* pc_keys;
+    struct ProfilePc* pcs;
+    uint32_t pc_capacity;
+    uint32_t pc_count;
+
+    // Node 0 is the root, whatever was running when profiling started
+    struct ProfileNode* nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    // (parent, kind, addr) to child, same scheme as the PCs
+    uint64_t* child_keys;
+    uint32_t* children;
+    uint32_t child_capacity;
+
+    struct ProfileFrame stack[PROFILE_MAX_DEPTH];
+    int depth;
+    uint32_t node; // The one instructions are going to
+
+    // Where the next instruction has to be to carry on the same block, ~0 if it can't
+    uint32_t fallthrough;
+};
+
+struct Profile* profile_create();
+void profile_free(struct Profile* profile);
+
+// After every instruction. `mode` is the CPU mode it ran in, `ends_block`
+// whether the block cache would end a block on it, and `next_pc` and `S` are
+// how it left them
+void profile_record(struct Profile* profile, uint32_t pc, uint8_t opcode, int mode, uint32_t cycles,
+    bool ends_block, uint32_t next_pc, uint16_t S);
+// After a hardware interrupt's been taken
+void profile_interrupt(struct Profile* profile, enum ProfileFrameKind kind, uint32_t handler_pc, uint16_t S);
+
+// Flat report, hottest first
+void profile_write_report(struct Profile* profile, FILE* out, const char* title);
+// One "frame;frame;frame cycles" line per stack, for flamegraph.pl and friends
+void profile_write_folded(struct Profile* profile, FILE* out);
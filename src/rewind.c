@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include "rewind.h"
+
+// Codec tokens. A control byte below 0x80 is followed by that many plus one
+// literal bytes, anything else repeats the next byte (control & 0x7F) + 1 times
+#define RLE_MAX 128
+#define RLE_REPEAT 0x80
+// Repeats shorter than this aren't worth breaking a literal run for
+#define RLE_MIN_REPEAT 3
+
+bool rewind_init(struct Rewind* rewind, size_t capacity) {
+    memset(rewind, 0, sizeof(*rewind));
+    rewind->buffer = malloc(capacity);
+    rewind->capacity = rewind->buffer ? capacity : 0;
+    return rewind->buffer != NULL;
+}
+
+void rewind_free(struct Rewind* rewind) {
+    free(rewind->buffer);
+    rewind->buffer = NULL;
+    rewind->capacity = 0;
+    rewind->count = 0;
+}
+
+static struct RewindEntry* entry_at(struct Rewind* rewind, int index) {
+    return &rewind->entries[(rewind->first + index) % REWIND_MAX_ENTRIES];
+}
+
+static void drop_oldest(struct Rewind* rewind) {
+    rewind->first = (rewind->first + 1) % REWIND_MAX_ENTRIES;
+    rewind->count--;
+}
+
+uint8_t* rewind_begin(struct Rewind* rewind, size_t max_size) {
+    if (max_size > rewind->capacity) return NULL;
+
+    if (rewind->head + max_size > rewind->capacity) {
+        // Wrap. Whatever's left between here and the end is the oldest stuff
+        while (rewind->count && entry_at(rewind, 0)->offset >= rewind->head) drop_oldest(rewind);
+        rewind->head = 0;
+    }
+
+    while (rewind->count) {
+        struct RewindEntry* oldest = entry_at(rewind, 0);
+        bool overlaps = oldest->offset < rewind->head + max_size && oldest->offset + oldest->size > rewind->head;
+        if (!overlaps && rewind->count < REWIND_MAX_ENTRIES) break;
+        drop_oldest(rewind);
+    }
+
+    // Deltas are no use without the keyframe they build on. If that was the
+    // last keyframe the ring's empty now, and the caller has to make this one
+    while (rewind->count && !entry_at(rewind, 0)->keyframe) drop_oldest(rewind);
+
+    return rewind->buffer + rewind->head;
+}
+
+void rewind_commit(struct Rewind* rewind, uint64_t frame, bool keyframe, size_t size) {
+    *entry_at(rewind, rewind->count++) = (struct RewindEntry) {
+        .frame = frame,
+        .offset = rewind->head,
+        .size = size,
+        .keyframe = keyframe,
+    };
+    rewind->head += size;
+}
+
+const struct RewindEntry* rewind_entry(const struct Rewind* rewind, int index) {
+    if (index < 0 || index >= rewind->count) return NULL;
+    return &rewind->entries[(rewind->first + index) % REWIND_MAX_ENTRIES];
+}
+
+const uint8_t* rewind_data(const struct Rewind* rewind, const struct RewindEntry* entry) {
+    return rewind->buffer + entry->offset;
+}
+
+void rewind_truncate(struct Rewind* rewind, int count) {
+    if (count >= rewind->count) return;
+    rewind->count = count < 0 ? 0 : count;
+
+    // Carry on right after the last one kept
+    if (rewind->count) {
+        struct RewindEntry* last = entry_at(rewind, rewind->count - 1);
+        rewind->head = last->offset + last->size;
+    } else {
+        rewind->head = 0;
+    }
+}
+
+size_t rewind_compress(const uint8_t* in, size_t size, uint8_t* out) {
+    size_t o = 0;
+    size_t i = 0;
+    size_t literal_start = 0;
+
+    while (i < size) {
+        size_t run = 1;
+        while (i + run < size && run < RLE_MAX && in[i + run] == in[i]) run++;
+
+        if (run < RLE_MIN_REPEAT) {
+            i += run;
+            continue;
+        }
+
+        // Flush the literals in front of the repeat
+        while (literal_start < i) {
+            size_t length = i - literal_start < RLE_MAX ? i - literal_start : RLE_MAX;
+            out[o++] = length - 1;
+            memcpy(out + o, in + literal_start, length);
+            o += length;
+            literal_start += length;
+        }
+
+        out[o++] = RLE_REPEAT | (run - 1);
+        out[o++] = in[i];
+        i += run;
+        literal_start = i;
+    }
+
+    while (literal_start < size) {
+        size_t length = size - literal_start < RLE_MAX ? size - literal_start : RLE_MAX;
+        out[o++] = length - 1;
+        memcpy(out + o, in + literal_start, length);
+        o += length;
+        literal_start += length;
+    }
+
+    return o;
+}
+
+size_t rewind_decompress(const uint8_t* in, size_t in_size, uint8_t* out, size_t size) {
+    size_t i = 0;
+    size_t o = 0;
+
+    while (o < size && i < in_size) {
+        uint8_t control = in[i++];
+        size_t length = (control & 0x7F) + 1;
+        if (o + length > size) return 0;
+
+        if (control & RLE_REPEAT) {
+            if (i >= in_size) return 0;
+            memset(out + o, in[i++], length);
+        } else {
+            if (i + length > in_size) return 0;
+            memcpy(out + o, in + i, length);
+            i += length;
+        }
+        o += length;
+    }
+
+    return o == size ? i : 0;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Rewind history. A fixed size byte ring of entries, each one whatever main.c
+// captured at some frame: normally just the pages dirtied since the previous
+// entry, with a keyframe of everything every so often. Once the ring's full the
+// oldest entries make room, along with any deltas left without their keyframe,
+// so memory use never grows past what was asked for.
+//
+// Page data goes through rewind_compress(), a byte RLE. Deltas are XORed
+// against the page as it was at the previous entry first, which leaves little
+// but zero runs.
+
+#define REWIND_MAX_ENTRIES 4096
+
+// Worst case rewind_compress() output for `size` bytes in
+#define REWIND_COMPRESS_BOUND(size) ((size) + (size) / 128 + 1)
+
+struct RewindEntry {
+    uint64_t frame;
+    size_t offset;
+    size_t size;
+    bool keyframe;
+};
+
+struct Rewind {
+    uint8_t* buffer;
+    size_t capacity;
+    // Where the next entry goes
+    size_t head;
+
+    // Oldest first, circular
+    struct RewindEntry entries[REWIND_MAX_ENTRIES];
+    int first;
+    int count;
+};
+
+bool rewind_init(struct Rewind* rewind, size_t capacity);
+void rewind_free(struct Rewind* rewind);
+
+// Makes room for an entry of up to `max_size` bytes and returns where to write it.
+// NULL if it wouldn't fit even with the ring empty. The ring always starts with
+// a keyframe, so if this leaves it empty the next entry has to be one
+uint8_t* rewind_begin(struct Rewind* rewind, size_t max_size);
+// Adds the entry started by rewind_begin(), `size` being what was actually used
+void rewind_commit(struct Rewind* rewind, uint64_t frame, bool keyframe, size_t size);
+
+// 0 is the oldest
+const struct RewindEntry* rewind_entry(const struct Rewind* rewind, int index);
+const uint8_t* rewind_data(const struct Rewind* rewind, const struct RewindEntry* entry);
+// Drops everything after the first `count` entries
+void rewind_truncate(struct Rewind* rewind, int count);
+
+size_t rewind_compress(const uint8_t* in, size_t size, uint8_t* out);
+// Returns the bytes of `in` used, 0 if it doesn't decode to exactly `size` bytes
+size_t rewind_decompress(const uint8_t* in, size_t in_size, uint8_t* out, size_t size);
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rom.h"
+
+// A copier device or the like sometimes prepends one of these
+#define COPIER_HEADER_SIZE 512
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Rom* registry;
+
+// FNV-1a, a word at a time. Only has to tell carts apart, not resist anyone
+static uint64_t hash_data(const uint8_t* data, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x100000001B3;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001B3;
+    }
+
+    return hash;
+}
+
+static struct Rom* find_by_file(struct stat* info) {
+    for (struct Rom* rom = registry; rom; rom = rom->next) {
+        if (rom->device == (uint64_t)info->st_dev && rom->inode == (uint64_t)info->st_ino &&
+            rom->mapping_size == (size_t)info->st_size && rom->mtime == (int64_t)info->st_mtime) {
+            return rom;
+        }
+    }
+    return NULL;
+}
+
+static struct Rom* find_by_content(const uint8_t* data, size_t size, uint64_t hash) {
+    for (struct Rom* rom = registry; rom; rom = rom->next) {
+        if (rom->hash == hash && rom->size == size && !memcmp(rom->data, data, size)) return rom;
+    }
+    return NULL;
+}
+
+struct Rom* rom_acquire(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) || info.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&registry_lock);
+
+    struct Rom* rom = find_by_file(&info);
+    if (rom) {
+        rom->refs++;
+        pthread_mutex_unlock(&registry_lock);
+        close(fd);
+        return rom;
+    }
+
+    void* mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        pthread_mutex_unlock(&registry_lock);
+        return NULL;
+    }
+
+    // mmap can't start halfway into a page, so skip the header by pointer instead
+    size_t skip = (info.st_size % 1024 == COPIER_HEADER_SIZE) ? COPIER_HEADER_SIZE : 0;
+
+    const uint8_t* data = (const uint8_t*)mapping + skip;
+    size_t size = info.st_size - skip;
+    uint64_t hash = hash_data(data, size);
+
+    rom = find_by_content(data, size, hash);
+    if (rom) {
+        // Same cart under another name. Keep the first mapping
+        munmap(mapping, info.st_size);
+        rom->refs++;
+        pthread_mutex_unlock(&registry_lock);
+        return rom;
+    }
+
+    rom = calloc(1, sizeof(struct Rom));
+    if (!rom) {
+        munmap(mapping, info.st_size);
+        pthread_mutex_unlock(&registry_lock);
+        return NULL;
+    }
+
+    rom->data = data;
+    rom->size = size;
+    rom->hash = hash;
+    rom->header_size = skip;
+    rom->mapping = mapping;
+    rom->mapping_size = info.st_size;
+    rom->device = info.st_dev;
+    rom->inode = info.st_ino;
+    rom->mtime = info.st_mtime;
+    rom->refs = 1;
+    rom->next = registry;
+    registry = rom;
+
+    pthread_mutex_unlock(&registry_lock);
+    return rom;
+}
+
+void rom_retain(struct Rom* rom) {
+    pthread_mutex_lock(&registry_lock);
+    rom->refs++;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void rom_release(struct Rom* rom) {
+    if (!rom) return;
+
+    pthread_mutex_lock(&registry_lock);
+
+    if (--rom->refs > 0) {
+        pthread_mutex_unlock(&registry_lock);
+        return;
+    }
+
+    for (struct Rom** link = &registry; *link; link = &(*link)->next) {
+        if (*link != rom) continue;
+        *link = rom->next;
+        break;
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+
+    munmap(rom->mapping, rom->mapping_size);
+    free(rom);
+}
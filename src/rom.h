@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Cartridge images, mapped read-only straight from the file and shared by
+// every instance in the process. Nothing ever writes to ROM, so the pages are
+// just the page cache's own and cost nothing per instance.
+//
+// Loads are looked up by file identity first (device, inode, size, mtime), so
+// loading the same file again doesn't even read it. A file we haven't seen
+// gets hashed and checked against what's loaded by content, so the same cart
+// under two names still ends up as one mapping.
+
+struct Rom {
+    // ROM proper, past any copier header
+    const uint8_t* data;
+    size_t size;
+    uint64_t hash;
+    // The copier header skipped over to get there, 0 if there wasn't one
+    size_t header_size;
+
+    // Private to rom.c
+    void* mapping;
+    size_t mapping_size;
+    uint64_t device;
+    uint64_t inode;
+    int64_t mtime;
+    int refs;
+    struct Rom* next;
+};
+
+// Maps the file (or hands back the existing mapping of it) and takes a reference.
+// NULL if the file can't be opened or is empty
+struct Rom* rom_acquire(const char* path);
+// Another reference to a ROM that's already held, for forks
+void rom_retain(struct Rom* rom);
+// Drops a reference, unmapping once the last one's gone
+void rom_release(struct Rom* rom);
@@ -0,0 +1,76 @@
+#include "scheduler.h"
+
+static void swap_events(struct Scheduler* scheduler, int a, int b) {
+    struct Event temp = scheduler->heap[a];
+    scheduler->heap[a] = scheduler->heap[b];
+    scheduler->heap[b] = temp;
+}
+
+static void sift_up(struct Scheduler* scheduler, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (scheduler->heap[parent].time <= scheduler->heap[i].time) break;
+        swap_events(scheduler, i, parent);
+        i = parent;
+    }
+}
+
+static void sift_down(struct Scheduler* scheduler, int i) {
+    while (true) {
+        int smallest = i;
+        int left = i * 2 + 1;
+        int right = left + 1;
+
+        if (left < scheduler->size && scheduler->heap[left].time < scheduler->heap[smallest].time) smallest = left;
+        if (right < scheduler->size && scheduler->heap[right].time < scheduler->heap[smallest].time) smallest = right;
+        if (smallest == i) break;
+
+        swap_events(scheduler, i, smallest);
+        i = smallest;
+    }
+}
+
+static void update_deadline(struct Scheduler* scheduler) {
+    scheduler->deadline = scheduler->size ? scheduler->heap[0].time : UINT64_MAX;
+}
+
+static void remove_at(struct Scheduler* scheduler, int i) {
+    scheduler->size--;
+    if (i != scheduler->size) {
+        scheduler->heap[i] = scheduler->heap[scheduler->size];
+        sift_down(scheduler, i);
+        sift_up(scheduler, i);
+    }
+}
+
+void scheduler_reset(struct Scheduler* scheduler) {
+    scheduler->now = 0;
+    scheduler->size = 0;
+    update_deadline(scheduler);
+}
+
+void cancel_event(struct Scheduler* scheduler, enum EventType type) {
+    for (int i = 0; i < scheduler->size; i++) {
+        if (scheduler->heap[i].type != type) continue;
+        remove_at(scheduler, i);
+        break;
+    }
+    update_deadline(scheduler);
+}
+
+void schedule_event(struct Scheduler* scheduler, enum EventType type, uint64_t time) {
+    cancel_event(scheduler, type);
+
+    scheduler->heap[scheduler->size] = (struct Event) { .time = time, .type = type };
+    sift_up(scheduler, scheduler->size++);
+    update_deadline(scheduler);
+}
+
+bool pop_due_event(struct Scheduler* scheduler, enum EventType* type) {
+    if (!scheduler->size || scheduler->heap[0].time > scheduler->now) return false;
+
+    *type = scheduler->heap[0].type;
+    remove_at(scheduler, 0);
+    update_deadline(scheduler);
+    return true;
+}
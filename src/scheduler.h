@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Master clock and the queue of upcoming timed events. The CPU runs flat out
+// until `deadline` (the earliest queued event) and only then do events get
+// looked at, so nothing is polled per instruction.
+
+// All in master clock cycles (~21.477 MHz NTSC)
+#define MASTER_CYCLES_FAST 6
+#define MASTER_CYCLES_SLOW 8
+#define MASTER_CYCLES_XSLOW 12
+
+#define MASTER_CYCLES_PER_LINE 1364
+#define LINES_PER_FRAME 262
+#define VBLANK_START_LINE 225
+#define HBLANK_START_MASTER (274 * 4)
+
+enum EventType {
+    EVENT_SCANLINE, // Start of a new line, drives V and vblank/NMI
+    EVENT_HBLANK,
+    EVENT_HV_IRQ,
+    EVENT_INTERRUPT_CHECK, // Something unmasked a pending IRQ, look at it ASAP
+
+    EVENT_TYPE_COUNT,
+};
+
+struct Event {
+    uint64_t time;
+    uint8_t type;
+};
+
+struct Scheduler {
+    uint64_t now;
+    uint64_t deadline;
+
+    // Min-heap on time. There's never more than one pending event per type
+    struct Event heap[EVENT_TYPE_COUNT];
+    int size;
+};
+
+void scheduler_reset(struct Scheduler* scheduler);
+// Replaces any pending event of the same type
+void schedule_event(struct Scheduler* scheduler, enum EventType type, uint64_t time);
+void cancel_event(struct Scheduler* scheduler, enum EventType type);
+// Pops the earliest event if it's due, returns false if nothing is
+bool pop_due_event(struct Scheduler* scheduler, enum EventType* type);
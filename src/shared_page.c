@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shared_page.h"
+
+struct SharedPage* new_shared_page() {
+    struct SharedPage* page = malloc(sizeof(struct SharedPage));
+    if (!page) {
+        fprintf(stderr, "Couldn't allocate a page\n");
+        exit(1);
+    }
+    page->refs = 1;
+    return page;
+}
+
+struct SharedPage* retain_shared_page(struct SharedPage* page) {
+    __atomic_add_fetch(&page->refs, 1, __ATOMIC_RELAXED);
+    return page;
+}
+
+void release_shared_page(struct SharedPage* page) {
+    if (__atomic_sub_fetch(&page->refs, 1, __ATOMIC_ACQ_REL) == 0) free(page);
+}
+
+bool unshare_page(struct SharedPage** slot, bool copy) {
+    struct SharedPage* page = *slot;
+    if (shared_page_private(page)) return false;
+
+    struct SharedPage* own = new_shared_page();
+    if (copy) memcpy(own->data, page->data, SHARED_PAGE_SIZE);
+    *slot = own;
+    release_shared_page(page);
+    return true;
+}
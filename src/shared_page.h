@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// A page of memory that forks share until one of them writes to it. Whoever
+// holds the only reference can write in place, anyone else copies it first.
+// WRAM, VRAM and ARAM all live in these, so forking an instance costs a
+// reference count per page rather than a copy of each.
+//
+// The counts are atomic, forks can be running on different threads, but a page
+// is only ever written by the one instance holding it alone.
+
+#define SHARED_PAGE_SIZE 0x1000
+
+struct SharedPage {
+    int refs;
+    uint8_t data[SHARED_PAGE_SIZE];
+};
+
+// One reference, contents left to the caller
+struct SharedPage* new_shared_page();
+struct SharedPage* retain_shared_page(struct SharedPage* page);
+void release_shared_page(struct SharedPage* page);
+
+static inline bool shared_page_private(const struct SharedPage* page) {
+    return __atomic_load_n(&page->refs, __ATOMIC_ACQUIRE) == 1;
+}
+
+// Swaps `*slot` for a page of its own if it's shared, returns whether it had to.
+// Without `copy` the new page's contents are left to the caller
+bool unshare_page(struct SharedPage** slot, bool copy);
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "snapshot.h"
+
+// Equal bytes a delta run will swallow rather than start a new one, which
+// would cost a run header of its own
+#define DELTA_MERGE_GAP 8
+
+struct DeltaRun {
+    uint32_t offset;
+    uint32_t size;
+};
+
+static uint64_t next_id;
+
+static void reserve(struct Snapshot* snapshot, size_t size) {
+    if (size <= snapshot->capacity) return;
+
+    size_t capacity = snapshot->capacity ? snapshot->capacity : 4096;
+    while (capacity < size) capacity *= 2;
+
+    snapshot->data = realloc(snapshot->data, capacity);
+    if (!snapshot->data) {
+        fprintf(stderr, "Couldn't grow a snapshot to %lu bytes\n", capacity);
+        exit(1);
+    }
+    snapshot->capacity = capacity;
+}
+
+static void append(struct Snapshot* snapshot, const void* data, size_t size) {
+    reserve(snapshot, snapshot->size + size);
+    memcpy(snapshot->data + snapshot->size, data, size);
+    snapshot->size += size;
+}
+
+static struct SnapshotHeader* header_of(const struct Snapshot* snapshot) {
+    if (snapshot->size < sizeof(struct SnapshotHeader)) return NULL;
+    return (struct SnapshotHeader*)snapshot->data;
+}
+
+void snapshot_free(struct Snapshot* snapshot) {
+    free(snapshot->data);
+    *snapshot = (struct Snapshot) { 0 };
+}
+
+void snapshot_begin(struct Snapshot* snapshot, uint64_t rom_hash) {
+    // Only has to tell this process's snapshots apart from each other and from
+    // ones loaded off disk, so the clock plus a counter does
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t count = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+
+    struct SnapshotHeader header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .kind = SNAPSHOT_FULL,
+        .id = ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec) ^ (count * 0x9E3779B97F4A7C15),
+        .rom_hash = rom_hash,
+    };
+
+    snapshot->size = 0;
+    append(snapshot, &header, sizeof(header));
+}
+
+void* snapshot_add(struct Snapshot* snapshot, uint32_t tag, size_t size) {
+    struct SnapshotSection section = { .tag = tag, .size = size };
+    append(snapshot, &section, sizeof(section));
+
+    reserve(snapshot, snapshot->size + size);
+    void* out = snapshot->data + snapshot->size;
+    snapshot->size += size;
+    return out;
+}
+
+void snapshot_write(struct Snapshot* snapshot, uint32_t tag, const void* data, size_t size) {
+    memcpy(snapshot_add(snapshot, tag, size), data, size);
+}
+
+void snapshot_end(struct Snapshot* snapshot) {
+    header_of(snapshot)->size = snapshot->size;
+}
+
+const char* snapshot_check(const struct Snapshot* snapshot, uint64_t rom_hash) {
+    struct SnapshotHeader* header = header_of(snapshot);
+    if (!header || header->magic != SNAPSHOT_MAGIC) return "not a snapshot";
+    if (header->version != SNAPSHOT_VERSION) return "snapshot is from another version";
+    if (header->kind != SNAPSHOT_FULL) return "snapshot is a delta";
+    if (header->size != snapshot->size) return "snapshot is truncated";
+    if (header->rom_hash != rom_hash) return "snapshot is of another ROM";
+    return NULL;
+}
+
+const void* snapshot_find(const struct Snapshot* snapshot, uint32_t tag, size_t size) {
+    size_t offset = sizeof(struct SnapshotHeader);
+
+    // Sections come back in the order they went in, so this is normally the first one looked at
+    while (offset + sizeof(struct SnapshotSection) <= snapshot->size) {
+        struct SnapshotSection section;
+        memcpy(&section, snapshot->data + offset, sizeof(section));
+        offset += sizeof(section);
+
+        if (section.size > snapshot->size - offset) return NULL;
+        if (section.tag == tag) return section.size == size ? snapshot->data + offset : NULL;
+        offset += section.size;
+    }
+
+    return NULL;
+}
+
+bool snapshot_read(const struct Snapshot* snapshot, uint32_t tag, void* out, size_t size) {
+    const void* data = snapshot_find(snapshot, tag, size);
+    if (data) memcpy(out, data, size);
+    return data != NULL;
+}
+
+// Compares a word at a time, anything past the end of `base` is different
+static bool differs(const struct Snapshot* base, const struct Snapshot* current, size_t offset, size_t size) {
+    if (offset + size > base->size) return true;
+    if (size == 8) {
+        uint64_t a, b;
+        memcpy(&a, base->data + offset, 8);
+        memcpy(&b, current->data + offset, 8);
+        return a != b;
+    }
+    return memcmp(base->data + offset, current->data + offset, size) != 0;
+}
+
+bool snapshot_is_delta(const struct Snapshot* snapshot) {
+    struct SnapshotHeader* header = header_of(snapshot);
+    return header && header->magic == SNAPSHOT_MAGIC && header->kind == SNAPSHOT_DELTA;
+}
+
+void snapshot_delta(const struct Snapshot* base, const struct Snapshot* current, struct Snapshot* delta) {
+    struct SnapshotHeader header = *header_of(current);
+    header.kind = SNAPSHOT_DELTA;
+    header.id = header_of(base)->id;
+
+    delta->size = 0;
+    append(delta, &header, sizeof(header));
+
+    size_t common = base->size < current->size ? base->size : current->size;
+    size_t offset = 0;
+    while (offset < current->size) {
+        // Most of it's the same, so skip a cache line at a time while it is
+        if (offset + 64 <= common && !memcmp(base->data + offset, current->data + offset, 64)) {
+            offset += 64;
+            continue;
+        }
+
+        size_t chunk = current->size - offset < 8 ? current->size - offset : 8;
+        if (!differs(base, current, offset, chunk)) {
+            offset += chunk;
+            continue;
+        }
+
+        // Grow the run until it's gone DELTA_MERGE_GAP bytes without a difference
+        size_t start = offset;
+        size_t end = offset + chunk;
+        offset = end;
+        while (offset < current->size && offset - end < DELTA_MERGE_GAP) {
+            chunk = current->size - offset < 8 ? current->size - offset : 8;
+            if (differs(base, current, offset, chunk)) end = offset + chunk;
+            offset += chunk;
+        }
+        offset = end;
+
+        struct DeltaRun run = { .offset = start, .size = end - start };
+        append(delta, &run, sizeof(run));
+        append(delta, current->data + start, run.size);
+    }
+}
+
+bool snapshot_apply_delta(const struct Snapshot* base, const struct Snapshot* delta, struct Snapshot* out) {
+    struct SnapshotHeader* base_header = header_of(base);
+    struct SnapshotHeader* header = header_of(delta);
+    if (!base_header || !header || header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION) return false;
+    if (header->kind != SNAPSHOT_DELTA || header->id != base_header->id) return false;
+
+    out->size = 0;
+    reserve(out, header->size);
+    memcpy(out->data, base->data, base->size < header->size ? base->size : header->size);
+    out->size = header->size;
+
+    size_t offset = sizeof(struct SnapshotHeader);
+    while (offset + sizeof(struct DeltaRun) <= delta->size) {
+        struct DeltaRun run;
+        memcpy(&run, delta->data + offset, sizeof(run));
+        offset += sizeof(run);
+
+        if (run.size > delta->size - offset || run.offset + run.size > out->size) return false;
+        memcpy(out->data + run.offset, delta->data + offset, run.size);
+        offset += run.size;
+    }
+
+    return offset == delta->size;
+}
+
+bool snapshot_load_file(struct Snapshot* snapshot, const char* path) {
+    FILE* in = fopen(path, "rb");
+    if (!in) return false;
+
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    snapshot->size = 0;
+    reserve(snapshot, size > 0 ? size : 1);
+    bool ok = size > 0 && fread(snapshot->data, 1, size, in) == (size_t)size;
+    snapshot->size = ok ? size : 0;
+
+    fclose(in);
+    return ok;
+}
+
+bool snapshot_save_file(const struct Snapshot* snapshot, const char* path) {
+    FILE* out = fopen(path, "wb");
+    if (!out) return false;
+
+    bool ok = fwrite(snapshot->data, 1, snapshot->size, out) == snapshot->size;
+    return fclose(out) == 0 && ok;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Save-state container. A snapshot is a small header followed by tagged
+// sections, each the raw bytes of one piece of machine state. This side only
+// knows about blobs; what goes in each section is main.c's business.
+//
+// Sections are written as the in-memory structs, so saving and loading is a
+// handful of memcpys. That means SNAPSHOT_VERSION has to be bumped whenever one
+// of those structs changes layout (a size mismatch gets caught regardless).
+//
+// A delta holds just the byte runs that differ from a base snapshot, and can
+// only be applied on top of that exact base (matched by id).
+
+#define SNAPSHOT_MAGIC 0x53534C43 // "CLSS"
+#define SNAPSHOT_VERSION 6
+
+enum SnapshotKind {
+    SNAPSHOT_FULL,
+    SNAPSHOT_DELTA,
+};
+
+struct SnapshotHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t kind;
+    // Unique per full snapshot, deltas carry their base's
+    uint64_t id;
+    uint64_t rom_hash;
+    // Of the full snapshot, header included
+    uint64_t size;
+};
+
+struct SnapshotSection {
+    uint32_t tag;
+    uint32_t size;
+};
+
+// Grows as needed and is meant to be reused, so repeat saves don't allocate
+struct Snapshot {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+};
+
+void snapshot_free(struct Snapshot* snapshot);
+
+void snapshot_begin(struct Snapshot* snapshot, uint64_t rom_hash);
+void snapshot_write(struct Snapshot* snapshot, uint32_t tag, const void* data, size_t size);
+// Adds a section of `size` bytes and returns where to fill it in, good until the next write
+void* snapshot_add(struct Snapshot* snapshot, uint32_t tag, size_t size);
+void snapshot_end(struct Snapshot* snapshot);
+
+// Checks the header of a full snapshot, NULL if it's fine or what's wrong otherwise
+const char* snapshot_check(const struct Snapshot* snapshot, uint64_t rom_hash);
+// Copies a section out. false if it's missing or not `size` bytes
+bool snapshot_read(const struct Snapshot* snapshot, uint32_t tag, void* out, size_t size);
+// Same, but hands back a pointer to the section in place. NULL if it's missing or not `size` bytes
+const void* snapshot_find(const struct Snapshot* snapshot, uint32_t tag, size_t size);
+
+bool snapshot_is_delta(const struct Snapshot* snapshot);
+// Encodes `current` against `base` into `delta`
+void snapshot_delta(const struct Snapshot* base, const struct Snapshot* current, struct Snapshot* delta);
+// Rebuilds the full snapshot from `base` and a delta of it. false if the delta's for another base
+bool snapshot_apply_delta(const struct Snapshot* base, const struct Snapshot* delta, struct Snapshot* out);
+
+bool snapshot_load_file(struct Snapshot* snapshot, const char* path);
+bool snapshot_save_file(const struct Snapshot* snapshot, const char* path);
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "trace.h"
+
+struct Trace trace;
+struct ExecTrace exec_trace = { .fd = -1 };
+
+// Only trace_init() needs these, and only when tracing is compiled in
+#ifdef TRACE_ENABLED
+static uint32_t parse_categories(const char* spec) {
+    uint32_t mask = 0;
+
+    const char* names[] = { "fetch", "disasm", "io", "apu", "exec" };
+    const uint32_t bits[] = { TRACE_FETCH, TRACE_DISASM, TRACE_IO, TRACE_APU, TRACE_EXEC };
+
+    while (*spec) {
+        size_t len = strcspn(spec, ",");
+
+        if (len == 3 && !strncmp(spec, "all", 3)) mask |= TRACE_ALL;
+
+        for (size_t i = 0; i < sizeof(bits) / sizeof(bits[0]); i++) {
+            if (strlen(names[i]) == len && !strncmp(spec, names[i], len)) mask |= bits[i];
+        }
+
+        spec += len;
+        if (*spec == ',') spec++;
+    }
+
+    return mask;
+}
+#endif
+
+static void map_exec_trace_window() {
+    int result = ftruncate(exec_trace.fd, exec_trace.window_offset + EXEC_TRACE_WINDOW_SIZE);
+    if (result == 0) {
+        exec_trace.window = mmap(NULL, EXEC_TRACE_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, exec_trace.fd, exec_trace.window_offset);
+    }
+
+    if (result != 0 || exec_trace.window == MAP_FAILED) {
+        fprintf(stderr, "Couldn't map execution trace window, giving up on it\n");
+        exit(1);
+    }
+}
+
+#ifdef TRACE_ENABLED
+static void open_exec_trace(const char* path) {
+    exec_trace.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (exec_trace.fd < 0) {
+        fprintf(stderr, "Couldn't open execution trace '%s'\n", path);
+        trace.mask &= ~TRACE_EXEC;
+        return;
+    }
+
+    exec_trace.window_offset = 0;
+    exec_trace.window_used = 0;
+    map_exec_trace_window();
+
+    struct ExecTraceHeader header = {
+        .magic = EXEC_TRACE_MAGIC,
+        .version = EXEC_TRACE_VERSION,
+        .record_size = sizeof(struct ExecTraceRecord),
+    };
+
+    memcpy(exec_trace.window, &header, sizeof(header));
+    exec_trace.window_used = sizeof(header);
+}
+#endif
+
+void exec_trace_advance_window() {
+    munmap(exec_trace.window, EXEC_TRACE_WINDOW_SIZE);
+    exec_trace.window_offset += exec_trace.window_used;
+    exec_trace.window_used = 0;
+    map_exec_trace_window();
+}
+
+static void close_exec_trace() {
+    if (exec_trace.fd < 0) return;
+
+    munmap(exec_trace.window, EXEC_TRACE_WINDOW_SIZE);
+    // Chop off the unused tail of the last window
+    if (ftruncate(exec_trace.fd, exec_trace.window_offset + exec_trace.window_used) != 0) {
+        fprintf(stderr, "Couldn't trim execution trace\n");
+    }
+    close(exec_trace.fd);
+    exec_trace.fd = -1;
+}
+
+// Categories come from CLSNES_TRACE (i.e. "fetch,io" or "all"), and events go to
+// the file named by CLSNES_TRACE_FILE if there is one. The "exec" category
+// writes to CLSNES_EXEC_TRACE_FILE, or mairo-trace.log
+void trace_init() {
+    const char* spec = getenv("CLSNES_TRACE");
+    if (!spec) return;
+
+#ifndef TRACE_ENABLED
+    fprintf(stderr, "Note: CLSNES_TRACE is set but tracing was compiled out\n");
+#else
+    trace.mask = parse_categories(spec);
+
+    if (trace.mask & TRACE_EXEC) {
+        const char* exec_path = getenv("CLSNES_EXEC_TRACE_FILE");
+        open_exec_trace(exec_path ? exec_path : EXEC_TRACE_DEFAULT_PATH);
+    }
+
+    const char* path = getenv("CLSNES_TRACE_FILE");
+    if (path) {
+        trace.out = fopen(path, "wb");
+        if (!trace.out) fprintf(stderr, "Couldn't open trace file '%s'\n", path);
+    }
+
+    atexit(trace_shutdown);
+#endif
+}
+
+// Called by trace_event() every time the ring wraps
+void trace_flush() {
+    if (!trace.out) return;
+    fwrite(trace.ring, sizeof(struct TraceEvent), TRACE_RING_SIZE, trace.out);
+}
+
+void trace_format_event(const struct TraceEvent* event, char* buf, size_t size) {
+    const char* dir = (event->flags & TRACE_WRITE) ? "W" : "R";
+    int digits = (event->flags & TRACE_WIDE) ? 4 : 2;
+
+    switch (event->category) {
+        case TRACE_FETCH:
+            snprintf(buf, size, "[fetch] %06x <- %0*x", event->addr, digits, event->value);
+            break;
+        case TRACE_DISASM:
+            snprintf(buf, size, "[x::%x] :: %02x", event->addr, event->value);
+            break;
+        case TRACE_IO:
+            snprintf(buf, size, "[io] %s %04x = %0*x", dir, event->addr & 0xFFFF, digits, event->value);
+            break;
+        case TRACE_APU:
+            snprintf(buf, size, "[apu] %s %04x = %0*x", dir, event->addr & 0xFFFF, digits, event->value);
+            break;
+        default:
+            snprintf(buf, size, "[?%x] %x %x", event->category, event->addr, event->value);
+            break;
+    }
+}
+
+void trace_shutdown() {
+    close_exec_trace();
+
+    if (trace.out) {
+        // Flush whatever is left after the last wrap
+        size_t count = trace.head & (TRACE_RING_SIZE - 1);
+        fwrite(trace.ring, sizeof(struct TraceEvent), count, trace.out);
+        fclose(trace.out);
+        trace.out = NULL;
+        return;
+    }
+
+    uint32_t count = trace.head < TRACE_TAIL_SIZE ? trace.head : TRACE_TAIL_SIZE;
+    char line[128];
+
+    for (uint32_t i = trace.head - count; i != trace.head; i++) {
+        trace_format_event(&trace.ring[i & (TRACE_RING_SIZE - 1)], line, sizeof(line));
+        fprintf(stderr, "%s\n", line);
+    }
+}
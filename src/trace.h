@@ -0,0 +1,149 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Structured tracing. Call sites use TRACE(), which compiles to nothing unless
+// built with TRACE_ENABLED (make TRACE=1, the default). When compiled in, each
+// category can be switched on at runtime; enabled events are appended to a
+// binary ring without any formatting, and only get turned into text when the
+// ring is dumped.
+
+enum TraceCategory {
+    TRACE_FETCH = 1 << 0, // Every byte pulled from the instruction stream
+    TRACE_DISASM = 1 << 1, // One event per executed instruction
+    TRACE_IO = 1 << 2, // I/O register reads and writes
+    TRACE_APU = 1 << 3, // APUIO port ($2140-$217F) traffic
+    TRACE_EXEC = 1 << 4, // Full CPU state per instruction, into its own file
+
+    TRACE_ALL = 0xFF,
+};
+
+enum TraceFlags {
+    TRACE_READ = 1 << 0,
+    TRACE_WRITE = 1 << 1,
+    TRACE_WIDE = 1 << 2, // Value is 16 bits
+};
+
+struct TraceEvent {
+    uint32_t seq;
+    uint8_t category;
+    uint8_t flags;
+    uint16_t _pad;
+    uint32_t addr;
+    uint32_t value;
+};
+
+// Must stay a power of two
+#define TRACE_RING_SIZE (1 << 16)
+
+// How many events get printed at exit when there's no trace file
+#define TRACE_TAIL_SIZE 64
+
+struct Trace {
+    uint32_t mask;
+    uint32_t seq;
+    uint32_t head;
+
+    // When set, the ring is flushed here every time it fills up. Otherwise it
+    // acts as a flight recorder and the tail gets printed at exit
+    FILE* out;
+
+    struct TraceEvent ring[TRACE_RING_SIZE];
+};
+
+extern struct Trace trace;
+
+// Execution trace: one fixed size record per instruction, CPU state as it was
+// right before the instruction ran. tools/trace_decode turns a file of these
+// back into text
+#define EXEC_TRACE_MAGIC "CLSNTRC1"
+#define EXEC_TRACE_VERSION 1
+#define EXEC_TRACE_DEFAULT_PATH "mairo-trace.log"
+
+// Padded out to a record so every window boundary lands on a record boundary
+struct ExecTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint8_t _reserved[16];
+};
+
+struct ExecTraceRecord {
+    uint32_t PC; // 24-bit, bank included
+    uint8_t opcode;
+    uint8_t operands[3]; // Whatever follows the opcode, length depends on it and P
+    uint16_t A;
+    uint16_t X;
+    uint16_t Y;
+    uint16_t S;
+    uint16_t D;
+    uint8_t DBR;
+    uint8_t P;
+    uint8_t E;
+    uint8_t _pad[3];
+    uint64_t cycles;
+};
+
+
+// The file is grown and mapped this much at a time, records are written
+// straight into the mapping
+#define EXEC_TRACE_WINDOW_SIZE (64 << 20)
+
+_Static_assert(sizeof(struct ExecTraceHeader) == sizeof(struct ExecTraceRecord), "Trace header must be record sized");
+_Static_assert(EXEC_TRACE_WINDOW_SIZE % sizeof(struct ExecTraceRecord) == 0, "Trace window must hold whole records");
+
+struct ExecTrace {
+    int fd;
+    uint8_t* window;
+    size_t window_offset; // Where the window starts in the file
+    size_t window_used;
+};
+
+extern struct ExecTrace exec_trace;
+
+void exec_trace_advance_window();
+
+void trace_init();
+void trace_shutdown();
+void trace_flush();
+void trace_format_event(const struct TraceEvent* event, char* buf, size_t size);
+
+static inline void trace_event(uint8_t category, uint8_t flags, uint32_t addr, uint32_t value) {
+    struct TraceEvent* event = &trace.ring[trace.head & (TRACE_RING_SIZE - 1)];
+    event->seq = trace.seq++;
+    event->category = category;
+    event->flags = flags;
+    event->addr = addr;
+    event->value = value;
+
+    trace.head++;
+    if (trace.out && !(trace.head & (TRACE_RING_SIZE - 1))) trace_flush();
+}
+
+// Hands out the next record slot in the mapped window
+static inline struct ExecTraceRecord* exec_trace_next() {
+    if (exec_trace.window_used + sizeof(struct ExecTraceRecord) > EXEC_TRACE_WINDOW_SIZE) {
+        exec_trace_advance_window();
+    }
+
+    struct ExecTraceRecord* record = (struct ExecTraceRecord*)(exec_trace.window + exec_trace.window_used);
+    exec_trace.window_used += sizeof(struct ExecTraceRecord);
+    return record;
+}
+
+#ifdef TRACE_ENABLED
+#define TRACE_ON(category) (trace.mask & (category))
+#define TRACE(category, flags, addr, value) \
+    do { \
+        if (trace.mask & (category)) trace_event((category), (flags), (addr), (value)); \
+    } while (0)
+#else
+#define TRACE_ON(category) 0
+// Still uses the arguments, so locals only kept for tracing don't warn
+#define TRACE(category, flags, addr, value) \
+    do { \
+        (void)(category); (void)(flags); (void)(addr); (void)(value); \
+    } while (0)
+#endif
@@ -0,0 +1,88 @@
+// Turns a binary execution trace (CLSNES_TRACE=exec) back into one line of text
+// per instruction, bsnes style, for diffing against other emulators:
+//
+//   008000 sei                  A:0000 X:0000 Y:0000 S:01ff D:0000 DB:00 nvMXdIzc E:1 C:0
+//
+// Usage: trace_decode [--no-cycles] [trace file] (defaults to mairo-trace.log)
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "trace.h"
+#include "disasm.h"
+
+#define READ_BATCH 4096
+
+void format_flags(uint8_t p, char* out) {
+    const char* names = "czidxmvn";
+    const char* upper = "CZIDXMVN";
+
+    // Printed N first, like everyone else does
+    for (int bit = 7; bit >= 0; bit--) {
+        *(out++) = (p & (1 << bit)) ? upper[bit] : names[bit];
+    }
+    *out = '\0';
+}
+
+int main(int argc, char** argv) {
+    const char* path = EXEC_TRACE_DEFAULT_PATH;
+    bool show_cycles = true;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--no-cycles")) {
+            show_cycles = false;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Couldn't open '%s'\n", path);
+        return 1;
+    }
+
+    struct ExecTraceHeader header;
+    if (
+        fread(&header, sizeof(header), 1, fp) != 1
+        || memcmp(header.magic, EXEC_TRACE_MAGIC, sizeof(header.magic))
+    ) {
+        fprintf(stderr, "'%s' isn't an execution trace\n", path);
+        return 1;
+    }
+
+    if (header.version != EXEC_TRACE_VERSION || header.record_size != sizeof(struct ExecTraceRecord)) {
+        fprintf(stderr, "Unsupported trace version %u (record size %u)\n", header.version, header.record_size);
+        return 1;
+    }
+
+    static struct ExecTraceRecord records[READ_BATCH];
+    size_t count;
+
+    while ((count = fread(records, sizeof(struct ExecTraceRecord), READ_BATCH, fp))) {
+        for (size_t i = 0; i < count; i++) {
+            struct ExecTraceRecord* r = &records[i];
+
+            uint8_t bytes[4] = { r->opcode, r->operands[0], r->operands[1], r->operands[2] };
+            bool m8 = r->E || (r->P & 0x20);
+            bool x8 = r->E || (r->P & 0x10);
+
+            char text[32];
+            disassemble(r->PC, bytes, m8, x8, text, sizeof(text));
+
+            char flags[9];
+            format_flags(r->P, flags);
+
+            printf(
+                "%06x %-20s A:%04x X:%04x Y:%04x S:%04x D:%04x DB:%02x %s E:%u",
+                r->PC, text, r->A, r->X, r->Y, r->S, r->D, r->DBR, flags, r->E
+            );
+
+            if (show_cycles) printf(" C:%lu", r->cycles);
+            printf("\n");
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}